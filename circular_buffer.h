@@ -1,125 +1,202 @@
 #ifndef CIRCULAR_BUFFER_H
 #define CIRCULAR_BUFFER_H
 
-#include <string.h> /* memcpy */
 #include <stdint.h>
-#include <cmsis_gcc.h>
-
-struct circular_buffer {
-	void *start;
-	void *end;
-	void *writep;
-	void *readp;	
-};
 
 /*
- * WARNING! WE DO NOT SUPPORT HANDLING OBJECTS OF VARIABLE SIZES!
- * sz always must be sizeof(type) from when we were declaring the buffer!
- */
-
-/* Advance the read pointer, to getr one element from the circular buffer.
-
-   This should be lockless and work inside or outside irq context.
-
-   If the buffer is empty, we return NULL.
-
-   If the buffer is non-empty, advance the read-pointer and return
-   the pointer before it was advanced (corresponding to the element
-   that has been read. This element will not be overwritten because
-   there is always one free spot between writep (next element to be
-   written) and readp. */
-static inline void *
-circular_buffer_inc_readp_if_nonempty(struct circular_buffer *p, size_t sz) {
-	void *rp, *nrp, *wp;
-
-	do {
-		rp = (void*)__LDREXW((uint32_t*)&p->readp);
-		wp = *(void * volatile *)&p->writep;
-
-		if (rp == wp) /* empty */
-			return NULL;
-
-		nrp = (void*)((char*)(rp)+sz);
-		if (nrp == p->end)
-			nrp = p->start;
-	} while (__STREXW((uint32_t)nrp, (uint32_t*)&p->readp));
-
-	return rp;
-}
-
-/* Advance the write pointer to get one element from the circular buffer.
-
-   If the buffer is full, we return NULL.
-
-   If the buffer is not full, we advance the write pointer and return the
-   pointer before it has been advanced. This corresponds to the element that
-   ought to be written.
-   
-   XXX FIXME: This currently leaves the possibility that the element
-              is not written fast enough, so we will have to merge the inc
-	      and put/get functions!
- */
-
-static inline void *  __attribute__((always_inline))
-circular_buffer_inc_writep_if_nonfull(struct circular_buffer *p, size_t sz) {
-	void *rp, *wp, *nwp;
-
-	do {
-		rp = *(void * volatile *)&p->readp;
-		wp = (void*)__LDREXW((uint32_t*)&p->writep);
-		nwp = (void*)((char*)(wp)+sz);
-		if (nwp == p->end)
-			nwp = p->start;
-		if (nwp == rp) /* full */
-			return NULL;
-	} while(__STREXW((uint32_t)nwp, (uint32_t*)&p->writep));
-	return wp;
-}
-
-static inline int __attribute__((always_inline))
-circular_buffer_put(struct circular_buffer *p, const void * element, size_t sz)
-{
-	void *wp;
-
-	wp = circular_buffer_inc_writep_if_nonfull(p, sz);
-	if (!wp)
-		return -1; /* full */
-	memcpy(wp, element, sz);
-	return 0;
-}
-
-static inline int
-circular_buffer_get(struct circular_buffer *p, void * element, size_t sz)
-{
-	void *rp = circular_buffer_inc_readp_if_nonempty(p, sz);
-	if (!rp)
-		return -1;
-	memcpy(element, rp, sz);
-	return 0;
-}
-
-#define CIRCULAR_BUFFER_INIT_STATIC(buf, total_sz) \
-	{ .start=(void*)(buf), \
-	  .end=(void*)(((char*)(buf))+(total_sz)), \
-	  .writep=(void*)buf, \
-	  .readp=(void*)buf }
-
-#define CIRCULAR_BUFFER_INIT_STATIC_ARR(arr) CIRCULAR_BUFFER_INIT_STATIC((arr), sizeof(arr))
-
-/* CIRCULAR_BUFFER_DECLARE(name, type, num_elements) declares
-    - the buffer array: type name_data[num_elements];
-    - the circular buffer structure struct circular buffer name;
-    - inline functions name_put() and name_get()
+ * Single producer, single consumer ring buffers, generated per element
+ * type by CIRCULAR_BUFFER_DECLARE(): exactly one context (the main loop
+ * or one interrupt handler) writes, exactly one reads. head is only ever
+ * written by the producer, tail only by the consumer, so no exclusive
+ * monitor or irq locking is needed, just the ordering of the data against
+ * the index: the producer stores head with release semantics after the
+ * elements are written, the consumer loads it with acquire semantics
+ * before it reads them, and the same the other way round for tail. On the
+ * Cortex-M4 this is a DMB next to a plain ldr/str.
+ *
+ * head and tail count elements and run freely, the number of elements is
+ * a power of two and the array is indexed with the masked counters, so
+ * all slots are used and head - tail is the fill level even across the
+ * wrap of the counters. Everything is inline with the element type and
+ * the mask known at compile time, elements are copied by assignment.
  */
 
-#define CIRCULAR_BUFFER_DECLARE(name, type, num_elements) \
-	  static const size_t name ## _sz = sizeof(type); \
-	  static type name ## _data[num_elements]; \
-	  static struct circular_buffer name = \
-	  	CIRCULAR_BUFFER_INIT_STATIC_ARR(name ## _data); \
-	  static inline int name ## _put(type c) { \
-	  	return circular_buffer_put(&name, &c, sizeof(type)); } \
-	  static inline int name ## _get(type * c) { \
-	  	return circular_buffer_get(&name, c, sizeof(type)); }
+/* put fails if the ring is full */
+#define CIRCULAR_BUFFER_DROP_NEW  0
+/* put always succeeds, the reader skips what has been overwritten and
+   counts it in name_lost(); one slot less is usable */
+#define CIRCULAR_BUFFER_OVERWRITE 1
+
+#define CIRCULAR_BUFFER_LOAD_ACQ(x)     __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define CIRCULAR_BUFFER_STORE_REL(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+/* CIRCULAR_BUFFER_DECLARE(name, type, num_elements, mode) declares the
+   ring name (struct name_ring) and the inline functions
+    - name_put(), name_get(): one element, 0 or -1 if full/empty
+    - name_put_n(), name_get_n(): up to n elements, returns how many
+    - name_reserve(), name_commit(): producer, zero copy, contiguous room
+      for up to *n elements, write them in place and commit
+    - name_peek(), name_consume(): the same for the consumer
+    - name_used(), name_free(), name_lost()
+   num_elements must be a power of two. In CIRCULAR_BUFFER_OVERWRITE mode
+   only name_put() and name_get() may be used. */
+
+#define CIRCULAR_BUFFER_DECLARE(name, type, num_elements, mode) \
+	_Static_assert(((num_elements) & ((num_elements) - 1)) == 0, \
+		#name ": number of elements must be a power of two"); \
+	\
+	static struct name ## _ring { \
+		type data[num_elements]; \
+		volatile unsigned int head; /* next to write, producer */ \
+		volatile unsigned int tail; /* next to read, consumer */ \
+		unsigned int lost;          /* overwritten, consumer */ \
+	} name; \
+	\
+	static inline unsigned int \
+	name ## _free(void) \
+	{ \
+		return (num_elements) - \
+			(name.head - CIRCULAR_BUFFER_LOAD_ACQ(name.tail)); \
+	} \
+	\
+	static inline unsigned int \
+	name ## _used(void) \
+	{ \
+		return CIRCULAR_BUFFER_LOAD_ACQ(name.head) - name.tail; \
+	} \
+	\
+	static inline unsigned int \
+	name ## _lost(void) \
+	{ \
+		return name.lost; \
+	} \
+	\
+	static inline type * \
+	name ## _reserve(unsigned int *n) \
+	{ \
+		unsigned int idx = name.head & ((num_elements) - 1); \
+		unsigned int k = name ## _free(); \
+		\
+		if (k > (num_elements) - idx) \
+			k = (num_elements) - idx; \
+		if (k > *n) \
+			k = *n; \
+		*n = k; \
+		return k ? &name.data[idx] : 0; \
+	} \
+	\
+	static inline void \
+	name ## _commit(unsigned int n) \
+	{ \
+		CIRCULAR_BUFFER_STORE_REL(name.head, name.head + n); \
+	} \
+	\
+	static inline const type * \
+	name ## _peek(unsigned int *n) \
+	{ \
+		unsigned int idx = name.tail & ((num_elements) - 1); \
+		unsigned int k = name ## _used(); \
+		\
+		if (k > (num_elements) - idx) \
+			k = (num_elements) - idx; \
+		if (k > *n) \
+			k = *n; \
+		*n = k; \
+		return k ? &name.data[idx] : 0; \
+	} \
+	\
+	static inline void \
+	name ## _consume(unsigned int n) \
+	{ \
+		CIRCULAR_BUFFER_STORE_REL(name.tail, name.tail + n); \
+	} \
+	\
+	static inline int \
+	name ## _put(const type *c) \
+	{ \
+		unsigned int head = name.head; \
+		\
+		if ((mode) == CIRCULAR_BUFFER_OVERWRITE) { \
+			/* the previous head before the data, see name_get() */ \
+			__atomic_thread_fence(__ATOMIC_SEQ_CST); \
+		} else if (head - CIRCULAR_BUFFER_LOAD_ACQ(name.tail) >= \
+			   (num_elements)) { \
+			return -1; \
+		} \
+		name.data[head & ((num_elements) - 1)] = *c; \
+		CIRCULAR_BUFFER_STORE_REL(name.head, head + 1); \
+		return 0; \
+	} \
+	\
+	/* overwrite: the producer may be writing the slot of index head \
+	   while the element at tail is read, so if head has come within \
+	   num_elements of tail by the time the copy is done, it may be \
+	   torn and is thrown away */ \
+	static inline int \
+	name ## _get(type *c) \
+	{ \
+		unsigned int tail = name.tail; \
+		unsigned int head; \
+		\
+		for (;;) { \
+			head = CIRCULAR_BUFFER_LOAD_ACQ(name.head); \
+			if (head == tail) \
+				return -1; \
+			if ((mode) == CIRCULAR_BUFFER_OVERWRITE && \
+			    head - tail >= (num_elements)) { \
+				name.lost += head - tail - (num_elements) + 1; \
+				tail = head - (num_elements) + 1; \
+			} \
+			*c = name.data[tail & ((num_elements) - 1)]; \
+			if ((mode) != CIRCULAR_BUFFER_OVERWRITE) \
+				break; \
+			__atomic_thread_fence(__ATOMIC_ACQUIRE); \
+			if (CIRCULAR_BUFFER_LOAD_ACQ(name.head) - tail < \
+			    (num_elements)) \
+				break; \
+			name.lost++; \
+			tail++; \
+		} \
+		CIRCULAR_BUFFER_STORE_REL(name.tail, tail + 1); \
+		return 0; \
+	} \
+	\
+	static inline unsigned int \
+	name ## _put_n(const type *c, unsigned int n) \
+	{ \
+		unsigned int done = 0, i; \
+		\
+		while (done < n) { \
+			unsigned int k = n - done; \
+			type *wp = name ## _reserve(&k); \
+			\
+			if (!wp) \
+				break; \
+			for (i=0; i<k; i++) \
+				wp[i] = c[done + i]; \
+			name ## _commit(k); \
+			done += k; \
+		} \
+		return done; \
+	} \
+	\
+	static inline unsigned int \
+	name ## _get_n(type *c, unsigned int n) \
+	{ \
+		unsigned int done = 0, i; \
+		\
+		while (done < n) { \
+			unsigned int k = n - done; \
+			const type *rp = name ## _peek(&k); \
+			\
+			if (!rp) \
+				break; \
+			for (i=0; i<k; i++) \
+				c[done + i] = rp[i]; \
+			name ## _consume(k); \
+			done += k; \
+		} \
+		return done; \
+	}
 
 #endif
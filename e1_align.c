@@ -0,0 +1,206 @@
+/*
+ * This file is part of the osmocom sam4s usb interface firmware.
+ * Copyright (c) 2018 Christian Vogel <vogelchr@vogel.cx>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* G.706 frame alignment: find the FAS at any of the 512 bit offsets of a
+   received double-frame and move the frame sync from TC2 accordingly */
+
+#include "e1_align.h"
+#include "sam4s_ssc.h"
+#include "sam4s_timer.h"
+#include "g704.h"
+
+#include <sam4s8b.h>
+#include <string.h>
+
+/* G.706 4.1.1: alignment is lost after three consecutive bad FAS */
+#define E1_ALIGN_LOF_COUNT    3
+/* give TC2 a few double-frames to apply the phase correction */
+#define E1_ALIGN_SETTLE_COUNT 4
+/* if several candidates survive that long, just take the first one */
+#define E1_ALIGN_HUNT_MAX     8
+
+static enum e1_align_state e1_align_state;
+static int e1_align_enabled = 1;
+static unsigned int e1_align_cnt; /* meaning depends on state */
+static unsigned int e1_align_hunt_cnt;
+
+/* bit (31-b) of e1_align_cand[w] set: FAS may start at bit 32*w+b */
+static uint32_t e1_align_cand[SAM4S_SSC_DBLFRM_LONGWORDS];
+
+static struct e1_align_stats e1_align_stats;
+
+void
+e1_align_init()
+{
+	e1_align_state = E1_ALIGN_HUNT;
+	e1_align_hunt_cnt = 0;
+	e1_align_cnt = 0;
+}
+
+void
+e1_align_enable(int onoff)
+{
+	e1_align_enabled = onoff;
+}
+
+enum e1_align_state
+e1_align_get_state()
+{
+	return e1_align_state;
+}
+
+void
+e1_align_get_stats(struct e1_align_stats *p)
+{
+	sam4s_seqlock_snapshot(&sam4s_ssc_seqlock, p, &e1_align_stats,
+		sizeof(e1_align_stats));
+}
+
+/* 32 bits starting at bit j (1..31) of longword a, continued in b */
+#define FUNNEL(a, b, j) (((a) << (j)) | ((b) >> (32-(j))))
+
+/*
+ * Test all 512 bit offsets k of the double-frame at once, 32 offsets per
+ * longword: bits k+1..k+7 have to be the FAS 0011011 and bit k+257 (bit 2
+ * of the octet 256 bits later) has to be the 1 of the NFAS. The data is
+ * periodic in 512 bits, so the double-frame is treated as a ring.
+ */
+static void
+e1_align_fas_match(const uint32_t *p, uint32_t *m)
+{
+	int w;
+
+	for (w=0; w<SAM4S_SSC_DBLFRM_LONGWORDS; w++) {
+		uint32_t a = p[w];
+		uint32_t b = p[(w+1) % SAM4S_SSC_DBLFRM_LONGWORDS];
+		uint32_t na = p[(w+8) % SAM4S_SSC_DBLFRM_LONGWORDS];
+		uint32_t nb = p[(w+9) % SAM4S_SSC_DBLFRM_LONGWORDS];
+
+		m[w] = ~FUNNEL(a, b, 1) & ~FUNNEL(a, b, 2) &
+			FUNNEL(a, b, 3) & FUNNEL(a, b, 4) &
+			~FUNNEL(a, b, 5) & FUNNEL(a, b, 6) &
+			FUNNEL(a, b, 7) & FUNNEL(na, nb, 1);
+	}
+}
+
+/* returns bit offset of first candidate, or -1, *n is the number of
+   candidates (saturating at 2, we only care about "exactly one") */
+static int
+e1_align_first_cand(const uint32_t *m, int *n)
+{
+	int w, first = -1;
+
+	*n = 0;
+	for (w=0; w<SAM4S_SSC_DBLFRM_LONGWORDS; w++) {
+		if (!m[w])
+			continue;
+		if (first == -1) {
+			first = w * SAM4S_SSC_BITS_PER_LONGWORD +
+				__builtin_clz(m[w]);
+			*n = (m[w] & (m[w]-1)) ? 2 : 1;
+		} else {
+			*n = 2;
+			break;
+		}
+	}
+	return first;
+}
+
+static void
+e1_align_hunt(const uint32_t *p)
+{
+	uint32_t m[SAM4S_SSC_DBLFRM_LONGWORDS];
+	uint32_t any = 0;
+	int w, k, n;
+
+	e1_align_stats.hunt_dblfrm++;
+	e1_align_fas_match(p, m);
+
+	/* G.706 4.1.2: FAS, NFAS in the next frame, FAS again in the next
+	   frame: the first double-frame gives FAS+NFAS, each further one
+	   has to confirm the FAS at the same offset */
+	if (e1_align_hunt_cnt) {
+		for (w=0; w<SAM4S_SSC_DBLFRM_LONGWORDS; w++)
+			any |= (m[w] &= e1_align_cand[w]);
+		if (!any) { /* all candidates gone, start over from
+			       this double-frame, m has been cleared */
+			e1_align_fas_match(p, m);
+			e1_align_hunt_cnt = 0;
+		}
+	}
+	memcpy(e1_align_cand, m, sizeof(e1_align_cand));
+	e1_align_hunt_cnt++;
+
+	if (e1_align_hunt_cnt < 2)
+		return;
+
+	k = e1_align_first_cand(e1_align_cand, &n);
+	if (k == -1 || (n > 1 && e1_align_hunt_cnt < E1_ALIGN_HUNT_MAX))
+		return;
+
+	if (k == 0) {
+		e1_align_state = E1_ALIGN_LOCKED;
+		e1_align_cnt = 0;
+		return;
+	}
+
+	if (!e1_align_enabled)
+		return;
+
+	/* one single correction: delay all following frame syncs by k
+	   bits, so the FAS ends up at bit 0 of p[0] */
+	if (sam4s_timer_e1_phase_adj(k) == 0) {
+		e1_align_stats.phase_adj++;
+		e1_align_stats.last_offs = k;
+		e1_align_state = E1_ALIGN_SETTLE;
+		e1_align_cnt = E1_ALIGN_SETTLE_COUNT;
+	}
+}
+
+int
+e1_align_rx_dblfrm(const uint32_t *p)
+{
+	int ok = CHK_G704_FAS_LW(p[0]) && CHK_G704_NOFAS_LW(p[8]);
+
+	switch (e1_align_state) {
+	case E1_ALIGN_HUNT:
+		e1_align_hunt(p);
+		break;
+	case E1_ALIGN_SETTLE:
+		if (ok) {
+			e1_align_state = E1_ALIGN_LOCKED;
+			e1_align_cnt = 0;
+		} else if (!--e1_align_cnt) {
+			e1_align_state = E1_ALIGN_HUNT;
+			e1_align_hunt_cnt = 0;
+		}
+		break;
+	case E1_ALIGN_LOCKED:
+		if (ok) {
+			e1_align_cnt = 0;
+			break;
+		}
+		if (++e1_align_cnt >= E1_ALIGN_LOF_COUNT) {
+			e1_align_stats.lof++;
+			e1_align_state = E1_ALIGN_HUNT;
+			e1_align_hunt_cnt = 0;
+		}
+		break;
+	}
+
+	return ok && e1_align_state == E1_ALIGN_LOCKED;
+}
@@ -0,0 +1,31 @@
+#ifndef E1_ALIGN_H
+#define E1_ALIGN_H
+
+#include <stdint.h>
+
+enum e1_align_state {
+	E1_ALIGN_HUNT,     /* searching all bit offsets for FAS/NFAS/FAS */
+	E1_ALIGN_SETTLE,   /* phase correction submitted to TC2 */
+	E1_ALIGN_LOCKED    /* FAS at p[0], NFAS at p[8] */
+};
+
+struct e1_align_stats {
+	unsigned int lof;         /* loss of frame alignment events */
+	unsigned int phase_adj;   /* phase corrections issued to TC2 */
+	unsigned int hunt_dblfrm; /* double-frames spent searching */
+	int last_offs;            /* bit offset of last correction */
+};
+
+extern void e1_align_init();
+
+/* enable/disable automatic phase correction, alignment is still tracked */
+extern void e1_align_enable(int onoff);
+
+/* called in irq context for each received double-frame, returns
+   non-zero if p[0]/p[8] carry the FAS/NFAS */
+extern int e1_align_rx_dblfrm(const uint32_t *p);
+
+extern enum e1_align_state e1_align_get_state();
+extern void e1_align_get_stats(struct e1_align_stats *p);
+
+#endif
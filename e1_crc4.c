@@ -0,0 +1,201 @@
+/*
+ * This file is part of the osmocom sam4s usb interface firmware.
+ * Copyright (c) 2018 Christian Vogel <vogelchr@vogel.cx>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* G.706 CRC-4 multiframe alignment and CRC-4 block error checking, the
+   CRC is updated once per double-frame so there is no need to buffer a
+   whole sub-multiframe */
+
+#include "e1_crc4.h"
+#include "sam4s_ssc.h"
+#include "g704.h"
+
+#include <sam4s8b.h>
+#include <string.h>
+
+/* a multiframe is 16 frames = 8 double-frames, 4 per sub-multiframe */
+#define E1_CRC4_MF_DBLFRM  8
+#define E1_CRC4_SMF_DBLFRM 4
+
+/* G.706 4.3.2: alignment is lost with >= 915 errored blocks out of 1000 */
+#define E1_CRC4_LOSS_WINDOW 1000
+#define E1_CRC4_LOSS_ERRORS 915
+
+/* remainder of an octet shifted through x^4+x+1, starting at 0 */
+static const uint8_t e1_crc4_tab[256] = {
+	0x0, 0x3, 0x6, 0x5, 0xc, 0xf, 0xa, 0x9, 0xb, 0x8, 0xd, 0xe, 0x7, 0x4, 0x1, 0x2,
+	0x5, 0x6, 0x3, 0x0, 0x9, 0xa, 0xf, 0xc, 0xe, 0xd, 0x8, 0xb, 0x2, 0x1, 0x4, 0x7,
+	0xa, 0x9, 0xc, 0xf, 0x6, 0x5, 0x0, 0x3, 0x1, 0x2, 0x7, 0x4, 0xd, 0xe, 0xb, 0x8,
+	0xf, 0xc, 0x9, 0xa, 0x3, 0x0, 0x5, 0x6, 0x4, 0x7, 0x2, 0x1, 0x8, 0xb, 0xe, 0xd,
+	0x7, 0x4, 0x1, 0x2, 0xb, 0x8, 0xd, 0xe, 0xc, 0xf, 0xa, 0x9, 0x0, 0x3, 0x6, 0x5,
+	0x2, 0x1, 0x4, 0x7, 0xe, 0xd, 0x8, 0xb, 0x9, 0xa, 0xf, 0xc, 0x5, 0x6, 0x3, 0x0,
+	0xd, 0xe, 0xb, 0x8, 0x1, 0x2, 0x7, 0x4, 0x6, 0x5, 0x0, 0x3, 0xa, 0x9, 0xc, 0xf,
+	0x8, 0xb, 0xe, 0xd, 0x4, 0x7, 0x2, 0x1, 0x3, 0x0, 0x5, 0x6, 0xf, 0xc, 0x9, 0xa,
+	0xe, 0xd, 0x8, 0xb, 0x2, 0x1, 0x4, 0x7, 0x5, 0x6, 0x3, 0x0, 0x9, 0xa, 0xf, 0xc,
+	0xb, 0x8, 0xd, 0xe, 0x7, 0x4, 0x1, 0x2, 0x0, 0x3, 0x6, 0x5, 0xc, 0xf, 0xa, 0x9,
+	0x4, 0x7, 0x2, 0x1, 0x8, 0xb, 0xe, 0xd, 0xf, 0xc, 0x9, 0xa, 0x3, 0x0, 0x5, 0x6,
+	0x1, 0x2, 0x7, 0x4, 0xd, 0xe, 0xb, 0x8, 0xa, 0x9, 0xc, 0xf, 0x6, 0x5, 0x0, 0x3,
+	0x9, 0xa, 0xf, 0xc, 0x5, 0x6, 0x3, 0x0, 0x2, 0x1, 0x4, 0x7, 0xe, 0xd, 0x8, 0xb,
+	0xc, 0xf, 0xa, 0x9, 0x0, 0x3, 0x6, 0x5, 0x7, 0x4, 0x1, 0x2, 0xb, 0x8, 0xd, 0xe,
+	0x3, 0x0, 0x5, 0x6, 0xf, 0xc, 0x9, 0xa, 0x8, 0xb, 0xe, 0xd, 0x4, 0x7, 0x2, 0x1,
+	0x6, 0x5, 0x0, 0x3, 0xa, 0x9, 0xc, 0xf, 0xd, 0xe, 0xb, 0x8, 0x1, 0x2, 0x7, 0x4,
+};
+
+#define E1_CRC4_OCTET(crc, o) (e1_crc4_tab[((crc) << 4) ^ (o)])
+
+static int e1_crc4_pos = -1;        /* dblfrm within multiframe, -1: hunt */
+static unsigned int e1_crc4_mfas;   /* shift register of NFAS Si bits */
+static int e1_crc4_mfas_seen = -1;  /* dblfrm since last MFAS, -1: none */
+
+static unsigned int e1_crc4_crc;     /* running CRC of current SMF */
+static unsigned int e1_crc4_crc_prev;/* CRC of previous SMF */
+static int e1_crc4_crc_valid;        /* current SMF seen from its start */
+static int e1_crc4_prev_valid;       /* e1_crc4_crc_prev can be checked */
+static unsigned int e1_crc4_c_rx;    /* received C1..C4 of current SMF */
+
+static unsigned int e1_crc4_win_smf; /* loss of alignment window */
+static unsigned int e1_crc4_win_err;
+
+static struct e1_crc4_stats e1_crc4_stats;
+
+unsigned int
+e1_crc4_dblfrm(unsigned int crc, const uint32_t *p)
+{
+	int i;
+
+	for (i=0; i<SAM4S_SSC_DBLFRM_LONGWORDS; i++) {
+		uint32_t lw = p[i];
+
+		if (i == 0) /* C bit */
+			lw &= ~((uint32_t)G704_SI_MSK << 24);
+		crc = E1_CRC4_OCTET(crc, lw >> 24);
+		crc = E1_CRC4_OCTET(crc, (lw >> 16) & 0xff);
+		crc = E1_CRC4_OCTET(crc, (lw >> 8) & 0xff);
+		crc = E1_CRC4_OCTET(crc, lw & 0xff);
+	}
+	return crc;
+}
+
+void
+e1_crc4_reset()
+{
+	e1_crc4_pos = -1;
+	e1_crc4_mfas = 0;
+	e1_crc4_mfas_seen = -1;
+}
+
+int
+e1_crc4_locked()
+{
+	return e1_crc4_pos != -1;
+}
+
+int
+e1_crc4_mf_pos()
+{
+	return e1_crc4_pos;
+}
+
+void
+e1_crc4_get_stats(struct e1_crc4_stats *p)
+{
+	sam4s_seqlock_snapshot(&sam4s_ssc_seqlock, p, &e1_crc4_stats,
+		sizeof(e1_crc4_stats));
+}
+
+/* G.706 4.2: two MFAS, 2 ms (one multiframe) apart */
+static void
+e1_crc4_hunt()
+{
+	if (e1_crc4_mfas_seen != -1 &&
+	    ++e1_crc4_mfas_seen > E1_CRC4_MF_DBLFRM)
+		e1_crc4_mfas_seen = -1;
+
+	if ((e1_crc4_mfas & G704_MFAS_MSK) != G704_MFAS_BITS)
+		return;
+
+	if (e1_crc4_mfas_seen != E1_CRC4_MF_DBLFRM) {
+		e1_crc4_mfas_seen = 0;
+		return;
+	}
+
+	/* this was frame 11, the last one with a MFAS bit */
+	e1_crc4_pos = 5;
+	e1_crc4_crc = 0;
+	e1_crc4_crc_valid = 0;
+	e1_crc4_prev_valid = 0;
+	e1_crc4_c_rx = 0;
+	e1_crc4_win_smf = 0;
+	e1_crc4_win_err = 0;
+}
+
+/* last double-frame of a sub-multiframe has been received */
+static void
+e1_crc4_smf_done()
+{
+	/* C bits received just now belong to the previous SMF */
+	if (e1_crc4_prev_valid) {
+		e1_crc4_stats.smf++;
+		e1_crc4_win_smf++;
+		if (e1_crc4_c_rx != e1_crc4_crc_prev) {
+			e1_crc4_stats.crc_err++;
+			e1_crc4_win_err++;
+		}
+	}
+
+	e1_crc4_prev_valid = e1_crc4_crc_valid;
+	e1_crc4_crc_prev = e1_crc4_crc;
+	e1_crc4_crc_valid = 1;
+	e1_crc4_crc = 0;
+	e1_crc4_c_rx = 0;
+
+	if (e1_crc4_win_smf >= E1_CRC4_LOSS_WINDOW) {
+		if (e1_crc4_win_err >= E1_CRC4_LOSS_ERRORS) {
+			e1_crc4_stats.mf_loss++;
+			e1_crc4_reset();
+		}
+		e1_crc4_win_smf = 0;
+		e1_crc4_win_err = 0;
+	}
+}
+
+void
+e1_crc4_rx_dblfrm(const uint32_t *p)
+{
+	unsigned int si_fas = p[0] >> 31;
+	unsigned int si_nfas = p[8] >> 31;
+	int j = e1_crc4_pos;
+
+	e1_crc4_mfas = (e1_crc4_mfas << 1) | si_nfas;
+
+	if (j == -1) {
+		e1_crc4_hunt();
+		return;
+	}
+
+	j = (j + 1) % E1_CRC4_MF_DBLFRM;
+	e1_crc4_pos = j;
+
+	e1_crc4_crc = e1_crc4_dblfrm(e1_crc4_crc, p);
+	e1_crc4_c_rx = (e1_crc4_c_rx << 1) | si_fas;
+
+	/* frames 13 and 15 carry the E bits for SMF I and II */
+	if (j >= 6 && !si_nfas)
+		e1_crc4_stats.febe++;
+
+	if (j % E1_CRC4_SMF_DBLFRM == E1_CRC4_SMF_DBLFRM - 1)
+		e1_crc4_smf_done();
+}
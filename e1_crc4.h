@@ -0,0 +1,30 @@
+#ifndef E1_CRC4_H
+#define E1_CRC4_H
+
+#include <stdint.h>
+
+struct e1_crc4_stats {
+	unsigned int smf;     /* sub-multiframes checked */
+	unsigned int crc_err; /* ... with CRC-4 error */
+	unsigned int febe;    /* E bits received as 0 (far end block error) */
+	unsigned int mf_loss; /* loss of multiframe alignment events */
+};
+
+extern void e1_crc4_reset();
+
+/* called in irq context for each frame aligned double-frame */
+extern void e1_crc4_rx_dblfrm(const uint32_t *p);
+
+/* non-zero if CRC-4 multiframe alignment has been found */
+extern int e1_crc4_locked();
+
+/* double-frame of the last one received within the multiframe (0..7,
+   its NFAS is frame 2*n+1), -1 without multiframe alignment */
+extern int e1_crc4_mf_pos();
+
+extern void e1_crc4_get_stats(struct e1_crc4_stats *p);
+
+/* update crc with one double-frame, Si bit of the FAS frame taken as 0 */
+extern unsigned int e1_crc4_dblfrm(unsigned int crc, const uint32_t *p);
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * This file is part of the osmocom sam4s usb interface firmware.
+ * Copyright (c) 2018 Christian Vogel <vogelchr@vogel.cx>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Timeslot demultiplexer: the rx ring holds frame-major longwords (4
+   timeslots each), the host mostly wants single 64 kbit/s channels. Every
+   second double-frame, the 4x4 octet blocks (4 frames x 4 timeslots) are
+   transposed with shifts and masks into one longword per timeslot. */
+
+#include "e1_demux.h"
+#include "sam4s_ssc.h"
+
+#include <sam4s8b.h>
+
+uint32_t e1_demux_buf[E1_DEMUX_TS][E1_DEMUX_DEPTH];
+volatile unsigned int e1_demux_seq;
+volatile unsigned int e1_demux_col_seq[E1_DEMUX_DEPTH];
+
+static volatile uint32_t e1_demux_mask;
+
+void
+e1_demux_set_mask(uint32_t mask)
+{
+	e1_demux_mask = mask;
+}
+
+uint32_t
+e1_demux_get_mask()
+{
+	return e1_demux_mask;
+}
+
+/*
+ * r0..r3: the same longword of 4 consecutive frames, octets of timeslots
+ * t..t+3 from MSB to LSB. First swap octets within 16 bit halves, then
+ * the halves (PKHBT/PKHTB on the M4), c0..c3 are timeslots t..t+3 with
+ * the octets of the 4 frames from MSB to LSB.
+ */
+static inline void
+e1_demux_transpose(uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3,
+	uint32_t *c0, uint32_t *c1, uint32_t *c2, uint32_t *c3)
+{
+	uint32_t t0 = (r0 & 0xff00ff00) | ((r1 >> 8) & 0x00ff00ff);
+	uint32_t t1 = ((r0 << 8) & 0xff00ff00) | (r1 & 0x00ff00ff);
+	uint32_t t2 = (r2 & 0xff00ff00) | ((r3 >> 8) & 0x00ff00ff);
+	uint32_t t3 = ((r2 << 8) & 0xff00ff00) | (r3 & 0x00ff00ff);
+
+	*c0 = (t0 & 0xffff0000) | (t2 >> 16);
+	*c1 = (t1 & 0xffff0000) | (t3 >> 16);
+	*c2 = (t0 << 16) | (t2 & 0x0000ffff);
+	*c3 = (t1 << 16) | (t3 & 0x0000ffff);
+}
+
+void
+e1_demux_rx_dblfrm(const uint32_t *p)
+{
+	unsigned int seq = sam4s_ssc_rx_seq;
+	unsigned int col = e1_demux_seq % E1_DEMUX_DEPTH;
+	const uint32_t *a;
+	int w;
+
+	/* p is the second double-frame of a group, see sam4s_ssc_init_rx_dma
+	   and sam4s_ssc_rx_recover for why seq keeps its parity across
+	   restarts */
+	if (!e1_demux_mask || (seq & 1))
+		return;
+
+	a = &sam4s_ssc_rx_buf[((seq - 2) % SAM4S_SSC_BUF_DBLFRAMES) *
+		SAM4S_SSC_DBLFRM_LONGWORDS];
+
+	for (w=0; w<SAM4S_SSC_DBLFRM_LONGWORDS/2; w++)
+		e1_demux_transpose(a[w], a[w+8], p[w], p[w+8],
+			&e1_demux_buf[4*w][col], &e1_demux_buf[4*w+1][col],
+			&e1_demux_buf[4*w+2][col], &e1_demux_buf[4*w+3][col]);
+
+	/* a group half in a gap of the ssc is not taken for data either */
+	if (sam4s_ssc_rx_slot_seq[(seq - 2) % SAM4S_SSC_BUF_DBLFRAMES] ==
+	    seq - 2)
+		e1_demux_col_seq[col] = e1_demux_seq;
+	e1_demux_seq++;
+}
+
+void
+e1_demux_rx_gap(unsigned int n)
+{
+	unsigned int seq = sam4s_ssc_rx_seq;
+	/* groups whose second double-frame is in the gap */
+	unsigned int grp = seq / 2 - (seq - n) / 2;
+	unsigned int i, ts;
+
+	if (!e1_demux_mask)
+		return;
+
+	for (i = grp > E1_DEMUX_DEPTH ? grp - E1_DEMUX_DEPTH : 0; i<grp; i++)
+		for (ts=0; ts<E1_DEMUX_TS; ts++)
+			e1_demux_buf[ts][(e1_demux_seq + i) % E1_DEMUX_DEPTH] =
+				0xffffffff;
+
+	e1_demux_seq += grp;
+}
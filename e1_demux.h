@@ -0,0 +1,41 @@
+#ifndef E1_DEMUX_H
+#define E1_DEMUX_H
+
+#include <stdint.h>
+
+#include "sam4s_ssc.h"
+
+#define E1_DEMUX_TS 32
+/* groups of 4 frames (2 double-frames, 500 us) kept for every timeslot,
+   must be a power of two. A batch of the ssc irq comes in at once, four
+   times the groups of it */
+#if SAM4S_SSC_BATCH <= 4
+#define E1_DEMUX_DEPTH 8
+#else
+#define E1_DEMUX_DEPTH (2*SAM4S_SSC_BATCH)
+#endif
+
+/* one longword per timeslot and group, the octet of the first frame in
+   the MSB, so each row is the byte stream of one 64 kbit/s channel */
+extern uint32_t e1_demux_buf[E1_DEMUX_TS][E1_DEMUX_DEPTH];
+
+/* number of groups demultiplexed, the last one is always in column
+   (e1_demux_seq-1) % E1_DEMUX_DEPTH, see also sam4s_ssc_rx_seq */
+extern volatile unsigned int e1_demux_seq;
+
+/* group demultiplexed into each column, written before e1_demux_seq
+   moves past it. A group with 0xff from a gap of the ssc keeps an older
+   one, see sam4s_ssc_rx_slot_seq */
+extern volatile unsigned int e1_demux_col_seq[E1_DEMUX_DEPTH];
+
+/* bit n set: timeslot n goes to the host, 0: raw double-frames */
+extern void e1_demux_set_mask(uint32_t mask);
+extern uint32_t e1_demux_get_mask();
+
+/* called in irq context for each received double-frame */
+extern void e1_demux_rx_dblfrm(const uint32_t *p);
+/* called in irq context after n double-frames were lost, with
+   sam4s_ssc_rx_seq already past them: their groups are filled with 0xff */
+extern void e1_demux_rx_gap(unsigned int n);
+
+#endif
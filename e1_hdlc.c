@@ -0,0 +1,490 @@
+/*
+ * This file is part of the osmocom sam4s usb interface firmware.
+ * Copyright (c) 2018 Christian Vogel <vogelchr@vogel.cx>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* HDLC for signalling timeslots (Q.921 LAPD on TS16 or any other 64 kbit/s
+   channel). Receiver: flag hunt, removal of stuffed zeros, abort and FCS
+   check. Transmitter: zero stuffing, FCS and flags in between frames.
+   The bits are not handled one by one but a nibble at a time, with tables
+   indexed by the number of ones seen before and the four bits. */
+
+#include "e1_hdlc.h"
+#include "sam4s_ssc.h"
+
+#include <sam4s8b.h>
+#include <string.h>
+
+#define E1_HDLC_RX_RING_MSK (E1_HDLC_RX_FRAMES - 1)
+
+/* FCS over a frame including its FCS, Q.921 2.7 / ISO 3309 */
+#define E1_HDLC_FCS_INIT 0xffff
+#define E1_HDLC_FCS_GOOD 0xf0b8
+
+/* one entry per (ones, nibble): destuffed data bits, first bit received
+   in bit 0, npre of them before the event and npost after it, and the
+   number of consecutive ones at the end of the nibble (7: seven or more) */
+#define E1_HDLC_TAB_DATA(e)  ((e) & 0xf)
+#define E1_HDLC_TAB_NPRE(e)  (((e) >> 4) & 0x7)
+#define E1_HDLC_TAB_NPOST(e) (((e) >> 7) & 0x3)
+#define E1_HDLC_TAB_ONES(e)  (((e) >> 9) & 0x7)
+#define E1_HDLC_TAB_EV(e)    (((e) >> 12) & 0x3)
+
+#define E1_HDLC_EV_NONE  0
+#define E1_HDLC_EV_FLAG  1
+#define E1_HDLC_EV_ABORT 2
+
+/* a flag or an abort needs six ones in a row, so there is never more
+   than one event in a nibble */
+static uint16_t e1_hdlc_rx_tab[8][16];
+
+/* CRC-16 x^16+x^12+x^5+1, LSB first, of a nibble */
+static const uint16_t e1_hdlc_fcs_tab[16] = {
+	0x0000, 0x1081, 0x2102, 0x3183, 0x4204, 0x5285, 0x6306, 0x7387,
+	0x8408, 0x9489, 0xa50a, 0xb58b, 0xc60c, 0xd68d, 0xe70e, 0xf78f,
+};
+
+struct e1_hdlc_rx {
+	unsigned int ts;    /* 0: off */
+	unsigned int ones;  /* consecutive ones, index into e1_hdlc_rx_tab */
+	uint32_t acc;       /* data bits not yet making up an octet ... */
+	unsigned int nbits; /* ... and how many of them */
+	int len;            /* octets in buf, -1: hunting for a flag */
+	unsigned int fcs;
+	uint8_t buf[E1_HDLC_MAX_LEN];
+};
+
+static struct e1_hdlc_rx e1_hdlc_rx[E1_HDLC_CHANNELS];
+
+static struct e1_hdlc_frame e1_hdlc_rx_ring[E1_HDLC_RX_FRAMES];
+static volatile unsigned int e1_hdlc_rx_head; /* written by ssc irq */
+static volatile unsigned int e1_hdlc_rx_tail; /* written by usb irq */
+
+static struct e1_hdlc_rx_stats e1_hdlc_rx_stats;
+
+#define E1_HDLC_TX_RING_MSK (E1_HDLC_TX_FRAMES - 1)
+#define E1_HDLC_FLAG 0x7e
+
+/* stuffed bits of a nibble, in the order they go on the line with the
+   first one as MSB, how many, and the ones at the end (0..4) */
+#define E1_HDLC_STUFF_BITS(e) ((e) & 0x3f)
+#define E1_HDLC_STUFF_N(e)    (((e) >> 6) & 0x7)
+#define E1_HDLC_STUFF_ONES(e) (((e) >> 9) & 0x7)
+
+static uint16_t e1_hdlc_tx_tab[5][16];
+
+struct e1_hdlc_tx {
+	unsigned int ts;    /* 0: off, same as the receiver */
+	uint32_t acc;       /* bits to go on the line, first one highest ... */
+	unsigned int nbits; /* ... and how many */
+	unsigned int ones;  /* consecutive ones, index into e1_hdlc_tx_tab */
+	const struct e1_hdlc_frame *f; /* being sent, NULL: idle */
+	unsigned int pos;   /* octets of f (and then the FCS) sent */
+	unsigned int fcs;
+	struct e1_hdlc_frame ring[E1_HDLC_TX_FRAMES];
+	volatile unsigned int head; /* written by usb irq */
+	volatile unsigned int tail; /* written by ssc irq */
+};
+
+static struct e1_hdlc_tx e1_hdlc_tx[E1_HDLC_CHANNELS];
+static struct e1_hdlc_tx_stats e1_hdlc_tx_stats;
+
+static inline unsigned int
+e1_hdlc_fcs(unsigned int fcs, unsigned int o)
+{
+	fcs = (fcs >> 4) ^ e1_hdlc_fcs_tab[(fcs ^ o) & 0xf];
+	return (fcs >> 4) ^ e1_hdlc_fcs_tab[(fcs ^ (o >> 4)) & 0xf];
+}
+
+static uint16_t
+e1_hdlc_rx_tab_entry(unsigned int ones, unsigned int nib)
+{
+	unsigned int data = 0, n = 0, npre = 0, ev = E1_HDLC_EV_NONE;
+	int b;
+
+	for (b=3; b>=0; b--) {
+		if (nib & (1 << b)) {
+			if (ones == 6) {
+				ev = E1_HDLC_EV_ABORT;
+				npre = n;
+			}
+			if (ones < 7)
+				ones++;
+			if (ones <= 5)
+				data |= 1 << n++;
+			continue;
+		}
+		if (ones == 6) {
+			ev = E1_HDLC_EV_FLAG;
+			npre = n;
+		} else if (ones != 5) { /* five ones and a 0: stuffed */
+			n++;
+		}
+		ones = 0;
+	}
+	if (ev == E1_HDLC_EV_NONE)
+		npre = n;
+
+	return data | (npre << 4) | ((n - npre) << 7) | (ones << 9) |
+		(ev << 12);
+}
+
+/* nib holds the bits in the order they are sent from bit 0 up, a 0 goes
+   in after each run of five ones */
+static uint16_t
+e1_hdlc_tx_tab_entry(unsigned int ones, unsigned int nib)
+{
+	unsigned int bits = 0, n = 0;
+	int b;
+
+	for (b=0; b<4; b++) {
+		unsigned int bit = (nib >> b) & 1;
+
+		bits = (bits << 1) | bit;
+		n++;
+		ones = bit ? ones + 1 : 0;
+		if (ones == 5) {
+			bits <<= 1;
+			n++;
+			ones = 0;
+		}
+	}
+	return bits | (n << 6) | (ones << 9);
+}
+
+void
+e1_hdlc_init()
+{
+	unsigned int ones, nib, ch;
+
+	for (ones=0; ones<8; ones++)
+		for (nib=0; nib<16; nib++)
+			e1_hdlc_rx_tab[ones][nib] =
+				e1_hdlc_rx_tab_entry(ones, nib);
+	for (ones=0; ones<5; ones++)
+		for (nib=0; nib<16; nib++)
+			e1_hdlc_tx_tab[ones][nib] =
+				e1_hdlc_tx_tab_entry(ones, nib);
+
+	for (ch=0; ch<E1_HDLC_CHANNELS; ch++)
+		e1_hdlc_set_ts(ch, 0);
+}
+
+void
+e1_hdlc_rx_reset()
+{
+	int ch;
+
+	for (ch=0; ch<E1_HDLC_CHANNELS; ch++)
+		e1_hdlc_rx[ch].len = -1;
+}
+
+int
+e1_hdlc_set_ts(unsigned int ch, unsigned int ts)
+{
+	struct e1_hdlc_tx *tx;
+	uint32_t lock;
+
+	if (ch >= E1_HDLC_CHANNELS || ts >= 32)
+		return -1;
+	tx = &e1_hdlc_tx[ch];
+
+	/* only the ssc irq works on the channels */
+	lock = sam4s_irq_lock(SAM4S_IRQ_PRIO_SSC);
+	e1_hdlc_rx[ch].ts = ts;
+	e1_hdlc_rx[ch].ones = 0;
+	e1_hdlc_rx[ch].len = -1;
+
+	/* a frame in progress is lost, queued ones go out on the new
+	   timeslot, after a flag */
+	if (tx->f) {
+		tx->f = NULL;
+		tx->tail++;
+	}
+	tx->ts = ts;
+	tx->acc = E1_HDLC_FLAG;
+	tx->nbits = 8;
+	tx->ones = 0;
+	sam4s_irq_unlock(lock);
+	return 0;
+}
+
+const struct e1_hdlc_frame *
+e1_hdlc_rx_peek()
+{
+	if (e1_hdlc_rx_tail == e1_hdlc_rx_head)
+		return NULL;
+	return &e1_hdlc_rx_ring[e1_hdlc_rx_tail & E1_HDLC_RX_RING_MSK];
+}
+
+void
+e1_hdlc_rx_pop()
+{
+	if (e1_hdlc_rx_tail != e1_hdlc_rx_head)
+		e1_hdlc_rx_tail++;
+}
+
+void
+e1_hdlc_get_rx_stats(struct e1_hdlc_rx_stats *p)
+{
+	sam4s_seqlock_snapshot(&sam4s_ssc_seqlock, p, &e1_hdlc_rx_stats,
+		sizeof(e1_hdlc_rx_stats));
+}
+
+/* closing flag: the opening 0 and five ones of it have already gone into
+   acc as data, so a frame of whole octets has exactly 6 bits left there */
+static void
+e1_hdlc_rx_frame_end(struct e1_hdlc_rx *rx, unsigned int ch)
+{
+	struct e1_hdlc_frame *f;
+
+	if (rx->len == 0) /* back to back flags */
+		return;
+	if (rx->nbits != 6) {
+		e1_hdlc_rx_stats.align++;
+		return;
+	}
+	if (rx->len < E1_HDLC_MIN_LEN) {
+		e1_hdlc_rx_stats.too_short++;
+		return;
+	}
+	if (rx->fcs != E1_HDLC_FCS_GOOD) {
+		e1_hdlc_rx_stats.crc_err++;
+		return;
+	}
+	if (e1_hdlc_rx_head - e1_hdlc_rx_tail >= E1_HDLC_RX_FRAMES) {
+		e1_hdlc_rx_stats.overrun++;
+		return;
+	}
+
+	f = &e1_hdlc_rx_ring[e1_hdlc_rx_head & E1_HDLC_RX_RING_MSK];
+	f->ts = rx->ts;
+	f->ch = ch;
+	f->len = rx->len - 2;
+	memcpy(f->data, rx->buf, f->len);
+	__DMB(); /* frame complete before the usb irq can see it */
+	e1_hdlc_rx_head++;
+	e1_hdlc_rx_stats.frames++;
+}
+
+static void
+e1_hdlc_rx_bits(struct e1_hdlc_rx *rx, unsigned int data, unsigned int n)
+{
+	unsigned int o;
+
+	rx->acc |= data << rx->nbits;
+	rx->nbits += n;
+	if (rx->nbits < 8)
+		return;
+
+	o = rx->acc & 0xff;
+	rx->acc >>= 8;
+	rx->nbits -= 8;
+
+	if (rx->len >= E1_HDLC_MAX_LEN) {
+		e1_hdlc_rx_stats.too_long++;
+		rx->len = -1;
+		return;
+	}
+	rx->buf[rx->len++] = o;
+	rx->fcs = e1_hdlc_fcs(rx->fcs, o);
+}
+
+static inline void
+e1_hdlc_rx_nibble(struct e1_hdlc_rx *rx, unsigned int ch, unsigned int nib)
+{
+	unsigned int e = e1_hdlc_rx_tab[rx->ones][nib];
+	unsigned int data = E1_HDLC_TAB_DATA(e);
+	unsigned int npre = E1_HDLC_TAB_NPRE(e);
+
+	rx->ones = E1_HDLC_TAB_ONES(e);
+
+	if (rx->len >= 0 && npre)
+		e1_hdlc_rx_bits(rx, data, npre);
+
+	switch (E1_HDLC_TAB_EV(e)) {
+	case E1_HDLC_EV_NONE:
+		return;
+	case E1_HDLC_EV_FLAG:
+		if (rx->len >= 0)
+			e1_hdlc_rx_frame_end(rx, ch);
+		rx->len = 0;
+		rx->acc = 0;
+		rx->nbits = 0;
+		rx->fcs = E1_HDLC_FCS_INIT;
+		break;
+	case E1_HDLC_EV_ABORT:
+		if (rx->len > 0)
+			e1_hdlc_rx_stats.abort++;
+		rx->len = -1;
+		return;
+	}
+
+	if (E1_HDLC_TAB_NPOST(e))
+		e1_hdlc_rx_bits(rx, data >> npre, E1_HDLC_TAB_NPOST(e));
+}
+
+/* the first bit of a timeslot on the line is the MSB of its octet in the
+   rx ring, and the LSB of the HDLC octet */
+void
+e1_hdlc_rx_dblfrm(const uint32_t *p)
+{
+	unsigned int ch, f;
+
+	for (ch=0; ch<E1_HDLC_CHANNELS; ch++) {
+		struct e1_hdlc_rx *rx = &e1_hdlc_rx[ch];
+		unsigned int ts = rx->ts;
+
+		if (!ts)
+			continue;
+
+		for (f=0; f<2; f++) {
+			unsigned int o = (p[8*f + ts/4] >> (24 - 8*(ts%4))) &
+				0xff;
+
+			e1_hdlc_rx_nibble(rx, ch, o >> 4);
+			e1_hdlc_rx_nibble(rx, ch, o & 0xf);
+		}
+	}
+}
+
+struct e1_hdlc_frame *
+e1_hdlc_tx_write_begin(unsigned int ch)
+{
+	struct e1_hdlc_tx *tx;
+
+	if (ch >= E1_HDLC_CHANNELS)
+		return NULL;
+	tx = &e1_hdlc_tx[ch];
+	if (tx->head - tx->tail >= E1_HDLC_TX_FRAMES)
+		return NULL;
+	return &tx->ring[tx->head & E1_HDLC_TX_RING_MSK];
+}
+
+int
+e1_hdlc_tx_write_commit(unsigned int ch)
+{
+	struct e1_hdlc_tx *tx = &e1_hdlc_tx[ch];
+	struct e1_hdlc_frame *f = &tx->ring[tx->head & E1_HDLC_TX_RING_MSK];
+
+	if (f->len > E1_HDLC_MAX_LEN - 2) {
+		e1_hdlc_tx_stats.too_long++;
+		return -1;
+	}
+	if (f->len < E1_HDLC_MIN_LEN - 2) {
+		e1_hdlc_tx_stats.too_short++;
+		return -1;
+	}
+
+	f->ch = ch;
+	__DMB(); /* frame complete before the ssc irq can see it */
+	tx->head++;
+	return 0;
+}
+
+void
+e1_hdlc_get_tx_stats(struct e1_hdlc_tx_stats *p)
+{
+	/* too_long and too_short come from the writer side, single words */
+	sam4s_seqlock_snapshot(&sam4s_ssc_seqlock, p, &e1_hdlc_tx_stats,
+		sizeof(e1_hdlc_tx_stats));
+}
+
+static inline void
+e1_hdlc_tx_octet(struct e1_hdlc_tx *tx, unsigned int o)
+{
+	unsigned int e;
+
+	e = e1_hdlc_tx_tab[tx->ones][o & 0xf];
+	tx->acc = (tx->acc << E1_HDLC_STUFF_N(e)) | E1_HDLC_STUFF_BITS(e);
+	tx->nbits += E1_HDLC_STUFF_N(e);
+
+	e = e1_hdlc_tx_tab[E1_HDLC_STUFF_ONES(e)][o >> 4];
+	tx->acc = (tx->acc << E1_HDLC_STUFF_N(e)) | E1_HDLC_STUFF_BITS(e);
+	tx->nbits += E1_HDLC_STUFF_N(e);
+	tx->ones = E1_HDLC_STUFF_ONES(e);
+}
+
+/* flags are not stuffed, and the same in both bit orders */
+static inline void
+e1_hdlc_tx_flag(struct e1_hdlc_tx *tx)
+{
+	tx->acc = (tx->acc << 8) | E1_HDLC_FLAG;
+	tx->nbits += 8;
+	tx->ones = 0;
+}
+
+/* at least 8 more bits into acc, one octet may grow to 10 with stuffing,
+   so acc never holds more than 17 */
+static void
+e1_hdlc_tx_fill(struct e1_hdlc_tx *tx)
+{
+	while (tx->nbits < 8) {
+		const struct e1_hdlc_frame *f = tx->f;
+
+		if (!f) {
+			/* the flag before is the opening flag */
+			if (tx->tail == tx->head) {
+				e1_hdlc_tx_flag(tx);
+				continue;
+			}
+			f = tx->f = &tx->ring[tx->tail & E1_HDLC_TX_RING_MSK];
+			tx->pos = 0;
+			tx->fcs = E1_HDLC_FCS_INIT;
+		}
+
+		if (tx->pos < f->len) {
+			unsigned int o = f->data[tx->pos++];
+
+			tx->fcs = e1_hdlc_fcs(tx->fcs, o);
+			e1_hdlc_tx_octet(tx, o);
+		} else if (tx->pos < f->len + 2u) {
+			/* FCS, ones complement, low octet first */
+			e1_hdlc_tx_octet(tx, ~(tx->fcs >>
+				(8 * (tx->pos - f->len))) & 0xff);
+			tx->pos++;
+		} else {
+			e1_hdlc_tx_flag(tx);
+			tx->f = NULL;
+			tx->tail++;
+			e1_hdlc_tx_stats.frames++;
+		}
+	}
+}
+
+void
+e1_hdlc_tx_dblfrm(uint32_t *p)
+{
+	unsigned int ch, f;
+
+	for (ch=0; ch<E1_HDLC_CHANNELS; ch++) {
+		struct e1_hdlc_tx *tx = &e1_hdlc_tx[ch];
+		unsigned int ts = tx->ts;
+
+		if (!ts)
+			continue;
+
+		for (f=0; f<2; f++) {
+			uint32_t *lw = &p[8*f + ts/4];
+			unsigned int sh = 24 - 8*(ts%4);
+			unsigned int o;
+
+			e1_hdlc_tx_fill(tx);
+			tx->nbits -= 8;
+			o = (tx->acc >> tx->nbits) & 0xff;
+			*lw = (*lw & ~(0xffUL << sh)) | ((uint32_t)o << sh);
+		}
+	}
+}
@@ -0,0 +1,70 @@
+#ifndef E1_HDLC_H
+#define E1_HDLC_H
+
+#include <stdint.h>
+
+/* number of timeslots with an hdlc receiver and transmitter */
+#define E1_HDLC_CHANNELS 2
+/* Q.921 N201 of 260 octets plus address, control and FCS */
+#define E1_HDLC_MAX_LEN 266
+/* address, control (or two octets of address) and FCS */
+#define E1_HDLC_MIN_LEN 4
+/* received frames waiting for the host, must be a power of two */
+#define E1_HDLC_RX_FRAMES 8
+/* frames queued for each transmitter, must be a power of two */
+#define E1_HDLC_TX_FRAMES 4
+
+struct e1_hdlc_frame {
+	uint8_t ts;       /* timeslot the frame was received on */
+	uint8_t ch;       /* channel, see e1_hdlc_set_ts() */
+	uint16_t len;     /* octets in data, without the FCS */
+	uint8_t data[E1_HDLC_MAX_LEN];
+};
+
+struct e1_hdlc_rx_stats {
+	unsigned int frames;   /* good frames put into the ring */
+	unsigned int crc_err;  /* FCS did not match */
+	unsigned int abort;    /* seven or more ones within a frame */
+	unsigned int align;    /* frame not a multiple of 8 bits */
+	unsigned int too_long; /* frame larger than E1_HDLC_MAX_LEN */
+	unsigned int too_short;/* frame shorter than E1_HDLC_MIN_LEN */
+	unsigned int overrun;  /* good frames lost, ring full */
+};
+
+struct e1_hdlc_tx_stats {
+	unsigned int frames;   /* frames sent completely */
+	unsigned int too_long; /* frames refused, longer than E1_HDLC_MAX_LEN */
+	unsigned int too_short;/* ... shorter than E1_HDLC_MIN_LEN */
+};
+
+extern void e1_hdlc_init();
+
+/* receive and send on timeslot ts (1..31) on channel ch, ts 0 switches
+   it off, returns -1 if ch or ts is out of range */
+extern int e1_hdlc_set_ts(unsigned int ch, unsigned int ts);
+
+/* called in ssc irq context for each aligned double-frame, and once when
+   alignment is lost, to go back to hunting for a flag */
+extern void e1_hdlc_rx_dblfrm(const uint32_t *p);
+extern void e1_hdlc_rx_reset();
+
+/* reader side (usb irq): oldest complete frame or NULL, and release it
+   once it has been sent */
+extern const struct e1_hdlc_frame *e1_hdlc_rx_peek();
+extern void e1_hdlc_rx_pop();
+
+extern void e1_hdlc_get_rx_stats(struct e1_hdlc_rx_stats *p);
+
+/* called in ssc irq context after e1_tx_dblfrm_irq(), puts the next
+   two octets of each transmitter (flags when idle) into p */
+extern void e1_hdlc_tx_dblfrm(uint32_t *p);
+
+/* writer side (usb irq): room for the next frame of channel ch, NULL if
+   its queue is full, fill in data and len (without the FCS) and commit,
+   -1 if the frame has been refused */
+extern struct e1_hdlc_frame *e1_hdlc_tx_write_begin(unsigned int ch);
+extern int e1_hdlc_tx_write_commit(unsigned int ch);
+
+extern void e1_hdlc_get_tx_stats(struct e1_hdlc_tx_stats *p);
+
+#endif
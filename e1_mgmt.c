@@ -1,56 +1,40 @@
 #include "e1_mgmt.h"
 #include "sam4s_ssc.h"
 #include "sam4s_timer.h"
+#include "e1_align.h"
+#include "e1_crc4.h"
+#include "e1_tx.h"
+#include "e1_demux.h"
+#include "e1_hdlc.h"
+#include "e1_ts0.h"
+#include "g704.h"
+
+#include <sam4s8b.h>
 
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
-/*
- * G.704 (10/98) Table 5/A G.704 – Allocation of bits 1 to 8 of the frame
- *
- *                       MSB                         LSB
- *                        1                           8
- * Frame containing     +---+---+---+---+---+---+---+---+
- * the frame alignment  | Si| 0 | 0 | 1 | 1 | 0 | 1 | 1 |
- * signal:              +---+---+---+---+---+---+---+---+
- *
- * Frame not containing +---+---+---+---+---+---+---+---+
- * the frame alignment  | Si| 1 | A |Sa4|Sa5|Sa6|Sa7|Sa8|
- * signal:              +---+---+---+---+---+---+---+---+
- */
-
-#define G704_FAS_MSK   0x7f
-#define G704_FAS_BITS   0x1b
-#define G704_NOFAS_MSK 0xc0
-#define G704_NOFAS_BITS 0x40
-
-#define CHK_LW_MSB_OCTET(c,m,b) (((c) & ((m) << 24)) == ((b) << 24))
-#define CHK_G704_FAS_LW(c) CHK_LW_MSB_OCTET((c), G704_FAS_MSK, G704_FAS_BITS)
-#define CHK_G704_NOFAS_LW(c) CHK_LW_MSB_OCTET((c), G704_NOFAS_MSK, G704_NOFAS_BITS)
-
-struct e1_mgmt_irqstats {
-	unsigned int dblfrm;
-	unsigned int n_dblframes_bad_fas;
-};
-
 static struct e1_mgmt_irqstats e1_mgmt_irqstats;
 
 void
-e1_mgmt_init() {
-	int i;
+e1_mgmt_get_irqstats(struct e1_mgmt_irqstats *p)
+{
+	sam4s_seqlock_snapshot(&sam4s_ssc_seqlock, p, &e1_mgmt_irqstats,
+		sizeof(e1_mgmt_irqstats));
+}
 
-	/* create idle pattern for tx */
+void
+e1_mgmt_init() {
 	memset(sam4s_ssc_rx_buf, '\0', sizeof(sam4s_ssc_rx_buf));
-	memset(sam4s_ssc_tx_buf, '\0', sizeof(sam4s_ssc_tx_buf));
 
-	for (i=0; i<SAM4S_SSC_BUF_DBLFRAMES; i++) {
-		/* even C 0 0 1 1 0 1 1 */
-		sam4s_ssc_tx_buf[i*SAM4S_SSC_DBLFRM_LONGWORDS] = 0x1b000000;
-		/* odd  0 1 A S S S S S */
-		sam4s_ssc_tx_buf[i*SAM4S_SSC_DBLFRM_LONGWORDS+8] = 0x40000000;  
-	}
+	/* idle pattern for tx, see e1_tx.c */
+	e1_ts0_init();
+	e1_tx_init();
 
+	e1_align_init();
+	e1_crc4_reset();
+	e1_hdlc_init();
 }
 
 /*
@@ -65,50 +49,45 @@ void
 e1_mgmt_rx_dblfrm_irq(uint32_t *p) {
 	e1_mgmt_irqstats.dblfrm++;
 
-	if (!(CHK_G704_FAS_LW(p[0]) && CHK_G704_NOFAS_LW(p[8]))) {
-		e1_mgmt_irqstats.n_dblframes_bad_fas;
+	if (!e1_align_rx_dblfrm(p)) {
+		e1_mgmt_irqstats.n_dblframes_bad_fas++;
 	}
-}
-
-/* this is handled in the idle loop repeatedly */
-void
-e1_mgmt_poll() {
-#if 0
-	if (last_dblfrm_processed == sam4s_ssc_rx_last_dblfrm)
-		return;
-
-	/* possibly process a single dblframe */
 
-	/* wrap-around happened? */
-	if (last_dblfrm_processed > sam4s_ssc_rx_last_dblfrm)
-		goto out; /* not yet */
+	/* single FAS errors do not disturb the multiframe */
+	if (e1_align_get_state() == E1_ALIGN_LOCKED) {
+		e1_crc4_rx_dblfrm(p);
+		e1_ts0_rx_dblfrm(p);
+		e1_hdlc_rx_dblfrm(p);
+	} else {
+		e1_crc4_reset();
+		e1_ts0_rx_reset();
+		e1_hdlc_rx_reset();
+	}
 
-	rx_process_ctr++;
-	if (rx_process_ctr > 200) { /* give two dblframes (4ms) to sync */
-		int i;
-		for (i=0; i<SAM4S_SSC_BUF_DBLFRAMES; i++) {
-			uint32_t lwe, lwo; /* even and odd longwords */
-			lwe = sam4s_ssc_rx_buf[i*SAM4S_SSC_DBLFRM_LONGWORDS];
-			lwo = sam4s_ssc_rx_buf[i*SAM4S_SSC_DBLFRM_LONGWORDS+8];
+	e1_demux_rx_dblfrm(p);
+}
 
-			if ((lwe & 0x7f000000) != 0x1b000000 ||
-			    (lwo & 0xc0000000) != 0x40000000) {
-				if (enable_sync)
-					printf("%d: lwe=0x%08x lwo=0x%08x\r\n", i, lwe, lwo);
-				break;
+/* called in the ssc interrupt when n double-frames were not received,
+   see sam4s_ssc.c. Frame alignment holds across the gap, the multiframe
+   and the hdlc frames in progress do not */
+void
+e1_mgmt_rx_gap_irq(unsigned int n) {
+	e1_crc4_reset();
+	e1_ts0_rx_reset();
+	e1_hdlc_rx_reset();
+	e1_demux_rx_gap(n);
+}
 
-			    }
-		}
-		/* sync markers didn't match up */
-		if (i != SAM4S_SSC_BUF_DBLFRAMES) {
-			rx_process_ctr = 0;
+/* called in the ssc interrupt right before the tx double-frame p is
+   queued to the PDC, seq numbers the transmitted double-frames */
+void
+e1_mgmt_tx_dblfrm_irq(uint32_t *p, unsigned int seq) {
+	e1_tx_dblfrm_irq(p, seq);
+	e1_hdlc_tx_dblfrm(p);
+}
 
-			if (enable_sync) {
-				sam4s_timer_e1_phase_adj(1);
-			}
-		}
-	}
-out:
-	last_dblfrm_processed = sam4s_ssc_rx_last_dblfrm;
-#endif
+/* this is handled in the idle loop repeatedly */
+void
+e1_mgmt_poll() {
+	/* frame alignment is done in irq context, see e1_align.c */
 }
@@ -3,8 +3,16 @@
 
 #include <stdint.h>
 
+struct e1_mgmt_irqstats {
+	unsigned int dblfrm;
+	unsigned int n_dblframes_bad_fas;
+};
+
 extern void e1_mgmt_init();
 extern void e1_mgmt_poll();
 extern void e1_mgmt_rx_dblfrm_irq(uint32_t *p); /* called in irq context! */
+extern void e1_mgmt_tx_dblfrm_irq(uint32_t *p, unsigned int seq); /* ditto */
+extern void e1_mgmt_rx_gap_irq(unsigned int n); /* ditto */
+extern void e1_mgmt_get_irqstats(struct e1_mgmt_irqstats *p);
 
 #endif
\ No newline at end of file
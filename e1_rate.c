@@ -0,0 +1,218 @@
+/*
+ * This file is part of the osmocom sam4s usb interface firmware.
+ * Copyright (c) 2018 Christian Vogel <vogelchr@vogel.cx>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Rate of the E1 line clock measured against the USB start of frame: on
+   every SOF the position in the received bitstream is timestamped to the
+   bit, the filtered number of bits per 1 ms frame sizes the iso in packets.
+   The ssc transmitter runs from MCK, not from the line clock, so the rate
+   the tx jitter buffer drains at is measured the same way from the cycle
+   counter, and reported on the feedback endpoint for iso out. */
+
+#include "e1_rate.h"
+#include "sam4s_ssc.h"
+
+#include <sam4s8b.h>
+#include <string.h>
+
+#define E1_RATE_DBLFRM_BITS \
+	(SAM4S_SSC_DBLFRM_LONGWORDS * SAM4S_SSC_BITS_PER_LONGWORD)
+
+/*
+ * The timestamps jitter with the SOF irq latency by a few bits, so the
+ * rate is not taken from the difference of two timestamps, but from a
+ * second order loop that tracks the bit position: phase error e, rate
+ * += e * 2^-KI, predicted position += rate + e * 2^-KP. Critically damped,
+ * settles within about a second.
+ */
+#define E1_RATE_KP 6
+#define E1_RATE_KI 14
+/* the loop has settled after that many frames */
+#define E1_RATE_SETTLE 2048
+/* a larger phase error is a phase adjustment, a restart of the ssc dma,
+   a line clock problem... and restarts the loop */
+#define E1_RATE_MAX_ERR 256
+/* longer gaps (suspend, lost SOFs) restart it as well */
+#define E1_RATE_MAX_DFRM 8
+
+/* MCK cycles per transmitted bit, see sam4s_ssc.h */
+#define E1_RATE_TX_CYCLES_PER_BIT (2 * SAM4S_SSC_CMR_DIV)
+
+struct e1_rate_loop {
+	unsigned int nsamples;
+	int64_t phase;  /* predicted bit position, 48.16 */
+	int32_t q16;    /* bits per frame, 16.16 */
+};
+
+static unsigned int e1_rate_last_frm;
+static struct e1_rate_loop e1_rate_rx = { .q16 = E1_RATE_NOMINAL << 16 };
+static struct e1_rate_loop e1_rate_tx = { .q16 = E1_RATE_NOMINAL << 16 };
+
+/* tx bit position from DWT->CYCCNT, kept in bits and leftover cycles */
+static uint32_t e1_rate_tx_cyc;
+static uint32_t e1_rate_tx_rem;
+static uint32_t e1_rate_tx_bits;
+
+static struct e1_rate_stats e1_rate_stats;
+static struct sam4s_seqlock e1_rate_seqlock; /* held by e1_rate_sof() */
+
+void
+e1_rate_init()
+{
+	e1_rate_rx.nsamples = 0;
+	e1_rate_rx.q16 = E1_RATE_NOMINAL << 16;
+	e1_rate_tx.nsamples = 0;
+	e1_rate_tx.q16 = E1_RATE_NOMINAL << 16;
+}
+
+/*
+ * Number of bits received so far (modulo 2^32): whole double-frames from
+ * the position of the PDC in the rx ring, which is still right when the
+ * ssc irq has not run yet (or not for the whole batch, SAM4S_SSC_BATCH),
+ * the bits within the double-frame from the counter of TC2. PDC and TC2
+ * do not change at exactly the same time, so the coarse position from the
+ * PDC decides to which double-frame the counter value belongs.
+ */
+static uint32_t
+e1_rate_rx_bitpos()
+{
+	unsigned int seq = sam4s_ssc_rx_seq;
+	uint32_t rpr = PDC_SSC->PERIPH_RPR;
+	uint32_t cv = TC0->TC_CHANNEL[2].TC_CV;
+	unsigned int lw, slot, dblfrm;
+	int coarse, d;
+
+	lw = (rpr - (uint32_t)sam4s_ssc_rx_buf) / sizeof(uint32_t);
+	slot = lw / SAM4S_SSC_DBLFRM_LONGWORDS;
+	/* double-frames completed but not yet seen by the ssc irq */
+	dblfrm = seq + ((slot - seq) & (SAM4S_SSC_BUF_DBLFRAMES - 1));
+
+	coarse = (lw % SAM4S_SSC_DBLFRM_LONGWORDS) * SAM4S_SSC_BITS_PER_LONGWORD;
+	d = (int)cv - coarse;
+	if (d < -E1_RATE_DBLFRM_BITS/2)
+		dblfrm++;
+	else if (d > E1_RATE_DBLFRM_BITS/2)
+		dblfrm--;
+
+	return dblfrm * E1_RATE_DBLFRM_BITS + cv;
+}
+
+/* bits sent so far (modulo 2^32) at the rate of MCK, the cycle counter
+   wraps after 38 s, long before that the loop restarts anyway */
+static uint32_t
+e1_rate_tx_bitpos()
+{
+	uint32_t cyc = DWT->CYCCNT;
+	uint32_t d = cyc - e1_rate_tx_cyc + e1_rate_tx_rem;
+
+	e1_rate_tx_cyc = cyc;
+	e1_rate_tx_bits += d / E1_RATE_TX_CYCLES_PER_BIT;
+	e1_rate_tx_rem = d % E1_RATE_TX_CYCLES_PER_BIT;
+	return e1_rate_tx_bits;
+}
+
+static void
+e1_rate_loop_update(struct e1_rate_loop *l, uint32_t pos, unsigned int dfrm)
+{
+	int64_t e;
+
+	if (l->nsamples && dfrm && dfrm <= E1_RATE_MAX_DFRM) {
+		l->phase += (int64_t)dfrm * l->q16;
+		/* only the lower 32 bits of the position are known */
+		e = (int32_t)(pos - (uint32_t)(l->phase >> 16));
+		e = e * 65536 - (l->phase & 0xffff);
+
+		if (e > -((int64_t)E1_RATE_MAX_ERR << 16) &&
+		    e < ((int64_t)E1_RATE_MAX_ERR << 16)) {
+			l->q16 += e >> E1_RATE_KI;
+			l->phase += e >> E1_RATE_KP;
+			if (l->nsamples < E1_RATE_SETTLE)
+				l->nsamples++;
+			return;
+		}
+		e1_rate_stats.glitch++;
+	}
+
+	/* (re)start the loop at this position, keep the rate */
+	l->phase = (int64_t)pos << 16;
+	if (!l->nsamples)
+		l->nsamples = 1;
+}
+
+static void
+e1_rate_update(unsigned int frm_num)
+{
+	uint32_t pos = e1_rate_rx_bitpos();
+	uint32_t tx_pos = e1_rate_tx_bitpos();
+	unsigned int dfrm = (frm_num - e1_rate_last_frm) &
+		(UDP_FRM_NUM_FRM_NUM_Msk >> UDP_FRM_NUM_FRM_NUM_Pos);
+
+	e1_rate_stats.sof++;
+	e1_rate_last_frm = frm_num;
+
+	e1_rate_loop_update(&e1_rate_rx, pos, dfrm);
+	e1_rate_loop_update(&e1_rate_tx, tx_pos, dfrm);
+}
+
+void
+e1_rate_sof(unsigned int frm_num)
+{
+	sam4s_seqlock_write_begin(&e1_rate_seqlock);
+	e1_rate_update(frm_num);
+	sam4s_seqlock_write_end(&e1_rate_seqlock);
+}
+
+static uint32_t
+e1_rate_loop_get(const struct e1_rate_loop *l)
+{
+	if (l->nsamples < E1_RATE_SETTLE)
+		return (uint32_t)E1_RATE_NOMINAL << 16;
+	return l->q16;
+}
+
+uint32_t
+e1_rate_get()
+{
+	return e1_rate_loop_get(&e1_rate_rx);
+}
+
+uint32_t
+e1_rate_get_tx()
+{
+	return e1_rate_loop_get(&e1_rate_tx);
+}
+
+static int
+e1_rate_ppb(uint32_t rate)
+{
+	return ((int64_t)rate - (E1_RATE_NOMINAL << 16)) *
+		1000000000 / (E1_RATE_NOMINAL << 16);
+}
+
+void
+e1_rate_get_stats(struct e1_rate_stats *p)
+{
+	unsigned int seq;
+
+	do {
+		seq = sam4s_seqlock_read_begin(&e1_rate_seqlock);
+		memcpy(p, &e1_rate_stats, sizeof(e1_rate_stats));
+		p->rate = e1_rate_rx.q16;
+		p->tx_rate = e1_rate_tx.q16;
+	} while (sam4s_seqlock_read_retry(&e1_rate_seqlock, seq));
+	p->ppb = e1_rate_ppb(p->rate);
+	p->tx_ppb = e1_rate_ppb(p->tx_rate);
+}
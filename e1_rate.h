@@ -0,0 +1,31 @@
+#ifndef E1_RATE_H
+#define E1_RATE_H
+
+#include <stdint.h>
+
+/* nominal E1 bits per USB frame (1 ms) */
+#define E1_RATE_NOMINAL 2048
+
+struct e1_rate_stats {
+	unsigned int sof;     /* start of frames timestamped */
+	unsigned int glitch;  /* ... rejected as outliers */
+	uint32_t rate;        /* filtered E1 bits per USB frame, 16.16 */
+	int ppb;              /* E1 clock vs. USB frame clock, 1e-9 */
+	uint32_t tx_rate;     /* same for the ssc tx clock (MCK) */
+	int tx_ppb;
+};
+
+extern void e1_rate_init();
+
+/* called in the usb SOF irq with the 11 bit frame number */
+extern void e1_rate_sof(unsigned int frm_num);
+
+/* filtered E1 bits per USB frame, 16.16, nominal value until the
+   filter has settled */
+extern uint32_t e1_rate_get();
+/* the same for the rate the ssc transmits at, from MCK */
+extern uint32_t e1_rate_get_tx();
+
+extern void e1_rate_get_stats(struct e1_rate_stats *p);
+
+#endif
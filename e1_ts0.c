@@ -0,0 +1,199 @@
+/*
+ * This file is part of the osmocom sam4s usb interface firmware.
+ * Copyright (c) 2018 Christian Vogel <vogelchr@vogel.cx>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A and Sa bits of timeslot 0: remote alarm state and the received bits
+   per multiframe for the host, the transmitted ones from a queue the host
+   fills, one bit of each per double-frame either way */
+
+#include "e1_ts0.h"
+#include "e1_align.h"
+#include "e1_crc4.h"
+#include "sam4s_ssc.h"
+#include "g704.h"
+
+#include <sam4s8b.h>
+#include <string.h>
+
+/* NFAS frames per multiframe, one per double-frame */
+#define E1_TS0_MF_NFAS 8
+
+struct e1_ts0_mf e1_ts0_rx_buf[E1_TS0_RX_MF];
+volatile unsigned int e1_ts0_rx_seq;
+
+static struct e1_ts0_mf e1_ts0_rx_cur;   /* multiframe being received */
+static int e1_ts0_rx_pos;                /* its NFAS frame, without CRC-4 */
+static int e1_ts0_rx_n;                  /* NFAS frames of it seen */
+static int e1_ts0_rx_a_run;              /* NFAS in a row with A != rai */
+
+static struct e1_ts0_mf e1_ts0_tx_q[E1_TS0_TX_MF];
+static volatile unsigned int e1_ts0_tx_head; /* written by usb */
+static volatile unsigned int e1_ts0_tx_tail; /* sent by ssc */
+static volatile unsigned int e1_ts0_tx_first;/* queued before: flushed */
+static struct e1_ts0_mf e1_ts0_tx_cur;   /* multiframe being sent */
+
+static struct e1_ts0_stats e1_ts0_stats;
+
+void
+e1_ts0_init()
+{
+	memset(&e1_ts0_tx_cur, 0, sizeof(e1_ts0_tx_cur));
+	memset(e1_ts0_tx_cur.sa, 0xff, sizeof(e1_ts0_tx_cur.sa));
+	e1_ts0_tx_first = e1_ts0_tx_head;
+	e1_ts0_rx_reset();
+}
+
+void
+e1_ts0_get_stats(struct e1_ts0_stats *p)
+{
+	sam4s_seqlock_snapshot(&sam4s_ssc_seqlock, p, &e1_ts0_stats,
+		sizeof(e1_ts0_stats));
+}
+
+void
+e1_ts0_rx_reset()
+{
+	e1_ts0_rx_pos = 0;
+	e1_ts0_rx_n = 0;
+	e1_ts0_rx_a_run = 0;
+}
+
+/* multiframe complete, into the ring */
+static void
+e1_ts0_rx_mf_done(int crc4)
+{
+	unsigned int seq = e1_ts0_rx_seq;
+	const struct e1_ts0_mf *prev =
+		&e1_ts0_rx_buf[(seq - 1) % E1_TS0_RX_MF];
+	struct e1_ts0_mf *mf = &e1_ts0_rx_buf[seq % E1_TS0_RX_MF];
+
+	e1_ts0_rx_cur.flags = (crc4 ? E1_TS0_MF_CRC4 : 0) |
+		(e1_ts0_stats.rai ? E1_TS0_MF_RAI : 0);
+	if (seq && memcmp(prev->sa, e1_ts0_rx_cur.sa, sizeof(prev->sa)))
+		e1_ts0_stats.rx_changes++;
+
+	*mf = e1_ts0_rx_cur;
+	__DMB(); /* multiframe complete before the usb irq can see it */
+	e1_ts0_rx_seq = seq + 1;
+	e1_ts0_stats.rx_mf++;
+}
+
+void
+e1_ts0_rx_dblfrm(const uint32_t *p)
+{
+	unsigned int nfas = p[8] >> 24;
+	unsigned int a = !!(nfas & G704_A_MSK);
+	int pos = e1_crc4_mf_pos();
+	int crc4 = pos >= 0;
+	int i;
+
+	/* remote alarm, once the A bit is the other way for long enough */
+	if (a != e1_ts0_stats.rai) {
+		if (++e1_ts0_rx_a_run >= E1_TS0_RAI_NFAS) {
+			e1_ts0_stats.rai = a;
+			e1_ts0_stats.rai_events += a;
+			e1_ts0_rx_a_run = 0;
+		}
+	} else {
+		e1_ts0_rx_a_run = 0;
+	}
+
+	/* without CRC-4 (or still hunting for it) count for ourselves, a
+	   multiframe started that way is dropped once CRC-4 locks */
+	if (!crc4)
+		pos = e1_ts0_rx_pos;
+	e1_ts0_rx_pos = (pos + 1) % E1_TS0_MF_NFAS;
+
+	if (pos == 0) {
+		memset(&e1_ts0_rx_cur, 0, sizeof(e1_ts0_rx_cur));
+		e1_ts0_rx_n = 0;
+	}
+	e1_ts0_rx_n++;
+
+	e1_ts0_rx_cur.a |= a << (E1_TS0_MF_NFAS - 1 - pos);
+	for (i=0; i<E1_TS0_SA; i++)
+		e1_ts0_rx_cur.sa[i] |= ((nfas >> (E1_TS0_SA - 1 - i)) & 1) <<
+			(E1_TS0_MF_NFAS - 1 - pos);
+
+	if (pos == E1_TS0_MF_NFAS - 1 && e1_ts0_rx_n == E1_TS0_MF_NFAS)
+		e1_ts0_rx_mf_done(crc4);
+}
+
+unsigned int
+e1_ts0_tx_room()
+{
+	return E1_TS0_TX_MF - (e1_ts0_tx_head - e1_ts0_tx_tail);
+}
+
+/* the ssc irq preempts the usb irq: it only sees head once the entries
+   are complete, and first and head together, or it would find the flush
+   but not what follows it and repeat the old multiframe once more */
+int
+e1_ts0_tx_write(const struct e1_ts0_mf *p, unsigned int n, int flush)
+{
+	unsigned int head = e1_ts0_tx_head;
+	unsigned int i;
+	uint32_t lock;
+
+	if (n > e1_ts0_tx_room())
+		return -1;
+
+	for (i=0; i<n; i++)
+		e1_ts0_tx_q[(head + i) % E1_TS0_TX_MF] = p[i];
+	lock = sam4s_irq_lock(SAM4S_IRQ_PRIO_SSC);
+	if (flush)
+		e1_ts0_tx_first = head;
+	e1_ts0_tx_head = head + n;
+	sam4s_irq_unlock(lock);
+	return 0;
+}
+
+/* next multiframe from the queue, or the last one again */
+static void
+e1_ts0_tx_next()
+{
+	unsigned int tail = e1_ts0_tx_tail;
+
+	if ((int)(e1_ts0_tx_first - tail) > 0)
+		tail = e1_ts0_tx_first;
+	if (tail == e1_ts0_tx_head) {
+		e1_ts0_stats.tx_repeat++;
+	} else {
+		e1_ts0_tx_cur = e1_ts0_tx_q[tail % E1_TS0_TX_MF];
+		e1_ts0_tx_tail = tail + 1;
+		e1_ts0_stats.tx_mf++;
+	}
+}
+
+uint8_t
+e1_ts0_tx_nfas(unsigned int seq)
+{
+	int pos = seq % E1_TS0_MF_NFAS;
+	int sh = E1_TS0_MF_NFAS - 1 - pos;
+	uint8_t nfas = G704_SI_MSK | G704_NOFAS_BITS;
+	int i;
+
+	if (pos == 0)
+		e1_ts0_tx_next();
+
+	if ((e1_ts0_tx_cur.a >> sh) & 1 ||
+	    ((e1_ts0_tx_cur.flags & E1_TS0_MF_AUTO_RAI) &&
+	     e1_align_get_state() != E1_ALIGN_LOCKED))
+		nfas |= G704_A_MSK;
+	for (i=0; i<E1_TS0_SA; i++)
+		nfas |= ((e1_ts0_tx_cur.sa[i] >> sh) & 1) << (E1_TS0_SA - 1 - i);
+	return nfas;
+}
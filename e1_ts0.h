@@ -0,0 +1,78 @@
+#ifndef E1_TS0_H
+#define E1_TS0_H
+
+#include <stdint.h>
+
+/*
+ * The A bit (remote alarm indication) and the national bits Sa4..Sa8 in
+ * timeslot 0 of the frames without FAS, see g704.h. Each of them is one
+ * bit per double-frame, 8 per multiframe (2 ms, 4 kbit/s), collected
+ * into one octet per bit and multiframe, the bit of the first NFAS frame
+ * (frame 1) in the MSB. With CRC-4 the octets follow the multiframe,
+ * without it they are groups of 8 NFAS frames counted from alignment.
+ */
+
+#define E1_TS0_SA 5 /* Sa4..Sa8 */
+/* received multiframes kept for the host, 128 ms, a power of two */
+#define E1_TS0_RX_MF 64
+/* multiframes queued for transmission, a power of two */
+#define E1_TS0_TX_MF 16
+/* NFAS frames in a row with the same A bit to change the remote alarm
+   state */
+#define E1_TS0_RAI_NFAS 3
+
+/* one multiframe, 8 bytes, received or to send */
+struct e1_ts0_mf {
+	uint8_t a;
+	uint8_t sa[E1_TS0_SA];  /* Sa4..Sa8 */
+	uint8_t flags;          /* E1_TS0_MF_* */
+	uint8_t rsvd;
+};
+
+/* rx: aligned to the CRC-4 multiframe */
+#define E1_TS0_MF_CRC4     0x01
+/* rx: remote alarm state at the end of the multiframe */
+#define E1_TS0_MF_RAI      0x02
+/* tx: A = 1 in addition while the receiver has no frame alignment */
+#define E1_TS0_MF_AUTO_RAI 0x04
+
+struct e1_ts0_stats {
+	unsigned int rai;        /* remote alarm indicated now */
+	unsigned int rai_events; /* ... times it came on */
+	unsigned int rx_mf;      /* multiframes put into the ring */
+	unsigned int rx_changes; /* ... with Sa bits other than the one before */
+	unsigned int tx_mf;      /* queued multiframes sent */
+	unsigned int tx_repeat;  /* multiframes repeated, queue empty */
+};
+
+/* number of multiframes received, the last one is always in
+   e1_ts0_rx_buf[(e1_ts0_rx_seq-1) % E1_TS0_RX_MF], see also
+   e1_demux_seq. The one after is being written, so the reader (usb irq)
+   can take the E1_TS0_RX_MF-1 before e1_ts0_rx_seq */
+extern struct e1_ts0_mf e1_ts0_rx_buf[E1_TS0_RX_MF];
+extern volatile unsigned int e1_ts0_rx_seq;
+
+/* sends A = 0, Sa = 1 until told otherwise */
+extern void e1_ts0_init();
+
+/* called in ssc irq context for each aligned double-frame, after
+   e1_crc4_rx_dblfrm(), and when alignment is lost or double-frames were
+   not received, to start over with the next multiframe */
+extern void e1_ts0_rx_dblfrm(const uint32_t *p);
+extern void e1_ts0_rx_reset();
+
+/* writer side (usb irq): queues n multiframes, each sent once, the last
+   one is repeated until there is another one. flush drops the ones not
+   sent yet. Returns -1 (nothing queued) if there is no room */
+extern int e1_ts0_tx_write(const struct e1_ts0_mf *p, unsigned int n,
+	int flush);
+/* room in the queue, usb irq context */
+extern unsigned int e1_ts0_tx_room();
+
+/* called in ssc irq context for each tx double-frame, returns the NFAS
+   octet for it, seq as in e1_tx_dblfrm_irq() */
+extern uint8_t e1_ts0_tx_nfas(unsigned int seq);
+
+extern void e1_ts0_get_stats(struct e1_ts0_stats *p);
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ * This file is part of the osmocom sam4s usb interface firmware.
+ * Copyright (c) 2018 Christian Vogel <vogelchr@vogel.cx>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* E1 transmit path: the ssc tx ring doubles as jitter buffer for the data
+   from the iso out endpoint, which is written a few double-frames ahead of
+   the PDC. Timeslot 0 is always regenerated here, double-frames that did
+   not arrive in time are concealed per timeslot. */
+
+#include "e1_tx.h"
+#include "e1_ts0.h"
+#include "sam4s_ssc.h"
+#include "g704.h"
+
+#include <sam4s8b.h>
+#include <string.h>
+
+#define E1_TX_RING_MSK   (SAM4S_SSC_TX_BUF_DBLFRAMES - 1)
+/* the PDC owns the double-frames before sam4s_ssc_tx_seq */
+#define E1_TX_MAX_AHEAD  (SAM4S_SSC_TX_BUF_DBLFRAMES - SAM4S_SSC_PDC_DBLFRAMES)
+
+/* default fill level after an underrun, 2 ms, and the batch the ssc irq
+   takes at once beyond the first double-frame */
+#ifndef E1_TX_JBUF_TARGET
+#define E1_TX_JBUF_TARGET (7 + SAM4S_SSC_BATCH)
+#endif
+
+/* room for the target, a usb packet (1 ms) on top and the batch */
+_Static_assert(E1_TX_JBUF_TARGET + 4 + SAM4S_SSC_BATCH <= E1_TX_MAX_AHEAD,
+	"SAM4S_SSC_TX_BUF_DBLFRAMES too small for the jitter buffer");
+
+/* idle pattern for concealed timeslots */
+#define E1_TX_IDLE_OCTET 0xff
+#define E1_TX_IDLE_LW    (E1_TX_IDLE_OCTET * 0x01010101UL)
+
+/* timeslot 0: Si = 1 (no CRC-4), A and Sa4..Sa8 come from e1_ts0.c,
+   the ring starts out with A = 0, Sa = 1 */
+#define E1_TX_TS0_FAS    (G704_SI_MSK | G704_FAS_BITS)
+#define E1_TX_TS0_NFAS   (G704_SI_MSK | G704_NOFAS_BITS | G704_SA_MSK)
+
+static volatile unsigned int e1_tx_wseq;  /* double-frame written by usb */
+static volatile unsigned int e1_tx_wlw;   /* longwords of it written so far */
+static volatile unsigned int e1_tx_wgen;  /* bumped when the ssc irq moves wseq */
+static unsigned int e1_tx_wgen_begin;
+/* the host streams from double-frame stream_seq on, its first data
+   after init or a pause: concealment before that is not an underrun. A
+   resync without any data since the one before (committed) is a pause,
+   the host has stopped */
+static volatile int e1_tx_streaming;
+static volatile int e1_tx_committed;
+static volatile unsigned int e1_tx_stream_seq;
+static unsigned int e1_tx_target = E1_TX_JBUF_TARGET;
+
+/* seq of the data in each ring slot, once completely written by usb */
+static volatile unsigned int e1_tx_slot_seq[SAM4S_SSC_TX_BUF_DBLFRAMES];
+
+/* octets set to 0xff are repeated on underrun, one per longword of a frame */
+static uint32_t e1_tx_repeat_msk[SAM4S_SSC_DBLFRM_LONGWORDS/2];
+
+static struct e1_tx_stats e1_tx_stats;
+
+void
+e1_tx_init()
+{
+	int i;
+
+	for (i=0; i<SAM4S_SSC_DBLFRM_LONGWORDS*SAM4S_SSC_TX_BUF_DBLFRAMES; i++)
+		sam4s_ssc_tx_buf[i] = E1_TX_IDLE_LW;
+
+	for (i=0; i<SAM4S_SSC_TX_BUF_DBLFRAMES; i++) {
+		uint32_t *p = &sam4s_ssc_tx_buf[i*SAM4S_SSC_DBLFRM_LONGWORDS];
+
+		p[0] = (p[0] & 0x00ffffff) | ((uint32_t)E1_TX_TS0_FAS << 24);
+		p[8] = (p[8] & 0x00ffffff) | ((uint32_t)E1_TX_TS0_NFAS << 24);
+		e1_tx_slot_seq[i] = ~0U;
+	}
+
+	/* first ssc irq will find wseq behind and resync */
+	e1_tx_wseq = sam4s_ssc_tx_seq;
+	e1_tx_wlw = 0;
+	e1_tx_wgen++;
+	e1_tx_streaming = 0;
+	e1_tx_committed = 0;
+}
+
+/* at least the batch the ssc irq that resyncs queues and a usb packet
+   (1 ms): with less, the slot goes out before it is handed out or the
+   packet after it arrives, and the next resync takes it for a pause */
+int
+e1_tx_set_target(unsigned int dblfrm)
+{
+	if (dblfrm < 4 + SAM4S_SSC_BATCH ||
+	    dblfrm + 4 + SAM4S_SSC_BATCH > E1_TX_MAX_AHEAD)
+		return -1;
+	e1_tx_target = dblfrm;
+	return 0;
+}
+
+void
+e1_tx_set_conceal(uint32_t repeat_ts)
+{
+	int i, j;
+
+	for (i=0; i<SAM4S_SSC_DBLFRM_LONGWORDS/2; i++) {
+		uint32_t m = 0;
+
+		for (j=0; j<4; j++)
+			if (repeat_ts & (1UL << (4*i+j)))
+				m |= 0xffUL << (24 - 8*j);
+		e1_tx_repeat_msk[i] = m;
+	}
+}
+
+int
+e1_tx_fill_error()
+{
+	int ahead = e1_tx_wseq - sam4s_ssc_tx_seq;
+
+	return (ahead - (int)e1_tx_target) * SAM4S_SSC_DBLFRM_LONGWORDS +
+		(int)e1_tx_wlw;
+}
+
+void
+e1_tx_get_stats(struct e1_tx_stats *p)
+{
+	/* overrun comes from the writer side, a single word */
+	sam4s_seqlock_snapshot(&sam4s_ssc_seqlock, p, &e1_tx_stats,
+		sizeof(e1_tx_stats));
+}
+
+/* repeat the previous double-frame (still in the ring, owned by the PDC
+   for reading only) or idle, depending on the timeslot */
+static void
+e1_tx_conceal(uint32_t *p, unsigned int seq)
+{
+	const uint32_t *prev = &sam4s_ssc_tx_buf[((seq - 1) & E1_TX_RING_MSK) *
+		SAM4S_SSC_DBLFRM_LONGWORDS];
+	int i;
+
+	for (i=0; i<SAM4S_SSC_DBLFRM_LONGWORDS; i++) {
+		uint32_t m = e1_tx_repeat_msk[i % (SAM4S_SSC_DBLFRM_LONGWORDS/2)];
+
+		p[i] = (prev[i] & m) | (E1_TX_IDLE_LW & ~m);
+	}
+}
+
+void
+e1_tx_dblfrm_irq(uint32_t *p, unsigned int seq)
+{
+	e1_tx_stats.dblfrm++;
+
+	if (e1_tx_slot_seq[seq & E1_TX_RING_MSK] == seq) {
+		e1_tx_stats.usb_dblfrm++;
+	} else {
+		e1_tx_conceal(p, seq);
+		if (e1_tx_streaming && (int)(seq - e1_tx_stream_seq) >= 0)
+			e1_tx_stats.underrun++;
+
+		/* usb has fallen behind (or is writing this very slot): skip
+		   ahead, the gap is concealed as it goes out */
+		if ((int)(e1_tx_wseq - seq) <= 0) {
+			e1_tx_wseq = seq + e1_tx_target;
+			e1_tx_wlw = 0;
+			e1_tx_wgen++;
+			if (e1_tx_streaming)
+				e1_tx_stats.resync++;
+			if (!e1_tx_committed)
+				e1_tx_streaming = 0;
+			e1_tx_committed = 0;
+		}
+	}
+
+	/* timeslot 0 is ours, whatever the host sent */
+	p[0] = (p[0] & 0x00ffffff) | ((uint32_t)E1_TX_TS0_FAS << 24);
+	p[8] = (p[8] & 0x00ffffff) | ((uint32_t)e1_ts0_tx_nfas(seq) << 24);
+}
+
+/* the ssc irq preempts the usb irq. Its next run conceals and queues the
+   batch from sam4s_ssc_tx_seq on, so the slot handed out has to lie
+   beyond it: the copy into it is done long before the irq after that.
+   Only sam4s_ssc_tx_recover() after an underflow fills further ahead and
+   can queue the slot being copied into, which then goes out with part of
+   the packet over it, TS0 included, once; the resync drops the commit.
+   wgen is read first, a resync in between is then seen by commit */
+uint32_t *
+e1_tx_write_begin(unsigned int *n)
+{
+	unsigned int wseq, wlw;
+	int ahead;
+
+	e1_tx_wgen_begin = e1_tx_wgen;
+	wseq = e1_tx_wseq;
+	wlw = e1_tx_wlw;
+	ahead = wseq - sam4s_ssc_tx_seq;
+
+	/* before the first ssc irq, or too close to the ssc side, which
+	   will resync, see e1_tx_dblfrm_irq */
+	if (ahead < SAM4S_SSC_BATCH)
+		return NULL;
+	if (ahead >= E1_TX_MAX_AHEAD) {
+		e1_tx_stats.overrun++;
+		return NULL;
+	}
+
+	*n = SAM4S_SSC_DBLFRM_LONGWORDS - wlw;
+	return &sam4s_ssc_tx_buf[(wseq & E1_TX_RING_MSK) *
+		SAM4S_SSC_DBLFRM_LONGWORDS + wlw];
+}
+
+/* if the ssc irq did resync since write_begin, the data went to a slot
+   that is not ours anymore: drop it. The check and the update are one
+   step for the ssc irq, which must not resync in between */
+void
+e1_tx_write_commit(unsigned int n)
+{
+	unsigned int wlw;
+	uint32_t lock;
+
+	lock = sam4s_irq_lock(SAM4S_IRQ_PRIO_SSC);
+	if (e1_tx_wgen == e1_tx_wgen_begin) {
+		if (!e1_tx_streaming) {
+			e1_tx_stream_seq = e1_tx_wseq;
+			e1_tx_streaming = 1;
+		}
+		e1_tx_committed = 1;
+		wlw = e1_tx_wlw + n;
+		if (wlw >= SAM4S_SSC_DBLFRM_LONGWORDS) {
+			e1_tx_slot_seq[e1_tx_wseq & E1_TX_RING_MSK] = e1_tx_wseq;
+			e1_tx_wseq++;
+			wlw = 0;
+		}
+		e1_tx_wlw = wlw;
+	}
+	sam4s_irq_unlock(lock);
+}
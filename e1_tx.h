@@ -0,0 +1,45 @@
+#ifndef E1_TX_H
+#define E1_TX_H
+
+#include <stdint.h>
+
+struct e1_tx_stats {
+	unsigned int dblfrm;    /* double-frames handed to the ssc */
+	unsigned int usb_dblfrm;/* ... of those received completely from usb */
+	/* double-frames concealed while the host streams, from the first
+	   late one until its data arrives again, the refill after a resync
+	   included. Streaming starts with the first data after init and
+	   stops when a resync finds none since the one before; the other
+	   concealed ones, dblfrm - usb_dblfrm - underrun, are idle */
+	unsigned int underrun;
+	unsigned int resync;    /* jitter buffer refilled to target level */
+	unsigned int overrun;   /* writes refused, jitter buffer full */
+};
+
+extern void e1_tx_init();
+
+/* double-frames of jitter buffer to build up after an underrun, returns
+   -1 if that is less than a usb packet and the ssc batch, or leaves no
+   room for a packet on top */
+extern int e1_tx_set_target(unsigned int dblfrm);
+
+/* bit n set: timeslot n repeats the previous double-frame on underrun,
+   otherwise it is filled with the idle pattern */
+extern void e1_tx_set_conceal(uint32_t repeat_ts);
+
+/* called in ssc irq context right before p is queued for transmission,
+   seq is the value of sam4s_ssc_tx_seq for this double-frame */
+extern void e1_tx_dblfrm_irq(uint32_t *p, unsigned int seq);
+
+/* writer side (usb irq): get room for *n longwords, NULL if the jitter
+   buffer is full, then commit what has actually been written */
+extern uint32_t *e1_tx_write_begin(unsigned int *n);
+extern void e1_tx_write_commit(unsigned int n);
+
+/* longwords in the jitter buffer minus the target fill level, for the
+   rate feedback to the host, usb irq context */
+extern int e1_tx_fill_error();
+
+extern void e1_tx_get_stats(struct e1_tx_stats *p);
+
+#endif
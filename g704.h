@@ -0,0 +1,44 @@
+#ifndef G704_H
+#define G704_H
+
+/*
+ * G.704 (10/98) Table 5/A G.704 – Allocation of bits 1 to 8 of the frame
+ *
+ *                       MSB                         LSB
+ *                        1                           8
+ * Frame containing     +---+---+---+---+---+---+---+---+
+ * the frame alignment  | Si| 0 | 0 | 1 | 1 | 0 | 1 | 1 |
+ * signal:              +---+---+---+---+---+---+---+---+
+ *
+ * Frame not containing +---+---+---+---+---+---+---+---+
+ * the frame alignment  | Si| 1 | A |Sa4|Sa5|Sa6|Sa7|Sa8|
+ * signal:              +---+---+---+---+---+---+---+---+
+ */
+
+#define G704_FAS_MSK   0x7f
+#define G704_FAS_BITS   0x1b
+#define G704_NOFAS_MSK 0x40
+#define G704_NOFAS_BITS 0x40
+
+/*
+ * G.704 Table 5B/G.704 – CRC-4 multiframe structure, Si bits of
+ * frames 0..15 of a multiframe (two sub-multiframes SMF I/II of 8 frames)
+ *
+ * frame: 0  1  2  3  4  5  6  7  8  9 10 11 12 13 14 15
+ * Si:   C1  0 C2  0 C3  1 C4  0 C1  1 C2  1 C3  E C4  E
+ *
+ * The CRC-4 (x^4+x+1) is computed over the 2048 bits of a sub-multiframe,
+ * with C1..C4 set to 0, and is sent in the C bits of the next one.
+ */
+
+#define G704_MFAS_BITS   0x0b  /* 001011, Si of frames 1,3,5,7,9,11 */
+#define G704_MFAS_MSK    0x3f
+#define G704_SI_MSK      0x80
+#define G704_A_MSK       0x20  /* remote alarm in the NFAS */
+#define G704_SA_MSK      0x1f  /* Sa4..Sa8 in the NFAS */
+
+#define CHK_LW_MSB_OCTET(c,m,b) (((c) & ((m) << 24)) == ((b) << 24))
+#define CHK_G704_FAS_LW(c) CHK_LW_MSB_OCTET((c), G704_FAS_MSK, G704_FAS_BITS)
+#define CHK_G704_NOFAS_LW(c) CHK_LW_MSB_OCTET((c), G704_NOFAS_MSK, G704_NOFAS_BITS)
+
+#endif
@@ -55,6 +55,7 @@ static int32_t gps_steer_dac_per_offs;  /* DAC correction per capture offset */
 static uint32_t gps_steer_dac_center;   /* integrator for DAC center value */
 
 static unsigned long gps_steer_nopps_cnt = 0; /* suppress gps messages after 3 counts */
+static uint32_t gps_steer_pps_cnt;
 
 static void
 gps_steer_reset()
@@ -116,6 +117,7 @@ gps_steer_poll()
 	}
 
 	gps_steer_nopps_cnt=0;
+	gps_steer_pps_cnt++;
 
 	/* modes use this counter differently, but all expect it to count
 	   down, one per captured pulse */
@@ -250,3 +252,14 @@ gps_steer_poll()
 
 	gps_steer_last_ts_offs = ts_capt_delta_offs;
 }
+
+void
+gps_steer_get_stats(struct gps_steer_stats *p)
+{
+	p->mode = gps_steer_mode;
+	p->pps = gps_steer_pps_cnt;
+	p->nopps = gps_steer_nopps_cnt;
+	p->last_offs = gps_steer_last_ts_offs;
+	p->dac = gps_steer_dac;
+	p->dac_center = gps_steer_dac_center;
+}
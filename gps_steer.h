@@ -1,7 +1,20 @@
 #ifndef GPS_STEER_H
 #define GPS_STEER_H
 
+#include <stdint.h>
+
+struct gps_steer_stats {
+	uint32_t mode;        /* INIT, DAC_MIN, DAC_MAX, FREQ, PHASE */
+	uint32_t pps;         /* pulses used */
+	uint32_t nopps;       /* timeouts since the last pulse */
+	int32_t last_offs;    /* capture clocks off nominal, last pulse */
+	uint32_t dac;         /* current DAC value */
+	uint32_t dac_center;  /* integrator */
+};
+
 extern void gps_steer_init();
 extern void gps_steer_poll();
+/* main loop only, like gps_steer_poll() */
+extern void gps_steer_get_stats(struct gps_steer_stats *p);
 
 #endif
\ No newline at end of file
@@ -61,14 +61,10 @@ _lseek(int fd, _off_t offs, int whence)
 int
 _write(int fd, const void *buf, size_t nbyte)
 {
-	const char *src = buf;
-	const char *end = src + nbyte;
-
 	if (fd != 1 && fd != 2)
 		return -1;
-	while (src != end) {
-		sam4s_uart0_console_tx(*src++);
-	}
+	/* in non-blocking mode the rest is dropped, and counted */
+	sam4s_uart0_console_write(buf, nbyte);
 	return nbyte;
 }
 
@@ -0,0 +1,139 @@
+/*
+ * This file is part of the osmocom sam4s usb interface firmware.
+ * Copyright (c) 2018 Christian Vogel <vogelchr@vogel.cx>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Cycle counts per site (handler, part of one, or poll function of the
+   main loop) from the DWT counter. The main loop closes a window every
+   second: it takes the difference of the running totals and publishes
+   calls, average, min, max and the cpu load of the window. */
+
+#include "prof_util.h"
+#include "sam4s_irq.h"
+
+#include <sam4s8b.h>
+#include <string.h>
+
+static const char * const prof_util_names[PROF_UTIL_SITES] = {
+	[PROF_UTIL_TC2_IRQ]     = "TC2",
+	[PROF_UTIL_SSC_IRQ]     = "SSC",
+	[PROF_UTIL_TC0_IRQ]     = "TC0",
+	[PROF_UTIL_UDP_IRQ]     = "UDP",
+	[PROF_UTIL_UART0_IRQ]   = "UART0",
+	[PROF_UTIL_SYSTICK_IRQ] = "SysTick",
+	[PROF_UTIL_E1_RX]       = "SSC e1 rx",
+	[PROF_UTIL_E1_TX]       = "SSC e1 tx",
+	[PROF_UTIL_GPS_POLL]    = "gps poll",
+	[PROF_UTIL_E1_POLL]     = "e1 poll",
+};
+
+struct prof_util_stats {
+	uint32_t n;
+	uint32_t min;
+	uint32_t max;
+	uint64_t sum;   /* total cycles, does not wrap in practice */
+};
+
+/* running totals, written by the site only, min and max start over when
+   it sees a new prof_util_gen */
+static struct {
+	struct sam4s_seqlock lock;
+	unsigned int gen;
+	struct prof_util_stats s;
+} prof_util_site[PROF_UTIL_SITES];
+static volatile unsigned int prof_util_gen = 1;
+
+/* main loop only */
+static struct prof_util_stats prof_util_prev[PROF_UTIL_SITES];
+static uint32_t prof_util_window_start;
+
+/* main loop fills the one not published, an irq reading the published
+   one cannot be interrupted by the main loop */
+static struct prof_util_report prof_util_report[2][PROF_UTIL_SITES];
+static volatile unsigned int prof_util_report_idx;
+
+const char *
+prof_util_name(enum prof_util_site site)
+{
+	return prof_util_names[site];
+}
+
+#if PROF_UTIL
+void
+prof_util_add(enum prof_util_site site, uint32_t cycles)
+{
+	unsigned int gen = prof_util_gen;
+
+	sam4s_seqlock_write_begin(&prof_util_site[site].lock);
+	if (prof_util_site[site].gen != gen) {
+		prof_util_site[site].gen = gen;
+		prof_util_site[site].s.min = cycles;
+		prof_util_site[site].s.max = cycles;
+	}
+	if (cycles < prof_util_site[site].s.min)
+		prof_util_site[site].s.min = cycles;
+	if (cycles > prof_util_site[site].s.max)
+		prof_util_site[site].s.max = cycles;
+	prof_util_site[site].s.n++;
+	prof_util_site[site].s.sum += cycles;
+	sam4s_seqlock_write_end(&prof_util_site[site].lock);
+}
+#endif
+
+void
+prof_util_poll()
+{
+#if PROF_UTIL
+	uint32_t now = DWT->CYCCNT;
+	uint32_t win = now - prof_util_window_start;
+	unsigned int idx = !prof_util_report_idx;
+	struct prof_util_report *r = prof_util_report[idx];
+	struct prof_util_stats s;
+	uint32_t dn;
+	uint64_t dsum;
+	int i;
+
+	if (win < PROF_UTIL_WINDOW)
+		return;
+
+	for (i=0; i<PROF_UTIL_SITES; i++) {
+		sam4s_seqlock_snapshot(&prof_util_site[i].lock, &s,
+			&prof_util_site[i].s, sizeof(s));
+		dn = s.n - prof_util_prev[i].n;
+		dsum = s.sum - prof_util_prev[i].sum;
+
+		r[i].n = dn;
+		r[i].min = dn ? s.min : 0;
+		r[i].max = dn ? s.max : 0;
+		r[i].avg = dn ? dsum / dn : 0;
+		r[i].load = dsum * 10000 / win;
+		prof_util_prev[i] = s;
+	}
+
+	/* min and max of the next window */
+	prof_util_gen++;
+	prof_util_window_start = now;
+	__atomic_store_n(&prof_util_report_idx, idx, __ATOMIC_RELEASE);
+#endif
+}
+
+void
+prof_util_get_report(enum prof_util_site site, struct prof_util_report *p)
+{
+	unsigned int idx = __atomic_load_n(&prof_util_report_idx,
+		__ATOMIC_ACQUIRE);
+
+	memcpy(p, &prof_util_report[idx][site], sizeof(*p));
+}
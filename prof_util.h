@@ -0,0 +1,65 @@
+#ifndef PROF_UTIL_H
+#define PROF_UTIL_H
+
+#include <stdint.h>
+
+#include <sam4s8b.h>
+
+/* compile with -DPROF_UTIL=0 to leave out the profiling */
+#ifndef PROF_UTIL
+#define PROF_UTIL 1
+#endif
+
+/* the places that are timed. The handlers are accounted for by
+   sam4s_irq_exit(), the others are part of a handler or the main loop
+   and wrapped in PROF_UTIL_ENTER()/PROF_UTIL_EXIT() */
+enum prof_util_site {
+	PROF_UTIL_TC2_IRQ,
+	PROF_UTIL_SSC_IRQ,
+	PROF_UTIL_TC0_IRQ,
+	PROF_UTIL_UDP_IRQ,
+	PROF_UTIL_UART0_IRQ,
+	PROF_UTIL_SYSTICK_IRQ,
+	PROF_UTIL_E1_RX,        /* in SSC_Handler() */
+	PROF_UTIL_E1_TX,        /* in SSC_Handler() */
+	PROF_UTIL_GPS_POLL,     /* main loop */
+	PROF_UTIL_E1_POLL,      /* main loop */
+	PROF_UTIL_SITES
+};
+
+/* cycles of one window, statistics and load cover the last complete one */
+#define PROF_UTIL_WINDOW F_MCK_HZ
+
+struct prof_util_report {
+	uint32_t n;     /* calls */
+	uint32_t min;   /* cycles per call */
+	uint32_t max;
+	uint32_t avg;
+	uint32_t load;  /* share of the cpu in 1/100 %, including the time
+			   the site has been preempted */
+};
+
+extern const char *prof_util_name(enum prof_util_site site);
+
+/* main loop: closes the window once it is over, must be called at least
+   every 38 s (wrap of the cycle counter) */
+extern void prof_util_poll();
+
+/* the last complete window, from the main loop or any irq */
+extern void prof_util_get_report(enum prof_util_site site,
+	struct prof_util_report *p);
+
+#if PROF_UTIL
+/* a site is only ever accounted for from one context */
+extern void prof_util_add(enum prof_util_site site, uint32_t cycles);
+
+#define PROF_UTIL_ENTER(site) \
+	uint32_t prof_util_t0_ ## site = DWT->CYCCNT
+#define PROF_UTIL_EXIT(site) \
+	prof_util_add((site), DWT->CYCCNT - prof_util_t0_ ## site)
+#else
+#define PROF_UTIL_ENTER(site) do { } while (0)
+#define PROF_UTIL_EXIT(site)  do { } while (0)
+#endif
+
+#endif
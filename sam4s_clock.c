@@ -20,6 +20,7 @@
 
 #include "sam4s_clock.h"
 #include "sam4s_pinmux.h"
+#include "sam4s_irq.h"
 #include <sam4s8b.h>
 #include <string.h>
 
@@ -34,6 +35,10 @@ static uint32_t sam4s_clock_blink_ctr;
 
 void
 SysTick_Handler() {
+	uint32_t t0 = sam4s_irq_enter();
+	/* counts down from LOAD after the reload at 0 */
+	uint32_t lat = SysTick->LOAD - SysTick->VAL;
+
 	sam4s_clock_tick++;
 	sam4s_clock_blink_ctr++;
 
@@ -43,6 +48,7 @@ SysTick_Handler() {
 		sam4s_pinmux_gpio_set(SAM4S_PINMUX_PA(24), 1);
 		sam4s_clock_blink_ctr=0;
 	}
+	sam4s_irq_exit(SAM4S_IRQ_SYSTICK, t0, lat);
 }
 
 /*
@@ -219,8 +225,7 @@ sam4s_clock_init()
 	SysTick->LOAD = (F_MCK_HZ / SAM4S_CLOCK_HZ)-1;
 	SysTick->VAL = 0;
 
-	/* set highest priority */
-	NVIC_SetPriority (SysTick_IRQn, (1UL << __NVIC_PRIO_BITS) - 1UL);
+	/* priority is set by sam4s_irq_init() */
 	NVIC_EnableIRQ(SysTick_IRQn);
 
 	SysTick->CTRL = SysTick_CTRL_ENABLE_Msk | SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk;
@@ -24,9 +24,14 @@
 #include "sam4s_usb.h"
 #include "sam4s_usb_descriptors.h"
 #include "sam4s_timer.h"
+#include "sam4s_irq.h"
+#include "prof_util.h"
+#include "stats_util.h"
 #include "gps_steer.h"
 #include "trace_util.h"
 #include "e1_mgmt.h"
+#include "e1_align.h"
+#include "e1_hdlc.h"
 
 #include <stdint.h>
 #include <stdlib.h>
@@ -85,10 +90,10 @@ idt82v2081_reg(unsigned char regnum, int write)
 }
 
 struct trace_util_data trace;
+unsigned int trace_lost;
 
 static unsigned int rx_process_ctr;
 static int last_dblfrm_processed;
-static int enable_sync;
 
 int
 main()
@@ -98,6 +103,9 @@ main()
 	/* disable watchdog */
 	WDT->WDT_MR = WDT_MR_WDDIS;
 
+	/* before anything enables an interrupt */
+	sam4s_irq_init();
+
 	sam4s_pinmux_init();
 	/* Port PB1 is VCXO_EN */
 	sam4s_pinmux_function(SAM4S_PINMUX_PB(1), SAM4S_PINMUX_GPIO);
@@ -133,6 +141,7 @@ main()
 
 	__enable_irq();
 
+	trace_util_init();
 	sam4s_uart0_console_init();
 
 	sam4s_ssc_init();
@@ -150,14 +159,23 @@ main()
 	for(;;) {
 		int k;
 
+		PROF_UTIL_ENTER(PROF_UTIL_GPS_POLL);
 		gps_steer_poll();
+		PROF_UTIL_EXIT(PROF_UTIL_GPS_POLL);
+		PROF_UTIL_ENTER(PROF_UTIL_E1_POLL);
 		e1_mgmt_poll();
+		PROF_UTIL_EXIT(PROF_UTIL_E1_POLL);
+		prof_util_poll();
+		stats_util_poll();
 
+		/* decoded on the host with tools/trace_decode */
 		if(!trace_util_read(&trace) ) {
-			/* "precision" for string must match
-			    sizeof(struct trace_util_data.text)! */
-			printf("%.32s 0x%08lx 0x%08lx\r\n",
-				trace.text,trace.a,trace.b);
+			printf("T %08lx %08lx %08lx %08lx\r\n",
+				trace.ts, trace.id, trace.a, trace.b);
+		}
+		if (trace_util_lost() != trace_lost) {
+			trace_lost = trace_util_lost();
+			printf("trace: %u entries lost\r\n", trace_lost);
 		}
 
 		k = sam4s_uart0_console_rx();
@@ -205,16 +223,16 @@ main()
 
 		if (k == 'r') {
 			uint32_t *p = sam4s_ssc_rx_buf;
+			struct sam4s_ssc_irqstats st;
 
-#if 0
+			sam4s_ssc_get_irqstats(&st);
 			printf("last rx: %d/tx %d, rx_irq %u tx_irq %u over %u under %u\r\n",
 				sam4s_ssc_rx_last_dblfrm,
 				sam4s_ssc_tx_last_dblfrm,
-				sam4s_ssc_rx_irq_ctr,
-				sam4s_ssc_tx_irq_ctr,
-				sam4s_ssc_irq_overflow_ctr,
-				sam4s_ssc_irq_underflow_ctr);
-#endif
+				st.rx_ctr,
+				st.tx_ctr,
+				st.rx_overflow,
+				st.tx_underflow);
 
 			for (i=0; i<SAM4S_SSC_DBLFRM_LONGWORDS*SAM4S_SSC_BUF_DBLFRAMES; i++) {
 				if ((i % 8) == 0)
@@ -239,6 +257,35 @@ main()
 			sam4s_usb_init();
 		if (k == 'U')
 			sam4s_usb_off();
+		if (k == 'i') {
+			struct sam4s_usb_iso_stats st;
+
+			sam4s_usb_get_iso_stats(&st);
+			printf("iso in:  %u pkts %u lw dropped %u gap %u "
+				"busy %u, cycles/pkt avg %u max %u\r\n",
+				st.in_pkts, st.in_lw, st.in_dropped, st.in_gap,
+				st.in_busy,
+				st.in_pkts ? st.in_cycles / st.in_pkts : 0,
+				st.in_cycles_max);
+			printf("iso out: %u pkts dropped %u bytes, "
+				"cycles/pkt avg %u max %u, fb %u\r\n",
+				st.out_pkts, st.out_dropped,
+				st.out_pkts ? st.out_cycles / st.out_pkts : 0,
+				st.out_cycles_max, st.fb_pkts);
+		}
+		if (k == 'h') {
+			struct e1_hdlc_rx_stats st;
+			struct e1_hdlc_tx_stats tst;
+
+			e1_hdlc_get_rx_stats(&st);
+			e1_hdlc_get_tx_stats(&tst);
+			printf("hdlc rx: %u frames crc_err %u abort %u align %u "
+				"long %u short %u overrun %u\r\n",
+				st.frames, st.crc_err, st.abort, st.align,
+				st.too_long, st.too_short, st.overrun);
+			printf("hdlc tx: %u frames refused long %u short %u\r\n",
+				tst.frames, tst.too_long, tst.too_short);
+		}
 		if (k == 't') {
 			printf("\r\n\r\nTimer Status\r\n------------\r\n");
 			for (i=0; i<3; i++) {
@@ -253,13 +300,72 @@ main()
 					TC0->TC_CHANNEL[i].TC_RC);
 			}
 		}
+		if (k == 'o') {
+			struct sam4s_uart0_console_stats st;
+
+			sam4s_uart0_console_get_stats(&st);
+			printf("console: tx %u bytes in %u dma, dropped %u, "
+				"rx dropped %u\r\n", st.tx_bytes, st.tx_dma,
+				st.tx_dropped, st.rx_dropped);
+		}
+		if (k == 'l') {
+			struct sam4s_ssc_irqstats st;
+
+			/* one E1 bit is 488 ns */
+			sam4s_ssc_get_irqstats(&st);
+			printf("ssc: rx %u (overflow %u) tx %u (underflow %u), "
+				"irq latency min %u max %u bits\r\n",
+				st.rx_ctr, st.rx_overflow, st.tx_ctr,
+				st.tx_underflow, st.rx_lat_min, st.rx_lat_max);
+			printf("ssc gaps: rx lost %u (last at %u) tx lost %u "
+				"(last at %u) double-frames\r\n", st.rx_lost,
+				st.rx_gap_seq, st.tx_lost, st.tx_gap_seq);
+		}
+		if (k == 'p') {
+			struct sam4s_irq_stats st;
+			int j;
+
+			printf("irq prio: calls, max latency and duration in "
+				"cycles, histograms <32 <64 <128 ...\r\n");
+			for (i=0; i<SAM4S_IRQ_NUM; i++) {
+				sam4s_irq_get_stats(i, &st);
+				printf("%-7s %2u: n %lu lat %lu dur %lu\r\n",
+					sam4s_irq_name(i), sam4s_irq_prio(i),
+					st.dur.n, st.lat.max, st.dur.max);
+				printf("  lat:");
+				for (j=0; j<SAM4S_IRQ_HIST_BINS; j++)
+					printf(" %lu", st.lat.bin[j]);
+				printf("\r\n  dur:");
+				for (j=0; j<SAM4S_IRQ_HIST_BINS; j++)
+					printf(" %lu", st.dur.bin[j]);
+				printf("\r\n");
+			}
+		}
+		if (k == 'f') {
+			struct prof_util_report r;
+
+			printf("profile of the last %u ms, cycles, "
+				"load in %%:\r\n",
+				PROF_UTIL_WINDOW / (F_MCK_HZ / 1000));
+			for (i=0; i<PROF_UTIL_SITES; i++) {
+				prof_util_get_report(i, &r);
+				printf("%-10s n %6lu min %6lu avg %6lu max %6lu "
+					"%3lu.%02lu\r\n", prof_util_name(i),
+					r.n, r.min, r.avg, r.max,
+					r.load / 100, r.load % 100);
+			}
+		}
+		if (k == 'n')
+			sam4s_uart0_console_nonblocking(1);
+		if (k == 'N')
+			sam4s_uart0_console_nonblocking(0);
 		if (k == 's')
-			enable_sync++;
+			e1_align_enable(1);
 		if (k== 'S')
-			enable_sync=0;
+			e1_align_enable(0);
 
 		if (k == '<' || k == '>') {
-			i = sam4s_timer_e1_phase_adj(k == '>');
+			i = sam4s_timer_e1_phase_adj(k == '>' ? 1 : -1);
 			printf("phase_adj: %d\r\n",i);
 		}
 	}
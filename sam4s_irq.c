@@ -0,0 +1,135 @@
+/*
+ * This file is part of the osmocom sam4s usb interface firmware.
+ * Copyright (c) 2018 Christian Vogel <vogelchr@vogel.cx>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* interrupt priorities and per-handler latency/duration histograms */
+
+#include "sam4s_irq.h"
+
+#include <sam4s8b.h>
+#include <string.h>
+
+static const struct {
+	const char *name;
+	IRQn_Type irqn;
+	unsigned int prio;
+	enum prof_util_site prof;
+} sam4s_irq_tab[SAM4S_IRQ_NUM] = {
+	[SAM4S_IRQ_TC2]     = { "TC2",     TC2_IRQn,     SAM4S_IRQ_PRIO_TC2,
+				PROF_UTIL_TC2_IRQ },
+	[SAM4S_IRQ_SSC]     = { "SSC",     SSC_IRQn,     SAM4S_IRQ_PRIO_SSC,
+				PROF_UTIL_SSC_IRQ },
+	[SAM4S_IRQ_TC0]     = { "TC0",     TC0_IRQn,     SAM4S_IRQ_PRIO_TC0,
+				PROF_UTIL_TC0_IRQ },
+	[SAM4S_IRQ_UDP]     = { "UDP",     UDP_IRQn,     SAM4S_IRQ_PRIO_UDP,
+				PROF_UTIL_UDP_IRQ },
+	[SAM4S_IRQ_UART0]   = { "UART0",   UART0_IRQn,   SAM4S_IRQ_PRIO_UART0,
+				PROF_UTIL_UART0_IRQ },
+	[SAM4S_IRQ_SYSTICK] = { "SysTick", SysTick_IRQn, SAM4S_IRQ_PRIO_SYSTICK,
+				PROF_UTIL_SYSTICK_IRQ },
+};
+
+/* each entry is only written by its own handler */
+static struct {
+	struct sam4s_seqlock lock;
+	struct sam4s_irq_stats s;
+} sam4s_irq_stats[SAM4S_IRQ_NUM];
+
+void
+sam4s_irq_init()
+{
+	int i;
+
+	for (i=0; i<SAM4S_IRQ_NUM; i++)
+		NVIC_SetPriority(sam4s_irq_tab[i].irqn, sam4s_irq_tab[i].prio);
+
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+const char *
+sam4s_irq_name(enum sam4s_irq_id id)
+{
+	return sam4s_irq_tab[id].name;
+}
+
+unsigned int
+sam4s_irq_prio(enum sam4s_irq_id id)
+{
+	return sam4s_irq_tab[id].prio;
+}
+
+/* can handler id interrupt whoever is running now? */
+static int
+sam4s_irq_preempts_caller(enum sam4s_irq_id id)
+{
+	uint32_t exc = __get_IPSR(); /* exception number, 0: thread mode */
+
+	if (!exc)
+		return 1;
+	return sam4s_irq_tab[id].prio <
+		NVIC_GetPriority((IRQn_Type)((int)exc - 16));
+}
+
+void
+sam4s_irq_get_stats(enum sam4s_irq_id id, struct sam4s_irq_stats *p)
+{
+	/* a handler we have interrupted cannot finish its update before we
+	   return, retrying would spin forever, take it with a sample half
+	   counted */
+	if (sam4s_irq_preempts_caller(id))
+		sam4s_seqlock_snapshot(&sam4s_irq_stats[id].lock, p,
+			&sam4s_irq_stats[id].s, sizeof(*p));
+	else
+		memcpy(p, &sam4s_irq_stats[id].s, sizeof(*p));
+}
+
+#if SAM4S_IRQ_STATS
+static inline void
+sam4s_irq_hist_add(struct sam4s_irq_hist *h, uint32_t v)
+{
+	unsigned int b = 0;
+
+	if (v >= 32) {
+		b = 27 - __builtin_clz(v);
+		if (b >= SAM4S_IRQ_HIST_BINS)
+			b = SAM4S_IRQ_HIST_BINS - 1;
+	}
+	h->n++;
+	if (v > h->max)
+		h->max = v;
+	h->bin[b]++;
+}
+#endif
+
+#if SAM4S_IRQ_STATS || PROF_UTIL
+void
+sam4s_irq_exit(enum sam4s_irq_id id, uint32_t t0, uint32_t lat)
+{
+	uint32_t dur = DWT->CYCCNT - t0;
+
+#if SAM4S_IRQ_STATS
+	sam4s_seqlock_write_begin(&sam4s_irq_stats[id].lock);
+	if (lat != SAM4S_IRQ_LAT_UNKNOWN)
+		sam4s_irq_hist_add(&sam4s_irq_stats[id].s.lat, lat);
+	sam4s_irq_hist_add(&sam4s_irq_stats[id].s.dur, dur);
+	sam4s_seqlock_write_end(&sam4s_irq_stats[id].lock);
+#endif
+#if PROF_UTIL
+	prof_util_add(sam4s_irq_tab[id].prof, dur);
+#endif
+}
+#endif
@@ -0,0 +1,181 @@
+#ifndef SAM4S_IRQ_H
+#define SAM4S_IRQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sam4s8b.h>
+
+#include "prof_util.h"
+
+/*
+ * Critical sections without __disable_irq():
+ *
+ * sam4s_irq_lock(prio) holds off the interrupts with a priority value of
+ * prio or more (the less urgent ones) by raising BASEPRI, the more urgent
+ * ones keep running. It only ever raises BASEPRI, so it nests. Priority 0
+ * cannot be masked this way.
+ *
+ * A seqlock protects data written by one interrupt handler and read by
+ * less urgent code, usually the main loop: the writer never waits, the
+ * reader copies and retries if the handler has run in the meantime. The
+ * reader must be preemptible by the writer, it would spin forever when
+ * called from a more urgent handler that interrupted the writer.
+ */
+
+/*
+ * NVIC priorities, lower values are more urgent, sam4s_irq_init() applies
+ * them. 0 is left free as BASEPRI cannot mask it.
+ *
+ * TC2 has to write RC within a few E1 bits of the match when the frame
+ * phase is adjusted, but only runs then and is a handful of instructions.
+ * SSC reloads the PDC once per double-frame (250 us, or per batch, see
+ * SAM4S_SSC_BATCH) and runs the whole E1 receive and transmit path, it
+ * must not wait for usb. TC0 counts the
+ * capture timer overflows, every 1.19 ms. UDP works from the usb fifos
+ * with double buffering, UART0 from the PDC, SysTick only blinks a LED.
+ */
+#define SAM4S_IRQ_PRIO_TC2     1
+#define SAM4S_IRQ_PRIO_SSC     2
+#define SAM4S_IRQ_PRIO_TC0     3
+#define SAM4S_IRQ_PRIO_UDP     4
+#define SAM4S_IRQ_PRIO_UART0   5
+#define SAM4S_IRQ_PRIO_SYSTICK ((1U << __NVIC_PRIO_BITS) - 1U)
+
+static inline uint32_t
+sam4s_irq_lock(unsigned int prio)
+{
+	uint32_t old = __get_BASEPRI();
+
+	__set_BASEPRI_MAX(prio << (8 - __NVIC_PRIO_BITS));
+	return old;
+}
+
+static inline void
+sam4s_irq_unlock(uint32_t old)
+{
+	__set_BASEPRI(old);
+}
+
+struct sam4s_seqlock {
+	volatile unsigned int seq; /* odd while the writer is active */
+};
+
+static inline void
+sam4s_seqlock_write_begin(struct sam4s_seqlock *l)
+{
+	l->seq++;
+	__DMB();
+}
+
+static inline void
+sam4s_seqlock_write_end(struct sam4s_seqlock *l)
+{
+	__DMB();
+	l->seq++;
+}
+
+static inline unsigned int
+sam4s_seqlock_read_begin(const struct sam4s_seqlock *l)
+{
+	unsigned int seq = l->seq;
+
+	__DMB();
+	return seq;
+}
+
+static inline int
+sam4s_seqlock_read_retry(const struct sam4s_seqlock *l, unsigned int seq)
+{
+	__DMB();
+	return (seq & 1) || l->seq != seq;
+}
+
+/* consistent copy of len bytes at src, written under l */
+static inline void
+sam4s_seqlock_snapshot(const struct sam4s_seqlock *l, void *dst,
+	const void *src, size_t len)
+{
+	unsigned int seq;
+
+	do {
+		seq = sam4s_seqlock_read_begin(l);
+		memcpy(dst, src, len);
+	} while (sam4s_seqlock_read_retry(l, seq));
+}
+
+/* the handlers with latency and duration histograms, in the order of
+   their priority */
+enum sam4s_irq_id {
+	SAM4S_IRQ_TC2,
+	SAM4S_IRQ_SSC,
+	SAM4S_IRQ_TC0,
+	SAM4S_IRQ_UDP,
+	SAM4S_IRQ_UART0,
+	SAM4S_IRQ_SYSTICK,
+	SAM4S_IRQ_NUM
+};
+
+/* compile with -DSAM4S_IRQ_STATS=0 to leave out the histograms */
+#ifndef SAM4S_IRQ_STATS
+#define SAM4S_IRQ_STATS 1
+#endif
+
+/* in DWT cycles, bin 0 counts values below 32, bin i (i > 0) values from
+   16 << i up to 32 << i, the last bin everything above */
+#define SAM4S_IRQ_HIST_BINS 14
+
+struct sam4s_irq_hist {
+	uint32_t n;
+	uint32_t max;
+	uint32_t bin[SAM4S_IRQ_HIST_BINS];
+};
+
+struct sam4s_irq_stats {
+	struct sam4s_irq_hist lat; /* from the event to handler entry */
+	struct sam4s_irq_hist dur; /* from entry to exit, incl. preemption */
+};
+
+/* handlers which cannot tell when their event happened */
+#define SAM4S_IRQ_LAT_UNKNOWN 0xffffffffU
+
+/* TC2 counts E1 bits, 2.048 MHz */
+#define SAM4S_IRQ_CYCLES_PER_E1_BIT (F_MCK_HZ / 2048000)
+
+/* sets the priorities above, starts the DWT cycle counter */
+extern void sam4s_irq_init();
+
+extern const char *sam4s_irq_name(enum sam4s_irq_id id);
+extern unsigned int sam4s_irq_prio(enum sam4s_irq_id id);
+
+/* safe from any context, see the seqlock remark above: a less urgent
+   handler which has been interrupted in its update is copied as is */
+extern void sam4s_irq_get_stats(enum sam4s_irq_id id,
+	struct sam4s_irq_stats *p);
+
+/* call first and last thing in a handler, lat is the latency in cycles
+   or SAM4S_IRQ_LAT_UNKNOWN, the duration also goes to prof_util */
+#if SAM4S_IRQ_STATS || PROF_UTIL
+static inline uint32_t
+sam4s_irq_enter()
+{
+	return DWT->CYCCNT;
+}
+
+extern void sam4s_irq_exit(enum sam4s_irq_id id, uint32_t t0, uint32_t lat);
+#else
+static inline uint32_t
+sam4s_irq_enter()
+{
+	return 0;
+}
+
+static inline void
+sam4s_irq_exit(enum sam4s_irq_id id, uint32_t t0, uint32_t lat)
+{
+	(void)id; (void)t0; (void)lat;
+}
+#endif
+
+#endif
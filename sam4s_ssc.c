@@ -19,118 +19,452 @@
    interface */
 
 #include "sam4s_ssc.h"
-#include <sam4s4c.h>
+#include <sam4s8b.h>
 #include <string.h> // memcpy
 
 #include "sam4s_clock.h"
 #include "sam4s_pinmux.h"
+#include "sam4s_timer.h"
 #include "e1_mgmt.h"
+#include "prof_util.h"
+#include "trace_util.h"
 
 /* externally visible buffer for received realigned data */
 uint32_t sam4s_ssc_rx_buf[SAM4S_SSC_DBLFRM_LONGWORDS*SAM4S_SSC_BUF_DBLFRAMES];
 volatile int sam4s_ssc_rx_last_dblfrm;
+volatile unsigned int sam4s_ssc_rx_seq;
+volatile unsigned int sam4s_ssc_rx_slot_seq[SAM4S_SSC_BUF_DBLFRAMES];
 static int sam4s_ssc_rx_curr_dblfrm;
 
 /* externally visible buffer for data that needs to be transmitted */
-uint32_t sam4s_ssc_tx_buf[SAM4S_SSC_DBLFRM_LONGWORDS*SAM4S_SSC_BUF_DBLFRAMES];
+uint32_t sam4s_ssc_tx_buf[SAM4S_SSC_DBLFRM_LONGWORDS*SAM4S_SSC_TX_BUF_DBLFRAMES];
 volatile int sam4s_ssc_tx_last_dblfrm;
+volatile unsigned int sam4s_ssc_tx_seq;
 static int sam4s_ssc_tx_curr_dblfrm;
 
-struct sam4s_ssc_irqstats {
-	unsigned int tx_ctr;
-	unsigned int tx_underflow;
-	unsigned int rx_ctr;
-	unsigned int rx_overflow;
+_Static_assert(SAM4S_SSC_BUF_DBLFRAMES >= 2 * SAM4S_SSC_PDC_DBLFRAMES &&
+	SAM4S_SSC_TX_BUF_DBLFRAMES >= 2 * SAM4S_SSC_PDC_DBLFRAMES,
+	"ssc rings must hold four batches");
+_Static_assert((SAM4S_SSC_BATCH & (SAM4S_SSC_BATCH - 1)) == 0,
+	"SAM4S_SSC_BATCH must be a power of two");
+
+static struct sam4s_ssc_irqstats sam4s_ssc_irqstats = {
+	.rx_lat_min = ~0U,
 };
 
-static struct sam4s_ssc_irqstats sam4s_ssc_irqstats;
+struct sam4s_seqlock sam4s_ssc_seqlock;
 
 void
 sam4s_ssc_get_irqstats(struct sam4s_ssc_irqstats *p)
 {
-	__disable_irq();
-	memcpy(p, &sam4s_ssc_irqstats, sizeof(sam4s_ssc_irqstats));
-	__enable_irq();
+	sam4s_seqlock_snapshot(&sam4s_ssc_seqlock, p, &sam4s_ssc_irqstats,
+		sizeof(sam4s_ssc_irqstats));
+}
+
+/*
+ * Recovery from overflow and underflow. When the irq is held off for
+ * longer than the two batches the PDC owns (in practice only with the
+ * cpu stopped in the debugger), the PDC stops. Restarting it at ring
+ * slot 0 would lose the relation between seq, ring slot and E1 frame
+ * phase, and everything downstream would have to realign. Instead the
+ * length of the gap is measured, the PDC goes on at the slot (for tx:
+ * the longword) the data would have had anyway, and the double-frames
+ * of the gap are counted, see struct sam4s_ssc_irqstats.
+ *
+ * rx: channel 1 of the timer counts the frame syncs, its offset to the
+ * double-frames seen by the PDC is taken on every ENDRX. The receiver is
+ * disabled and enabled again, so it starts with the next frame sync.
+ *
+ * tx: the transmit clock is MCK / (2 * SAM4S_SSC_CMR_DIV), the cycle
+ * counter tells how many longwords went out in the meantime. When the
+ * PDC hands a longword to the SSC is learned from TCR on every ENDTX.
+ * This works for gaps up to one wrap of the cycle counter (38 s).
+ */
+
+/* the ssc has to be enabled again this early before the next frame
+   sync, or the PDC armed before the next longword is due */
+#define SAM4S_SSC_RESTART_BITS   SAM4S_SSC_BITS_PER_LONGWORD
+#define SAM4S_SSC_RESTART_CYCLES 256
+#define SAM4S_SSC_CYCLES_PER_BIT (2 * SAM4S_SSC_CMR_DIV)
+#define SAM4S_SSC_CYCLES_PER_LW \
+	(SAM4S_SSC_CYCLES_PER_BIT * SAM4S_SSC_BITS_PER_LONGWORD)
+/* rx waits for TC2 to leave the last SAM4S_SSC_RESTART_BITS of the
+   double-frame, 1728 cycles (16 us) with the line clock at its nominal
+   rate. Without a line clock TC2 stands still: give up after twice that */
+#define SAM4S_SSC_RX_WAIT_CYCLES \
+	(2 * SAM4S_SSC_RESTART_BITS * SAM4S_SSC_CYCLES_PER_BIT)
+
+/* frame syncs (sam4s_timer_e1_dblfrm()) less rx seq of the double-frame
+   in progress, once known */
+static uint16_t sam4s_ssc_rx_frm_off;
+static int sam4s_ssc_rx_frm_ok;
+/* double-frames at the start of the current rx batch that are not
+   received, after a recovery */
+static int sam4s_ssc_rx_curr_skip;
+
+/* the PDC hands longword tx_pos (counted like sam4s_ssc_tx_seq) to the
+   SSC one longword after cycle tx_t */
+static unsigned int sam4s_ssc_tx_pos;
+static uint32_t sam4s_ssc_tx_t;
+static int sam4s_ssc_tx_t_ok;
+
+/* the PDC continues with rx double-frame seq. Batches stay aligned to
+   SAM4S_SSC_BATCH in the ring, so the first one may be short */
+static void
+sam4s_ssc_rx_arm(unsigned int seq)
+{
+	int slot = seq % SAM4S_SSC_BUF_DBLFRAMES;
+	int skip = seq % SAM4S_SSC_BATCH;
+	int next = (slot - skip + SAM4S_SSC_BATCH) % SAM4S_SSC_BUF_DBLFRAMES;
+
+	sam4s_ssc_rx_curr_dblfrm = slot - skip;
+	sam4s_ssc_rx_curr_skip = skip;
+	PDC_SSC->PERIPH_RPR = (uint32_t)&sam4s_ssc_rx_buf[slot*SAM4S_SSC_DBLFRM_LONGWORDS];
+	PDC_SSC->PERIPH_RCR = SAM4S_SSC_BATCH_LONGWORDS -
+		skip * SAM4S_SSC_DBLFRM_LONGWORDS;
+	PDC_SSC->PERIPH_RNPR = (uint32_t)&sam4s_ssc_rx_buf[next*SAM4S_SSC_DBLFRM_LONGWORDS];
+	PDC_SSC->PERIPH_RNCR = SAM4S_SSC_BATCH_LONGWORDS;
 }
 
 /* start or re-start the DMA, also happens on over/underflow which
    basically only happens during debugging (when CPU is stopped) */
 static void
 sam4s_ssc_init_rx_dma() {
-	/* enable DMA for SSC, receive and transmit...
-	  first next pointer register, then pointer register and counters */
 	sam4s_ssc_rx_last_dblfrm = -1;
-	sam4s_ssc_rx_curr_dblfrm = 0;
-	PDC_SSC->PERIPH_RPR = (uint32_t)&sam4s_ssc_rx_buf;
-	PDC_SSC->PERIPH_RCR = SAM4S_SSC_DBLFRM_LONGWORDS;
-	PDC_SSC->PERIPH_RNPR = (uint32_t)&sam4s_ssc_rx_buf[SAM4S_SSC_DBLFRM_LONGWORDS];
-	PDC_SSC->PERIPH_RNCR = SAM4S_SSC_DBLFRM_LONGWORDS;
+	/* keep seq and ring slot in step, see sam4s_ssc.h */
+	sam4s_ssc_rx_seq = (sam4s_ssc_rx_seq + SAM4S_SSC_BUF_DBLFRAMES - 1) &
+		~(SAM4S_SSC_BUF_DBLFRAMES - 1);
+	sam4s_ssc_rx_arm(sam4s_ssc_rx_seq);
 }
 
 static void
 sam4s_ssc_init_tx_dma() {
 	sam4s_ssc_tx_last_dblfrm = -1;
 	sam4s_ssc_tx_curr_dblfrm = 0;
+	/* the first two batches go to the PDC right away */
+	sam4s_ssc_tx_seq = ((sam4s_ssc_tx_seq + SAM4S_SSC_TX_BUF_DBLFRAMES - 1) &
+		~(SAM4S_SSC_TX_BUF_DBLFRAMES - 1)) + SAM4S_SSC_PDC_DBLFRAMES;
 	PDC_SSC->PERIPH_TPR = (uint32_t)&sam4s_ssc_tx_buf;
-	PDC_SSC->PERIPH_TCR = SAM4S_SSC_DBLFRM_LONGWORDS;
-	PDC_SSC->PERIPH_TNPR = (uint32_t)&sam4s_ssc_tx_buf[SAM4S_SSC_DBLFRM_LONGWORDS];
-	PDC_SSC->PERIPH_TNCR = SAM4S_SSC_DBLFRM_LONGWORDS;
+	PDC_SSC->PERIPH_TCR = SAM4S_SSC_BATCH_LONGWORDS;
+	PDC_SSC->PERIPH_TNPR = (uint32_t)&sam4s_ssc_tx_buf[SAM4S_SSC_BATCH_LONGWORDS];
+	PDC_SSC->PERIPH_TNCR = SAM4S_SSC_BATCH_LONGWORDS;
+	sam4s_ssc_tx_t_ok = 0;
 }
 
-void
-SSC_Handler()
+/* the received double-frames of the batch in ring slot slot, from the
+   skip-th on, one by one as if each had its own irq */
+static void
+sam4s_ssc_rx_dblfrms(int slot, int skip)
+{
+	int i;
+
+	for (i=skip; i<SAM4S_SSC_BATCH; i++) {
+		sam4s_ssc_rx_last_dblfrm = slot + i;
+		sam4s_ssc_rx_slot_seq[slot + i] = sam4s_ssc_rx_seq;
+		sam4s_ssc_rx_seq++;
+
+		PROF_UTIL_ENTER(PROF_UTIL_E1_RX);
+		e1_mgmt_rx_dblfrm_irq(&sam4s_ssc_rx_buf[(slot + i)*SAM4S_SSC_DBLFRM_LONGWORDS]);
+		PROF_UTIL_EXIT(PROF_UTIL_E1_RX);
+	}
+	sam4s_ssc_irqstats.rx_ctr += SAM4S_SSC_BATCH - skip;
+}
+
+/* offset of the frame sync counter to the rx seq */
+static void
+sam4s_ssc_rx_frm_learn()
+{
+	unsigned int seq = sam4s_ssc_rx_seq;
+	uint16_t frm = sam4s_timer_e1_dblfrm();
+	uint32_t cv = TC0->TC_CHANNEL[2].TC_CV;
+	unsigned int lw = (PDC_SSC->PERIPH_RPR - (uint32_t)sam4s_ssc_rx_buf) /
+		sizeof(uint32_t);
+	unsigned int slot = lw / SAM4S_SSC_DBLFRM_LONGWORDS;
+	unsigned int pos;
+
+	/* a frame sync in between, or too far into the double-frame to
+	   tell how many longwords of it have been received */
+	if (frm != sam4s_timer_e1_dblfrm() ||
+	    cv >= SAM4S_SSC_DBLFRM_LONGWORDS * SAM4S_SSC_BITS_PER_LONGWORD / 2)
+		return;
+
+	/* longwords received, as in e1_rate_rx_bitpos(), rounded to the
+	   start of the double-frame in progress: the PDC may lag the frame
+	   sync by a bit or two */
+	pos = (seq + ((slot - seq) & (SAM4S_SSC_BUF_DBLFRAMES - 1))) *
+		SAM4S_SSC_DBLFRM_LONGWORDS + lw % SAM4S_SSC_DBLFRM_LONGWORDS;
+	sam4s_ssc_rx_frm_off = frm - (pos + SAM4S_SSC_DBLFRM_LONGWORDS/2 -
+		cv / SAM4S_SSC_BITS_PER_LONGWORD) / SAM4S_SSC_DBLFRM_LONGWORDS;
+	sam4s_ssc_rx_frm_ok = 1;
+}
+
+/* double-frames seq-lost .. seq-1 did not arrive: 0xff in the ring for
+   as many as fit next to what the PDC owns, for the consumers in this
+   irq. sam4s_ssc_rx_slot_seq keeps them apart from data for usb */
+static void
+sam4s_ssc_rx_gap(unsigned int seq, unsigned int lost)
+{
+	unsigned int n = lost, i;
+
+	if (n > SAM4S_SSC_BUF_DBLFRAMES - SAM4S_SSC_PDC_DBLFRAMES)
+		n = SAM4S_SSC_BUF_DBLFRAMES - SAM4S_SSC_PDC_DBLFRAMES;
+	for (i=seq-n; i!=seq; i++)
+		memset(&sam4s_ssc_rx_buf[(i % SAM4S_SSC_BUF_DBLFRAMES) *
+			SAM4S_SSC_DBLFRM_LONGWORDS], 0xff,
+			SAM4S_SSC_DBLFRM_LONGWORDS * sizeof(uint32_t));
+
+	sam4s_ssc_rx_seq = seq;
+	e1_mgmt_rx_gap_irq(lost);
+
+	sam4s_ssc_irqstats.rx_lost += lost;
+	sam4s_ssc_irqstats.rx_gap_seq = seq - lost;
+	TRACE_UTIL("ssc rx gap: double-frames lost, first", lost, seq - lost);
+}
+
+/* RXBUFF: the batch in slot done and the next one are complete. This
+   runs in the ssc irq and holds off everything less urgent (TC0, UDP...)
+   for the two batches, and a wait of up to SAM4S_SSC_RX_WAIT_CYCLES */
+static void
+sam4s_ssc_rx_recover(int done, int skip)
+{
+	unsigned int seq, lost;
+	uint32_t t0;
+
+	SSC->SSC_CR = SSC_CR_RXDIS;
+	(void)SSC->SSC_RHR;
+
+	sam4s_ssc_rx_dblfrms(done, skip);
+	sam4s_ssc_rx_dblfrms((done + SAM4S_SSC_BATCH) % SAM4S_SSC_BUF_DBLFRAMES, 0);
+	seq = sam4s_ssc_rx_seq;
+
+	if (!sam4s_ssc_rx_frm_ok) {
+		/* not known yet where we are, start over */
+		sam4s_ssc_init_rx_dma();
+		SSC->SSC_CR = SSC_CR_RXEN;
+		return;
+	}
+
+	/* the double-frame after the one in progress is the first one the
+	   receiver gets */
+	t0 = DWT->CYCCNT;
+	while (TC0->TC_CHANNEL[2].TC_CV + SAM4S_SSC_RESTART_BITS >=
+	    TC0->TC_CHANNEL[2].TC_RC) {
+		if (DWT->CYCCNT - t0 > SAM4S_SSC_RX_WAIT_CYCLES) {
+			/* no line clock, where we are is lost */
+			sam4s_ssc_rx_frm_ok = 0;
+			sam4s_ssc_init_rx_dma();
+			SSC->SSC_CR = SSC_CR_RXEN;
+			return;
+		}
+	}
+	lost = (uint16_t)(sam4s_timer_e1_dblfrm() - sam4s_ssc_rx_frm_off + 1 -
+		seq);
+	if (lost >= 0x8000)
+		lost = 0;
+	sam4s_ssc_rx_arm(seq + lost);
+	SSC->SSC_CR = SSC_CR_RXEN;
+
+	if (lost)
+		sam4s_ssc_rx_gap(seq + lost, lost);
+}
+
+/* the PDC continues with tx longword pos (counted like sam4s_ssc_tx_seq):
+   the double-frames up to the end of the next batch are filled, batches
+   stay aligned like for rx */
+static void
+sam4s_ssc_tx_arm(unsigned int pos)
+{
+	unsigned int seq = pos / SAM4S_SSC_DBLFRM_LONGWORDS;
+	unsigned int lw = pos % SAM4S_SSC_DBLFRM_LONGWORDS;
+	unsigned int batch = seq & ~(SAM4S_SSC_BATCH - 1);
+	unsigned int slot = seq % SAM4S_SSC_TX_BUF_DBLFRAMES;
+	unsigned int next = (batch + SAM4S_SSC_BATCH) % SAM4S_SSC_TX_BUF_DBLFRAMES;
+
+	sam4s_ssc_tx_curr_dblfrm = batch % SAM4S_SSC_TX_BUF_DBLFRAMES;
+	PDC_SSC->PERIPH_TPR = (uint32_t)&sam4s_ssc_tx_buf[
+		slot*SAM4S_SSC_DBLFRM_LONGWORDS + lw];
+	PDC_SSC->PERIPH_TCR = (batch + SAM4S_SSC_BATCH - seq) *
+		SAM4S_SSC_DBLFRM_LONGWORDS - lw;
+	PDC_SSC->PERIPH_TNPR = (uint32_t)&sam4s_ssc_tx_buf[next*SAM4S_SSC_DBLFRM_LONGWORDS];
+	PDC_SSC->PERIPH_TNCR = SAM4S_SSC_BATCH_LONGWORDS;
+}
+
+/* when the PDC hands longwords to the SSC, from the position at ENDTX.
+   The irq always comes a little later, the earliest time seen is the
+   closest */
+static void
+sam4s_ssc_tx_learn()
+{
+	uint32_t tcr = PDC_SSC->PERIPH_TCR;
+	uint32_t t = DWT->CYCCNT;
+	unsigned int pos;
+	int32_t e;
+
+	if (tcr != PDC_SSC->PERIPH_TCR)
+		return;
+	/* the PDC works on the batch before the one queued last */
+	pos = sam4s_ssc_tx_seq * SAM4S_SSC_DBLFRM_LONGWORDS - tcr;
+
+	sam4s_ssc_tx_t += (pos - sam4s_ssc_tx_pos) * SAM4S_SSC_CYCLES_PER_LW;
+	sam4s_ssc_tx_pos = pos;
+	e = t - sam4s_ssc_tx_t;
+	if (!sam4s_ssc_tx_t_ok || e < 0 || e >= SAM4S_SSC_CYCLES_PER_LW)
+		sam4s_ssc_tx_t = t;
+	sam4s_ssc_tx_t_ok = 1;
+}
+
+/* TXBUFE: everything up to sam4s_ssc_tx_seq has been sent. This runs in
+   the ssc irq and holds off everything less urgent: each pass waits at
+   most SAM4S_SSC_RESTART_CYCLES (256 cycles, 2.3 us) for the cycle
+   counter to leave the end of a longword, then fills up to 3 batches
+   (SAM4S_SSC_PDC_DBLFRAMES and the one in progress) with
+   e1_mgmt_tx_dblfrm_irq(). A second pass only follows when that took
+   longer than a batch of the line (SAM4S_SSC_BATCH * 250 us) */
+static void
+sam4s_ssc_tx_recover()
+{
+	unsigned int seq = sam4s_ssc_tx_seq, fill = seq, pos, batch, i;
+	uint32_t t;
+
+	if (!sam4s_ssc_tx_t_ok) {
+		sam4s_ssc_init_tx_dma();
+		return;
+	}
+
+	/* filling the double-frames takes a while, until the longword
+	   due next is in one of them */
+	for (;;) {
+		do {
+			t = DWT->CYCCNT - sam4s_ssc_tx_t;
+		} while (t % SAM4S_SSC_CYCLES_PER_LW + SAM4S_SSC_RESTART_CYCLES >=
+			SAM4S_SSC_CYCLES_PER_LW);
+		pos = sam4s_ssc_tx_pos + t / SAM4S_SSC_CYCLES_PER_LW;
+		batch = (pos / SAM4S_SSC_DBLFRM_LONGWORDS) &
+			~(SAM4S_SSC_BATCH - 1);
+		if ((int)(batch + SAM4S_SSC_PDC_DBLFRAMES - fill) <= 0)
+			break;
+
+		i = pos / SAM4S_SSC_DBLFRM_LONGWORDS;
+		if ((int)(i - fill) < 0)
+			i = fill;
+		for (; i!=batch+SAM4S_SSC_PDC_DBLFRAMES; i++) {
+			PROF_UTIL_ENTER(PROF_UTIL_E1_TX);
+			e1_mgmt_tx_dblfrm_irq(&sam4s_ssc_tx_buf[
+				(i % SAM4S_SSC_TX_BUF_DBLFRAMES) *
+				SAM4S_SSC_DBLFRM_LONGWORDS], i);
+			PROF_UTIL_EXIT(PROF_UTIL_E1_TX);
+		}
+		fill = i;
+	}
+	sam4s_ssc_tx_arm(pos);
+	sam4s_ssc_tx_seq = fill;
+
+	/* double-frames of which not all longwords went out */
+	i = (pos + SAM4S_SSC_DBLFRM_LONGWORDS - 1) / SAM4S_SSC_DBLFRM_LONGWORDS - seq;
+	sam4s_ssc_irqstats.tx_lost += i;
+	sam4s_ssc_irqstats.tx_gap_seq = seq;
+	TRACE_UTIL("ssc tx gap: double-frames lost, first", i, seq);
+}
+
+static void
+sam4s_ssc_irq(uint32_t sr)
 {
-	uint32_t sr = SSC->SSC_SR;
 	/* Receiver */
-	/* "current" rx buffer has finished receiving, but we have to submit
+	/* "current" rx batch has finished receiving, but we have to submit
 	   the one after the next (rxbuf_submit) to keep the queue full */
 	if (sr & SSC_SR_ENDRX) {
-		int cp = sam4s_ssc_rx_curr_dblfrm;
+		int done = sam4s_ssc_rx_curr_dblfrm;
+		int skip = sam4s_ssc_rx_curr_skip;
+		int cp;
 
 		if (sr & SSC_SR_RXBUFF) {
 			/* should never happen! */
 			sam4s_ssc_irqstats.rx_overflow++;
-			sam4s_ssc_init_rx_dma();
+			sam4s_ssc_rx_recover(done, skip);
+			goto rx_done;
 		}
 
-		sam4s_ssc_rx_last_dblfrm = cp;
-
-		/* this is the period that is currently being received */
-		cp = (cp + 1) % SAM4S_SSC_BUF_DBLFRAMES;
+		/* this is the batch that is currently being received */
+		cp = (done + SAM4S_SSC_BATCH) % SAM4S_SSC_BUF_DBLFRAMES;
 		sam4s_ssc_rx_curr_dblfrm = cp;
+		sam4s_ssc_rx_curr_skip = 0;
 
-		/* this is the next period that will be received */
-		cp = ( cp + 1 ) % SAM4S_SSC_BUF_DBLFRAMES;
+		/* this is the next batch that will be received */
+		cp = (cp + SAM4S_SSC_BATCH) % SAM4S_SSC_BUF_DBLFRAMES;
 		PDC_SSC->PERIPH_RNPR = (uint32_t) &sam4s_ssc_rx_buf[cp*SAM4S_SSC_DBLFRM_LONGWORDS];
-		PDC_SSC->PERIPH_RNCR = SAM4S_SSC_DBLFRM_LONGWORDS;
+		PDC_SSC->PERIPH_RNCR = SAM4S_SSC_BATCH_LONGWORDS;
 
-		e1_mgmt_rx_dblfrm_irq(&sam4s_ssc_rx_buf[sam4s_ssc_rx_last_dblfrm*SAM4S_SSC_DBLFRM_LONGWORDS]);
+		sam4s_ssc_rx_dblfrms(done, skip);
+		sam4s_ssc_rx_frm_learn();
 
 		/* debug */
-		sam4s_ssc_irqstats.rx_ctr++;
-		sam4s_pinmux_gpio_set(SAM4S_PINMUX_PA(25),sam4s_ssc_irqstats.rx_ctr & 1);
+		sam4s_pinmux_gpio_set(SAM4S_PINMUX_PA(25),
+			(sam4s_ssc_irqstats.rx_ctr / SAM4S_SSC_BATCH) & 1);
 	}
+rx_done:
 
 	if (sr & SSC_SR_ENDTX) {
 		int cp = sam4s_ssc_tx_curr_dblfrm;
+		unsigned int seq;
+		uint32_t *p;
+		int i;
 
 		if (sr & SSC_SR_TXBUFE) {
 			sam4s_ssc_irqstats.tx_underflow++;
-			sam4s_ssc_init_tx_dma();
+			sam4s_ssc_tx_recover();
+			return;
 		}
+		sam4s_ssc_tx_learn();
 
-		sam4s_ssc_tx_last_dblfrm = cp;
+		sam4s_ssc_tx_last_dblfrm = cp + SAM4S_SSC_BATCH - 1;
 
-		cp = (cp + 1) % SAM4S_SSC_BUF_DBLFRAMES;
+		cp = (cp + SAM4S_SSC_BATCH) % SAM4S_SSC_TX_BUF_DBLFRAMES;
 		sam4s_ssc_tx_curr_dblfrm = cp;
 
-		cp = ( cp + 1 ) % SAM4S_SSC_BUF_DBLFRAMES;
-		PDC_SSC->PERIPH_TNPR = (uint32_t) &sam4s_ssc_tx_buf[cp * SAM4S_SSC_DBLFRM_LONGWORDS];
-		PDC_SSC->PERIPH_TNCR = SAM4S_SSC_DBLFRM_LONGWORDS;
+		/* this is the next batch that will be transmitted, give
+		   e1_mgmt the last chance to fill it. seq is a multiple of the
+		   batch, the batch does not wrap in the ring */
+		seq = sam4s_ssc_tx_seq;
+		p = &sam4s_ssc_tx_buf[(seq % SAM4S_SSC_TX_BUF_DBLFRAMES) *
+			SAM4S_SSC_DBLFRM_LONGWORDS];
+		for (i=0; i<SAM4S_SSC_BATCH; i++) {
+			PROF_UTIL_ENTER(PROF_UTIL_E1_TX);
+			e1_mgmt_tx_dblfrm_irq(&p[i*SAM4S_SSC_DBLFRM_LONGWORDS],
+				seq + i);
+			PROF_UTIL_EXIT(PROF_UTIL_E1_TX);
+		}
+
+		PDC_SSC->PERIPH_TNPR = (uint32_t) p;
+		PDC_SSC->PERIPH_TNCR = SAM4S_SSC_BATCH_LONGWORDS;
+		sam4s_ssc_tx_seq = seq + SAM4S_SSC_BATCH;
+
+		sam4s_ssc_irqstats.tx_ctr += SAM4S_SSC_BATCH;
+		sam4s_pinmux_gpio_set(SAM4S_PINMUX_PA(26),
+			(sam4s_ssc_irqstats.tx_ctr / SAM4S_SSC_BATCH) & 1);
+	}
+}
 
-		sam4s_ssc_irqstats.tx_ctr++;
-		sam4s_pinmux_gpio_set(SAM4S_PINMUX_PA(26),sam4s_ssc_irqstats.tx_ctr & 1);
+void
+SSC_Handler()
+{
+	uint32_t t0 = sam4s_irq_enter();
+	/* the receive window ends with the TC2 period, so the count is
+	   how late we are, in E1 bits */
+	uint32_t lat = TC0->TC_CHANNEL[2].TC_CV;
+	uint32_t sr = SSC->SSC_SR;
+
+	sam4s_seqlock_write_begin(&sam4s_ssc_seqlock);
+	if (sr & SSC_SR_ENDRX) {
+		if (lat < sam4s_ssc_irqstats.rx_lat_min)
+			sam4s_ssc_irqstats.rx_lat_min = lat;
+		if (lat > sam4s_ssc_irqstats.rx_lat_max)
+			sam4s_ssc_irqstats.rx_lat_max = lat;
 	}
+	sam4s_ssc_irq(sr);
+	sam4s_seqlock_write_end(&sam4s_ssc_seqlock);
+
+	sam4s_irq_exit(SAM4S_IRQ_SSC, t0, (sr & SSC_SR_ENDRX) ?
+		lat * SAM4S_IRQ_CYCLES_PER_E1_BIT : SAM4S_IRQ_LAT_UNKNOWN);
 }
 
 
@@ -151,7 +485,7 @@ sam4s_ssc_init()
 	SSC->SSC_IDR = SSC->SSC_IMR;     /* disable all: disable <== mask */
 	PDC_SSC->PERIPH_PTCR = PERIPH_PTCR_RXTDIS|PERIPH_PTCR_TXTDIS;
 
-	SSC->SSC_CMR = SSC_CMR_DIV(27); /* 110.592 MHz / (27*2) = 2.048 MHz */
+	SSC->SSC_CMR = SSC_CMR_DIV(SAM4S_SSC_CMR_DIV);
 
 	/* ======== RECEIVE ======== */
 
@@ -186,7 +520,5 @@ sam4s_ssc_init()
 	PDC_SSC->PERIPH_PTCR = PERIPH_PTCR_RXTEN | PERIPH_PTCR_TXTEN;
 	SSC->SSC_IER = SSC_IER_ENDTX| SSC_IER_ENDRX;
 
-	/* set highest priority */
-	NVIC_SetPriority (SSC_IRQn, (1UL << __NVIC_PRIO_BITS) - 1UL);
 	NVIC_EnableIRQ(SSC_IRQn);
 }
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 
+#include "sam4s_irq.h"
+
 /*
  * 
  * One e1 frame is 32 bytes = 256 bits = 8 (32bit) long words, to lower
@@ -14,20 +16,83 @@
 
 #define SAM4S_SSC_DBLFRM_LONGWORDS 16
 #define SAM4S_SSC_BITS_PER_LONGWORD 32
-#define SAM4S_SSC_BUF_DBLFRAMES 4
+/* transmit clock divider: 110.592 MHz / (27*2) = 2.048 MHz */
+#define SAM4S_SSC_CMR_DIV 27
+/* double-frames per PDC transfer, and per ssc irq for each direction: 1
+   for the lowest latency, more for fewer interrupts (4: one per ms). A
+   power of two */
+#ifndef SAM4S_SSC_BATCH
+#define SAM4S_SSC_BATCH 1
+#endif
+#define SAM4S_SSC_BATCH_LONGWORDS (SAM4S_SSC_DBLFRM_LONGWORDS*SAM4S_SSC_BATCH)
+/* default depth of both rings, 4 ms, more with larger batches */
+#if SAM4S_SSC_BATCH == 1
+#define SAM4S_SSC_BUF_DEFAULT 16
+#elif SAM4S_SSC_BATCH <= 4
+#define SAM4S_SSC_BUF_DEFAULT 32
+#else
+#define SAM4S_SSC_BUF_DEFAULT (8*SAM4S_SSC_BATCH)
+#endif
+/* receive ring, what the usb iso in endpoint can fall behind is all of
+   it but the two batches owned by the PDC. Must be a power of two, see
+   sam4s_ssc_rx_seq, and hold at least four batches */
+#ifndef SAM4S_SSC_BUF_DBLFRAMES
+#define SAM4S_SSC_BUF_DBLFRAMES SAM4S_SSC_BUF_DEFAULT
+#endif
+/* transmit ring, doubles as the jitter buffer for data from usb, must be
+   a power of two, see sam4s_ssc_tx_seq and e1_tx.c, and hold at least
+   four batches */
+#ifndef SAM4S_SSC_TX_BUF_DBLFRAMES
+#define SAM4S_SSC_TX_BUF_DBLFRAMES SAM4S_SSC_BUF_DEFAULT
+#endif
+/* double-frames of each ring the PDC owns, the batch being transferred
+   and the one queued next */
+#define SAM4S_SSC_PDC_DBLFRAMES (2*SAM4S_SSC_BATCH)
 
 extern void sam4s_ssc_init();
 
+struct sam4s_ssc_irqstats {
+	unsigned int tx_ctr;
+	unsigned int tx_underflow;
+	unsigned int rx_ctr;
+	unsigned int rx_overflow;
+	/* TC2 count (E1 bits after the end of the double-frame) when the
+	   handler is entered for ENDRX, max - min is the irq jitter */
+	unsigned int rx_lat_min, rx_lat_max;
+	/* double-frames lost to overflow (not received) and underflow
+	   (not, or not completely, sent), and the seq of the first one of
+	   the last gap. The rx ring has 0xff in their place, the tx seq
+	   skips them, see the recovery in sam4s_ssc.c */
+	unsigned int rx_lost, rx_gap_seq;
+	unsigned int tx_lost, tx_gap_seq;
+};
+
+/* held by SSC_Handler() while it runs, for the statistics of everything
+   called from it, see sam4s_irq.h */
+extern struct sam4s_seqlock sam4s_ssc_seqlock;
+
+extern void sam4s_ssc_get_irqstats(struct sam4s_ssc_irqstats *p);
+
 extern uint32_t sam4s_ssc_rx_buf[SAM4S_SSC_DBLFRM_LONGWORDS*SAM4S_SSC_BUF_DBLFRAMES];
 extern volatile int sam4s_ssc_rx_last_dblfrm;
 
-extern uint32_t sam4s_ssc_tx_buf[SAM4S_SSC_DBLFRM_LONGWORDS*SAM4S_SSC_BUF_DBLFRAMES];
+/* number of double-frames received, the last one is always in
+   ring slot (sam4s_ssc_rx_seq-1) % SAM4S_SSC_BUF_DBLFRAMES, this allows
+   a consistent snapshot of both with one single read */
+extern volatile unsigned int sam4s_ssc_rx_seq;
+
+/* seq of the double-frame received into each ring slot, written before
+   sam4s_ssc_rx_seq moves past it. The 0xff of a gap and the slots a
+   restart skips keep an older one, so they are not taken for data */
+extern volatile unsigned int sam4s_ssc_rx_slot_seq[SAM4S_SSC_BUF_DBLFRAMES];
+
+extern uint32_t sam4s_ssc_tx_buf[SAM4S_SSC_DBLFRM_LONGWORDS*SAM4S_SSC_TX_BUF_DBLFRAMES];
 extern volatile int sam4s_ssc_tx_last_dblfrm;
 
-extern unsigned int sam4s_ssc_tx_irq_ctr;
-extern unsigned int sam4s_ssc_rx_irq_ctr;
-extern unsigned int sam4s_ssc_irq_underflow_ctr;
-extern unsigned int sam4s_ssc_irq_overflow_ctr;
+/* number of double-frames handed to the PDC for transmission, the next
+   one to be queued is ring slot sam4s_ssc_tx_seq % SAM4S_SSC_TX_BUF_DBLFRAMES,
+   the SAM4S_SSC_PDC_DBLFRAMES before it are owned by the PDC */
+extern volatile unsigned int sam4s_ssc_tx_seq;
 
 #endif
 
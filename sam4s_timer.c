@@ -21,6 +21,7 @@
 #include "sam4s_pinmux.h"
 #include "sam4s_clock.h"
 #include "sam4s_ssc.h"     /* we need this to calculate bits/ssc-frame */
+#include "sam4s_irq.h"
 
 #include <sam4s8b.h>
 
@@ -33,65 +34,99 @@
  *  of overflows as the 16 MSB of capture timestamps.
  */
 static uint16_t sam4s_timer_capt_msb;
-static uint32_t sam4s_timer_capt_rising;         /* msb << 16 | timstamp */
-static uint32_t sam4s_timer_capt_falling;        /* for rising & falling edge */
-static volatile uint32_t sam4s_timer_capt_flags;
+
+/* written by TC0_Handler() only, the main loop takes a snapshot and
+   compares the edge counts with the ones it has seen last time */
+static struct sam4s_timer_capt {
+	uint32_t rising;           /* msb << 16 | timstamp */
+	uint32_t falling;          /* for rising & falling edge */
+	unsigned int nrising;      /* number of edges captured */
+	unsigned int nfalling;
+} sam4s_timer_capt;
+static struct sam4s_seqlock sam4s_timer_capt_seqlock;
+static unsigned int sam4s_timer_capt_nrising_seen;
+static unsigned int sam4s_timer_capt_nfalling_seen;
 
 /*
  * ==== E1 frame synchronization ====
  *
- * we make one timer period one clock longer, or shorter
+ * we make one timer period nbits clocks longer, or shorter, this moves
+ * all following frame syncs (and therefore the SSC receive window) by
+ * nbits relative to the E1 bitstream
  */
 
 enum sam4s_timer_e1_phase_adj_state {
 	SAM4S_TIMER_E1_PHASE_IDLE,
-	SAM4S_TIMER_E1_PHASE_INC,
-	SAM4S_TIMER_E1_PHASE_DEC
+	SAM4S_TIMER_E1_PHASE_PENDING,  /* RC will be modified on next match */
+	SAM4S_TIMER_E1_PHASE_ACTIVE    /* current period has modified RC */
 };
 
 static volatile enum sam4s_timer_e1_phase_adj_state sam4s_timer_e1_phase_adj_state;
+static volatile int sam4s_timer_e1_phase_adj_bits;
 
 extern int
-sam4s_timer_e1_phase_adj(int do_inc) {
-	enum sam4s_timer_e1_phase_adj_state state = sam4s_timer_e1_phase_adj_state;
+sam4s_timer_e1_phase_adj(int nbits) {
+	enum sam4s_timer_e1_phase_adj_state idle = SAM4S_TIMER_E1_PHASE_IDLE;
 	uint32_t dummy;
 
-	if (state != SAM4S_TIMER_E1_PHASE_IDLE)
+	if (sam4s_timer_e1_phase_adj_state != SAM4S_TIMER_E1_PHASE_IDLE)
 		return -1; /* cannot adjust right now */
 
-	state = do_inc ? SAM4S_TIMER_E1_PHASE_INC : SAM4S_TIMER_E1_PHASE_DEC;
-
-	__disable_irq();
+	if (nbits == 0)
+		return 0;
+
+	if (nbits <= -SAM4S_TIMER_E1_CLOCKS_PER_DBLFRM ||
+	    nbits >= SAM4S_TIMER_E1_CLOCKS_PER_DBLFRM)
+		return -1; /* more than one period does not make sense */
+
+	/* main loop and ssc irq both call this: whoever moves the state
+	   out of IDLE owns it. TC2_Handler() only runs with the irq enabled,
+	   which is not before the IER write below, so nobody else touches
+	   the bits in between, no need to lock out irqs */
+	if (!__atomic_compare_exchange_n(&sam4s_timer_e1_phase_adj_state,
+	    &idle, SAM4S_TIMER_E1_PHASE_PENDING, 0,
+	    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return -1;
+	sam4s_timer_e1_phase_adj_bits = nbits;
 	/* Reading status register clears COVSFS interrupt flat, we only want
 	   it to fire right after next overflow! */
-	sam4s_timer_e1_phase_adj_state = state;
 	dummy = TC0->TC_CHANNEL[2].TC_SR;
 	TC0->TC_CHANNEL[2].TC_IER = TC_IER_CPCS; /* match register C */
-	__enable_irq();
 	return 0;
 }
 
+uint16_t
+sam4s_timer_e1_dblfrm()
+{
+	return TC0->TC_CHANNEL[1].TC_CV;
+}
+
 void TC2_Handler()
 {
+	uint32_t t0 = sam4s_irq_enter();
+	/* the counter restarted from 0 on the match */
+	uint32_t lat = TC0->TC_CHANNEL[2].TC_CV * SAM4S_IRQ_CYCLES_PER_E1_BIT;
 	uint32_t sr2 = TC0->TC_CHANNEL[2].TC_SR; /* reading SR clear irq flags */
 
 	if (!(sr2 & TC_SR_CPCS)) /* no match on register c? */
 		return;  /* should never happen */
 
-	/* to adjust the E1 phase, make a frame one bit longer, or shorter */
-	if (sam4s_timer_e1_phase_adj_state == SAM4S_TIMER_E1_PHASE_INC) {
-		TC0->TC_CHANNEL[2].TC_RC = SAM4S_TIMER_E1_CLOCKS_PER_DBLFRM + 1;
-	} else if (sam4s_timer_e1_phase_adj_state == SAM4S_TIMER_E1_PHASE_DEC) {
-		TC0->TC_CHANNEL[2].TC_RC = SAM4S_TIMER_E1_CLOCKS_PER_DBLFRM - 1;
+	/* to adjust the E1 phase, make a frame nbits longer, or shorter */
+	if (sam4s_timer_e1_phase_adj_state == SAM4S_TIMER_E1_PHASE_PENDING) {
+		TC0->TC_CHANNEL[2].TC_RC = SAM4S_TIMER_E1_CLOCKS_PER_DBLFRM +
+			sam4s_timer_e1_phase_adj_bits;
+		sam4s_timer_e1_phase_adj_state = SAM4S_TIMER_E1_PHASE_ACTIVE;
 	} else {
 		/* set back to normal number of bits/frame, disable irq */
 		TC0->TC_CHANNEL[2].TC_RC = SAM4S_TIMER_E1_CLOCKS_PER_DBLFRM;
-		TC0->TC_CHANNEL[2].TC_IDR = TC_IER_COVFS;
+		TC0->TC_CHANNEL[2].TC_IDR = TC_IDR_CPCS;
+		sam4s_timer_e1_phase_adj_state = SAM4S_TIMER_E1_PHASE_IDLE;
 	}
-	sam4s_timer_e1_phase_adj_state = SAM4S_TIMER_E1_PHASE_IDLE;
+	sam4s_irq_exit(SAM4S_IRQ_TC2, t0, lat);
 }
 
 void TC0_Handler() {
+	uint32_t t0 = sam4s_irq_enter();
 	uint32_t sr0 = TC0->TC_CHANNEL[0].TC_SR; /* status register */
 	uint16_t tv = TC0->TC_CHANNEL[0].TC_CV;  /* timer value */
 
@@ -107,14 +142,16 @@ void TC0_Handler() {
 	for this capture event is one more than the (at this point in
 	the IRQ handler not yet incremented) msb counter. */
 
+	sam4s_seqlock_write_begin(&sam4s_timer_capt_seqlock);
+
 	if (sr0 & TC_SR_LDRAS) {
 		uint16_t ra_msb = sam4s_timer_capt_msb;
 		uint16_t ra = TC0->TC_CHANNEL[0].TC_RA;
 
 		if (ra <= tv) /* read remark above */
 			ra_msb++;
-		sam4s_timer_capt_rising = (ra_msb << 16) | ra;
-		sam4s_timer_capt_flags |= SAM4S_TIMER_CAPT_RISING;
+		sam4s_timer_capt.rising = (ra_msb << 16) | ra;
+		sam4s_timer_capt.nrising++;
 	}
 
 	if (sr0 & TC_SR_LDRBS) {
@@ -123,18 +160,22 @@ void TC0_Handler() {
 
 		if (rb <= tv) /* read remark above */
 			rb_msb++;
-		sam4s_timer_capt_falling = (rb_msb << 16) | rb;
-		sam4s_timer_capt_flags |= SAM4S_TIMER_CAPT_FALLING;
+		sam4s_timer_capt.falling = (rb_msb << 16) | rb;
+		sam4s_timer_capt.nfalling++;
 	}
+	sam4s_seqlock_write_end(&sam4s_timer_capt_seqlock);
 
 	sam4s_timer_capt_msb++; /* number of timer overflows */
+
+	/* counting MCK/2 since the overflow */
+	sam4s_irq_exit(SAM4S_IRQ_TC0, t0, 2 * tv);
 }
 
 void
 sam4s_timer_init() {
 	uint32_t dummy;
 
-	/* turn on clock to three *CHANNELS*, we'll turn off ch1 again later */
+	/* turn on clock to all three *CHANNELS* */
 	sam4s_clock_peripheral_onoff(ID_TC0, 1 /*on  */);
 	sam4s_clock_peripheral_onoff(ID_TC1, 1 /*on */);
 	sam4s_clock_peripheral_onoff(ID_TC2, 1 /*on  */);
@@ -159,9 +200,15 @@ sam4s_timer_init() {
 	TC0->TC_CHANNEL[0].TC_IDR = TC0->TC_CHANNEL[0].TC_IMR; /* disable all */
 	TC0->TC_CHANNEL[0].TC_IER = TC_IER_COVFS; /* fire ISR on overflow */
 
-	/* channel 1 is unused  */
-	TC0->TC_CHANNEL[1].TC_CMR = 0;
-	TC0->TC_CHANNEL[1].TC_RA = 0; /* just testing */
+	/*
+	 * channel 1 counts the double-frames: clocked by XC1 = TIOA2, which
+	 * channel 2 sets on every RC match, just like the frame sync on
+	 * TIOB2. Capture mode, nothing is captured, the counter just wraps
+	 * at 16 bits, see sam4s_timer_e1_dblfrm()
+	 */
+	TC0->TC_BMR = (TC0->TC_BMR & ~TC_BMR_TC1XC1S_Msk) | TC_BMR_TC1XC1S_TIOA2;
+	TC0->TC_CHANNEL[1].TC_CMR = TC_CMR_TCCLKS_XC1;
+	TC0->TC_CHANNEL[1].TC_RA = 0;
 	TC0->TC_CHANNEL[1].TC_RB = 0;
 	TC0->TC_CHANNEL[1].TC_RC = 0;
 	TC0->TC_CHANNEL[1].TC_IDR = TC0->TC_CHANNEL[1].TC_IMR; /* disable all */
@@ -183,8 +230,8 @@ sam4s_timer_init() {
 		TC_CMR_EEVT_XC0 |     /* anything != TIOB makes TIOB an output */
 		TC_CMR_WAVSEL_UP_RC | /* count from 0..TC_RC */
 		TC_CMR_WAVE |         /* waveform mode */
-		TC_CMR_ACPA_NONE |    /* match TC_RA -> TIOA2: none */
-		TC_CMR_ACPC_NONE |    /* match TC_RC -> TIOA2: none */
+		TC_CMR_ACPA_CLEAR |   /* match TC_RA -> TIOA2: clr, for ch 1 */
+		TC_CMR_ACPC_SET |     /* match TC_RC -> TIOA2: set, for ch 1 */
 		TC_CMR_AEEVT_NONE |   /* ext. event  -> TIOA2: none */
 		TC_CMR_ASWTRG_NONE |  /* sw trigger  -> TIOA2: none */
 		TC_CMR_BCPB_CLEAR |   /* match TC_RB -> TIOB2: clr output */
@@ -193,7 +240,8 @@ sam4s_timer_init() {
 		TC_CMR_BSWTRG_NONE;   /* sw trigger  -> TIOB2: none */
 
 	/*
-	 * RA is unused, RB=1 is used for frame generation
+	 * RB=1 is used for frame generation, RA=1 for the same pulse on
+	 * TIOA2 that clocks channel 1
 	 *
 	 *       +--+  +--+  +--+  +--+  +--+  +--+  +--+  CLK
 	 *       |  |  |  |  |  |  |  |  |  |  |  |  |  |
@@ -212,7 +260,7 @@ sam4s_timer_init() {
 	 *                       CV=RB=1 sets TIOB2 low
 	 */
 
-	TC0->TC_CHANNEL[2].TC_RA = 0;
+	TC0->TC_CHANNEL[2].TC_RA = 1;
 	TC0->TC_CHANNEL[2].TC_RB = 1;
 	TC0->TC_CHANNEL[2].TC_RC = SAM4S_TIMER_E1_CLOCKS_PER_DBLFRM;
 	TC0->TC_CHANNEL[2].TC_IDR = TC0->TC_CHANNEL[2].TC_IMR; /* disable all IRQ */
@@ -223,11 +271,10 @@ sam4s_timer_init() {
 	dummy = TC0->TC_CHANNEL[2].TC_SR;
 
 	TC0->TC_CHANNEL[0].TC_CCR = TC_CCR_CLKEN; /* enable channel 0 */
+	TC0->TC_CHANNEL[1].TC_CCR = TC_CCR_CLKEN; /* enable channel 1 */
 	TC0->TC_CHANNEL[2].TC_CCR = TC_CCR_CLKEN; /* enable channel 2 */
 	TC0->TC_BCR = TC_BCR_SYNC;                /* start all channels */
 
-	sam4s_clock_peripheral_onoff(ID_TC1, 0/* off, not needed */);
-
 	NVIC_EnableIRQ(TC0_IRQn);
 	NVIC_EnableIRQ(TC2_IRQn);
 }
@@ -237,17 +284,23 @@ sam4s_timer_capt_poll(
 	uint32_t *rising,
 	uint32_t *falling
 ) {
+	struct sam4s_timer_capt c;
 	unsigned int ret = 0;
 
-	__disable_irq();
-	if ((sam4s_timer_capt_flags & SAM4S_TIMER_CAPT_RISING) && rising)
-		*rising = sam4s_timer_capt_rising;
-	if ((sam4s_timer_capt_flags & SAM4S_TIMER_CAPT_FALLING) && falling)
-		*falling = sam4s_timer_capt_falling;
-	ret = sam4s_timer_capt_flags;
-	sam4s_timer_capt_flags = 0;
-	__enable_irq();
-
+	sam4s_seqlock_snapshot(&sam4s_timer_capt_seqlock, &c,
+		&sam4s_timer_capt, sizeof(c));
 
+	if (c.nrising != sam4s_timer_capt_nrising_seen) {
+		sam4s_timer_capt_nrising_seen = c.nrising;
+		if (rising)
+			*rising = c.rising;
+		ret |= SAM4S_TIMER_CAPT_RISING;
+	}
+	if (c.nfalling != sam4s_timer_capt_nfalling_seen) {
+		sam4s_timer_capt_nfalling_seen = c.nfalling;
+		if (falling)
+			*falling = c.falling;
+		ret |= SAM4S_TIMER_CAPT_FALLING;
+	}
 	return ret;
 }
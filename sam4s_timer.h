@@ -12,7 +12,14 @@ extern void sam4s_timer_init();
 extern unsigned int
 sam4s_timer_capt_poll(uint32_t *rising, uint32_t *falling );
 
+/* lengthen (nbits > 0) or shorten (nbits < 0) the next E1 double-frame
+   period, returns -1 if an adjustment is still in progress */
 extern int
-sam4s_timer_e1_phase_adj(int do_inc);
+sam4s_timer_e1_phase_adj(int nbits);
+
+/* frame syncs generated so far, modulo 2^16: the double-frame whose
+   bits are arriving right now is counted already */
+extern uint16_t
+sam4s_timer_e1_dblfrm();
 
 #endif
\ No newline at end of file
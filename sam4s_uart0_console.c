@@ -17,37 +17,85 @@
 
 #include "sam4s_uart0_console.h"
 #include "circular_buffer.h"
+#include "sam4s_irq.h"
 #include <sam4s8b.h>
+#include <string.h>
 
 #include "sam4s_clock.h"
 #include "sam4s_pinmux.h"
 
-/* hardcoded serial handler for UART0, the bare minimum */
+/* hardcoded serial handler for UART0: receive one character per irq,
+   transmit with the PDC straight out of the tx ring, the whole contiguous
+   part of it as the current buffer and the wrapped rest as the next one,
+   so there is one irq per trip around the ring and the writer never has
+   to lock interrupts */
 
 #define BAUDRATE 115200
 
-CIRCULAR_BUFFER_DECLARE(rxbuf, char, 32)
-CIRCULAR_BUFFER_DECLARE(txbuf, char, 32)
+/* must be a power of two */
+#define SAM4S_UART0_CONSOLE_TX_BUF 1024
+
+CIRCULAR_BUFFER_DECLARE(rxbuf, char, 32, CIRCULAR_BUFFER_DROP_NEW)
+CIRCULAR_BUFFER_DECLARE(txbuf, unsigned char, SAM4S_UART0_CONSOLE_TX_BUF,
+	CIRCULAR_BUFFER_DROP_NEW)
+
+static unsigned int sam4s_uart0_console_inflight; /* in the PDC, irq */
+static int sam4s_uart0_console_nonblock;          /* drop if txbuf full */
+static struct sam4s_uart0_console_stats sam4s_uart0_console_stats;
+/* held by UART0_Handler(), tx_bytes and tx_dropped are the main loop's */
+static struct sam4s_seqlock sam4s_uart0_console_seqlock;
+
+/* PDC is done with everything it had, give it what is in the ring now */
+static void
+sam4s_uart0_console_tx_dma()
+{
+	unsigned int n = SAM4S_UART0_CONSOLE_TX_BUF, rest;
+	const unsigned char *p;
+
+	txbuf_consume(sam4s_uart0_console_inflight);
+	sam4s_uart0_console_inflight = 0;
+
+	p = txbuf_peek(&n);
+	if (!p) {
+		UART0->UART_IDR = UART_IDR_TXBUFE;
+		return;
+	}
+	PDC_UART0->PERIPH_TPR = (uint32_t)p;
+	PDC_UART0->PERIPH_TCR = n;
+
+	/* wrapped around the end of the ring */
+	rest = txbuf_used() - n;
+	if (rest && p + n == &txbuf.data[SAM4S_UART0_CONSOLE_TX_BUF]) {
+		PDC_UART0->PERIPH_TNPR = (uint32_t)txbuf.data;
+		PDC_UART0->PERIPH_TNCR = rest;
+		n += rest;
+	}
+	sam4s_uart0_console_inflight = n;
+	sam4s_uart0_console_stats.tx_dma++;
+}
 
 void
 UART0_Handler()
 {
+	uint32_t t0 = sam4s_irq_enter();
 	/* reading status register will clear "irq has fired" bits */
 	uint32_t sr = UART0->UART_SR;
 
+	sam4s_seqlock_write_begin(&sam4s_uart0_console_seqlock);
+
 	/* receive char */
 	if (sr & UART_SR_RXRDY) {
 		char c = UART0->UART_RHR;
-		rxbuf_put(c);
+		if (rxbuf_put(&c))
+			sam4s_uart0_console_stats.rx_dropped++;
 	}
 
-	if (sr & UART_SR_TXEMPTY) {
-		char c;
-		if (txbuf_get(&c) != -1)      /* is there data to send? */
-			UART0->UART_THR = c;  /*  -> send data */
-		else                          /* if not, disable IRQ */
-			UART0->UART_IDR = UART_IER_TXEMPTY;
-	}
+	/* TXBUFE is set whenever the PDC is idle, only look at it if
+	   the writer has asked for it */
+	if ((sr & UART_SR_TXBUFE) && (UART0->UART_IMR & UART_IMR_TXBUFE))
+		sam4s_uart0_console_tx_dma();
+	sam4s_seqlock_write_end(&sam4s_uart0_console_seqlock);
+	sam4s_irq_exit(SAM4S_IRQ_UART0, t0, SAM4S_IRQ_LAT_UNKNOWN);
 }
 
 /*
@@ -62,25 +110,57 @@ sam4s_uart0_console_init() {
 	UART0->UART_MR = UART_MR_PAR_NO; /* no parity, no loopback */
 	UART0->UART_BRGR = (F_MCK_HZ / (16 * BAUDRATE)) + 0.5;
 
+	PDC_UART0->PERIPH_PTCR = PERIPH_PTCR_TXTDIS | PERIPH_PTCR_RXTDIS;
+	PDC_UART0->PERIPH_TCR = 0;
+	PDC_UART0->PERIPH_TNCR = 0;
+	PDC_UART0->PERIPH_PTCR = PERIPH_PTCR_TXTEN;
+
 	UART0->UART_IER = UART_IER_RXRDY;
 	NVIC_EnableIRQ(UART0_IRQn);
 
 	UART0->UART_CR = UART_CR_RXEN|UART_CR_TXEN;
 }
 
-/* may only happen within non-irq context! */
-void
-sam4s_uart0_console_tx(unsigned char c)
+/* may only happen within non-irq context! Waits for room in the ring,
+   or in non-blocking mode drops what does not fit. */
+unsigned int
+sam4s_uart0_console_write(const unsigned char *buf, unsigned int len)
 {
-	/* I guess the __disable/enable_irq() are not strictly needed */
+	unsigned int done = 0, k;
+
 	for (;;) {
-		__disable_irq();
-		if (txbuf_put(c) == 0)
-			break;  /* successfully queued in txbuf, else... */
-		__enable_irq(); /* txbuf full, allow IRQ hdlr to drain queue */
+		k = txbuf_put_n(buf + done, len - done);
+		done += k;
+		if (k) /* irq runs right away if the PDC is idle */
+			UART0->UART_IER = UART_IER_TXBUFE;
+		if (done == len)
+			break;
+		if (sam4s_uart0_console_nonblock) {
+			sam4s_uart0_console_stats.tx_dropped += len - done;
+			break;
+		}
 	}
-	UART0->UART_IER = UART_IER_TXEMPTY;
-	__enable_irq();
+	sam4s_uart0_console_stats.tx_bytes += done;
+	return done;
+}
+
+void
+sam4s_uart0_console_tx(unsigned char c)
+{
+	sam4s_uart0_console_write(&c, 1);
+}
+
+void
+sam4s_uart0_console_nonblocking(int onoff)
+{
+	sam4s_uart0_console_nonblock = onoff;
+}
+
+void
+sam4s_uart0_console_get_stats(struct sam4s_uart0_console_stats *p)
+{
+	sam4s_seqlock_snapshot(&sam4s_uart0_console_seqlock, p,
+		&sam4s_uart0_console_stats, sizeof(*p));
 }
 
 int
@@ -1,8 +1,22 @@
 #ifndef SAM4S_UART0_CONSOLE_H
 #define SAM4S_UART0_CONSOLE_H
 
+struct sam4s_uart0_console_stats {
+	unsigned int tx_bytes;   /* queued for sending */
+	unsigned int tx_dropped; /* ... not queued, non-blocking mode */
+	unsigned int tx_dma;     /* PDC transfers started */
+	unsigned int rx_dropped; /* received, but the rx ring was full */
+};
+
 extern void sam4s_uart0_console_init();
+/* main loop only: queue len bytes for sending, returns how many were
+   queued, which is less than len only in non-blocking mode */
+extern unsigned int sam4s_uart0_console_write(const unsigned char *buf,
+	unsigned int len);
 extern void sam4s_uart0_console_tx(unsigned char c);
+/* 1: drop output instead of waiting when the tx ring is full */
+extern void sam4s_uart0_console_nonblocking(int onoff);
+extern void sam4s_uart0_console_get_stats(struct sam4s_uart0_console_stats *p);
 extern int sam4s_uart0_console_rx();
 
 #endif
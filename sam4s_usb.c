@@ -1,7 +1,16 @@
 #include "sam4s_usb.h"
 #include "sam4s_clock.h"
 #include "sam4s_usb_descriptors.h"
+#include "sam4s_ssc.h"
+#include "e1_tx.h"
+#include "e1_rate.h"
+#include "e1_demux.h"
+#include "e1_hdlc.h"
+#include "e1_ts0.h"
 #include "trace_util.h"
+#include "sam4s_irq.h"
+#include "prof_util.h"
+#include "stats_util.h"
 #include <sam4s8b.h>
 #include <unistd.h>
 #include <string.h>
@@ -32,17 +41,23 @@
 
 #define TRACE_TAG_USB(l) ('u' | ('s' << 8) | ((l) << 16))
 
-static void
-trace_write(char *s, uint32_t a, uint32_t b)
-{
-	struct trace_util_data tmp;
-	strncpy(tmp.text, s, sizeof(tmp.text));
-	tmp.a = a;
-	tmp.b = b;
-	trace_util_write(tmp);
-}
+/* 0: no tracing at all, 1: control transfers and bus events,
+   2: also every fifo access of the control endpoint */
+#ifndef SAM4S_USB_TRACE
+#define SAM4S_USB_TRACE 1
+#endif
 
-#define TRACE(s, a, b) trace_write(s, a, b)
+#if SAM4S_USB_TRACE
+#define TRACE(s, a, b) TRACE_UTIL(s, a, b)
+#else
+#define TRACE(s, a, b) do { } while (0)
+#endif
+
+#if SAM4S_USB_TRACE >= 2
+#define TRACE_FIFO(s, a, b) TRACE_UTIL(s, a, b)
+#else
+#define TRACE_FIFO(s, a, b) do { } while (0)
+#endif
 
 #define SAM4S_USB_NENDP ((int)(sizeof(UDP->UDP_CSR) / sizeof(UDP->UDP_CSR[0])))
 
@@ -125,15 +140,68 @@ enum sam4s_usb_dev_state sam4s_usb_dev_state;
 unsigned char sam4s_usb_lastbank[SAM4S_USB_NENDP];
 unsigned char sam4s_usb_devaddr;
 
+/* isochronous endpoints for the E1 bitstream, and the explicit feedback
+   for the data rate of the out endpoint */
+#define SAM4S_USB_EP_ISO_IN  4
+#define SAM4S_USB_EP_ISO_OUT 5
+#define SAM4S_USB_EP_ISO_FB  6
+/* bulk in/out for frames from the hdlc receiver and to the transmitter */
+#define SAM4S_USB_EP_HDLC_IN  1
+#define SAM4S_USB_EP_HDLC_OUT 2
+/* bulk in for the binary trace, see trace_util.h */
+#define SAM4S_USB_EP_TRACE_IN 7
+
+/* only these longwords of the ssc rx ring are never touched by the
+   PDC: all but the batch being received and the one queued next */
+#define SAM4S_USB_ISO_IN_MAX_LW \
+	((SAM4S_SSC_BUF_DBLFRAMES-SAM4S_SSC_PDC_DBLFRAMES) * SAM4S_SSC_DBLFRM_LONGWORDS)
+/* wMaxPacketSize of the iso in endpoint, and what struct
+   sam4s_usb_iso_in_hdr leaves of it for the data */
+#define SAM4S_USB_ISO_IN_PKT_LW  (512 / 4)
+#define SAM4S_USB_ISO_IN_DATA_LW (SAM4S_USB_ISO_IN_PKT_LW - 1)
+/* data left in the ring after each packet, absorbs the jitter of the
+   SOF against the batches of double-frames */
+#define SAM4S_USB_ISO_IN_TARGET_LW \
+	((SAM4S_SSC_BATCH + 1) * SAM4S_SSC_DBLFRM_LONGWORDS)
+
+_Static_assert(SAM4S_USB_ISO_IN_TARGET_LW + SAM4S_USB_ISO_IN_PKT_LW <=
+	SAM4S_USB_ISO_IN_MAX_LW, "SAM4S_SSC_BUF_DBLFRAMES too small for iso in");
+
+static unsigned int sam4s_usb_iso_in_lw;   /* next longword to be sent */
+static unsigned int sam4s_usb_iso_in_grp;  /* next demux group to be sent */
+static uint32_t sam4s_usb_iso_in_frac;     /* fraction of a longword, 0.16 */
+static struct sam4s_usb_iso_stats sam4s_usb_iso_stats;
+/* held by UDP_Handler() while it runs, see sam4s_irq.h */
+static struct sam4s_seqlock sam4s_usb_seqlock;
+
+/* octets of the current hdlc frame (with header) already in the fifo */
+static unsigned int sam4s_usb_hdlc_pos;
+
+/* hdlc frame being received from the host, see sam4s_usb_hdlc_out() */
+static struct e1_hdlc_frame *sam4s_usb_hdlc_out_f;
+static unsigned int sam4s_usb_hdlc_out_ch;  /* channel of that frame */
+static unsigned int sam4s_usb_hdlc_out_rem; /* octets left in the bank */
+static int sam4s_usb_hdlc_out_hdr;      /* header read, no frame yet */
+static int sam4s_usb_hdlc_out_last;     /* bank is the end of the transfer */
+static int sam4s_usb_hdlc_out_drop;     /* ignore up to the end of it */
+static int sam4s_usb_hdlc_out_paused;   /* waiting for room in the queue */
+
+/* last trace packet was full, the transfer needs a short one to end */
+static int sam4s_usb_trace_zlp;
+
+/* longest data stage of a control transfer, in either direction */
+#define SAM4S_USB_EP0_BUF 2048
+
 struct usb_ctrlreq sam4s_usb_ctrl; /* global buffer for control requests */
-unsigned char sam4s_usb_ep0buf[64]; /* buffer for receiving payload of control transfers */
+unsigned char sam4s_usb_ep0buf[SAM4S_USB_EP0_BUF]; /* data stage of control transfers */
 unsigned int sam4s_usb_ep0buf_len;  /* number of bytes used within buffer */
+static unsigned int sam4s_usb_ep0_pos; /* in data stage: bytes sent so far */
 
 static inline void
 sam4s_usb_cp_ep0buf(unsigned char *src, unsigned int len)
 {
 	unsigned char *dst = sam4s_usb_ep0buf + sam4s_usb_ep0buf_len;
-	while (sam4s_usb_ep0buf_len <= sizeof(sam4s_usb_ep0buf) && len) {
+	while (sam4s_usb_ep0buf_len < sizeof(sam4s_usb_ep0buf) && len) {
 		*dst++ = *src++;
 		len--;
 		sam4s_usb_ep0buf_len++;
@@ -143,11 +211,23 @@ sam4s_usb_cp_ep0buf(unsigned char *src, unsigned int len)
 #define SAM4S_USB_CP_EP0BUF_OBJ(x) \
 		sam4s_usb_cp_ep0buf((unsigned char*)&(x), sizeof(x))
 
-/* some operations on the CSR register need a few NOPs */
+/*
+ * §40.7.10 UDP_CSR: a write takes 1 UDP clock and 1 peripheral clock
+ * (3 and 3 for RX_DATA_BKx and TXPKTRDY) to show up in the register, and
+ * the register must not be written again before. Instead of always
+ * burning the worst case in NOPs, read back until the bits we changed
+ * are as written, which usually is the very first read. The bound is for
+ * bits that the hardware changes on its own in the meantime.
+ */
+#define SAM4S_USB_CSR_SYNC_READS 16
+
 static inline void
-sam4s_usb_nops(unsigned int n) {
-	while (n--)
-		asm volatile ("nop"::);
+sam4s_usb_csr_sync(unsigned int ep, uint32_t mask, uint32_t val)
+{
+	unsigned int n = SAM4S_USB_CSR_SYNC_READS;
+
+	while (n-- && (UDP->UDP_CSR[ep] & mask) != val)
+		;
 }
 
 static inline void /* nuttx: sam_csr_clrbits */
@@ -156,7 +236,7 @@ sam4s_usb_csr_clr(unsigned int ep, uint32_t mask) {
 	csr |= CSR_NOEFFECT_BITS; /* must be set 1 for no change! */
 	csr &= ~mask;
 	UDP->UDP_CSR[ep] = csr;
-	sam4s_usb_nops(16);
+	sam4s_usb_csr_sync(ep, mask, 0);
 }
 
 static inline void /* nuttx: sam_csr_setbits */
@@ -165,7 +245,7 @@ sam4s_usb_csr_set(unsigned int ep, uint32_t mask) {
 	csr |= mask;
 	csr |= CSR_NOEFFECT_BITS; /* must be set to 1 for no change! */
 	UDP->UDP_CSR[ep] = csr;
-	sam4s_usb_nops(16);
+	sam4s_usb_csr_sync(ep, mask, mask);
 }
 
 static void
@@ -184,36 +264,869 @@ sam4s_usb_ep_reset(unsigned int ep)
 	sam4s_usb_ep_state[ep] = SAM4S_USB_EP_DISABLED;
 }
 
+/*
+ * FIFO access: UDP_FDR moves one byte per register access, there is no
+ * wider path into the dual port RAM. So all we can do is to keep the loop
+ * overhead (and the address calculation) away from those accesses: one
+ * pointer to the register, loops unrolled to 8 bytes, the source/sink
+ * accessed as longwords where the data is longwords anyway. Build with
+ * SAM4S_USB_FDR_UNROLL=0 for the plain byte loops, to compare the cycle
+ * counts in struct sam4s_usb_iso_stats.
+ */
+#ifndef SAM4S_USB_FDR_UNROLL
+#define SAM4S_USB_FDR_UNROLL 1
+#endif
+
+/* size of one bank, §40.2 Table 40-1 */
+static const uint16_t sam4s_usb_ep_fifo_size[SAM4S_USB_NENDP] = {
+	64, 64, 64, 64, 512, 512, 64, 64
+};
+
+/* one byte into or out of the fifo. The host simulation has no memory
+   mapped fifo and brings its own accessors, see sim/sim_udp.h */
+#ifdef SAM4S_USB_FDR_WR
+#define FDR_WR(fdr, v) SAM4S_USB_FDR_WR(fdr, v)
+#define FDR_RD(fdr)    SAM4S_USB_FDR_RD(fdr)
+#else
+#define FDR_WR(fdr, v) (*(fdr) = (v))
+#define FDR_RD(fdr)    (*(fdr))
+#endif
+
+#define FDR_WR_LW(fdr, lw) do { \
+		FDR_WR(fdr, (lw) >> 24); \
+		FDR_WR(fdr, (lw) >> 16); \
+		FDR_WR(fdr, (lw) >> 8); \
+		FDR_WR(fdr, (lw)); \
+	} while (0)
+
+/* not a macro: the order of the four reads matters */
+static inline uint32_t
+sam4s_usb_fdr_rd_lw(volatile uint32_t *fdr)
+{
+	uint32_t lw;
+
+	lw = FDR_RD(fdr) << 24;
+	lw |= FDR_RD(fdr) << 16;
+	lw |= FDR_RD(fdr) << 8;
+	lw |= FDR_RD(fdr);
+	return lw;
+}
+
 static inline void
 sam4s_usb_cp_to_fdr(unsigned int ep, const unsigned char *buf, unsigned int len)
 {
-	uint32_t a=(buf[0]<<24)|(buf[1]<<16)|(buf[2]<<8)|buf[3];
-	uint32_t b=len;
+	volatile uint32_t *fdr = &UDP->UDP_FDR[ep];
+
+	if (len > sam4s_usb_ep_fifo_size[ep])
+		len = sam4s_usb_ep_fifo_size[ep];
+	TRACE_FIFO("sam4s_usb_cp_to_fdr", ep, len);
+
+#if SAM4S_USB_FDR_UNROLL
+	while (len >= 8) {
+		FDR_WR(fdr, buf[0]); FDR_WR(fdr, buf[1]);
+		FDR_WR(fdr, buf[2]); FDR_WR(fdr, buf[3]);
+		FDR_WR(fdr, buf[4]); FDR_WR(fdr, buf[5]);
+		FDR_WR(fdr, buf[6]); FDR_WR(fdr, buf[7]);
+		buf += 8;
+		len -= 8;
+	}
+#endif
 	while (len--)
-		UDP->UDP_FDR[ep] = *buf++;
-	TRACE("sam4s_usb_cp_to_fdr", a, b);
+		FDR_WR(fdr, *buf++);
 }
 
 static inline unsigned int
 sam4s_usb_cp_from_fdr(unsigned int ep, unsigned char *dst, unsigned int dstlen)
 {
+	volatile uint32_t *fdr = &UDP->UDP_FDR[ep];
 	unsigned int rxbytecnt = RXBYTECNT(ep);
-	unsigned int ret = 0;
+	unsigned int ret, n;
 	volatile char c;
 
-	while (dstlen && rxbytecnt) {
-		*dst++ = UDP->UDP_FDR[ep];
-		dstlen--;
-		rxbytecnt--;
-		ret++;
+	ret = n = (dstlen < rxbytecnt) ? dstlen : rxbytecnt;
+	rxbytecnt -= n;
+	TRACE_FIFO("sam4s_usb_cp_from_fdr", ep, n);
+
+#if SAM4S_USB_FDR_UNROLL
+	while (n >= 8) {
+		dst[0] = FDR_RD(fdr); dst[1] = FDR_RD(fdr);
+		dst[2] = FDR_RD(fdr); dst[3] = FDR_RD(fdr);
+		dst[4] = FDR_RD(fdr); dst[5] = FDR_RD(fdr);
+		dst[6] = FDR_RD(fdr); dst[7] = FDR_RD(fdr);
+		dst += 8;
+		n -= 8;
 	}
+#endif
+	while (n--)
+		*dst++ = FDR_RD(fdr);
 
 	while (rxbytecnt--)
-		c = UDP->UDP_FDR[ep];
+		c = FDR_RD(fdr);
 
 	return ret;
 }
 
+/* E1 data goes to the fifo in the order it was received on the line,
+   that is MSB of the first longword first */
+static inline void
+sam4s_usb_cp_lw_to_fdr(unsigned int ep, const uint32_t *src, unsigned int n)
+{
+	volatile uint32_t *fdr = &UDP->UDP_FDR[ep];
+
+#if SAM4S_USB_FDR_UNROLL
+	while (n >= 2) {
+		uint32_t a = src[0], b = src[1];
+
+		FDR_WR_LW(fdr, a);
+		FDR_WR_LW(fdr, b);
+		src += 2;
+		n -= 2;
+	}
+#endif
+	while (n--) {
+		uint32_t lw = *src++;
+
+		FDR_WR_LW(fdr, lw);
+	}
+}
+
+/* and back, the first byte from the fifo is the MSB */
+static inline void
+sam4s_usb_cp_lw_from_fdr(unsigned int ep, uint32_t *dst, unsigned int n)
+{
+	volatile uint32_t *fdr = &UDP->UDP_FDR[ep];
+
+#if SAM4S_USB_FDR_UNROLL
+	while (n >= 2) {
+		dst[0] = sam4s_usb_fdr_rd_lw(fdr);
+		dst[1] = sam4s_usb_fdr_rd_lw(fdr);
+		dst += 2;
+		n -= 2;
+	}
+#endif
+	while (n--)
+		*dst++ = sam4s_usb_fdr_rd_lw(fdr);
+}
+
+void
+sam4s_usb_get_iso_stats(struct sam4s_usb_iso_stats *p)
+{
+	sam4s_seqlock_snapshot(&sam4s_usb_seqlock, p, &sam4s_usb_iso_stats,
+		sizeof(sam4s_usb_iso_stats));
+}
+
+/* struct sam4s_usb_iso_in_hdr, little endian like the other structs,
+   ahead of the E1 data of every packet */
+static void
+sam4s_usb_iso_in_hdr(unsigned int ep, uint32_t pos)
+{
+	volatile uint32_t *fdr = &UDP->UDP_FDR[ep];
+
+	FDR_WR(fdr, pos);
+	FDR_WR(fdr, pos >> 8);
+	FDR_WR(fdr, pos >> 16);
+	FDR_WR(fdr, pos >> 24);
+}
+
+/* the double-frame of raw longword lw has been received, not filled in
+   for a gap. Compared in longwords, lw wraps before the seq does */
+static int
+sam4s_usb_iso_in_rcvd(unsigned int lw)
+{
+	unsigned int slot = lw / SAM4S_SSC_DBLFRM_LONGWORDS %
+		SAM4S_SSC_BUF_DBLFRAMES;
+
+	return sam4s_ssc_rx_slot_seq[slot] * SAM4S_SSC_DBLFRM_LONGWORDS ==
+		(lw & ~(SAM4S_SSC_DBLFRM_LONGWORDS - 1));
+}
+
+/* timeslot mode, see e1_demux.h: the groups completed since the last
+   packet, after the header one row of longwords for every selected
+   timeslot after the other. The host knows the mask, the number of
+   groups follows from the packet length. */
+static void
+sam4s_usb_iso_in_demux(uint32_t mask)
+{
+	unsigned int ep = SAM4S_USB_EP_ISO_IN;
+	unsigned int seq = e1_demux_seq; /* one read, see e1_demux.h */
+	unsigned int n = seq - sam4s_usb_iso_in_grp;
+	unsigned int nts = __builtin_popcount(mask);
+	unsigned int max = SAM4S_USB_ISO_IN_DATA_LW / nts;
+	unsigned int first, col, k, ts;
+
+	/* the column after the last one may be written right now */
+	if (n > E1_DEMUX_DEPTH - 1) {
+		sam4s_usb_iso_stats.in_dropped += (n - (E1_DEMUX_DEPTH - 1)) *
+			nts;
+		n = E1_DEMUX_DEPTH - 1;
+	}
+	first = seq - n;
+
+	/* the groups of a gap are not sent, the header of the next packet
+	   tells the host */
+	while (n && e1_demux_col_seq[first % E1_DEMUX_DEPTH] != first) {
+		sam4s_usb_iso_stats.in_gap += nts;
+		first++;
+		n--;
+	}
+	sam4s_usb_iso_in_grp = first;
+	if (n > max)
+		n = max; /* rest goes with the next packet */
+	for (k=1; k<n; k++)
+		if (e1_demux_col_seq[(first + k) % E1_DEMUX_DEPTH] != first + k)
+			n = k;
+	if (!n)
+		return;
+
+	sam4s_usb_iso_in_hdr(ep, first);
+	col = first % E1_DEMUX_DEPTH;
+	k = E1_DEMUX_DEPTH - col;
+	if (k > n)
+		k = n;
+
+	for (ts=0; ts<E1_DEMUX_TS; ts++) {
+		if (!(mask & (1UL << ts)))
+			continue;
+		sam4s_usb_cp_lw_to_fdr(ep, &e1_demux_buf[ts][col], k);
+		sam4s_usb_cp_lw_to_fdr(ep, e1_demux_buf[ts], n - k);
+	}
+	sam4s_usb_iso_in_grp = first + n;
+
+	sam4s_usb_ep_state[ep] = SAM4S_USB_EP_SENDING;
+	sam4s_usb_csr_set(ep, UDP_CSR_TXPKTRDY);
+
+	sam4s_usb_iso_stats.in_pkts++;
+	sam4s_usb_iso_stats.in_lw += n * nts;
+}
+
+/* called on every start of frame (1 ms = 4 double-frames): the data
+   received since the last packet is copied from the ssc rx ring straight
+   into the fifo of the iso in endpoint. The packet size follows the
+   measured E1 rate (see e1_rate.c) in steps of one longword, so the
+   packets carry 256 +/- a few bytes, and not 192/256/320 bytes depending
+   on how the SOF falls relative to the double-frames. */
+static void
+sam4s_usb_iso_in_sof()
+{
+	unsigned int ep = SAM4S_USB_EP_ISO_IN;
+	/* one read, see sam4s_ssc.h */
+	unsigned int avail = sam4s_ssc_rx_seq * SAM4S_SSC_DBLFRM_LONGWORDS;
+	unsigned int backlog = avail - sam4s_usb_iso_in_lw;
+	uint32_t mask = e1_demux_get_mask();
+	unsigned int idx, k;
+	uint32_t cyc;
+	int n;
+
+	/* host has not picked up the last packet yet, data stays in ring */
+	if (sam4s_usb_ep_state[ep] == SAM4S_USB_EP_SENDING) {
+		sam4s_usb_iso_stats.in_busy++;
+		return;
+	}
+
+	if (mask) {
+		sam4s_usb_iso_in_demux(mask);
+		return;
+	}
+
+	if (backlog > SAM4S_USB_ISO_IN_MAX_LW) {
+		sam4s_usb_iso_stats.in_dropped += backlog - SAM4S_USB_ISO_IN_TARGET_LW;
+		sam4s_usb_iso_in_lw = avail - SAM4S_USB_ISO_IN_TARGET_LW;
+		backlog = SAM4S_USB_ISO_IN_TARGET_LW;
+	}
+
+	/* the double-frames of a gap are not sent, the header of the next
+	   packet tells the host */
+	while (backlog && !sam4s_usb_iso_in_rcvd(sam4s_usb_iso_in_lw)) {
+		k = SAM4S_SSC_DBLFRM_LONGWORDS -
+			sam4s_usb_iso_in_lw % SAM4S_SSC_DBLFRM_LONGWORDS;
+		sam4s_usb_iso_stats.in_gap += k;
+		sam4s_usb_iso_in_lw += k;
+		backlog -= k;
+	}
+
+	/* longwords per frame at the measured rate, and a slow correction of
+	   what is left in the ring towards the target */
+	sam4s_usb_iso_in_frac += e1_rate_get() / SAM4S_SSC_BITS_PER_LONGWORD;
+	n = sam4s_usb_iso_in_frac >> 16;
+	sam4s_usb_iso_in_frac &= 0xffff;
+	n += ((int)backlog - n - SAM4S_USB_ISO_IN_TARGET_LW) / 8;
+
+	if (n > (int)backlog)
+		n = backlog;
+	if (n > SAM4S_USB_ISO_IN_DATA_LW)
+		n = SAM4S_USB_ISO_IN_DATA_LW;
+	/* up to the next gap */
+	for (k = SAM4S_SSC_DBLFRM_LONGWORDS -
+	    sam4s_usb_iso_in_lw % SAM4S_SSC_DBLFRM_LONGWORDS; (int)k < n;
+	    k += SAM4S_SSC_DBLFRM_LONGWORDS)
+		if (!sam4s_usb_iso_in_rcvd(sam4s_usb_iso_in_lw + k))
+			n = k;
+	if (n <= 0)
+		return;
+
+	cyc = DWT->CYCCNT;
+
+	sam4s_usb_iso_in_hdr(ep, sam4s_usb_iso_in_lw);
+	/* the ring is a power of two longwords, wraps at most once */
+	idx = sam4s_usb_iso_in_lw %
+		(SAM4S_SSC_BUF_DBLFRAMES * SAM4S_SSC_DBLFRM_LONGWORDS);
+	k = SAM4S_SSC_BUF_DBLFRAMES * SAM4S_SSC_DBLFRM_LONGWORDS - idx;
+	if (k > (unsigned int)n)
+		k = n;
+	sam4s_usb_cp_lw_to_fdr(ep, &sam4s_ssc_rx_buf[idx], k);
+	sam4s_usb_cp_lw_to_fdr(ep, sam4s_ssc_rx_buf, n - k);
+	sam4s_usb_iso_in_lw += n;
+
+	sam4s_usb_ep_state[ep] = SAM4S_USB_EP_SENDING;
+	sam4s_usb_csr_set(ep, UDP_CSR_TXPKTRDY);
+
+	cyc = DWT->CYCCNT - cyc;
+	sam4s_usb_iso_stats.in_pkts++;
+	sam4s_usb_iso_stats.in_lw += n;
+	sam4s_usb_iso_stats.in_cycles += cyc;
+	if (cyc > sam4s_usb_iso_stats.in_cycles_max)
+		sam4s_usb_iso_stats.in_cycles_max = cyc;
+}
+
+/* explicit feedback for the iso out endpoint: bytes per frame in 10.14
+   format, from the measured rate of the ssc transmitter (clocked from
+   MCK, that is what drains the tx jitter buffer, not the received line
+   clock), plus a correction of the fill level of the jitter buffer so
+   that the host slowly brings it back to the target (one longword off:
+   1/16 byte per frame less or more) */
+static void
+sam4s_usb_iso_fb_sof()
+{
+	unsigned int ep = SAM4S_USB_EP_ISO_FB;
+	int err = e1_tx_fill_error();
+	uint32_t fb;
+
+	if (sam4s_usb_ep_state[ep] == SAM4S_USB_EP_SENDING)
+		return;
+
+	if (err > 64)
+		err = 64;
+	if (err < -64)
+		err = -64;
+
+	/* 16.16 bits -> 10.14 bytes */
+	fb = (e1_rate_get_tx() >> 5) - err * (1 << 10);
+
+	FDR_WR(&UDP->UDP_FDR[ep], fb);
+	FDR_WR(&UDP->UDP_FDR[ep], fb >> 8);
+	FDR_WR(&UDP->UDP_FDR[ep], fb >> 16);
+
+	sam4s_usb_ep_state[ep] = SAM4S_USB_EP_SENDING;
+	sam4s_usb_csr_set(ep, UDP_CSR_TXPKTRDY);
+	sam4s_usb_iso_stats.fb_pkts++;
+}
+
+/* iso out: E1 data to be transmitted goes straight from the fifo into
+   the jitter buffer in the ssc tx ring, see e1_tx.c */
+static void
+sam4s_usb_iso_out(unsigned int ep)
+{
+	uint32_t cyc = DWT->CYCCNT;
+	unsigned int rxbytecnt = RXBYTECNT(ep);
+	unsigned int nlw = rxbytecnt / 4;
+	unsigned int n;
+	uint32_t *p;
+
+	sam4s_usb_iso_stats.out_pkts++;
+
+	while (nlw) {
+		p = e1_tx_write_begin(&n);
+		if (!p)
+			break;
+		if (n > nlw)
+			n = nlw;
+		sam4s_usb_cp_lw_from_fdr(ep, p, n);
+		e1_tx_write_commit(n);
+		nlw -= n;
+	}
+
+	/* the bank is released by clearing RX_DATA_BKx, no need to
+	   read out the rest */
+	sam4s_usb_iso_stats.out_dropped += nlw * 4 + rxbytecnt % 4;
+
+	cyc = DWT->CYCCNT - cyc;
+	sam4s_usb_iso_stats.out_cycles += cyc;
+	if (cyc > sam4s_usb_iso_stats.out_cycles_max)
+		sam4s_usb_iso_stats.out_cycles_max = cyc;
+}
+
+/* hdlc frames on the bulk in endpoint: one transfer per frame, the
+   header (timeslot, channel, see sam4s_usb.h) followed by the frame
+   without the FCS, ended by a short (or zero length) packet. Called on
+   SOF, and on TXCOMP to send the rest of a frame right away. */
+static void
+sam4s_usb_hdlc_in()
+{
+	unsigned int ep = SAM4S_USB_EP_HDLC_IN;
+	unsigned int pkt = sam4s_usb_ep_fifo_size[ep];
+	const struct e1_hdlc_frame *f;
+	unsigned int n, len;
+
+	if (sam4s_usb_ep_state[ep] == SAM4S_USB_EP_SENDING)
+		return;
+	f = e1_hdlc_rx_peek();
+	if (!f)
+		return;
+
+	len = SAM4S_USB_HDLC_HDR_LEN + f->len;
+	n = len - sam4s_usb_hdlc_pos;
+	if (n > pkt)
+		n = pkt;
+
+	if (sam4s_usb_hdlc_pos == 0) {
+		FDR_WR(&UDP->UDP_FDR[ep], f->ts);
+		FDR_WR(&UDP->UDP_FDR[ep], f->ch);
+		sam4s_usb_cp_to_fdr(ep, f->data, n - SAM4S_USB_HDLC_HDR_LEN);
+	} else {
+		sam4s_usb_cp_to_fdr(ep,
+			f->data + sam4s_usb_hdlc_pos - SAM4S_USB_HDLC_HDR_LEN, n);
+	}
+	sam4s_usb_hdlc_pos += n;
+
+	/* the fifo has a copy, the ring slot can go */
+	if (n < pkt) {
+		e1_hdlc_rx_pop();
+		sam4s_usb_hdlc_pos = 0;
+	}
+
+	sam4s_usb_ep_state[ep] = SAM4S_USB_EP_SENDING;
+	sam4s_usb_csr_set(ep, UDP_CSR_TXPKTRDY);
+}
+
+/* hdlc frames from the host on the bulk out endpoint, one transfer per
+   frame: the header as on the way in, of which only the channel counts
+   (the timeslot octet is ignored), and the frame without the FCS. If the
+   queue of that channel is full, the bank is left in the fifo and the
+   endpoint interrupt disabled, so the host gets NAKs until
+   sam4s_usb_hdlc_out_sof() finds room again. Returns -1 in that case, 0
+   when the bank can be released. */
+static int
+sam4s_usb_hdlc_out(unsigned int ep)
+{
+	volatile uint32_t *fdr = &UDP->UDP_FDR[ep];
+	struct e1_hdlc_frame *f = sam4s_usb_hdlc_out_f;
+	unsigned int n;
+
+	if (sam4s_usb_hdlc_out_paused)
+		return -1;
+
+	/* unless we come back to a bank whose header has been read */
+	if (!sam4s_usb_hdlc_out_hdr) {
+		sam4s_usb_hdlc_out_rem = RXBYTECNT(ep);
+		sam4s_usb_hdlc_out_last =
+			sam4s_usb_hdlc_out_rem < sam4s_usb_ep_fifo_size[ep];
+	}
+
+	/* first packet of a frame */
+	if (!f && !sam4s_usb_hdlc_out_drop) {
+		if (!sam4s_usb_hdlc_out_hdr) {
+			if (sam4s_usb_hdlc_out_rem < SAM4S_USB_HDLC_HDR_LEN) {
+				sam4s_usb_hdlc_out_drop = 1;
+				goto done;
+			}
+			(void)FDR_RD(fdr); /* timeslot */
+			sam4s_usb_hdlc_out_ch = FDR_RD(fdr);
+			sam4s_usb_hdlc_out_rem -= SAM4S_USB_HDLC_HDR_LEN;
+			sam4s_usb_hdlc_out_hdr = 1;
+		}
+		if (sam4s_usb_hdlc_out_ch >= E1_HDLC_CHANNELS) {
+			TRACE("hdlc_out: bad channel", sam4s_usb_hdlc_out_ch, 0);
+			sam4s_usb_hdlc_out_hdr = 0;
+			sam4s_usb_hdlc_out_drop = 1;
+			goto done;
+		}
+		f = e1_hdlc_tx_write_begin(sam4s_usb_hdlc_out_ch);
+		if (!f) {
+			sam4s_usb_hdlc_out_paused = 1;
+			return -1;
+		}
+		sam4s_usb_hdlc_out_hdr = 0;
+		f->len = 0;
+		sam4s_usb_hdlc_out_f = f;
+	}
+
+	if (f) {
+		n = sam4s_usb_hdlc_out_rem;
+		/* too long, e1_hdlc_tx_write_commit() will refuse it */
+		if (f->len + n > E1_HDLC_MAX_LEN) {
+			f->len = E1_HDLC_MAX_LEN;
+			n = 0;
+		}
+		while (n--)
+			f->data[f->len++] = FDR_RD(fdr);
+	}
+
+done:
+	if (sam4s_usb_hdlc_out_last) {
+		if (f)
+			e1_hdlc_tx_write_commit(sam4s_usb_hdlc_out_ch);
+		sam4s_usb_hdlc_out_f = NULL;
+		sam4s_usb_hdlc_out_drop = 0;
+	}
+	return 0;
+}
+
+/* once per ms: let the endpoint interrupt try the waiting bank again */
+static void
+sam4s_usb_hdlc_out_sof()
+{
+	if (!sam4s_usb_hdlc_out_paused)
+		return;
+	sam4s_usb_hdlc_out_paused = 0;
+	UDP->UDP_IER = UDP_IxR_EPnINT(SAM4S_USB_EP_HDLC_OUT);
+}
+
+static void
+sam4s_usb_hdlc_reset()
+{
+	sam4s_usb_hdlc_pos = 0;
+	sam4s_usb_hdlc_out_f = NULL;
+	sam4s_usb_hdlc_out_hdr = 0;
+	sam4s_usb_hdlc_out_drop = 0;
+	sam4s_usb_hdlc_out_paused = 0;
+	UDP->UDP_IER = UDP_IxR_EPnINT(SAM4S_USB_EP_HDLC_OUT);
+}
+
+/* trace records on the bulk in endpoint, as many as fit into a packet,
+   a full packet is followed by a short (or zero length) one once there
+   is nothing left, so that the host sees the end of the transfer. Called
+   on SOF, and on TXCOMP while there is more. */
+static void
+sam4s_usb_trace_in()
+{
+	unsigned int ep = SAM4S_USB_EP_TRACE_IN;
+	unsigned int pkt = sam4s_usb_ep_fifo_size[ep];
+	struct trace_util_data d;
+	unsigned int n = 0;
+
+	if (sam4s_usb_ep_state[ep] == SAM4S_USB_EP_SENDING)
+		return;
+
+	while (n + sizeof(d) <= pkt && trace_util_read_usb(&d) == 0) {
+		sam4s_usb_cp_to_fdr(ep, (const unsigned char *)&d, sizeof(d));
+		n += sizeof(d);
+	}
+	if (!n && !sam4s_usb_trace_zlp)
+		return;
+	sam4s_usb_trace_zlp = (n == pkt);
+
+	sam4s_usb_ep_state[ep] = SAM4S_USB_EP_SENDING;
+	sam4s_usb_csr_set(ep, UDP_CSR_TXPKTRDY);
+}
+
+/* SET_CONFIGURATION: 1 is our only configuration, 0 unconfigures */
+static int
+sam4s_usb_set_configuration(unsigned int cfg)
+{
+	if (cfg > 1)
+		return -1;
+
+	if (cfg) {
+		UDP->UDP_GLB_STAT |= UDP_GLB_STAT_CONFG;
+		sam4s_usb_dev_state = SAM4S_USB_DEV_CONFIGURED;
+		/* start streaming with the double-frame received last */
+		sam4s_usb_iso_in_lw = (sam4s_ssc_rx_seq - 1) *
+			SAM4S_SSC_DBLFRM_LONGWORDS;
+		sam4s_usb_iso_in_frac = 0;
+		sam4s_usb_hdlc_reset();
+		e1_rate_init();
+		UDP->UDP_IER = UDP_IER_SOFINT;
+	} else {
+		UDP->UDP_IDR = UDP_IDR_SOFINT;
+		trace_util_usb(0);
+		UDP->UDP_GLB_STAT &= ~UDP_GLB_STAT_CONFG;
+		sam4s_usb_dev_state = SAM4S_USB_DEV_ADDRESSED;
+	}
+	return 0;
+}
+
+/*
+ * Control requests: sam4s_usb_ep0_reqs[] maps type, bRequest and direction
+ * to a handler. It runs once the setup packet and the data stage of an out
+ * request, up to SAM4S_USB_EP0_BUF bytes in sam4s_usb_ep0buf, have been
+ * received, and returns the length of the in data stage it has put into
+ * sam4s_usb_ep0buf (0 for out requests) or -1 to stall. Arguments in
+ * wValue and wIndex are checked by the handler.
+ */
+struct sam4s_usb_req {
+	uint8_t type;     /* BMREQUESTTYPE_TYPE_STD, _CLASS or _VENDOR */
+	uint8_t bRequest;
+	uint8_t dir;      /* BMREQUESTTYPE_DIR_DEV_TO_HOST or _HOST_TO_DEV */
+	int (*fn)();
+};
+
+static int
+sam4s_usb_std_get_status()
+{
+	uint16_t v = 0;
+	unsigned int ep;
+
+	if (sam4s_usb_ctrl.wValue != 0 || sam4s_usb_ctrl.wLength != 2) {
+		TRACE("ep0_setup, req/val/len invalid", 0, 0);
+		return -1;
+	}
+
+	switch (BMREQUESTTYPE_RECP(sam4s_usb_ctrl.bmRequestType)) {
+	case BMREQUESTTYPE_RECP_ENDP:
+		ep = sam4s_usb_ctrl.wIndex & 0x0f;
+		if (ep >= SAM4S_USB_NENDP)
+			return -1;
+		if (sam4s_usb_ep_state[ep] == SAM4S_USB_EP_STALLED)
+			v = 1;
+		break;
+	case BMREQUESTTYPE_RECP_DEV:
+		v = 0; /* could be REMOTEWAKEUP capable */
+		break;
+	case BMREQUESTTYPE_RECP_INTF:
+		v = 0;
+		break;
+	default:
+		return -1;
+	}
+	/* send back status */
+	sam4s_usb_ep0buf_len = 0;
+	SAM4S_USB_CP_EP0BUF_OBJ(v);
+	return sam4s_usb_ep0buf_len;
+}
+
+/* the address is only taken once the status stage is done, see
+   SAM4S_USB_EP_EP0_ADDRESS */
+static int
+sam4s_usb_std_set_address()
+{
+	TRACE("ep0_setup: set address", sam4s_usb_ctrl.wValue, 0);
+	sam4s_usb_devaddr = sam4s_usb_ctrl.wValue;
+	return 0;
+}
+
+static int
+sam4s_usb_std_get_descriptor()
+{
+	/* descriptor type */
+	uint8_t dt = sam4s_usb_ctrl.wValue >> 8;
+
+	sam4s_usb_ep0buf_len = 0;
+	TRACE("ep0_setup: descriptor type", dt, 0);
+	if (dt == LIBUSB_DT_DEVICE) {
+		SAM4S_USB_CP_EP0BUF_OBJ(sam4s_usb_descr_dev);
+	} else if (dt == LIBUSB_DT_CONFIG) {
+		/* build whole packet for host */
+		SAM4S_USB_CP_EP0BUF_OBJ(sam4s_usb_descr_cfg);
+		SAM4S_USB_CP_EP0BUF_OBJ(sam4s_usb_descr_int);
+		SAM4S_USB_CP_EP0BUF_OBJ(sam4s_usb_descr_ep1);
+		SAM4S_USB_CP_EP0BUF_OBJ(sam4s_usb_descr_ep2);
+		SAM4S_USB_CP_EP0BUF_OBJ(sam4s_usb_descr_ep3);
+		SAM4S_USB_CP_EP0BUF_OBJ(sam4s_usb_descr_ep4);
+		SAM4S_USB_CP_EP0BUF_OBJ(sam4s_usb_descr_ep5);
+		SAM4S_USB_CP_EP0BUF_OBJ(sam4s_usb_descr_ep6);
+	} else {
+		return -1; /* error -> stall */
+	}
+	return sam4s_usb_ep0buf_len;
+}
+
+static int
+sam4s_usb_std_get_configuration()
+{
+	sam4s_usb_ep0buf[0] = (sam4s_usb_dev_state == SAM4S_USB_DEV_CONFIGURED);
+	return 1;
+}
+
+static int
+sam4s_usb_std_set_configuration()
+{
+	TRACE("ep0_setup: set configuration", sam4s_usb_ctrl.wValue, 0);
+	return sam4s_usb_set_configuration(sam4s_usb_ctrl.wValue);
+}
+
+/* vendor requests, see sam4s_usb.h */
+
+static int
+sam4s_usb_vreq_set_ts_mask()
+{
+	/* restart the iso in stream in the new format */
+	e1_demux_set_mask(sam4s_usb_ctrl.wValue |
+		((uint32_t)sam4s_usb_ctrl.wIndex << 16));
+	sam4s_usb_iso_in_grp = e1_demux_seq;
+	sam4s_usb_iso_in_lw = (sam4s_ssc_rx_seq - 1) *
+		SAM4S_SSC_DBLFRM_LONGWORDS;
+	return 0;
+}
+
+static int
+sam4s_usb_vreq_set_hdlc_ts()
+{
+	return e1_hdlc_set_ts(sam4s_usb_ctrl.wIndex, sam4s_usb_ctrl.wValue);
+}
+
+static int
+sam4s_usb_vreq_set_tx_target()
+{
+	return e1_tx_set_target(sam4s_usb_ctrl.wValue);
+}
+
+static int
+sam4s_usb_vreq_set_tx_conceal()
+{
+	e1_tx_set_conceal(sam4s_usb_ctrl.wValue |
+		((uint32_t)sam4s_usb_ctrl.wIndex << 16));
+	return 0;
+}
+
+static int
+sam4s_usb_vreq_set_trace()
+{
+	trace_util_usb(sam4s_usb_ctrl.wValue != 0);
+	return 0;
+}
+
+static int
+sam4s_usb_vreq_get_irq_stats()
+{
+	struct sam4s_irq_stats st;
+
+	if (sam4s_usb_ctrl.wValue >= SAM4S_IRQ_NUM || sam4s_usb_ctrl.wIndex >= 2)
+		return -1;
+	sam4s_irq_get_stats(sam4s_usb_ctrl.wValue, &st);
+	memcpy(sam4s_usb_ep0buf, sam4s_usb_ctrl.wIndex ? &st.dur :
+		&st.lat, sizeof(st.lat));
+	return sizeof(st.lat);
+}
+
+static int
+sam4s_usb_vreq_get_prof()
+{
+	struct prof_util_report r;
+
+	if (sam4s_usb_ctrl.wValue >= PROF_UTIL_SITES)
+		return -1;
+	prof_util_get_report(sam4s_usb_ctrl.wValue, &r);
+	memcpy(sam4s_usb_ep0buf, &r, sizeof(r));
+	return sizeof(r);
+}
+
+_Static_assert(sizeof(struct stats_util_block) <= SAM4S_USB_EP0_BUF,
+	"statistics block does not fit into one control transfer");
+
+static int
+sam4s_usb_vreq_get_stats()
+{
+	return stats_util_read(sam4s_usb_ctrl.wIndex, sam4s_usb_ep0buf,
+		sizeof(sam4s_usb_ep0buf));
+}
+
+static int
+sam4s_usb_vreq_get_ts0()
+{
+	struct sam4s_usb_ts0_hdr h;
+	unsigned int seq = e1_ts0_rx_seq;
+	unsigned int n = (uint16_t)(seq - sam4s_usb_ctrl.wIndex);
+	unsigned int max = 0, i;
+
+	/* the one after seq-1 is being written */
+	if (n > E1_TS0_RX_MF - 1)
+		n = E1_TS0_RX_MF - 1;
+	if (sam4s_usb_ctrl.wLength > sizeof(h))
+		max = (sam4s_usb_ctrl.wLength - sizeof(h)) /
+			sizeof(struct e1_ts0_mf);
+	if (n > max)
+		n = max;
+
+	h.seq = seq;
+	h.n = n;
+	h.tx_room = e1_ts0_tx_room();
+	h.rai = !!(e1_ts0_rx_buf[(seq - 1) % E1_TS0_RX_MF].flags &
+		E1_TS0_MF_RAI);
+
+	sam4s_usb_ep0buf_len = 0;
+	SAM4S_USB_CP_EP0BUF_OBJ(h);
+	for (i=seq-n; i!=seq; i++)
+		SAM4S_USB_CP_EP0BUF_OBJ(e1_ts0_rx_buf[i % E1_TS0_RX_MF]);
+	return sam4s_usb_ep0buf_len;
+}
+
+static int
+sam4s_usb_vreq_set_ts0()
+{
+	if (sam4s_usb_ctrl.wLength % sizeof(struct e1_ts0_mf))
+		return -1;
+	return e1_ts0_tx_write((const struct e1_ts0_mf *)sam4s_usb_ep0buf,
+		sam4s_usb_ctrl.wLength / sizeof(struct e1_ts0_mf),
+		sam4s_usb_ctrl.wValue == 1);
+}
+
+_Static_assert(sizeof(struct sam4s_usb_ts0_hdr) + (E1_TS0_RX_MF - 1) *
+	sizeof(struct e1_ts0_mf) <= SAM4S_USB_EP0_BUF,
+	"received multiframes do not fit into one control transfer");
+
+/* there are no class requests, the interface is vendor specific */
+static const struct sam4s_usb_req sam4s_usb_ep0_reqs[] = {
+	{ BMREQUESTTYPE_TYPE_STD, BREQUEST_STD_GETSTATUS,
+	  BMREQUESTTYPE_DIR_DEV_TO_HOST, sam4s_usb_std_get_status },
+	{ BMREQUESTTYPE_TYPE_STD, BREQUEST_STD_SET_ADDRESS,
+	  BMREQUESTTYPE_DIR_HOST_TO_DEV, sam4s_usb_std_set_address },
+	{ BMREQUESTTYPE_TYPE_STD, BREQUEST_STD_GET_DESCRIPTOR,
+	  BMREQUESTTYPE_DIR_DEV_TO_HOST, sam4s_usb_std_get_descriptor },
+	{ BMREQUESTTYPE_TYPE_STD, BREQUEST_STD_GET_CONFIGURATIOn,
+	  BMREQUESTTYPE_DIR_DEV_TO_HOST, sam4s_usb_std_get_configuration },
+	{ BMREQUESTTYPE_TYPE_STD, BREQUEST_STD_SET_CONFIGURATIOn,
+	  BMREQUESTTYPE_DIR_HOST_TO_DEV, sam4s_usb_std_set_configuration },
+	{ BMREQUESTTYPE_TYPE_VENDOR, SAM4S_USB_VREQ_SET_TS_MASK,
+	  BMREQUESTTYPE_DIR_HOST_TO_DEV, sam4s_usb_vreq_set_ts_mask },
+	{ BMREQUESTTYPE_TYPE_VENDOR, SAM4S_USB_VREQ_SET_HDLC_TS,
+	  BMREQUESTTYPE_DIR_HOST_TO_DEV, sam4s_usb_vreq_set_hdlc_ts },
+	{ BMREQUESTTYPE_TYPE_VENDOR, SAM4S_USB_VREQ_SET_TRACE,
+	  BMREQUESTTYPE_DIR_HOST_TO_DEV, sam4s_usb_vreq_set_trace },
+	{ BMREQUESTTYPE_TYPE_VENDOR, SAM4S_USB_VREQ_GET_IRQ_STATS,
+	  BMREQUESTTYPE_DIR_DEV_TO_HOST, sam4s_usb_vreq_get_irq_stats },
+	{ BMREQUESTTYPE_TYPE_VENDOR, SAM4S_USB_VREQ_GET_PROF,
+	  BMREQUESTTYPE_DIR_DEV_TO_HOST, sam4s_usb_vreq_get_prof },
+	{ BMREQUESTTYPE_TYPE_VENDOR, SAM4S_USB_VREQ_GET_STATS,
+	  BMREQUESTTYPE_DIR_DEV_TO_HOST, sam4s_usb_vreq_get_stats },
+	{ BMREQUESTTYPE_TYPE_VENDOR, SAM4S_USB_VREQ_GET_TS0,
+	  BMREQUESTTYPE_DIR_DEV_TO_HOST, sam4s_usb_vreq_get_ts0 },
+	{ BMREQUESTTYPE_TYPE_VENDOR, SAM4S_USB_VREQ_SET_TS0,
+	  BMREQUESTTYPE_DIR_HOST_TO_DEV, sam4s_usb_vreq_set_ts0 },
+	{ BMREQUESTTYPE_TYPE_VENDOR, SAM4S_USB_VREQ_SET_TX_TARGET,
+	  BMREQUESTTYPE_DIR_HOST_TO_DEV, sam4s_usb_vreq_set_tx_target },
+	{ BMREQUESTTYPE_TYPE_VENDOR, SAM4S_USB_VREQ_SET_TX_CONCEAL,
+	  BMREQUESTTYPE_DIR_HOST_TO_DEV, sam4s_usb_vreq_set_tx_conceal },
+};
+
+#define SAM4S_USB_EP0_NREQS \
+	(sizeof(sam4s_usb_ep0_reqs) / sizeof(sam4s_usb_ep0_reqs[0]))
+
+/* entry for the request in sam4s_usb_ctrl, or NULL */
+static const struct sam4s_usb_req *
+sam4s_usb_ep0_find()
+{
+	uint8_t t = sam4s_usb_ctrl.bmRequestType;
+	unsigned int i;
+
+	for (i=0; i<SAM4S_USB_EP0_NREQS; i++) {
+		const struct sam4s_usb_req *r = &sam4s_usb_ep0_reqs[i];
+
+		if (r->bRequest == sam4s_usb_ctrl.bRequest &&
+		    r->type == BMREQUESTTYPE_TYPE(t) &&
+		    r->dir == BMREQUESTTYPE_DIR(t))
+			return r;
+	}
+	return NULL;
+}
+
+static void
+sam4s_usb_ep0_stall()
+{
+	TRACE("ep0_setup stall", 0, 0);
+	sam4s_usb_ep_state[0] = SAM4S_USB_EP_STALLED;
+	sam4s_usb_csr_set(0, UDP_CSR_FORCESTALL);
+}
+
 /* go either in the addressed (addr==0) or default (addr!=0)
    state, see state diagram §40.6.3, Fig 40-14 USB Device State Diagram */
 static void
@@ -233,12 +1146,43 @@ sam4s_usb_setaddr(unsigned int addr)
 	}
 }
 
+/* next packet of the in data stage, from sam4s_usb_ep0_pos on. The
+   endpoint stays in SAM4S_USB_EP_SENDING while there is more to send,
+   including the zero length packet that has to end a full last packet
+   when the host asked for more. The status stage of an out request, and
+   an empty in data stage, is a single zero length packet. */
+static void
+sam4s_usb_ep0_in()
+{
+	unsigned int pkt = sam4s_usb_ep_fifo_size[0];
+	unsigned int n = sam4s_usb_ep0buf_len - sam4s_usb_ep0_pos;
+
+	if (n > pkt)
+		n = pkt;
+	sam4s_usb_cp_to_fdr(0, sam4s_usb_ep0buf + sam4s_usb_ep0_pos, n);
+	sam4s_usb_ep0_pos += n;
+
+	if (sam4s_usb_ep0_pos < sam4s_usb_ep0buf_len ||
+	    (n == pkt && sam4s_usb_ep0buf_len < sam4s_usb_ctrl.wLength))
+		sam4s_usb_ep_state[0] = SAM4S_USB_EP_SENDING;
+	else if (BMREQUESTTYPE_TYPE(sam4s_usb_ctrl.bmRequestType) ==
+		 BMREQUESTTYPE_TYPE_STD &&
+		 sam4s_usb_ctrl.bRequest == BREQUEST_STD_SET_ADDRESS)
+		sam4s_usb_ep_state[0] = SAM4S_USB_EP_EP0_ADDRESS;
+	else
+		sam4s_usb_ep_state[0] = SAM4S_USB_EP_EP0_STATUS_IN;
+
+	sam4s_usb_csr_set(0, UDP_CSR_TXPKTRDY);
+	TRACE("ep0_setup write", n, sam4s_usb_ep0_pos);
+}
+
 /* handler for when we have recveived a SETUP transaction on our control
-   endpoint, *or* the SETUP transaction followed by a data-out transfer
+   endpoint, *or* the SETUP transaction followed by the data-out stage
    the payload of which we have stored in sam4s_usb_ep0buf */
 static void
 sam4s_usb_handle_ep0_setup() {
-	int wrlen = 0;   /* set to -1 to stall */
+	const struct sam4s_usb_req *r;
+	int wrlen;
 
 	TRACE("\033[33;1mep0_setup\033[0m",
 		sam4s_usb_ctrl.bmRequestType << 24|
@@ -248,97 +1192,24 @@ sam4s_usb_handle_ep0_setup() {
 		sam4s_usb_ctrl.wLength
 	);
 
-	/* only handle standard requests for now! */
-	if (BMREQUESTTYPE_TYPE(sam4s_usb_ctrl.bmRequestType) !=
-	    BMREQUESTTYPE_TYPE_STD
-	) {
-		TRACE("ep0_setup, type != STD",0,0);
-		goto out;
-	}
-
-	if (sam4s_usb_ctrl.bRequest == BREQUEST_STD_GETSTATUS) {
-		if (sam4s_usb_ctrl.wValue != 0 ||
-		    sam4s_usb_ctrl.wLength != 2
-		) {
-			TRACE("ep0_setup, req/val/len invalid", 0, 0);
-			wrlen = -1;
-		} else {
-			uint16_t ep = 0, v;
-
-			switch (BMREQUESTTYPE_RECP(sam4s_usb_ctrl.bmRequestType)) {
-			case BMREQUESTTYPE_RECP_ENDP:
-				ep = sam4s_usb_ctrl.wIndex;
-				if (ep >= SAM4S_USB_NENDP)
-					ep = 0;
-				if (sam4s_usb_ep_state[ep] == SAM4S_USB_EP_STALLED)
-					v = 1;
-				break;
-			case BMREQUESTTYPE_RECP_DEV:
-				v = 0; /* could be REMOTEWAKEUP capable */
-				break;
-			case BMREQUESTTYPE_RECP_INTF:
-				v = 0;
-				break;
-			}
-			/* send back status */
-			sam4s_usb_ep0buf_len = 0;
-			SAM4S_USB_CP_EP0BUF_OBJ(v);
-			wrlen = sizeof(v);
-		}
-	} else if (sam4s_usb_ctrl.bRequest == BREQUEST_STD_CLEAR_FEATURE) {
-		TRACE("ep0_setup: clear feature", 0, 0);
-		wrlen = -1;
-		/* TODO */
-	} else if (sam4s_usb_ctrl.bRequest == BREQUEST_STD_SET_FEATURE) {
-		TRACE("ep0_setup: set feature", 0, 0);
-		wrlen = -1;
-		/* TODO */
-	} else if (sam4s_usb_ctrl.bRequest == BREQUEST_STD_SET_ADDRESS) {
-		TRACE("ep0_setup: set address", sam4s_usb_ctrl.wValue, 0);
-		sam4s_usb_devaddr = sam4s_usb_ctrl.wValue;
-	} else if (sam4s_usb_ctrl.bRequest == BREQUEST_STD_GET_DESCRIPTOR) {
-		/* descriptor type */
-		uint8_t dt = sam4s_usb_ctrl.wValue >> 8;
-		sam4s_usb_ep0buf_len = 0;
-		TRACE("ep0_setup: descriptor type", dt, 0);
-		if (dt == LIBUSB_DT_DEVICE) {
-			SAM4S_USB_CP_EP0BUF_OBJ(sam4s_usb_descr_dev);
-			wrlen = sam4s_usb_ep0buf_len;
-		} else if (dt == LIBUSB_DT_CONFIG) {
-			/* build whole packet for host */
-			SAM4S_USB_CP_EP0BUF_OBJ(sam4s_usb_descr_cfg);
-			SAM4S_USB_CP_EP0BUF_OBJ(sam4s_usb_descr_int);
-			SAM4S_USB_CP_EP0BUF_OBJ(sam4s_usb_descr_ep1);
-			SAM4S_USB_CP_EP0BUF_OBJ(sam4s_usb_descr_ep2);
-			wrlen = sam4s_usb_ep0buf_len;
-		} else {
-			wrlen = -1; /* error -> stall */
-		}
-	} else {
-		/* not handled, stall endpoint */
-		wrlen = -1;
-	}
-
-out:
+	r = sam4s_usb_ep0_find();
+	wrlen = r ? r->fn() : -1;
 	if (wrlen == -1) {
-		TRACE("ep0_setup stall", wrlen, 0);
-		sam4s_usb_ep_state[0] = SAM4S_USB_EP_STALLED;
-		sam4s_usb_csr_set(0, UDP_CSR_FORCESTALL);
+		sam4s_usb_ep0_stall();
 		return;
 	}
 
-	if (sam4s_usb_ctrl.bRequest == BREQUEST_STD_SET_ADDRESS)
-		sam4s_usb_ep_state[0] = SAM4S_USB_EP_EP0_ADDRESS;
-	else
-		sam4s_usb_ep_state[0] = SAM4S_USB_EP_EP0_STATUS_IN;
-
-	if (wrlen > sam4s_usb_ctrl.wLength)
+	/* out requests have their data stage behind them, only the
+	   status is left */
+	if (BMREQUESTTYPE_DIR(sam4s_usb_ctrl.bmRequestType) ==
+	    BMREQUESTTYPE_DIR_HOST_TO_DEV)
+		wrlen = 0;
+	else if (wrlen > sam4s_usb_ctrl.wLength)
 		wrlen = sam4s_usb_ctrl.wLength;
 
-	/* transmit packet */
-	sam4s_usb_cp_to_fdr(0, sam4s_usb_ep0buf, wrlen);
-	sam4s_usb_csr_set(0, UDP_CSR_TXPKTRDY);
-	TRACE("ep0_setup write", wrlen, 0);
+	sam4s_usb_ep0buf_len = wrlen;
+	sam4s_usb_ep0_pos = 0;
+	sam4s_usb_ep0_in();
 }
 
 /* this is the main handler for data reception, which is double buffered
@@ -346,20 +1217,41 @@ out:
 static void
 sam4s_usb_handle_bankint(unsigned int ep, int bank)
 {
-	TRACE("\033[31;1mhandle_bankint\033[0m", UDP->UDP_CSR[ep],
-		(bank << 31)|(ep << 24)|
-		(sam4s_usb_ep_state[ep] << 16) |
-		RXBYTECNT(ep));
+	int last = 0; /* end of the data stage of a control request */
+
+	if (ep != SAM4S_USB_EP_ISO_OUT) /* once per ms, too noisy */
+		TRACE("\033[31;1mhandle_bankint\033[0m", UDP->UDP_CSR[ep],
+			(bank << 31)|(ep << 24)|
+			(sam4s_usb_ep_state[ep] << 16) |
+			RXBYTECNT(ep));
 
 	/* normal payload */
-	if (sam4s_usb_ep_state[ep] == SAM4S_USB_EP_IDLE) {
+	if (ep == SAM4S_USB_EP_ISO_OUT) {
+		sam4s_usb_iso_out(ep);
+	} else if (ep == SAM4S_USB_EP_HDLC_OUT) {
+		if (sam4s_usb_hdlc_out(ep) == -1) {
+			/* bank stays in the fifo, see sam4s_usb_hdlc_out() */
+			UDP->UDP_IDR = UDP_IxR_EPnINT(ep);
+			return;
+		}
+	} else if (sam4s_usb_ep_state[ep] == SAM4S_USB_EP_IDLE) {
 		sam4s_usb_cp_from_fdr(ep, NULL, 0);
 		/* TODO: what to do with the data?! */
 	/* control transfer with additional data received */
 	} else if (sam4s_usb_ep_state[ep] == SAM4S_USB_EP_EP0_DATA_OUT) {
-		sam4s_usb_ep0buf_len = sam4s_usb_cp_from_fdr(ep,
-					sam4s_usb_ep0buf,
-					sizeof(sam4s_usb_ep0buf));
+		/* a short packet ends the data stage early */
+		if (RXBYTECNT(ep) < sam4s_usb_ep_fifo_size[ep])
+			last = 1;
+		sam4s_usb_ep0buf_len += sam4s_usb_cp_from_fdr(ep,
+			sam4s_usb_ep0buf + sam4s_usb_ep0buf_len,
+			sam4s_usb_ctrl.wLength - sam4s_usb_ep0buf_len);
+		if (sam4s_usb_ep0buf_len == sam4s_usb_ctrl.wLength)
+			last = 1;
+	} else if (ep == 0 && sam4s_usb_ep_state[ep] == SAM4S_USB_EP_SENDING) {
+		/* the host ended the in data stage with the status stage */
+		sam4s_usb_cp_from_fdr(ep, NULL, 0);
+		sam4s_usb_csr_clr(ep, UDP_CSR_TXPKTRDY);
+		sam4s_usb_ep_state[ep] = SAM4S_USB_EP_IDLE;
 	} else {
 		/* TODO */
 	}
@@ -367,9 +1259,11 @@ sam4s_usb_handle_bankint(unsigned int ep, int bank)
 	sam4s_usb_lastbank[ep] = bank; /* remember used bank, clr irq flag */
 	sam4s_usb_csr_clr(ep, bank ? UDP_CSR_RX_DATA_BK1 : UDP_CSR_RX_DATA_BK0);
 
-	/* in case it was a control request with addtln data, process... */
-	if (sam4s_usb_ep_state[ep] == SAM4S_USB_EP_EP0_DATA_OUT)
+	/* control request with all of its data, process and send status */
+	if (last) {
+		sam4s_usb_csr_set(ep, UDP_CSR_DIR); /* in */
 		sam4s_usb_handle_ep0_setup();
+	}
 }
 
 /* interrupt handler for the endpoint */
@@ -386,21 +1280,26 @@ sam4s_usb_handle_epint(unsigned int ep)
 
 	/* Data IN transaction is achieved, acknowledged by the Host */
 	if (csr & UDP_CSR_TXCOMP) { /* transmission has completed */
-		TRACE("\033[34;1mhandle_epint/TXCOMP\033[0m",csr,
-			(ep<<24) | (*state << 16));
+		if (ep != SAM4S_USB_EP_ISO_IN && ep != SAM4S_USB_EP_ISO_FB &&
+		    ep != SAM4S_USB_EP_HDLC_IN && ep != SAM4S_USB_EP_TRACE_IN)
+			/* once per ms, too noisy */
+			TRACE("\033[34;1mhandle_epint/TXCOMP\033[0m",csr,
+				(ep<<24) | (*state << 16));
 		sam4s_usb_csr_clr(ep, UDP_CSR_TXCOMP);
 
 		/* completion of a normal write request, or status for ctrl transfer */
-		if (*state == SAM4S_USB_EP_SENDING ||
-		    *state == SAM4S_USB_EP_EP0_STATUS_IN
-		) {
-			/* ... */
-		} else if (*state == SAM4S_USB_EP_EP0_ADDRESS) {
-			sam4s_usb_setaddr(sam4s_usb_devaddr);
+		if (ep == 0 && *state == SAM4S_USB_EP_SENDING) {
+			sam4s_usb_ep0_in(); /* more of the data stage */
 		} else {
-			/* error, unexpected state! */
+			if (*state == SAM4S_USB_EP_EP0_ADDRESS)
+				sam4s_usb_setaddr(sam4s_usb_devaddr);
+			*state = SAM4S_USB_EP_IDLE;
 		}
-		*state = SAM4S_USB_EP_IDLE;
+
+		if (ep == SAM4S_USB_EP_HDLC_IN)
+			sam4s_usb_hdlc_in();
+		if (ep == SAM4S_USB_EP_TRACE_IN)
+			sam4s_usb_trace_in();
 	}
 
 	/* in case both banks have data, we have to choose the order
@@ -442,16 +1341,27 @@ sam4s_usb_handle_epint(unsigned int ep)
 		sam4s_usb_cp_from_fdr(0, (unsigned char*)&sam4s_usb_ctrl,
 			sizeof(sam4s_usb_ctrl));
 
+		/* a new setup aborts a data stage still in progress */
+		if (*state == SAM4S_USB_EP_SENDING)
+			sam4s_usb_csr_clr(ep, UDP_CSR_TXPKTRDY);
+
 		/* out request, bmRequestType.D7 == 0, i.e. host->device
 		   with additional data, so we have to wait..*/
 		if ((BMREQUESTTYPE_DIR(sam4s_usb_ctrl.bmRequestType) ==
 			BMREQUESTTYPE_DIR_HOST_TO_DEV) &&
 			sam4s_usb_ctrl.wLength > 0
 		){
-			/* we will receive additional data */
-			sam4s_usb_ep_state[ep] = SAM4S_USB_EP_EP0_DATA_OUT;
 			sam4s_usb_csr_clr(ep, UDP_CSR_DIR); /* out */
 			sam4s_usb_csr_clr(ep, UDP_CSR_RXSETUP);
+			/* nobody would take the data, or it does not fit */
+			if (!sam4s_usb_ep0_find() ||
+			    sam4s_usb_ctrl.wLength > sizeof(sam4s_usb_ep0buf)) {
+				sam4s_usb_ep0_stall();
+				return;
+			}
+			/* we will receive additional data */
+			sam4s_usb_ep_state[ep] = SAM4S_USB_EP_EP0_DATA_OUT;
+			sam4s_usb_ep0buf_len = 0;
 		} else {
 			/* out request without additional data, or a request
 			   to send in data, which we process immediately */
@@ -470,7 +1380,9 @@ UDP_Handler()
 	uint32_t isr;
 	uint32_t irq_pending;
 	unsigned int i;
+	uint32_t t0 = sam4s_irq_enter();
 
+	sam4s_seqlock_write_begin(&sam4s_usb_seqlock);
 	while (1) {
 		isr = UDP->UDP_ISR;
 		irq_pending = isr & UDP->UDP_IMR;
@@ -491,8 +1403,16 @@ UDP_Handler()
 
 		/* start of frame */
 		if (irq_pending & UDP_ISR_SOFINT) {
-			TRACE("\033[36mUDP_Handler/SOFINT\033[0m", isr, irq_pending);
 			UDP->UDP_ICR = UDP_ICR_SOFINT;
+			if (sam4s_usb_dev_state == SAM4S_USB_DEV_CONFIGURED) {
+				e1_rate_sof((UDP->UDP_FRM_NUM & UDP_FRM_NUM_FRM_NUM_Msk)
+					>> UDP_FRM_NUM_FRM_NUM_Pos);
+				sam4s_usb_iso_in_sof();
+				sam4s_usb_iso_fb_sof();
+				sam4s_usb_hdlc_in();
+				sam4s_usb_hdlc_out_sof();
+				sam4s_usb_trace_in();
+			}
 			break;
 		}
 
@@ -514,21 +1434,35 @@ UDP_Handler()
 
 			sam4s_usb_dev_state = SAM4S_USB_DEV_DEFAULT;
 			UDP->UDP_ICR = UDP_ICR_ENDBUSRES;
+			UDP->UDP_IDR = UDP_IDR_SOFINT; /* until configured */
 		
-			UDP->UDP_RST_EP = (1<<0)|(1<<4)|(1<<5); /* reset... */
+			UDP->UDP_RST_EP = (1<<0)|(1<<1)|(1<<2)|(1<<4)|(1<<5)|(1<<6)|(1<<7); /* reset... */
 
 			/* configure endpoint 0 as control endpoint */
-			/* 4 is isochronous in, 5 is isochronous out */
+			/* 1 and 2 are bulk in and out for hdlc frames,
+			   4 is isochronous in, 5 is isochronous out,
+			   6 is the feedback for 5, 7 bulk in for the trace */
 			UDP->UDP_CSR[0] = (UDP_CSR_EPTYPE_CTRL | UDP_CSR_EPEDS);
+			UDP->UDP_CSR[1] = (UDP_CSR_EPTYPE_BULK_IN | UDP_CSR_EPEDS);
+			UDP->UDP_CSR[2] = (UDP_CSR_EPTYPE_BULK_OUT | UDP_CSR_EPEDS);
 			UDP->UDP_CSR[4] = (UDP_CSR_EPTYPE_ISO_IN | UDP_CSR_EPEDS);
 			UDP->UDP_CSR[5] = (UDP_CSR_EPTYPE_ISO_OUT | UDP_CSR_EPEDS);
+			UDP->UDP_CSR[6] = (UDP_CSR_EPTYPE_ISO_IN | UDP_CSR_EPEDS);
+			UDP->UDP_CSR[7] = (UDP_CSR_EPTYPE_BULK_IN | UDP_CSR_EPEDS);
 
 			sam4s_usb_ep_state[0] = SAM4S_USB_EP_IDLE;
+			sam4s_usb_ep_state[1] = SAM4S_USB_EP_IDLE;
+			sam4s_usb_ep_state[2] = SAM4S_USB_EP_IDLE;
+			sam4s_usb_hdlc_reset();
 			sam4s_usb_ep_state[4] = SAM4S_USB_EP_IDLE;
 			sam4s_usb_ep_state[5] = SAM4S_USB_EP_IDLE;
+			sam4s_usb_ep_state[6] = SAM4S_USB_EP_IDLE;
+			sam4s_usb_ep_state[7] = SAM4S_USB_EP_IDLE;
+			sam4s_usb_trace_zlp = 0;
+			trace_util_usb(0);
 
 			UDP->UDP_RST_EP = 0;      /* clear reset flag */
-			UDP->UDP_IER = (1<<0)|(1<<4)|(1<<5); /* enable interrupts */
+			UDP->UDP_IER = (1<<0)|(1<<1)|(1<<2)|(1<<4)|(1<<5)|(1<<6)|(1<<7); /* enable interrupts */
 
 			break;
 		}
@@ -542,6 +1476,8 @@ UDP_Handler()
 			break;
 		}
 	}
+	sam4s_seqlock_write_end(&sam4s_usb_seqlock);
+	sam4s_irq_exit(SAM4S_IRQ_UDP, t0, SAM4S_IRQ_LAT_UNKNOWN);
 }
 
 void
@@ -551,6 +1487,10 @@ sam4s_usb_init()
 
 	NVIC_DisableIRQ(UDP_IRQn);
 
+	/* cycle counter for the fifo timing in the iso statistics */
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
 	UDP->UDP_TXVC = UDP_TXVC_TXVDIS; /* disable transceiver, disable pullups */
 	UDP->UDP_IDR = UDP->UDP_ISR; /* disable all interrupts */
 	UDP->UDP_ICR = UDP->UDP_ISR; /* acknowledge all interrupts */
@@ -573,7 +1513,6 @@ sam4s_usb_init()
 
 	/* now we should get a end-of-busreset interrupt */
 
-	NVIC_SetPriority (UDP_IRQn, 1);
 	NVIC_EnableIRQ(UDP_IRQn);
 
 }
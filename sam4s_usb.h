@@ -1,7 +1,96 @@
 #ifndef SAM4S_USB_H
 #define SAM4S_USB_H
 
+#include <stdint.h>
+
+struct sam4s_usb_iso_stats {
+	unsigned int in_pkts;     /* iso in packets queued */
+	unsigned int in_lw;       /* ... containing that many longwords */
+	unsigned int in_dropped;  /* longwords overwritten before sent */
+	unsigned int in_gap;      /* longwords not sent, lost by the ssc */
+	unsigned int in_busy;     /* SOF with previous packet still pending */
+	unsigned int out_pkts;    /* iso out packets received */
+	unsigned int out_dropped; /* ... bytes of those not taken by e1_tx */
+	unsigned int fb_pkts;     /* feedback packets queued */
+	/* cpu cycles spent moving the iso packets to/from the fifo */
+	unsigned int in_cycles, in_cycles_max;
+	unsigned int out_cycles, out_cycles_max;
+};
+
+/* vendor requests on ep0, data stages of up to 2 kB */
+/* host to device, no data: iso in carries only the timeslots set in
+   wValue (0..15) and wIndex (16..31) in the layout of e1_demux.h,
+   all zero for raw double-frames */
+#define SAM4S_USB_VREQ_SET_TS_MASK 0x01
+/* host to device, no data: hdlc channel wIndex receives and sends on
+   timeslot wValue (0: off), frames go to the bulk in endpoint 1 and come
+   from the bulk out endpoint 2, see e1_hdlc.h */
+#define SAM4S_USB_VREQ_SET_HDLC_TS 0x02
+
+/* each hdlc frame on the bulk endpoints is one transfer of this header
+   and the frame without the FCS. In: the timeslot it was received on
+   and the channel. Out: the same, the timeslot octet is ignored (the
+   channel sends on the one set with SET_HDLC_TS), so a received frame
+   can be sent back unchanged */
+#define SAM4S_USB_HDLC_HDR_TS  0
+#define SAM4S_USB_HDLC_HDR_CH  1
+#define SAM4S_USB_HDLC_HDR_LEN 2
+/* host to device, no data: wValue 1 sends the trace records (struct
+   trace_util_data, little endian) to the bulk in endpoint 7 instead of
+   the console, 0 switches back to the console */
+#define SAM4S_USB_VREQ_SET_TRACE 0x03
+/* device to host: struct sam4s_irq_hist (little endian) of the handler
+   wValue (enum sam4s_irq_id), wIndex 0 for the latency, 1 for the
+   duration histogram, see sam4s_irq.h */
+#define SAM4S_USB_VREQ_GET_IRQ_STATS 0x04
+/* device to host: struct prof_util_report (little endian) of the last
+   one second window of site wValue (enum prof_util_site), see
+   prof_util.h */
+#define SAM4S_USB_VREQ_GET_PROF 0x05
+/* device to host: struct stats_util_block (little endian) from offset
+   wIndex on, up to wLength bytes. Offset 0 takes a new snapshot, further
+   offsets continue in the same one, see stats_util.h */
+#define SAM4S_USB_VREQ_GET_STATS 0x06
+/* device to host: struct sam4s_usb_ts0_hdr and the received A/Sa bits
+   (struct e1_ts0_mf) of up to n multiframes, the oldest one first,
+   starting with the one whose seq is wIndex modulo 2^16 if it is still
+   there, see e1_ts0.h */
+#define SAM4S_USB_VREQ_GET_TS0 0x07
+/* host to device: the data stage, struct e1_ts0_mf of whole multiframes,
+   is queued for transmission, wValue 1 drops what is queued before.
+   Stalls if there is no room for all of it */
+#define SAM4S_USB_VREQ_SET_TS0 0x08
+/* host to device, no data: the tx jitter buffer fills up to wValue
+   double-frames after an underrun (default E1_TX_JBUF_TARGET). Stalls
+   if that is out of range, see e1_tx.h */
+#define SAM4S_USB_VREQ_SET_TX_TARGET 0x09
+/* host to device, no data: on a tx underrun, the timeslots set in wValue
+   (0..15) and wIndex (16..31) repeat the previous double-frame, the
+   others send 0xff (the default, all zero) */
+#define SAM4S_USB_VREQ_SET_TX_CONCEAL 0x0a
+
+/* every iso in packet starts with this header, little endian, then the
+   E1 data. pos is where that starts in the stream. Raw: the longword,
+   pos % 16 == 0 is the first one of a double-frame (with the FAS once
+   aligned, see e1_align.h). Timeslots: the group of 4 frames, see
+   e1_demux.h. Only what has been received is sent, a pos beyond the end
+   of the previous packet is a gap (the ssc lost double-frames, the host
+   did not pick up the packets in time, or one was lost on the bus).
+   Both counts wrap at 2^32 and go on across a new configuration, after
+   SET_TS_MASK pos counts in the new format. */
+struct sam4s_usb_iso_in_hdr {
+	uint32_t pos;
+};
+
+struct sam4s_usb_ts0_hdr {
+	uint32_t seq;     /* e1_ts0_rx_seq, the multiframes are seq-n..seq-1 */
+	uint16_t n;
+	uint8_t tx_room;  /* multiframes SET_TS0 can queue right now */
+	uint8_t rai;      /* remote alarm indicated */
+};
+
 extern void sam4s_usb_init();
 extern void sam4s_usb_off();
+extern void sam4s_usb_get_iso_stats(struct sam4s_usb_iso_stats *p);
 
 #endif
\ No newline at end of file
@@ -31,7 +31,11 @@ const struct libusb_config_descriptor sam4s_usb_descr_cfg = {
 	.wTotalLength = sizeof(sam4s_usb_descr_cfg)+
 		sizeof(sam4s_usb_descr_int)+
 		sizeof(sam4s_usb_descr_ep1)+
-		sizeof(sam4s_usb_descr_ep2),
+		sizeof(sam4s_usb_descr_ep2)+
+		sizeof(sam4s_usb_descr_ep3)+
+		sizeof(sam4s_usb_descr_ep4)+
+		sizeof(sam4s_usb_descr_ep5)+
+		sizeof(sam4s_usb_descr_ep6),
 	.bNumInterfaces = 1,
 	.bConfigurationValue = 1,
 	.iConfiguration = 0,
@@ -44,7 +48,7 @@ const struct libusb_interface_descriptor sam4s_usb_descr_int = {
 	.bDescriptorType = LIBUSB_DT_INTERFACE,
 	.bInterfaceNumber = 0,
 	.bAlternateSetting = 0,
-	.bNumEndpoints = 2,
+	.bNumEndpoints = 6,
 	.bInterfaceClass = 0xff,     /* vendor specific */
 	.bInterfaceSubClass = 0xff,  /* vendor specific */
 	.bInterfaceProtocol = 0xff,  /* vendor specific */
@@ -59,7 +63,7 @@ const struct libusb_endpoint_descriptor sam4s_usb_descr_ep1 = {
  	/* D1..0: xfer type: 0=control, 1=isochonous, 2=bulk, 3=interrupt,
 	   D3..2: isochr:    0=no sync, 1=async, 2=adaptive, 3=synchronous,
 	   D5..4: usage:     0=data, 1=feedback, 1:implicit feedback, 3: rsvd */
-	.bmAttributes = 0x0a, /* isochronous, adaptive */
+	.bmAttributes = 0x05, /* isochronous, asynchronous (E1 line clock) */
 	.wMaxPacketSize = 512,
 	.bInterval = 1,
 };
@@ -68,7 +72,46 @@ const struct libusb_endpoint_descriptor sam4s_usb_descr_ep2 = {
 	.bLength = sizeof(sam4s_usb_descr_ep1),
 	.bDescriptorType = LIBUSB_DT_ENDPOINT,
 	.bEndpointAddress = 0x05, /* EP5 OUT */
-	.bmAttributes = 0x0a, /* isochronous, adaptive */
+	.bmAttributes = 0x05, /* isochronous, asynchronous, see ep3 */
 	.wMaxPacketSize = 512,
 	.bInterval = 1,
 };
+
+/* explicit feedback for EP5: bytes per frame, 10.14 */
+const struct libusb_endpoint_descriptor sam4s_usb_descr_ep3 = {
+	.bLength = sizeof(sam4s_usb_descr_ep3),
+	.bDescriptorType = LIBUSB_DT_ENDPOINT,
+	.bEndpointAddress = 0x86, /* EP6 IN */
+	.bmAttributes = 0x11, /* isochronous, no sync, feedback */
+	.wMaxPacketSize = 3,
+	.bInterval = 1,
+};
+
+/* hdlc frames from and to the host, see e1_hdlc.h */
+const struct libusb_endpoint_descriptor sam4s_usb_descr_ep4 = {
+	.bLength = sizeof(sam4s_usb_descr_ep4),
+	.bDescriptorType = LIBUSB_DT_ENDPOINT,
+	.bEndpointAddress = 0x81, /* EP1 IN */
+	.bmAttributes = 0x02, /* bulk */
+	.wMaxPacketSize = 64,
+	.bInterval = 0,
+};
+
+const struct libusb_endpoint_descriptor sam4s_usb_descr_ep5 = {
+	.bLength = sizeof(sam4s_usb_descr_ep5),
+	.bDescriptorType = LIBUSB_DT_ENDPOINT,
+	.bEndpointAddress = 0x02, /* EP2 OUT */
+	.bmAttributes = 0x02, /* bulk */
+	.wMaxPacketSize = 64,
+	.bInterval = 0,
+};
+
+/* binary trace records, see trace_util.h */
+const struct libusb_endpoint_descriptor sam4s_usb_descr_ep6 = {
+	.bLength = sizeof(sam4s_usb_descr_ep6),
+	.bDescriptorType = LIBUSB_DT_ENDPOINT,
+	.bEndpointAddress = 0x87, /* EP7 IN */
+	.bmAttributes = 0x02, /* bulk */
+	.wMaxPacketSize = 64,
+	.bInterval = 0,
+};
@@ -74,5 +74,9 @@ extern const struct libusb_config_descriptor sam4s_usb_descr_cfg;
 extern const struct libusb_interface_descriptor sam4s_usb_descr_int;
 extern const struct libusb_endpoint_descriptor sam4s_usb_descr_ep1;
 extern const struct libusb_endpoint_descriptor sam4s_usb_descr_ep2;
+extern const struct libusb_endpoint_descriptor sam4s_usb_descr_ep3;
+extern const struct libusb_endpoint_descriptor sam4s_usb_descr_ep4;
+extern const struct libusb_endpoint_descriptor sam4s_usb_descr_ep5;
+extern const struct libusb_endpoint_descriptor sam4s_usb_descr_ep6;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1003 @@
+/*
+ * This file is part of the osmocom sam4s usb interface firmware.
+ * Copyright (c) 2018 Christian Vogel <vogelchr@vogel.cx>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host simulation of the E1 data path: the unmodified sam4s_ssc.c,
+ * sam4s_timer.c and e1_mgmt.c are compiled for the host, an E1 bitstream
+ * (synthetic, or recorded from a file) is fed longword by longword through
+ * the emulated PDC, and SSC_Handler()/TC2_Handler() are called exactly
+ * when the hardware would raise the interrupt. We measure the time spent
+ * in SSC_Handler() for every double-frame.
+ *
+ * The SSC receives one double-frame (512 bits) after each frame sync from
+ * TC2, the next frame sync happens TC_RC bits later, so a phase adjustment
+ * in the timer moves the receive window within the bitstream, just like
+ * on the real board.
+ *
+ * With -x, SSC_Handler() is held off now and then for longer than the
+ * PDC can go on by itself, as with the cpu stopped in the debugger. The
+ * cycle counter then follows the transmitted longwords instead of the
+ * host clock, so the recovery in sam4s_ssc.c can measure the gaps.
+ */
+
+#include "sim_periph.h"
+
+#include "sam4s_ssc.h"
+#include "g704.h"
+#include "sam4s_timer.h"
+#include "e1_mgmt.h"
+#include "e1_align.h"
+#include "e1_crc4.h"
+#include "e1_tx.h"
+#include "e1_rate.h"
+#include "e1_demux.h"
+#include "e1_hdlc.h"
+#include "e1_ts0.h"
+#include "sam4s_irq.h"
+
+#include <sam4s8b.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIM_E1_FRAME_OCTETS 32
+/* 2.048 Mbit/s / 512 bits per double-frame */
+#define SIM_DBLFRM_PER_SEC 4000.0
+/* -x: SSC_Handler() is held off once in that many double-frames */
+#define SIM_STALL_EVERY 8192
+/* cycles per transmitted longword, and from the last one to the irq */
+#define SIM_CYCLES_PER_LW (2 * SAM4S_SSC_CMR_DIV * SAM4S_SSC_BITS_PER_LONGWORD)
+#define SIM_IRQ_CYCLES    100
+
+/* recorded bitstream, replayed in a loop, NULL: synthetic stream */
+static unsigned char *sim_file_buf;
+static size_t sim_file_len;
+
+/* synthetic stream carries CRC-4 multiframes */
+static int sim_crc4;
+
+/* A and Sa bits vary per multiframe, both ways */
+static int sim_ts0;
+/* ... with the remote alarm on and off for that many multiframes */
+#define SIM_TS0_RAI_MF 500
+
+/* timeslot carrying the synthetic hdlc stream, 0: none */
+static unsigned int sim_hdlc_ts;
+#define SIM_HDLC_FRAMES 64
+#define SIM_HDLC_BITS   (SIM_HDLC_FRAMES * 8 * (E1_HDLC_MAX_LEN + 8) * 2)
+/* the hdlc bitstream of the timeslot, one octet per frame, replayed in
+   a loop, and the frames expected out of it (len 0: bad FCS or abort) */
+static unsigned char sim_hdlc_buf[SIM_HDLC_BITS / 8];
+static size_t sim_hdlc_len;
+static struct e1_hdlc_frame sim_hdlc_exp[SIM_HDLC_FRAMES];
+/* loop: the timeslot is what the transmitter sent that many frames ago */
+static int sim_hdlc_loop;
+#define SIM_HDLC_LOOP_LEN   1024
+#define SIM_HDLC_LOOP_DELAY 64
+static unsigned char sim_hdlc_loop_buf[SIM_HDLC_LOOP_LEN];
+
+/* cheap deterministic payload, so that any octet can be regenerated */
+static unsigned char
+sim_hash(uint64_t n)
+{
+	n ^= n >> 33;
+	n *= 0xff51afd7ed558ccdULL;
+	n ^= n >> 33;
+	return n;
+}
+
+static unsigned int sim_smf_crc(uint64_t smf);
+
+/* -a: A/Sa bits of received multiframe mf: the remote alarm comes and
+   goes, Sa4 carries a data link, the others fixed patterns */
+static void
+sim_ts0_rx_mf(uint64_t mf, struct e1_ts0_mf *m)
+{
+	memset(m, 0, sizeof(*m));
+	m->a = (mf / SIM_TS0_RAI_MF) % 2 ? 0xff : 0x00;
+	m->sa[0] = sim_hash(mf + (1ULL << 41));
+	m->sa[1] = 0xff;
+	m->sa[2] = 0x00;
+	m->sa[3] = 0xa5;
+	m->sa[4] = mf;
+}
+
+/* ... and the ones sent in the n-th multiframe queued, -1: before */
+static void
+sim_ts0_tx_mf(int64_t n, struct e1_ts0_mf *m)
+{
+	memset(m, 0, sizeof(*m));
+	if (n < 0) {
+		memset(m->sa, 0xff, sizeof(m->sa));
+		return;
+	}
+	m->a = (n & 1) ? 0x81 : 0x00;
+	m->sa[0] = sim_hash(n + (1ULL << 42));
+	m->sa[1] = 0x0f;
+	m->sa[2] = 0xf0;
+	m->sa[3] = 0x33;
+	m->sa[4] = n;
+}
+
+/* NFAS octet of frame (odd) */
+static unsigned char
+sim_e1_nfas(uint64_t frame)
+{
+	struct e1_ts0_mf m;
+	unsigned int k = 7 - (frame % 16) / 2, o;
+	int i;
+
+	if (!sim_ts0)
+		return 0x5f;
+	sim_ts0_rx_mf(frame / 16, &m);
+	o = G704_NOFAS_BITS | ((m.a >> k) & 1) << 5;
+	for (i=0; i<E1_TS0_SA; i++)
+		o |= ((m.sa[i] >> k) & 1) << (E1_TS0_SA - 1 - i);
+	return o;
+}
+
+/* Si bit of frame, C bits, MFAS and E=1 for CRC-4 multiframes */
+static unsigned char
+sim_e1_si(uint64_t frame)
+{
+	unsigned int f = frame % 16;
+
+	if (!sim_crc4)
+		return 1;
+	if (f & 1)
+		return (f >= 13) ? 1 : (G704_MFAS_BITS >> (5 - f/2)) & 1;
+	/* C1..C4 carry the CRC of the previous sub-multiframe */
+	if (frame < 8)
+		return 0;
+	return (sim_smf_crc(frame / 8 - 1) >> (3 - (f % 8) / 2)) & 1;
+}
+
+/* octet number n of the E1 bitstream */
+static unsigned char
+sim_e1_octet(uint64_t n)
+{
+	uint64_t frame = n / SIM_E1_FRAME_OCTETS;
+
+	if (sim_file_buf)
+		return sim_file_buf[n % sim_file_len];
+
+	if (sim_hdlc_ts && n % SIM_E1_FRAME_OCTETS == sim_hdlc_ts)
+		return sim_hdlc_loop ? sim_hdlc_loop_buf[(frame +
+			SIM_HDLC_LOOP_LEN - SIM_HDLC_LOOP_DELAY) %
+			SIM_HDLC_LOOP_LEN] : sim_hdlc_buf[frame % sim_hdlc_len];
+	if (n % SIM_E1_FRAME_OCTETS)
+		return sim_hash(n);
+
+	/* timeslot 0: FAS in even, NFAS (A=0, Sa=1 unless -a) in odd frames */
+	return (sim_e1_si(frame) << 7) | ((frame & 1) ? sim_e1_nfas(frame) : 0x1b);
+}
+
+/* CRC-4 of sub-multiframe smf, computed by the firmware's own routine */
+static unsigned int
+sim_smf_crc(uint64_t smf)
+{
+	static uint64_t cached_smf = UINT64_MAX;
+	static unsigned int cached_crc;
+	uint32_t dblfrm[SAM4S_SSC_DBLFRM_LONGWORDS];
+	uint64_t n;
+	unsigned int crc = 0;
+	int d, w, i;
+
+	if (smf == cached_smf)
+		return cached_crc;
+
+	for (d=0; d<4; d++) {
+		n = (smf * 4 + d) * 2 * SIM_E1_FRAME_OCTETS;
+		for (w=0; w<SAM4S_SSC_DBLFRM_LONGWORDS; w++) {
+			dblfrm[w] = 0;
+			for (i=0; i<4; i++)
+				dblfrm[w] = (dblfrm[w] << 8) |
+					sim_e1_octet(n + 4*w + i);
+		}
+		crc = e1_crc4_dblfrm(crc, dblfrm);
+	}
+	cached_smf = smf;
+	cached_crc = crc;
+	return crc;
+}
+
+/* 32 bits of the bitstream starting at bit pos, MSB first */
+static uint32_t
+sim_e1_bits(uint64_t pos)
+{
+	uint64_t n = pos >> 3;
+	uint64_t v = 0;
+	int i;
+
+	for (i=0; i<5; i++)
+		v = (v << 8) | sim_e1_octet(n + i);
+	return v >> (8 - (pos & 7));
+}
+
+static void
+sim_hdlc_put_bit(size_t *nbits, unsigned int bit)
+{
+	if (bit)
+		sim_hdlc_buf[*nbits / 8] |= 0x80 >> (*nbits % 8);
+	(*nbits)++;
+}
+
+static void
+sim_hdlc_put_flag(size_t *nbits)
+{
+	int i;
+
+	for (i=0; i<8; i++)
+		sim_hdlc_put_bit(nbits, (0x7e >> i) & 1);
+}
+
+/* frames of pseudo-random length and content, every 7th with a wrong
+   FCS and every 11th aborted in the middle, with zeros stuffed after five
+   ones and shared or separate flags in between */
+static void
+sim_hdlc_gen()
+{
+	size_t nbits = 0;
+	int i, j, b;
+
+	memset(sim_hdlc_buf, 0, sizeof(sim_hdlc_buf));
+	sim_hdlc_put_flag(&nbits);
+
+	for (i=0; i<SIM_HDLC_FRAMES; i++) {
+		struct e1_hdlc_frame *f = &sim_hdlc_exp[i];
+		unsigned char d[E1_HDLC_MAX_LEN];
+		unsigned int len = 2 + sim_hash(3*i) * (E1_HDLC_MAX_LEN - 4) / 255;
+		unsigned int fcs = 0xffff, ones = 0;
+
+		for (j=0; j<(int)len; j++) {
+			d[j] = (i % 5 == 0) ? 0xff : sim_hash(1000*i + j);
+			fcs ^= d[j];
+			for (b=0; b<8; b++)
+				fcs = (fcs & 1) ? (fcs >> 1) ^ 0x8408 : fcs >> 1;
+		}
+		fcs ^= 0xffff;
+		if (i % 7 == 3)
+			fcs ^= 0x0100;
+		d[len] = fcs;
+		d[len+1] = fcs >> 8;
+
+		f->ts = sim_hdlc_ts;
+		f->len = (i % 7 == 3 || i % 11 == 5) ? 0 : len;
+		memcpy(f->data, d, len);
+
+		for (j=0; j<(int)len+2; j++) {
+			if (i % 11 == 5 && j == (int)len / 2) {
+				for (b=0; b<7; b++)
+					sim_hdlc_put_bit(&nbits, 1);
+				break;
+			}
+			for (b=0; b<8; b++) {
+				unsigned int bit = (d[j] >> b) & 1;
+
+				sim_hdlc_put_bit(&nbits, bit);
+				ones = bit ? ones + 1 : 0;
+				if (ones == 5) {
+					sim_hdlc_put_bit(&nbits, 0);
+					ones = 0;
+				}
+			}
+		}
+		sim_hdlc_put_flag(&nbits);
+		if (i & 1)
+			sim_hdlc_put_flag(&nbits);
+	}
+	/* ones as inter-frame fill up to a whole octet */
+	while (nbits % 8)
+		sim_hdlc_put_bit(&nbits, 1);
+	sim_hdlc_len = nbits / 8;
+}
+
+/* compare the frames from the receiver against the ones generated,
+   they come in order, returns the number of mismatches */
+static unsigned long
+sim_hdlc_check(unsigned int *next, unsigned long *n)
+{
+	const struct e1_hdlc_frame *f;
+	unsigned long bad = 0;
+
+	while ((f = e1_hdlc_rx_peek())) {
+		const struct e1_hdlc_frame *exp;
+		unsigned int k = SIM_HDLC_FRAMES;
+
+		/* skip the ones that were not supposed to come through, and
+		   resync on a match (the very first one is found anywhere) */
+		do {
+			exp = &sim_hdlc_exp[(*next)++ % SIM_HDLC_FRAMES];
+		} while (k-- && (exp->len != f->len ||
+			memcmp(exp->data, f->data, f->len)));
+		if (k == ~0U || f->ts != sim_hdlc_ts)
+			bad++;
+		(*n)++;
+		e1_hdlc_rx_pop();
+	}
+	return bad;
+}
+
+/* what the bulk out endpoint would do: queue the frames that are
+   supposed to come through, as long as there is room */
+static void
+sim_hdlc_tx(unsigned int *next)
+{
+	struct e1_hdlc_frame *f;
+
+	while ((f = e1_hdlc_tx_write_begin(0))) {
+		const struct e1_hdlc_frame *src;
+
+		do {
+			src = &sim_hdlc_exp[(*next)++ % SIM_HDLC_FRAMES];
+		} while (!src->len);
+		f->len = src->len;
+		memcpy(f->data, src->data, src->len);
+		e1_hdlc_tx_write_commit(0);
+	}
+}
+
+/* what the iso out endpoint would do with one 1 ms packet, the payload
+   is a hash of its position in the host's stream */
+static void
+sim_usb_out(uint64_t *lw_ctr)
+{
+	unsigned int nlw = 4 * SAM4S_SSC_DBLFRM_LONGWORDS;
+	unsigned int n, k;
+	uint32_t *p;
+
+	while (nlw) {
+		p = e1_tx_write_begin(&n);
+		if (!p)
+			break;
+		if (n > nlw)
+			n = nlw;
+		for (k=0; k<n; k++)
+			p[k] = sim_hash(*lw_ctr + k + (1ULL << 40)) * 0x01010101U;
+		e1_tx_write_commit(n);
+		*lw_ctr += n;
+		nlw -= n;
+	}
+	*lw_ctr += nlw;
+}
+
+struct sim_tx_conceal {
+	uint32_t repeat;       /* e1_tx_set_conceal(), timeslot 0 aside */
+	uint32_t cur[SAM4S_SSC_DBLFRM_LONGWORDS];
+	uint32_t prev[SAM4S_SSC_DBLFRM_LONGWORDS];
+	int lost;              /* underflow in cur (1) or prev (2) */
+	unsigned long n, bad;
+};
+
+/* octet of timeslot ts in frame f of a double-frame */
+static unsigned int
+sim_tx_octet(const uint32_t *p, int f, int ts)
+{
+	return (p[f * 8 + ts / 4] >> (24 - 8 * (ts % 4))) & 0xff;
+}
+
+/* longword w of a tx double-frame, sent (not lost to an underflow) or
+   not: each complete one has to be either from sim_usb_out(), the same
+   octet in every timeslot of a longword, or concealed, the repeated
+   timeslots as in the double-frame before and the others idle */
+static void
+sim_tx_conceal_check(struct sim_tx_conceal *c, unsigned int w, uint32_t tx,
+	int sent)
+{
+	int f, ts, usb = 1, conceal = 1;
+
+	c->cur[w] = tx;
+	if (!sent)
+		c->lost |= 1;
+	if (w != SAM4S_SSC_DBLFRM_LONGWORDS - 1)
+		return;
+
+	/* the one before has to be complete as well to compare */
+	if (!c->lost) {
+		for (w=0; w<SAM4S_SSC_DBLFRM_LONGWORDS; w++) {
+			uint32_t x = c->cur[w];
+
+			if (w % 8 == 0) /* timeslot 0 is regenerated */
+				x = (x & 0x00ffffff) | (x << 8 & 0xff000000);
+			if (x != (x >> 24) * 0x01010101U)
+				usb = 0;
+		}
+		for (f=0; f<2; f++)
+			for (ts=1; ts<32; ts++)
+				if (sim_tx_octet(c->cur, f, ts) !=
+				    ((c->repeat & (1UL << ts)) ?
+				    sim_tx_octet(c->prev, f, ts) : 0xff))
+					conceal = 0;
+		if (conceal)
+			c->n++;
+		else if (!usb)
+			c->bad++;
+	}
+	memcpy(c->prev, c->cur, sizeof(c->prev));
+	c->lost = (c->lost & 1) << 1;
+}
+
+struct sim_ts0_rx {
+	unsigned int seq;      /* e1_ts0_rx_seq checked up to */
+	uint64_t next;         /* multiframe of the stream after the last
+				  one matched, 0: none yet */
+	unsigned long n, bad, unaligned;
+};
+
+/* the multiframes from e1_ts0.c, matched against the ones of the stream
+   (they are aligned with CRC-4 only, and counted without). Each one has
+   to come after the one matched before and at most one after the one at
+   frame: after a stall (-x) the batches received before it are processed
+   late, so there is no fixed window behind. Between a slip and re-lock,
+   garbage is expected */
+static void
+sim_ts0_rx_check(struct sim_ts0_rx *r, uint64_t frame, int slip)
+{
+	while (r->seq != e1_ts0_rx_seq) {
+		const struct e1_ts0_mf *m = &e1_ts0_rx_buf[r->seq % E1_TS0_RX_MF];
+		struct e1_ts0_mf exp;
+		uint64_t mf = frame / 16, k;
+
+		r->seq++;
+		r->n++;
+		if (!(m->flags & E1_TS0_MF_CRC4)) {
+			r->unaligned++;
+			continue;
+		}
+		k = r->next;
+		if (!k || k > mf + 1 || mf + 1 - k > 4 * E1_TS0_RX_MF)
+			k = mf > 3 ? mf - 3 : 0;
+		for (; k<=mf+1; k++) {
+			sim_ts0_rx_mf(k, &exp);
+			exp.flags = E1_TS0_MF_CRC4 |
+				(exp.a ? E1_TS0_MF_RAI : 0);
+			if (!memcmp(&exp, m, sizeof(exp)))
+				break;
+		}
+		if (k <= mf + 1)
+			r->next = k + 1;
+		else if (!slip)
+			r->bad++;
+	}
+}
+
+/* what the host would do with SET_TS0: keep the queue full */
+static void
+sim_ts0_tx_feed(int64_t *n)
+{
+	struct e1_ts0_mf m;
+
+	while (e1_ts0_tx_room()) {
+		sim_ts0_tx_mf((*n)++, &m);
+		e1_ts0_tx_write(&m, 1, 0);
+	}
+}
+
+struct sim_ts0_tx {
+	struct e1_ts0_mf mf;   /* collected from the NFAS sent */
+	unsigned int nfas;     /* ... of that many of its frames */
+	int64_t next;          /* multiframe queued expected next */
+	unsigned long n, bad, repeat, skip;
+};
+
+/* NFAS octet sent in tx double-frame seq: each multiframe has to be the
+   one queued next, or the one before it again. Across an underflow (-x)
+   one that was not sent completely is skipped */
+static void
+sim_ts0_tx_check(struct sim_ts0_tx *t, unsigned long seq, unsigned int nfas)
+{
+	unsigned int k = 7 - seq % 8;
+	struct e1_ts0_mf exp;
+	int i;
+
+	if (seq % 8 == 0) {
+		memset(&t->mf, 0, sizeof(t->mf));
+		t->nfas = 0;
+	}
+	t->mf.a |= ((nfas >> 5) & 1) << k;
+	for (i=0; i<E1_TS0_SA; i++)
+		t->mf.sa[i] |= ((nfas >> (E1_TS0_SA - 1 - i)) & 1) << k;
+	if (++t->nfas != 8 || k != 0)
+		return;
+
+	t->n++;
+	for (i=0; i<3; i++) {
+		sim_ts0_tx_mf(t->next + i, &exp);
+		if (!memcmp(&exp, &t->mf, sizeof(exp))) {
+			t->next += i + 1;
+			t->skip += i;
+			return;
+		}
+	}
+	sim_ts0_tx_mf(t->next - 1, &exp);
+	if (!memcmp(&exp, &t->mf, sizeof(exp)))
+		t->repeat++;
+	else
+		t->bad++;
+}
+
+static int
+sim_load_file(const char *fn)
+{
+	FILE *f = fopen(fn, "rb");
+	long len;
+
+	if (!f) {
+		perror(fn);
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (len < 8) {
+		fprintf(stderr, "%s: too short.\n", fn);
+		fclose(f);
+		return -1;
+	}
+	sim_file_buf = malloc(len);
+	sim_file_len = fread(sim_file_buf, 1, len, f);
+	fclose(f);
+	return 0;
+}
+
+static uint64_t
+sim_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-n dblframes] [-o bitoffs] [-f rx.bin] "
+		"[-t tx.bin] [-s slip] [-c] [-e err] [-u skip [-r mask] "
+		"[-j target]] [-p ppm] [-m mask] [-d ts [-l]] [-x stall] "
+		"[-a]\n",
+		argv0);
+	fprintf(stderr, "  -n  number of double-frames to simulate\n");
+	fprintf(stderr, "  -o  initial offset of the rx window in bits\n");
+	fprintf(stderr, "  -f  replay raw E1 bitstream (MSB first) from file\n");
+	fprintf(stderr, "  -t  write transmitted bitstream to file\n");
+	fprintf(stderr, "  -s  slip the rx bitstream every slip double-frames\n");
+	fprintf(stderr, "  -c  synthetic stream with CRC-4 multiframes\n");
+	fprintf(stderr, "  -e  flip one payload bit every err double-frames\n");
+	fprintf(stderr, "  -u  usb out packet every ms, leave out every skip-th\n");
+	fprintf(stderr, "  -r  ... repeat timeslots in mask on underrun, "
+		"check\n");
+	fprintf(stderr, "  -j  ... tx jitter buffer target in double-frames\n");
+	fprintf(stderr, "  -p  usb SOF every ms, clock off by ppm vs. E1\n");
+	fprintf(stderr, "  -m  demultiplex timeslots in mask, check the result\n");
+	fprintf(stderr, "  -d  hdlc frames in timeslot ts, check the receiver\n");
+	fprintf(stderr, "  -l  ... sent by the hdlc transmitter, looped back\n");
+	fprintf(stderr, "  -a  A/Sa bits vary, check them (rx with -c only)\n");
+	fprintf(stderr, "  -x  hold off the ssc irq for stall double-frames, "
+		"every %u\n", SIM_STALL_EVERY);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned long n_dblfrm = 500000, i, n_irq = 0;
+	unsigned long slip_every = 0, slip_at = 0, n_slip = 0;
+	unsigned long err_every = 0;
+	long usb_skip = -1;
+	struct sim_tx_conceal conceal = { .repeat = 0 };
+	unsigned int tx_target = 0;
+	unsigned long tx_lw = 0, tx_bad_ts0 = 0;
+	uint64_t usb_lw = 0;
+	uint64_t rx_bits = 0;
+	double sof_ppm = 0.0, sof_period = 0.0, sof_next = 0.0;
+	unsigned int sof_frm = 0;
+	uint32_t demux_mask = 0;
+	unsigned int demux_seq = 0;
+	unsigned long demux_grp = 0, demux_bad = 0;
+	unsigned int hdlc_next = 0, hdlc_tx_next = 0;
+	unsigned long hdlc_frames = 0, hdlc_bad = 0;
+	unsigned long relock, relock_sum = 0, relock_max = 0;
+	int slip_lost = 0;
+	unsigned long stall = 0, n_stall = 0, stall_tx = 0, stall_tx_lw = 0;
+	struct sim_ts0_rx ts0_rx = { .seq = 0 };
+	int64_t ts0_tx_n = 0;
+	struct sim_ts0_tx ts0_tx = { .next = -1 };
+	struct e1_ts0_stats ts0_stats;
+	unsigned int stall_lof = 0, stall_hunt = 0;
+	uint64_t pos = 0;
+	uint64_t t_irq, t_sum = 0, t_max = 0, t_min = UINT64_MAX, t_start;
+	FILE *txf = NULL;
+	TcChannel *tc2 = &TC0->TC_CHANNEL[2];
+	struct sam4s_ssc_irqstats ssc_stats;
+	struct sam4s_irq_stats irq_stats;
+	struct e1_mgmt_irqstats e1_stats;
+	struct e1_align_stats align_stats;
+	struct e1_crc4_stats crc4_stats;
+	struct e1_tx_stats tx_stats;
+	struct e1_rate_stats rate_stats;
+	struct e1_hdlc_rx_stats hdlc_stats;
+	struct e1_hdlc_tx_stats hdlc_tx_stats;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:o:f:t:s:ce:u:r:j:p:m:d:lx:ah")) != -1) {
+		switch (c) {
+		case 'n':
+			n_dblfrm = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			pos = strtoull(optarg, NULL, 0);
+			break;
+		case 'f':
+			if (sim_load_file(optarg))
+				exit(1);
+			break;
+		case 's':
+			slip_every = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			sim_crc4 = 1;
+			break;
+		case 'e':
+			err_every = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			sof_ppm = strtod(optarg, NULL);
+			sof_period = E1_RATE_NOMINAL * (1.0 + sof_ppm * 1e-6);
+			sof_next = sof_period;
+			break;
+		case 'd':
+			sim_hdlc_ts = strtoul(optarg, NULL, 0) % 32;
+			sim_hdlc_gen();
+			break;
+		case 'l':
+			sim_hdlc_loop = 1;
+			break;
+		case 'm':
+			demux_mask = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			sim_ts0 = 1;
+			break;
+		case 'x':
+			stall = strtoul(optarg, NULL, 0);
+			break;
+		case 'u':
+			usb_skip = strtol(optarg, NULL, 0);
+			break;
+		case 'r':
+			conceal.repeat = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			tx_target = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			txf = fopen(optarg, "wb");
+			if (!txf) {
+				perror(optarg);
+				exit(1);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	/* same order as in main() of the firmware */
+	sam4s_ssc_init();
+	sam4s_timer_init();
+	e1_mgmt_init();
+	e1_demux_set_mask(demux_mask);
+	e1_hdlc_set_ts(0, sim_hdlc_ts);
+	e1_tx_set_conceal(conceal.repeat);
+	conceal.repeat &= ~1UL;
+	if (tx_target && e1_tx_set_target(tx_target)) {
+		fprintf(stderr, "%s: jitter buffer target %u out of range\n",
+			argv[0], tx_target);
+		exit(1);
+	}
+	sim_tc_sync(0);
+	sim_tc_sync(2);
+
+	t_start = sim_now_ns();
+	for (i=0; i<n_dblfrm; i++) {
+		int w;
+
+		/* bit slip, by a pseudo-random amount */
+		if (slip_every && i && i % slip_every == 0) {
+			pos += 1 + sim_hash(i) % 511;
+			slip_at = i;
+			slip_lost = 0;
+			n_slip++;
+		}
+
+		/* one double-frame is shifted in after the frame sync */
+		for (w=0; w<SAM4S_SSC_DBLFRM_LONGWORDS; w++) {
+			unsigned long k;
+			uint32_t rx, tx;
+
+			rx = sim_e1_bits(pos + w * SAM4S_SSC_BITS_PER_LONGWORD);
+			if (err_every && w == 5 && i % err_every == err_every-1)
+				rx ^= 1 << (i % 32);
+			sim_pdc_ssc_rx_word(rx);
+			/* SOF during this longword, TC2 counts the bits since
+			   the frame sync */
+			if (sof_period > 0.0 &&
+			    rx_bits + SAM4S_SSC_BITS_PER_LONGWORD >= sof_next) {
+				sim_tc_set_cv(2, (w * SAM4S_SSC_BITS_PER_LONGWORD +
+					(unsigned int)(sof_next - rx_bits)) %
+					tc2->TC_RC);
+				/* the ssc tx clock, MCK, runs at the nominal
+				   line rate here */
+				sim_dwt_set((uint32_t)(uint64_t)(sof_next * 2 *
+					SAM4S_SSC_CMR_DIV));
+				e1_rate_sof(sof_frm++ & 0x7ff);
+				sof_next += sof_period;
+			}
+			rx_bits += SAM4S_SSC_BITS_PER_LONGWORD;
+			sim_tc_set_cv(2, ((w + 1) * SAM4S_SSC_BITS_PER_LONGWORD) %
+				tc2->TC_RC);
+			k = sim_periph_stats.tx_lost;
+			tx = sim_pdc_ssc_tx_word();
+			/* timeslot 0 has to be regenerated, always, in what
+			   the PDC fetched (the rest is an underflow) */
+			if (k == sim_periph_stats.tx_lost &&
+			    tx_lw % SAM4S_SSC_DBLFRM_LONGWORDS == 0 &&
+			    !CHK_G704_FAS_LW(tx))
+				tx_bad_ts0++;
+			if (k == sim_periph_stats.tx_lost &&
+			    tx_lw % SAM4S_SSC_DBLFRM_LONGWORDS == 8 &&
+			    !CHK_G704_NOFAS_LW(tx))
+				tx_bad_ts0++;
+			if (sim_ts0 && k == sim_periph_stats.tx_lost &&
+			    tx_lw % SAM4S_SSC_DBLFRM_LONGWORDS == 8)
+				sim_ts0_tx_check(&ts0_tx,
+					tx_lw / SAM4S_SSC_DBLFRM_LONGWORDS, tx >> 24);
+			if (usb_skip >= 0)
+				sim_tx_conceal_check(&conceal,
+					tx_lw % SAM4S_SSC_DBLFRM_LONGWORDS, tx,
+					k == sim_periph_stats.tx_lost);
+			if (sim_hdlc_loop && tx_lw % SAM4S_SSC_DBLFRM_LONGWORDS %
+			    8 == sim_hdlc_ts / 4)
+				sim_hdlc_loop_buf[tx_lw / 8 % SIM_HDLC_LOOP_LEN] =
+					tx >> (24 - 8 * (sim_hdlc_ts % 4));
+			tx_lw++;
+			if (txf) {
+				unsigned char b[4] = {
+					tx >> 24, tx >> 16, tx >> 8, tx };
+				fwrite(b, sizeof(b), 1, txf);
+			}
+		}
+
+		/* next frame sync, TC2 period may have been adjusted */
+		pos += tc2->TC_RC;
+		if (sim_tc_rc_compare(2))
+			TC2_Handler();
+		sim_tc_sync(2);
+
+		/* held off, and the tx gap the firmware will find: what the
+		   PDC did not fetch, rounded up to double-frames */
+		if (stall && i % SIM_STALL_EVERY >= SIM_STALL_EVERY - stall) {
+			sim_ssc_irq_pending();
+			continue;
+		}
+		if (stall && i % SIM_STALL_EVERY == 0 && i) {
+			struct e1_align_stats a;
+
+			stall_tx += (sim_periph_stats.tx_lost - stall_tx_lw +
+				SAM4S_SSC_DBLFRM_LONGWORDS - 1) /
+				SAM4S_SSC_DBLFRM_LONGWORDS;
+			n_stall++;
+			e1_align_get_stats(&a);
+			stall_lof = a.lof;
+			stall_hunt = a.hunt_dblfrm;
+		}
+		if (stall)
+			sim_dwt_set((tx_lw - 1) * SIM_CYCLES_PER_LW +
+				SIM_IRQ_CYCLES);
+
+		if (sim_ssc_irq_pending()) {
+			t_irq = sim_now_ns();
+			SSC_Handler();
+			t_irq = sim_now_ns() - t_irq;
+			sim_ssc_irq_done();
+
+			n_irq++;
+			t_sum += t_irq;
+			/* the groups of a gap are not compared, the rx
+			   ring has been overwritten already */
+			if (stall && i % SIM_STALL_EVERY == 0 && i) {
+				demux_grp += e1_demux_seq - demux_seq;
+				demux_seq = e1_demux_seq;
+				stall_tx_lw = sim_periph_stats.tx_lost;
+			}
+			if (t_irq > t_max)
+				t_max = t_irq;
+			if (t_irq < t_min)
+				t_min = t_irq;
+		}
+
+		/* new groups, one per irq or a batch of them: compare each
+		   column against its two double-frames in the rx ring */
+		while (demux_seq != e1_demux_seq) {
+			unsigned int col = demux_seq % E1_DEMUX_DEPTH;
+			unsigned int last = (sam4s_ssc_rx_seq & ~1U) - 1 -
+				2 * (e1_demux_seq - 1 - demux_seq);
+			int ts, f;
+
+			for (ts=0; ts<E1_DEMUX_TS; ts++) {
+				uint32_t exp = 0;
+
+				for (f=0; f<4; f++) {
+					const uint32_t *q = &sam4s_ssc_rx_buf[
+						((last - 1 + f / 2) %
+						SAM4S_SSC_BUF_DBLFRAMES) *
+						SAM4S_SSC_DBLFRM_LONGWORDS];
+					uint32_t lw = q[(f & 1) * 8 + ts / 4];
+
+					exp = (exp << 8) |
+						((lw >> (24 - 8 * (ts % 4))) & 0xff);
+				}
+				if (e1_demux_buf[ts][col] != exp)
+					demux_bad++;
+			}
+			demux_seq++;
+			demux_grp++;
+		}
+
+		/* time from slip to regained alignment */
+		if (slip_at && e1_align_get_state() != E1_ALIGN_LOCKED)
+			slip_lost = 1;
+		if (slip_at && slip_lost &&
+		    e1_align_get_state() == E1_ALIGN_LOCKED) {
+			relock = i - slip_at;
+			relock_sum += relock;
+			if (relock > relock_max)
+				relock_max = relock;
+			slip_at = 0;
+		}
+
+		/* SOF, every 4 double-frames */
+		if (usb_skip >= 0 && i % 4 == 0) {
+			if (usb_skip && (long)(i / 4) % usb_skip == usb_skip - 1)
+				usb_lw += 4 * SAM4S_SSC_DBLFRM_LONGWORDS;
+			else
+				sim_usb_out(&usb_lw);
+		}
+
+		if (sim_ts0) {
+			sim_ts0_rx_check(&ts0_rx, pos / (8 * SIM_E1_FRAME_OCTETS),
+				slip_at != 0);
+			sim_ts0_tx_feed(&ts0_tx_n);
+		}
+		if (sim_hdlc_ts)
+			hdlc_bad += sim_hdlc_check(&hdlc_next, &hdlc_frames);
+		if (sim_hdlc_loop)
+			sim_hdlc_tx(&hdlc_tx_next);
+
+		e1_mgmt_poll();
+	}
+	t_start = sim_now_ns() - t_start;
+
+	if (txf)
+		fclose(txf);
+
+	sam4s_ssc_get_irqstats(&ssc_stats);
+	e1_mgmt_get_irqstats(&e1_stats);
+	e1_align_get_stats(&align_stats);
+	e1_crc4_get_stats(&crc4_stats);
+	e1_tx_get_stats(&tx_stats);
+	e1_rate_get_stats(&rate_stats);
+	sam4s_irq_get_stats(SAM4S_IRQ_SSC, &irq_stats);
+	e1_hdlc_get_rx_stats(&hdlc_stats);
+	e1_hdlc_get_tx_stats(&hdlc_tx_stats);
+	e1_ts0_get_stats(&ts0_stats);
+
+	printf("simulated %lu double-frames (%.1f s of E1) in %.3f s\n",
+		n_dblfrm, n_dblfrm / SIM_DBLFRM_PER_SEC, t_start * 1e-9);
+	printf("SSC_Handler: %lu calls, min %llu ns, avg %.1f ns, max %llu ns\n",
+		n_irq, n_irq ? (unsigned long long)t_min : 0ULL,
+		n_irq ? (double)t_sum / n_irq : 0.0,
+		(unsigned long long)t_max);
+	if (t_sum)
+		printf("SSC_Handler throughput: %.0f double-frames/s\n",
+			n_dblfrm * 1e9 / t_sum);
+	printf("ssc: rx %u (overflow %u, lost %u) tx %u (underflow %u, "
+		"lost %u) irq latency %u..%u bits\n",
+		ssc_stats.rx_ctr, ssc_stats.rx_overflow, ssc_stats.rx_lost,
+		ssc_stats.tx_ctr, ssc_stats.tx_underflow, ssc_stats.tx_lost,
+		ssc_stats.rx_lat_min, ssc_stats.rx_lat_max);
+#if SAM4S_IRQ_STATS
+	printf("irq SSC: %u calls, duration max %u cycles, histogram",
+		irq_stats.dur.n, irq_stats.dur.max);
+	for (i=0; i<SAM4S_IRQ_HIST_BINS; i++)
+		printf(" %u", irq_stats.dur.bin[i]);
+	printf("\n");
+#endif
+	printf("pdc: rx %lu words (lost %lu, off %lu) tx %lu words "
+		"(lost %lu)\n",
+		sim_periph_stats.rx_words, sim_periph_stats.rx_lost,
+		sim_periph_stats.rx_off,
+		sim_periph_stats.tx_words, sim_periph_stats.tx_lost);
+	printf("e1: dblfrm %u bad_fas %u\n",
+		e1_stats.dblfrm, e1_stats.n_dblframes_bad_fas);
+	printf("align: lof %u phase_adj %u (last %d bits) hunt %u dblfrm\n",
+		align_stats.lof, align_stats.phase_adj, align_stats.last_offs,
+		align_stats.hunt_dblfrm);
+	printf("crc4: %s smf %u crc_err %u febe %u mf_loss %u\n",
+		e1_crc4_locked() ? "locked" : "unlocked", crc4_stats.smf,
+		crc4_stats.crc_err, crc4_stats.febe, crc4_stats.mf_loss);
+	printf("tx: dblfrm %u from usb %u underrun %u resync %u overrun %u, "
+		"bad ts0 %lu\n", tx_stats.dblfrm, tx_stats.usb_dblfrm,
+		tx_stats.underrun, tx_stats.resync, tx_stats.overrun,
+		tx_bad_ts0);
+	if (usb_skip >= 0)
+		printf("tx conceal: repeat 0x%08x, %lu double-frames "
+			"concealed, %lu bad\n", conceal.repeat, conceal.n,
+			conceal.bad);
+	if (demux_mask)
+		printf("demux: %lu groups, %lu bad columns\n", demux_grp,
+			demux_bad);
+	if (sim_hdlc_ts)
+		printf("hdlc: %u frames (%lu checked, %lu bad) crc_err %u "
+			"abort %u align %u long %u short %u overrun %u\n",
+			hdlc_stats.frames, hdlc_frames, hdlc_bad,
+			hdlc_stats.crc_err, hdlc_stats.abort, hdlc_stats.align,
+			hdlc_stats.too_long, hdlc_stats.too_short,
+			hdlc_stats.overrun);
+	if (sim_hdlc_loop)
+		printf("hdlc tx: %u frames long %u short %u\n",
+			hdlc_tx_stats.frames, hdlc_tx_stats.too_long,
+			hdlc_tx_stats.too_short);
+	if (sim_ts0) {
+		printf("ts0 rx: %lu multiframes (%lu bad, %lu not aligned) "
+			"rai %u, on %u times, sa changes %u\n", ts0_rx.n, ts0_rx.bad,
+			ts0_rx.unaligned, ts0_stats.rai, ts0_stats.rai_events,
+			ts0_stats.rx_changes);
+		printf("ts0 tx: %lu multiframes (%lu bad, %lu repeated, "
+			"%lu skipped) queued %u repeated %u\n", ts0_tx.n,
+			ts0_tx.bad, ts0_tx.repeat, ts0_tx.skip, ts0_stats.tx_mf,
+			ts0_stats.tx_repeat);
+	}
+	if (sof_period > 0.0)
+		printf("rate: sof %u glitch %u, rx %.4f bits/frame %d ppb, "
+			"tx %.4f bits/frame %d ppb (expected %.0f)\n",
+			rate_stats.sof, rate_stats.glitch,
+			rate_stats.rate / 65536.0, rate_stats.ppb,
+			rate_stats.tx_rate / 65536.0, rate_stats.tx_ppb,
+			sof_ppm * 1e3);
+	if (n_stall)
+		printf("stalls: %lu, double-frames lost rx %lu (expected %lu) "
+			"tx %lu (expected %lu), align lof %u hunt %u dblfrm\n",
+			n_stall, (unsigned long)ssc_stats.rx_lost,
+			/* what the PDC dropped, and what came in before the
+			   frame sync the receiver waited for */
+			(sim_periph_stats.rx_lost + sim_periph_stats.rx_off) /
+			SAM4S_SSC_DBLFRM_LONGWORDS,
+			(unsigned long)ssc_stats.tx_lost, stall_tx, stall_lof,
+			stall_hunt);
+	if (n_slip)
+		printf("slips: %lu, re-lock avg %.1f ms max %.1f ms\n", n_slip,
+			1e3 * relock_sum / n_slip / SIM_DBLFRM_PER_SEC,
+			1e3 * relock_max / SIM_DBLFRM_PER_SEC);
+
+	return 0;
+}
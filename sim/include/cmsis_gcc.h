@@ -0,0 +1,29 @@
+#ifndef SIM_CMSIS_GCC_H
+#define SIM_CMSIS_GCC_H
+
+/* host simulation stand-in for the handful of CMSIS intrinsics we use,
+   the simulation is single threaded so exclusive accesses always succeed */
+
+#include <stdint.h>
+
+static inline void __enable_irq(void) { }
+static inline void __disable_irq(void) { }
+static inline void __NOP(void) { }
+static inline void __DMB(void) { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+static inline uint32_t __get_BASEPRI(void) { return 0; }
+static inline void __set_BASEPRI(uint32_t v) { (void)v; }
+static inline void __set_BASEPRI_MAX(uint32_t v) { (void)v; }
+static inline uint32_t __get_IPSR(void) { return 0; /* thread mode */ }
+
+static inline uint32_t
+__LDREXW(volatile uint32_t *addr) {
+	return *addr;
+}
+
+static inline uint32_t
+__STREXW(uint32_t value, volatile uint32_t *addr) {
+	*addr = value;
+	return 0; /* success */
+}
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef SIM_SAM4S4C_H
+#define SIM_SAM4S4C_H
+
+/* the peripherals we simulate are identical on all SAM4S variants */
+#include "sam4s8b.h"
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef SIM_SAM4S8B_H
+#define SIM_SAM4S8B_H
+
+/*
+ * Host simulation stand-in for the Atmel device header: we reuse the
+ * register layouts from the component/ headers of the DFP, but instead
+ * of fixed peripheral addresses the register blocks live in ordinary
+ * RAM (see sim/sim_periph.c) and are driven by the simulation harness.
+ */
+
+#include <stdint.h>
+
+#define __I  volatile const
+#define __O  volatile
+#define __IO volatile
+
+typedef enum IRQn {
+	SysTick_IRQn = -1,
+	UART0_IRQn   =  8,
+	SSC_IRQn     = 22,
+	TC0_IRQn     = 23,
+	TC1_IRQn     = 24,
+	TC2_IRQn     = 25,
+	UDP_IRQn     = 34
+} IRQn_Type;
+
+#define __NVIC_PRIO_BITS 4
+
+#define ID_SSC (22)
+#define ID_TC0 (23)
+#define ID_TC1 (24)
+#define ID_TC2 (25)
+#define ID_UDP (34)
+
+#include "cmsis_gcc.h"
+
+#include "component/pdc.h"
+#include "component/ssc.h"
+#include "component/tc.h"
+#include "component/udp.h"
+#include "component/matrix.h"
+
+extern Ssc sim_ssc;
+extern Pdc sim_pdc_ssc;
+extern Tc  sim_tc0;
+
+#define SSC     (&sim_ssc)
+#define PDC_SSC (&sim_pdc_ssc)
+#define TC0     (&sim_tc0)
+
+extern Matrix sim_matrix;
+#define MATRIX  (&sim_matrix)
+
+/* the USB device port is a model that has to see every access, see
+   sim/sim_udp.h, and the fifo is not memory mapped (sam4s_usb.c) */
+extern Udp *sim_udp(void);
+extern void sim_udp_fdr_wr(volatile uint32_t *fdr, uint32_t v);
+extern uint32_t sim_udp_fdr_rd(volatile uint32_t *fdr);
+
+#define UDP (sim_udp())
+#define SAM4S_USB_FDR_WR(fdr, v) sim_udp_fdr_wr((fdr), (v))
+#define SAM4S_USB_FDR_RD(fdr)    sim_udp_fdr_rd(fdr)
+
+static inline void NVIC_EnableIRQ(IRQn_Type irqn) { (void)irqn; }
+static inline void NVIC_DisableIRQ(IRQn_Type irqn) { (void)irqn; }
+static inline void
+NVIC_SetPriority(IRQn_Type irqn, uint32_t prio) { (void)irqn; (void)prio; }
+static inline uint32_t
+NVIC_GetPriority(IRQn_Type irqn) { (void)irqn; return 0; }
+
+/* the cycle counter follows the host clock, scaled to F_MCK_HZ */
+typedef struct {
+	__IO uint32_t CTRL;
+	__IO uint32_t CYCCNT;
+} DWT_Type;
+typedef struct {
+	__IO uint32_t DEMCR;
+} CoreDebug_Type;
+
+#define DWT_CTRL_CYCCNTENA_Msk     (1UL << 0)
+#define CoreDebug_DEMCR_TRCENA_Msk (1UL << 24)
+
+extern DWT_Type *sim_dwt(void);
+extern CoreDebug_Type sim_coredebug;
+
+#define DWT       (sim_dwt())
+#define CoreDebug (&sim_coredebug)
+
+extern void SSC_Handler(void);
+extern void TC0_Handler(void);
+extern void TC2_Handler(void);
+extern void UDP_Handler(void);
+
+#endif
@@ -0,0 +1,260 @@
+/*
+ * This file is part of the osmocom sam4s usb interface firmware.
+ * Copyright (c) 2018 Christian Vogel <vogelchr@vogel.cx>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host micro-benchmark of circular_buffer.h, for the element sizes that
+ * are used in the firmware: 1 byte (uart console) and 16 bytes (struct
+ * trace_util_data). Single elements with put/get and bulk transfers with
+ * put_n/get_n, in one thread, and then producer and consumer in two
+ * threads, which also checks that the consumer never sees an element
+ * before the producer has finished writing it. Last the overwriting ring
+ * used for the trace, with a producer that never waits: every element
+ * has to arrive intact and in order or be counted as lost.
+ */
+
+#include "circular_buffer.h"
+#include "trace_util.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_BULK 16
+
+CIRCULAR_BUFFER_DECLARE(b1, uint8_t, 32, CIRCULAR_BUFFER_DROP_NEW)
+CIRCULAR_BUFFER_DECLARE(b16, struct trace_util_data, 128,
+	CIRCULAR_BUFFER_DROP_NEW)
+CIRCULAR_BUFFER_DECLARE(ow16, struct trace_util_data, 128,
+	CIRCULAR_BUFFER_OVERWRITE)
+
+static unsigned long bench_n = 20000000;
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+bench_report(const char *what, unsigned long ops, double t, unsigned long bad)
+{
+	printf("%-28s %12.0f ops/s %8.2f ns/op%s\n", what, ops / t,
+		t * 1e9 / ops, bad ? "  CORRUPTED" : "");
+	if (bad)
+		exit(1);
+}
+
+/* one put and one get per element, in bursts filling half the ring */
+#define BENCH_PUT_GET(name, type, burst, mk, chk) do { \
+		unsigned long i, j, bad = 0; \
+		double t = bench_now(); \
+		type e; \
+		for (i=0; i<bench_n; i+=(burst)) { \
+			for (j=0; j<(burst); j++) { \
+				mk(e, i + j); \
+				name ## _put(&e); \
+			} \
+			for (j=0; j<(burst); j++) { \
+				name ## _get(&e); \
+				bad += chk(e, i + j); \
+			} \
+		} \
+		bench_report(#name " put/get", bench_n, bench_now() - t, bad); \
+	} while (0)
+
+#define BENCH_WRITE_READ(name, type, mk, chk) do { \
+		unsigned long i, j, bad = 0; \
+		double t = bench_now(); \
+		type e[BENCH_BULK]; \
+		for (i=0; i<bench_n; i+=BENCH_BULK) { \
+			for (j=0; j<BENCH_BULK; j++) \
+				mk(e[j], i + j); \
+			name ## _put_n(e, BENCH_BULK); \
+			name ## _get_n(e, BENCH_BULK); \
+			for (j=0; j<BENCH_BULK; j++) \
+				bad += chk(e[j], i + j); \
+		} \
+		bench_report(#name " put_n/get_n x16", bench_n, \
+			bench_now() - t, bad); \
+	} while (0)
+
+#define MK1(e, i)  ((e) = (uint8_t)(i))
+#define CHK1(e, i) ((e) != (uint8_t)(i))
+#define MK16(e, i) do { \
+		(e).ts = (i); \
+		(e).id = ~(uint32_t)(i); \
+		(e).a = (uint32_t)(i) * 3; \
+		(e).b = (uint32_t)(i) ^ 0x5a5a5a5a; \
+	} while (0)
+#define CHK16(e, i) ((e).ts != (uint32_t)(i) || (e).id != ~(uint32_t)(i) || \
+	(e).a != (uint32_t)(i) * 3 || (e).b != ((uint32_t)(i) ^ 0x5a5a5a5a))
+
+static void *
+bench_producer16(void *arg)
+{
+	unsigned long i = 0;
+	struct trace_util_data e;
+
+	(void)arg;
+	while (i < bench_n) {
+		MK16(e, i);
+		if (b16_put(&e) == 0)
+			i++;
+		else
+			sched_yield(); /* full, there may be just one cpu */
+	}
+	return NULL;
+}
+
+static void *
+bench_producer1(void *arg)
+{
+	unsigned long i = 0;
+	uint8_t e[BENCH_BULK];
+	unsigned int j, k;
+
+	(void)arg;
+	while (i < bench_n) {
+		for (j=0; j<BENCH_BULK; j++)
+			MK1(e[j], i + j);
+		k = b1_put_n(e, BENCH_BULK);
+		/* what did not fit goes again, with the same numbers */
+		i += k;
+		if (k < BENCH_BULK)
+			sched_yield();
+		if (k < BENCH_BULK)
+			for (j=0; j+k<BENCH_BULK; j++)
+				e[j] = e[j+k];
+	}
+	return NULL;
+}
+
+static volatile int bench_ow_done;
+
+static void *
+bench_producer_ow(void *arg)
+{
+	unsigned long i;
+	struct trace_util_data e;
+
+	(void)arg;
+	for (i=0; i<bench_n; i++) {
+		MK16(e, i);
+		ow16_put(&e);
+		if (!(i % 1024))
+			sched_yield(); /* let the reader have a go sometimes */
+	}
+	__atomic_store_n(&bench_ow_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void
+bench_overwrite(void)
+{
+	pthread_t th;
+	unsigned long got = 0, bad = 0;
+	long last = -1;
+	struct trace_util_data e;
+	double t;
+
+	t = bench_now();
+	pthread_create(&th, NULL, bench_producer_ow, NULL);
+	for (;;) {
+		int done = __atomic_load_n(&bench_ow_done, __ATOMIC_ACQUIRE);
+
+		if (ow16_get(&e) == -1) {
+			if (done)
+				break;
+			sched_yield();
+			continue;
+		}
+		/* intact, and newer than the one before */
+		bad += CHK16(e, e.ts) || (long)e.ts <= last;
+		last = e.ts;
+		got++;
+	}
+	pthread_join(th, NULL);
+	if (got + ow16_lost() != bench_n)
+		bad++;
+	bench_report("ow16 2 threads overwrite", bench_n, bench_now() - t,
+		bad);
+	printf("%-28s %12lu read %12u lost\n", "", got, ow16_lost());
+}
+
+static void
+bench_threads(void)
+{
+	pthread_t th;
+	unsigned long i, bad;
+	double t;
+
+	bad = 0;
+	t = bench_now();
+	pthread_create(&th, NULL, bench_producer16, NULL);
+	for (i=0; i<bench_n; ) {
+		struct trace_util_data e;
+
+		if (b16_get(&e) == 0) {
+			bad += CHK16(e, i);
+			i++;
+		} else {
+			sched_yield();
+		}
+	}
+	pthread_join(th, NULL);
+	bench_report("b16 2 threads put/get", bench_n, bench_now() - t, bad);
+
+	bad = 0;
+	t = bench_now();
+	pthread_create(&th, NULL, bench_producer1, NULL);
+	for (i=0; i<bench_n; ) {
+		uint8_t e[BENCH_BULK];
+		unsigned int j, k;
+
+		k = b1_get_n(e, BENCH_BULK);
+		for (j=0; j<k; j++)
+			bad += CHK1(e[j], i + j);
+		i += k;
+		if (!k)
+			sched_yield();
+	}
+	pthread_join(th, NULL);
+	bench_report("b1 2 threads put_n/get_n", bench_n, bench_now() - t, bad);
+}
+
+int
+main(int argc, char **argv)
+{
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	if (argc > 1)
+		bench_n = strtoul(argv[1], NULL, 0) / BENCH_BULK * BENCH_BULK;
+
+	BENCH_PUT_GET(b1, uint8_t, 16, MK1, CHK1);
+	BENCH_PUT_GET(b16, struct trace_util_data, 16, MK16, CHK16);
+	BENCH_WRITE_READ(b1, uint8_t, MK1, CHK1);
+	BENCH_WRITE_READ(b16, struct trace_util_data, MK16, CHK16);
+	bench_threads();
+	bench_overwrite();
+	return 0;
+}
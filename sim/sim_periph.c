@@ -0,0 +1,282 @@
+/* 
+ * This file is part of the osmocom sam4s usb interface firmware.
+ * Copyright (c) 2018 Christian Vogel <vogelchr@vogel.cx>.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* register blocks and peripheral behaviour for the host simulation */
+
+#include "sim_periph.h"
+
+#include <sam4s8b.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "sam4s_clock.h"
+#include "sam4s_pinmux.h"
+#include "sam4s_uart0_console.h"
+#include "gps_steer.h"
+
+Ssc sim_ssc;
+Pdc sim_pdc_ssc;
+Tc  sim_tc0;
+Matrix sim_matrix;
+CoreDebug_Type sim_coredebug;
+static DWT_Type sim_dwt_regs;
+
+struct sim_periph_stats sim_periph_stats;
+
+volatile unsigned long sam4s_clock_tick;
+
+/* registers which are read-only for the firmware are written here */
+#define SIM_WR(reg) (*(volatile uint32_t *)&(reg))
+
+/* the firmware writes the PDC pointers as uint32_t, the simulation
+   binary is linked non-PIE so all static buffers are below 4 GiB */
+#define SIM_PTR(reg) ((uint32_t *)(uintptr_t)(reg))
+
+/* ENDRX/ENDTX are set when the counter reaches zero and stay set until
+   the next pointer/counter is written by software */
+static uint32_t sim_ssc_end_flags;
+
+/* the receiver, see sim_ssc_irq_done() */
+static enum {
+	SIM_SSC_RX_ON,
+	SIM_SSC_RX_OFF,
+	SIM_SSC_RX_WAIT_SYNC,
+} sim_ssc_rx_state;
+
+/* DWT->CYCCNT set by the harness, instead of the host clock, and while
+   running, advanced by the host clock since it was started */
+static int sim_dwt_fixed, sim_dwt_running;
+static uint32_t sim_dwt_base;
+static uint64_t sim_dwt_t0;
+
+static void
+sim_fold_imr(volatile uint32_t *ier, volatile uint32_t *idr,
+	volatile const uint32_t *imr)
+{
+	uint32_t v = (*imr | *ier) & ~*idr;
+
+	*(volatile uint32_t *)imr = v;
+	*ier = 0;
+	*idr = 0;
+}
+
+void
+sim_pdc_ssc_rx_word(uint32_t w)
+{
+	Pdc *pdc = PDC_SSC;
+
+	if (sim_ssc_rx_state != SIM_SSC_RX_ON) {
+		sim_periph_stats.rx_off++;
+		return;
+	}
+	if (!pdc->PERIPH_RCR) {
+		sim_periph_stats.rx_lost++;
+		return;
+	}
+
+	*SIM_PTR(pdc->PERIPH_RPR) = w;
+	pdc->PERIPH_RPR += sizeof(uint32_t);
+	sim_periph_stats.rx_words++;
+
+	if (--pdc->PERIPH_RCR)
+		return;
+
+	sim_ssc_end_flags |= SSC_SR_ENDRX;
+	if (pdc->PERIPH_RNCR) {
+		pdc->PERIPH_RPR = pdc->PERIPH_RNPR;
+		pdc->PERIPH_RCR = pdc->PERIPH_RNCR;
+		pdc->PERIPH_RNCR = 0;
+	}
+}
+
+uint32_t
+sim_pdc_ssc_tx_word(void)
+{
+	Pdc *pdc = PDC_SSC;
+	uint32_t w;
+
+	if (!pdc->PERIPH_TCR) {
+		sim_periph_stats.tx_lost++;
+		return 0;
+	}
+
+	w = *SIM_PTR(pdc->PERIPH_TPR);
+	pdc->PERIPH_TPR += sizeof(uint32_t);
+	sim_periph_stats.tx_words++;
+
+	if (--pdc->PERIPH_TCR)
+		return w;
+
+	sim_ssc_end_flags |= SSC_SR_ENDTX;
+	if (pdc->PERIPH_TNCR) {
+		pdc->PERIPH_TPR = pdc->PERIPH_TNPR;
+		pdc->PERIPH_TCR = pdc->PERIPH_TNCR;
+		pdc->PERIPH_TNCR = 0;
+	}
+	return w;
+}
+
+int
+sim_ssc_irq_pending(void)
+{
+	Pdc *pdc = PDC_SSC;
+	uint32_t sr = sim_ssc_end_flags;
+
+	sim_fold_imr(&SSC->SSC_IER, &SSC->SSC_IDR, &SSC->SSC_IMR);
+
+	if (!pdc->PERIPH_RCR && !pdc->PERIPH_RNCR)
+		sr |= SSC_SR_RXBUFF;
+	if (!pdc->PERIPH_TCR && !pdc->PERIPH_TNCR)
+		sr |= SSC_SR_TXBUFE;
+	SIM_WR(SSC->SSC_SR) = sr;
+	/* commands written before, by sam4s_ssc_init() */
+	SSC->SSC_CR = 0;
+
+	return !!(sr & SSC->SSC_IMR);
+}
+
+void
+sim_ssc_irq_done(void)
+{
+	/* writing a next counter acknowledges the end-of-buffer flag */
+	if (PDC_SSC->PERIPH_RNCR)
+		sim_ssc_end_flags &= ~SSC_SR_ENDRX;
+	if (PDC_SSC->PERIPH_TNCR)
+		sim_ssc_end_flags &= ~SSC_SR_ENDTX;
+	if (SSC->SSC_CR & SSC_CR_RXDIS)
+		sim_ssc_rx_state = SIM_SSC_RX_OFF;
+	else if (SSC->SSC_CR & SSC_CR_RXEN)
+		sim_ssc_rx_state = SIM_SSC_RX_WAIT_SYNC;
+	SSC->SSC_CR = 0;
+	sim_fold_imr(&SSC->SSC_IER, &SSC->SSC_IDR, &SSC->SSC_IMR);
+}
+
+void
+sim_tc_sync(int ch)
+{
+	TcChannel *tc = &TC0->TC_CHANNEL[ch];
+
+	sim_fold_imr(&tc->TC_IER, &tc->TC_IDR, &tc->TC_IMR);
+	SIM_WR(tc->TC_SR) = 0;
+}
+
+int
+sim_tc_rc_compare(int ch)
+{
+	TcChannel *tc = &TC0->TC_CHANNEL[ch];
+
+	sim_fold_imr(&tc->TC_IER, &tc->TC_IDR, &tc->TC_IMR);
+	SIM_WR(tc->TC_SR) |= TC_SR_CPCS;
+
+	if (ch == 2) {
+		TcChannel *tc1 = &TC0->TC_CHANNEL[1];
+
+		if (sim_ssc_rx_state == SIM_SSC_RX_WAIT_SYNC)
+			sim_ssc_rx_state = SIM_SSC_RX_ON;
+		if ((TC0->TC_BMR & TC_BMR_TC1XC1S_Msk) == TC_BMR_TC1XC1S_TIOA2 &&
+		    (tc1->TC_CMR & TC_CMR_TCCLKS_Msk) == TC_CMR_TCCLKS_XC1)
+			SIM_WR(tc1->TC_CV) = (tc1->TC_CV + 1) & 0xffff;
+	}
+	return !!(tc->TC_SR & tc->TC_IMR);
+}
+
+void
+sim_tc_set_cv(int ch, uint32_t cv)
+{
+	SIM_WR(TC0->TC_CHANNEL[ch].TC_CV) = cv;
+}
+
+/* ==== stubs for modules not part of the simulation ==== */
+
+void
+sam4s_clock_peripheral_onoff(int peripheral, int on_off)
+{
+	(void)peripheral;
+	(void)on_off;
+}
+
+void
+sam4s_pinmux_function(int pin, enum sam4s_pinmux_function func)
+{
+	(void)pin;
+	(void)func;
+}
+
+void
+sam4s_pinmux_gpio_set(int pin, int val)
+{
+	(void)pin;
+	(void)val;
+}
+
+/* for stats_util.c */
+void
+sam4s_uart0_console_get_stats(struct sam4s_uart0_console_stats *p)
+{
+	memset(p, 0, sizeof(*p));
+}
+
+void
+gps_steer_get_stats(struct gps_steer_stats *p)
+{
+	memset(p, 0, sizeof(*p));
+}
+
+/* the host clock in MCK cycles */
+static uint64_t
+sim_dwt_host(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * F_MCK_HZ +
+		(uint64_t)ts.tv_nsec * (F_MCK_HZ / 1000) / 1000000;
+}
+
+void
+sim_dwt_set(uint32_t cyccnt)
+{
+	sim_dwt_fixed = 1;
+	sim_dwt_base = cyccnt;
+	sim_dwt_t0 = sim_dwt_host();
+	SIM_WR(sim_dwt_regs.CYCCNT) = cyccnt;
+}
+
+void
+sim_dwt_run(int on)
+{
+	if (!sim_dwt_fixed)
+		return;
+	if (on)
+		sim_dwt_t0 = sim_dwt_host();
+	else if (sim_dwt_running)
+		sim_dwt_base += sim_dwt_host() - sim_dwt_t0;
+	sim_dwt_running = on;
+	SIM_WR(sim_dwt_regs.CYCCNT) = sim_dwt_base;
+}
+
+DWT_Type *
+sim_dwt(void)
+{
+	if (!sim_dwt_fixed)
+		SIM_WR(sim_dwt_regs.CYCCNT) = (uint32_t)sim_dwt_host();
+	else if (sim_dwt_running)
+		SIM_WR(sim_dwt_regs.CYCCNT) = sim_dwt_base +
+			(uint32_t)(sim_dwt_host() - sim_dwt_t0);
+	return &sim_dwt_regs;
+}
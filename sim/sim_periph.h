@@ -0,0 +1,57 @@
+#ifndef SIM_PERIPH_H
+#define SIM_PERIPH_H
+
+#include <stdint.h>
+
+/*
+ * Emulation of the peripheral side of the SSC/PDC and TC register blocks
+ * for the host simulation. The firmware modules access the registers
+ * as usual, the harness calls these functions to move data and to
+ * decide when an interrupt handler has to run.
+ */
+
+struct sim_periph_stats {
+	unsigned long rx_words;     /* longwords written by the rx PDC */
+	unsigned long rx_lost;      /* ... dropped because RCR=RNCR=0 */
+	unsigned long tx_words;     /* longwords read by the tx PDC */
+	unsigned long tx_lost;      /* ... replaced by 0 because TCR=TNCR=0 */
+	unsigned long rx_off;       /* longwords not received, the receiver
+				       was disabled or waited for a frame
+				       sync */
+};
+
+extern struct sim_periph_stats sim_periph_stats;
+
+/* the SSC received one longword, the PDC stores it in memory */
+extern void sim_pdc_ssc_rx_word(uint32_t w);
+
+/* the SSC needs one longword to transmit, fetched by the PDC */
+extern uint32_t sim_pdc_ssc_tx_word(void);
+
+/* fold writes to the IER/IDR registers into IMR, update SR, returns
+   non-zero if the SSC interrupt is pending */
+extern int sim_ssc_irq_pending(void);
+
+/* to be called after SSC_Handler() ran, emulates clear-on-write flags
+   and SSC_CR: the last command written counts, RXDIS stops the receiver,
+   RXEN (re)starts it with the next frame sync, sim_tc_rc_compare(2) */
+extern void sim_ssc_irq_done(void);
+
+/* fold IER/IDR into IMR for timer channel ch, clear SR (clear on read) */
+extern void sim_tc_sync(int ch);
+
+/* counter of channel ch reached RC, returns non-zero if irq is pending.
+   For channel 2 that is the frame sync, it also clocks channel 1 when
+   that counts TIOA2 (XC1) */
+extern int sim_tc_rc_compare(int ch);
+
+/* counter value of channel ch, it is read-only for the firmware */
+extern void sim_tc_set_cv(int ch, uint32_t cv);
+
+/* from then on, DWT->CYCCNT reads cyccnt instead of the host clock */
+extern void sim_dwt_set(uint32_t cyccnt);
+/* after sim_dwt_set(): DWT->CYCCNT moves on with the host clock while on,
+   and stands still while off, around the handlers whose cycles count */
+extern void sim_dwt_run(int on);
+
+#endif
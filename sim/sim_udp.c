@@ -0,0 +1,444 @@
+/*
+ * This file is part of the osmocom sam4s usb interface firmware.
+ * Copyright (c) 2018 Christian Vogel <vogelchr@vogel.cx>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* model of the USB device port for the host simulation, see sim_udp.h */
+
+#include "sim_udp.h"
+
+#include <sam4s8b.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SIM_UDP_NEP 8
+
+/* registers which are read-only for the firmware are written here */
+#define SIM_WR(reg) (*(volatile uint32_t *)&(reg))
+
+/* what the firmware writes and the model keeps as written */
+#define SIM_UDP_CSR_CTL (UDP_CSR_DIR | UDP_CSR_FORCESTALL | \
+			 UDP_CSR_EPTYPE_Msk | UDP_CSR_EPEDS)
+/* latched by the model, cleared by writing 0 */
+#define SIM_UDP_CSR_FLAGS (UDP_CSR_TXCOMP | UDP_CSR_STALLSENT)
+/* any of them raises EPnINT */
+#define SIM_UDP_CSR_INT (UDP_CSR_TXCOMP | UDP_CSR_RX_DATA_BK0 | \
+			 UDP_CSR_RXSETUP | UDP_CSR_STALLSENT | \
+			 UDP_CSR_RX_DATA_BK1)
+/* the bus events in ISR, cleared by ICR */
+#define SIM_UDP_ISR_EVENTS (UDP_ISR_RXSUSP | UDP_ISR_RXRSM | UDP_ISR_EXTRSM | \
+			    UDP_ISR_SOFINT | UDP_ISR_ENDBUSRES | \
+			    UDP_ISR_WAKEUP)
+
+/* §40.2 Table 40-1 */
+static const unsigned int sim_udp_fifo_size[SIM_UDP_NEP] = {
+	64, 64, 64, 64, 512, 512, 64, 64
+};
+static const unsigned int sim_udp_nbanks[SIM_UDP_NEP] = {
+	1, 2, 2, 1, 2, 2, 2, 2
+};
+
+struct sim_udp_bank {
+	uint8_t data[512];
+	unsigned int len;
+};
+
+struct sim_udp_ep {
+	struct sim_udp_bank fill;   /* being written by the firmware */
+	struct sim_udp_bank tx;     /* ... handed over, TXPKTRDY */
+	int tx_ready;
+	struct sim_udp_bank rx[2];  /* received */
+	unsigned int rx_valid;      /* banks holding a packet, bit mask */
+	unsigned int rx_first;      /* the oldest of them */
+	unsigned int rx_next;       /* bank the next packet goes to */
+	unsigned int rx_pos;        /* fifo read position in the oldest */
+	int rx_setup;               /* bank 0 holds a setup packet */
+	uint32_t ctl;               /* SIM_UDP_CSR_CTL bits */
+	uint32_t flags;             /* SIM_UDP_CSR_FLAGS bits */
+};
+
+static Udp sim_udp_regs;
+/* CSR as the model last set it, a difference is a write */
+static uint32_t sim_udp_csr_shadow[SIM_UDP_NEP];
+static uint32_t sim_udp_isr_events;
+static struct sim_udp_ep sim_udp_ep[SIM_UDP_NEP];
+
+struct sim_udp_stats sim_udp_stats;
+
+static uint32_t
+sim_udp_csr(unsigned int ep)
+{
+	const struct sim_udp_ep *e = &sim_udp_ep[ep];
+	uint32_t csr = e->ctl | e->flags;
+
+	if (e->tx_ready)
+		csr |= UDP_CSR_TXPKTRDY;
+	if (e->rx_setup)
+		csr |= UDP_CSR_RXSETUP;
+	else {
+		if (e->rx_valid & 1)
+			csr |= UDP_CSR_RX_DATA_BK0;
+		if (e->rx_valid & 2)
+			csr |= UDP_CSR_RX_DATA_BK1;
+	}
+	if (e->rx_valid)
+		csr |= UDP_CSR_RXBYTECNT(e->rx[e->rx_first].len);
+	return csr;
+}
+
+/* registers from the state of the model */
+static void
+sim_udp_update(void)
+{
+	uint32_t isr = sim_udp_isr_events;
+	unsigned int ep;
+
+	for (ep=0; ep<SIM_UDP_NEP; ep++) {
+		uint32_t csr = sim_udp_csr(ep);
+
+		sim_udp_csr_shadow[ep] = csr;
+		sim_udp_regs.UDP_CSR[ep] = csr;
+		if (csr & SIM_UDP_CSR_INT)
+			isr |= 1U << ep;
+	}
+	SIM_WR(sim_udp_regs.UDP_ISR) = isr;
+	/* bit 12 (ENDBUSRES) cannot be masked */
+	SIM_WR(sim_udp_regs.UDP_IMR) |= UDP_IMR_BIT12;
+}
+
+static void
+sim_udp_rx_release(unsigned int ep, unsigned int bank)
+{
+	struct sim_udp_ep *e = &sim_udp_ep[ep];
+
+	if (!(e->rx_valid & (1U << bank)))
+		return;
+	if (bank != e->rx_first)
+		sim_udp_stats.bank_order++;
+	else
+		e->rx_pos = 0;
+	e->rx_valid &= ~(1U << bank);
+	/* what is left is the oldest */
+	e->rx_first = (e->rx_valid == 2);
+}
+
+/* fifo reset: RST_EP, bus reset */
+static void
+sim_udp_ep_flush(unsigned int ep)
+{
+	struct sim_udp_ep *e = &sim_udp_ep[ep];
+
+	if (e->rx_valid)
+		sim_udp_stats.rx_lost++;
+	e->fill.len = 0;
+	e->tx_ready = 0;
+	e->rx_valid = 0;
+	e->rx_first = 0;
+	e->rx_next = 0;
+	e->rx_pos = 0;
+	e->rx_setup = 0;
+	e->flags = 0;
+}
+
+/* the firmware has written w over h */
+static void
+sim_udp_csr_write(unsigned int ep, uint32_t w, uint32_t h)
+{
+	struct sim_udp_ep *e = &sim_udp_ep[ep];
+	uint32_t clr = h & ~w;
+
+	e->ctl = w & SIM_UDP_CSR_CTL;
+	e->flags &= ~(clr & SIM_UDP_CSR_FLAGS);
+
+	if (clr & UDP_CSR_RXSETUP) {
+		/* §40.6.2.1: DIR has to be set before RXSETUP is cleared,
+		   or the in data stage gets NAKs */
+		if ((e->rx[0].data[0] & 0x80) && !(w & UDP_CSR_DIR))
+			sim_udp_stats.dir_late++;
+		e->rx_setup = 0;
+		sim_udp_rx_release(ep, 0);
+	}
+	if (clr & UDP_CSR_RX_DATA_BK0)
+		sim_udp_rx_release(ep, 0);
+	if (clr & UDP_CSR_RX_DATA_BK1)
+		sim_udp_rx_release(ep, 1);
+
+	if (!(h & UDP_CSR_TXPKTRDY) && (w & UDP_CSR_TXPKTRDY)) {
+		e->tx = e->fill;
+		e->tx_ready = 1;
+		e->fill.len = 0;
+	} else if (clr & UDP_CSR_TXPKTRDY) {
+		/* cancelled, the bank is flushed */
+		e->tx_ready = 0;
+		e->fill.len = 0;
+	}
+}
+
+/* applies what has been written since the last call */
+static void
+sim_udp_sync(void)
+{
+	Udp *u = &sim_udp_regs;
+	uint32_t rst = u->UDP_RST_EP;
+	unsigned int ep;
+
+	if (u->UDP_IER || u->UDP_IDR) {
+		SIM_WR(u->UDP_IMR) = (u->UDP_IMR | u->UDP_IER) & ~u->UDP_IDR;
+		u->UDP_IER = 0;
+		u->UDP_IDR = 0;
+	}
+	if (u->UDP_ICR) {
+		sim_udp_isr_events &= ~u->UDP_ICR;
+		u->UDP_ICR = 0;
+	}
+	for (ep=0; ep<SIM_UDP_NEP; ep++) {
+		if (rst & (1U << ep))
+			sim_udp_ep_flush(ep);
+		if (u->UDP_CSR[ep] != sim_udp_csr_shadow[ep])
+			sim_udp_csr_write(ep, u->UDP_CSR[ep],
+				sim_udp_csr_shadow[ep]);
+	}
+	sim_udp_update();
+}
+
+Udp *
+sim_udp(void)
+{
+	sim_udp_sync();
+	return &sim_udp_regs;
+}
+
+/* the fifo accessors only look at the endpoint they are for, a pending
+   write of its CSR has to be applied first */
+static struct sim_udp_ep *
+sim_udp_fdr_ep(volatile uint32_t *fdr, unsigned int *ep)
+{
+	*ep = fdr - sim_udp_regs.UDP_FDR;
+	if (sim_udp_regs.UDP_CSR[*ep] != sim_udp_csr_shadow[*ep])
+		sim_udp_sync();
+	return &sim_udp_ep[*ep];
+}
+
+void
+sim_udp_fdr_wr(volatile uint32_t *fdr, uint32_t v)
+{
+	unsigned int ep;
+	struct sim_udp_ep *e = sim_udp_fdr_ep(fdr, &ep);
+
+	if (e->tx_ready && sim_udp_nbanks[ep] == 1)
+		sim_udp_stats.fifo_overrun++;
+	if (e->fill.len >= sim_udp_fifo_size[ep]) {
+		sim_udp_stats.fifo_overrun++;
+		return;
+	}
+	e->fill.data[e->fill.len++] = v;
+}
+
+uint32_t
+sim_udp_fdr_rd(volatile uint32_t *fdr)
+{
+	unsigned int ep;
+	struct sim_udp_ep *e = sim_udp_fdr_ep(fdr, &ep);
+
+	if (!e->rx_valid || e->rx_pos >= e->rx[e->rx_first].len) {
+		sim_udp_stats.fifo_underrun++;
+		return 0;
+	}
+	return e->rx[e->rx_first].data[e->rx_pos++];
+}
+
+void
+sim_udp_reset(void)
+{
+	memset(&sim_udp_regs, 0, sizeof(sim_udp_regs));
+	memset(sim_udp_ep, 0, sizeof(sim_udp_ep));
+	memset(&sim_udp_stats, 0, sizeof(sim_udp_stats));
+	sim_udp_isr_events = 0;
+	sim_udp_regs.UDP_FADDR = UDP_FADDR_FEN;
+	sim_udp_regs.UDP_TXVC = UDP_TXVC_TXVDIS;
+	sim_udp_update();
+}
+
+/* §40.6.3.3: the endpoints are disabled, FADDR, GLB_STAT and the
+   interrupt mask reset */
+void
+sim_udp_bus_reset(void)
+{
+	unsigned int ep;
+
+	sim_udp_sync();
+	for (ep=0; ep<SIM_UDP_NEP; ep++) {
+		sim_udp_ep_flush(ep);
+		sim_udp_ep[ep].ctl = 0;
+	}
+	sim_udp_regs.UDP_FADDR = UDP_FADDR_FEN;
+	sim_udp_regs.UDP_GLB_STAT = 0;
+	SIM_WR(sim_udp_regs.UDP_IMR) = 0;
+	sim_udp_isr_events = UDP_ISR_ENDBUSRES;
+	sim_udp_update();
+}
+
+void
+sim_udp_sof(unsigned int frm_num)
+{
+	sim_udp_sync();
+	SIM_WR(sim_udp_regs.UDP_FRM_NUM) = UDP_FRM_NUM_FRM_OK |
+		(frm_num & UDP_FRM_NUM_FRM_NUM_Msk);
+	sim_udp_isr_events |= UDP_ISR_SOFINT;
+	sim_udp_update();
+}
+
+int
+sim_udp_attached(void)
+{
+	sim_udp_sync();
+	return (sim_udp_regs.UDP_TXVC & (UDP_TXVC_PUON | UDP_TXVC_TXVDIS)) ==
+		UDP_TXVC_PUON;
+}
+
+/* the device answers a token to addr on ep, stats updated if not */
+static int
+sim_udp_token(unsigned int addr, unsigned int ep)
+{
+	uint32_t faddr;
+	unsigned int dev = 0;
+
+	sim_udp_sync();
+	faddr = sim_udp_regs.UDP_FADDR;
+	if (sim_udp_regs.UDP_GLB_STAT & UDP_GLB_STAT_FADDEN)
+		dev = faddr & UDP_FADDR_FADD_Msk;
+	if (!sim_udp_attached() || !(faddr & UDP_FADDR_FEN) || addr != dev ||
+	    ep >= SIM_UDP_NEP || !(sim_udp_ep[ep].ctl & UDP_CSR_EPEDS)) {
+		sim_udp_stats.timeout++;
+		return 0;
+	}
+	return 1;
+}
+
+static int
+sim_udp_iso(unsigned int ep)
+{
+	uint32_t type = sim_udp_ep[ep].ctl & UDP_CSR_EPTYPE_Msk;
+
+	return type == UDP_CSR_EPTYPE_ISO_IN || type == UDP_CSR_EPTYPE_ISO_OUT;
+}
+
+int
+sim_udp_setup(unsigned int addr, const void *pkt)
+{
+	struct sim_udp_ep *e = &sim_udp_ep[0];
+
+	if (!sim_udp_token(addr, 0))
+		return SIM_UDP_TIMEOUT;
+
+	/* a setup is always taken, whatever is left in the bank is gone */
+	if (e->rx_valid)
+		sim_udp_stats.rx_lost++;
+	memcpy(e->rx[0].data, pkt, 8);
+	e->rx[0].len = 8;
+	e->rx_valid = 1;
+	e->rx_first = 0;
+	e->rx_next = 0;
+	e->rx_pos = 0;
+	e->rx_setup = 1;
+	sim_udp_stats.setup++;
+	sim_udp_update();
+	return 8;
+}
+
+int
+sim_udp_in(unsigned int addr, unsigned int ep, void *buf, unsigned int max)
+{
+	struct sim_udp_ep *e = &sim_udp_ep[ep];
+	unsigned int n;
+
+	if (!sim_udp_token(addr, ep))
+		return SIM_UDP_TIMEOUT;
+
+	if (e->ctl & UDP_CSR_FORCESTALL) {
+		e->flags |= UDP_CSR_STALLSENT;
+		sim_udp_stats.stall++;
+		sim_udp_update();
+		return SIM_UDP_STALL;
+	}
+	if (!e->tx_ready) {
+		if (sim_udp_iso(ep)) {
+			sim_udp_stats.iso_in_empty++;
+			return 0;
+		}
+		sim_udp_stats.nak++;
+		return SIM_UDP_NAK;
+	}
+
+	n = e->tx.len < max ? e->tx.len : max;
+	memcpy(buf, e->tx.data, n);
+	e->tx_ready = 0;
+	e->flags |= UDP_CSR_TXCOMP;
+	sim_udp_stats.in_pkts++;
+	sim_udp_stats.in_bytes += n;
+	sim_udp_update();
+	return n;
+}
+
+int
+sim_udp_out(unsigned int addr, unsigned int ep, const void *buf,
+	unsigned int len)
+{
+	struct sim_udp_ep *e = &sim_udp_ep[ep];
+	unsigned int b;
+
+	if (!sim_udp_token(addr, ep))
+		return SIM_UDP_TIMEOUT;
+
+	if (e->ctl & UDP_CSR_FORCESTALL) {
+		e->flags |= UDP_CSR_STALLSENT;
+		sim_udp_stats.stall++;
+		sim_udp_update();
+		return SIM_UDP_STALL;
+	}
+	/* no free bank, or the setup still there */
+	if (e->rx_setup || e->rx_valid == (1U << sim_udp_nbanks[ep]) - 1) {
+		if (sim_udp_iso(ep)) {
+			sim_udp_stats.iso_out_lost++;
+			return 0;
+		}
+		sim_udp_stats.nak++;
+		return SIM_UDP_NAK;
+	}
+
+	if (len > sim_udp_fifo_size[ep])
+		len = sim_udp_fifo_size[ep];
+	b = e->rx_next;
+	memcpy(e->rx[b].data, buf, len);
+	e->rx[b].len = len;
+	if (!e->rx_valid) {
+		e->rx_first = b;
+		e->rx_pos = 0;
+	}
+	e->rx_valid |= 1U << b;
+	if (sim_udp_nbanks[ep] == 2)
+		e->rx_next = b ^ 1;
+	sim_udp_stats.out_pkts++;
+	sim_udp_stats.out_bytes += len;
+	sim_udp_update();
+	return len;
+}
+
+int
+sim_udp_irq_pending(void)
+{
+	sim_udp_sync();
+	return !!(sim_udp_regs.UDP_ISR & sim_udp_regs.UDP_IMR);
+}
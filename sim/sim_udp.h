@@ -0,0 +1,84 @@
+#ifndef SIM_UDP_H
+#define SIM_UDP_H
+
+#include <stdint.h>
+
+/*
+ * Model of the SAM4S USB device port (UDP) for the host simulation, the
+ * device side as sam4s_usb.c sees it and the bus side driven by a
+ * scripted host (sim/usb_sim.c).
+ *
+ * Registers: UDP expands to sim_udp(), which brings the register block up
+ * to date before every access. Whatever the firmware has written since
+ * the last access is applied then, CSR writes with the semantics of
+ * §40.7.10 (RXSETUP, RX_DATA_BKx, TXCOMP and STALLSENT cleared by writing
+ * 0, TXPKTRDY queues or cancels the bank written, the rest as written),
+ * IER/IDR folded into IMR, ICR clears the ISR bits it has set, RST_EP
+ * flushes the fifos. ISR and the RXBYTECNT of CSR follow the state of the
+ * endpoints. The fifo is not memory mapped, sam4s_usb.c goes through
+ * SAM4S_USB_FDR_WR/RD, see sim/include/sam4s8b.h.
+ *
+ * Endpoints 0 and 3 have one bank, the others two (ping-pong). Writes to
+ * the fifo go to the bank being filled, TXPKTRDY hands it to the host,
+ * the next IN token takes it and sets TXCOMP. Received packets go to the
+ * free bank, RX_DATA_BK0/1 in the order received, the fifo reads from
+ * the oldest one. An isochronous IN without a bank ready gets a zero
+ * length packet, an isochronous OUT without a free bank is lost, other
+ * endpoints answer NAK. Timing, data toggles and CRCs are not modelled.
+ *
+ * Misuse that the real peripheral would not report but get wrong is
+ * counted in struct sim_udp_stats, see there.
+ */
+
+/* result of a token from the host, >= 0: ACK (IN: with that many bytes) */
+#define SIM_UDP_NAK     (-1)
+#define SIM_UDP_STALL   (-2)
+#define SIM_UDP_TIMEOUT (-3) /* wrong address, disabled or detached */
+
+struct sim_udp_stats {
+	unsigned long setup;        /* SETUP packets */
+	unsigned long in_pkts;      /* IN tokens answered with data */
+	unsigned long in_bytes;
+	unsigned long out_pkts;     /* OUT packets accepted */
+	unsigned long out_bytes;
+	unsigned long nak;
+	unsigned long stall;
+	unsigned long timeout;
+	unsigned long iso_in_empty; /* iso IN without a bank: zero length */
+	unsigned long iso_out_lost; /* iso OUT without a free bank */
+	/* firmware errors */
+	unsigned long fifo_overrun;  /* write beyond the bank, or into a
+					single bank still waiting for IN */
+	unsigned long fifo_underrun; /* read of more than RXBYTECNT */
+	unsigned long bank_order;    /* RX_DATA_BKx released that was not
+					the oldest bank */
+	unsigned long dir_late;      /* RXSETUP of an in request cleared
+					before DIR was set */
+	unsigned long rx_lost;       /* setup or data discarded by a bus
+					reset, RST_EP or another setup */
+};
+
+extern struct sim_udp_stats sim_udp_stats;
+
+/* power on state of the register block */
+extern void sim_udp_reset(void);
+
+/* bus events, set ENDBUSRES or SOFINT (and the frame number) */
+extern void sim_udp_bus_reset(void);
+extern void sim_udp_sof(unsigned int frm_num);
+
+/* tokens to address addr, endpoint ep: SETUP always gets an ACK (or a
+   timeout), IN copies up to max bytes of the packet to buf */
+extern int sim_udp_setup(unsigned int addr, const void *pkt);
+extern int sim_udp_in(unsigned int addr, unsigned int ep, void *buf,
+	unsigned int max);
+extern int sim_udp_out(unsigned int addr, unsigned int ep, const void *buf,
+	unsigned int len);
+
+/* brings the registers up to date, non-zero if UDP_Handler() has to run */
+extern int sim_udp_irq_pending(void);
+
+/* the pull-up is on (UDP_TXVC.PUON), the host sees the device */
+extern int sim_udp_attached(void);
+
+#endif
@@ -0,0 +1,973 @@
+/*
+ * This file is part of the osmocom sam4s usb interface firmware.
+ * Copyright (c) 2018 Christian Vogel <vogelchr@vogel.cx>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host simulation of the USB device stack: the unmodified sam4s_usb.c
+ * runs against the model of the UDP in sim/sim_udp.c, fed by the E1 side
+ * of sim/e1_sim.c (sam4s_ssc.c, e1_mgmt.c... against sim/sim_periph.c).
+ * A scripted host enumerates the device much like Linux does, runs the
+ * vendor requests and then streams the iso endpoints with one SOF per
+ * simulated ms: iso in is checked against what went into the SSC, raw
+ * and, from half way on, demultiplexed, each packet at the position its
+ * header gives, so that an rx overflow (forced by holding off the ssc
+ * irq) shows as a gap there; iso out is sized by the feedback endpoint
+ * like a host would and checked against what the SSC sends.
+ *
+ * UDP_Handler() runs whenever the model raises the interrupt, and its
+ * time is taken per cause (control, SOF, iso in TXCOMP, iso out bank).
+ * It includes the model behind every register access, which is small
+ * against the fifo copies but not zero.
+ */
+
+#include "sim_periph.h"
+#include "sim_udp.h"
+
+#include "sam4s_ssc.h"
+#include "sam4s_timer.h"
+#include "sam4s_usb.h"
+#include "sam4s_usb_descriptors.h"
+#include "sam4s_clock.h"
+#include "e1_mgmt.h"
+#include "e1_demux.h"
+#include "e1_tx.h"
+#include "e1_rate.h"
+#include "e1_ts0.h"
+#include "stats_util.h"
+#include "trace_util.h"
+
+#include <sam4s8b.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* address the host gives the device */
+#define USB_SIM_ADDR 5
+#define USB_SIM_EP0_PKT 64
+/* a NAK is retried that often, the device never gets slower */
+#define USB_SIM_NAK_TRIES 3
+/* UDP_Handler() calls per event before the interrupt counts as stuck */
+#define USB_SIM_IRQ_MAX 16
+
+#define USB_SIM_EP_ISO_IN  4
+#define USB_SIM_EP_ISO_OUT 5
+#define USB_SIM_EP_ISO_FB  6
+#define USB_SIM_EP_TRACE   7
+/* default as in sam4s_usb.c, with 0 nothing comes on the trace endpoint */
+#ifndef SAM4S_USB_TRACE
+#define SAM4S_USB_TRACE 1
+#endif
+#define USB_SIM_ISO_PKT    512
+/* 256 bytes per frame in 10.14 */
+#define USB_SIM_FB_NOMINAL (256 << 14)
+/* cycles per longword of the line, and from the last one to the ssc irq */
+#define USB_SIM_CYCLES_PER_LW (2 * SAM4S_SSC_CMR_DIV * SAM4S_SSC_BITS_PER_LONGWORD)
+#define USB_SIM_IRQ_CYCLES    100
+/* -o default: a stall the PDC cannot bridge */
+#define USB_SIM_STALL (2 * SAM4S_SSC_BATCH + 4)
+
+/* the longwords of both streams are an odd multiple of their position,
+   so each one can be placed (x USB_SIM_MUL^-1 mod 2^32) */
+#define USB_SIM_MUL 0x9e3779b1U
+
+#define BMREQUESTTYPE_IN     0x80
+#define BMREQUESTTYPE_VENDOR 0x40
+#define BMREQUESTTYPE_ENDP   0x02
+
+struct usb_sim_time {
+	unsigned long n;
+	uint64_t sum, min, max;   /* ns */
+};
+
+static unsigned int usb_sim_addr;
+static uint32_t usb_sim_inv;     /* USB_SIM_MUL^-1 */
+static unsigned int usb_sim_fail;
+static unsigned long usb_sim_irq_stuck;
+
+static struct usb_sim_time usb_sim_t_ctrl, usb_sim_t_sof, usb_sim_t_in,
+	usb_sim_t_fb, usb_sim_t_out, usb_sim_t_trace;
+
+/* E1 side: longwords fed to the rx PDC, taken from the tx PDC, the
+   latter at the start of ms 0 of the stream, 0 before */
+static uint64_t usb_sim_rx_pos, usb_sim_tx_pos, usb_sim_tx_pos0;
+
+/* double-frames the ssc irq is still held off for */
+static unsigned int usb_sim_rx_stall;
+
+/* iso in, raw: longword of the stream at header pos 0 once found, and
+   the pos the next packet continues at. Gaps are what the headers skip */
+static int usb_sim_rx_synced;
+static uint32_t usb_sim_rx_off, usb_sim_rx_next;
+static unsigned long usb_sim_rx_ok, usb_sim_rx_bad, usb_sim_rx_sync,
+	usb_sim_rx_unplaced, usb_sim_rx_gap, usb_sim_rx_gaps;
+/* iso in, timeslots: the same in groups, the offset in frames */
+static int usb_sim_grp_synced;
+static int64_t usb_sim_grp_off;
+static uint32_t usb_sim_grp_next;
+static unsigned long usb_sim_grp_ok, usb_sim_grp_bad, usb_sim_grp_sync,
+	usb_sim_grp_unplaced, usb_sim_grp_gap, usb_sim_grp_gaps;
+/* iso out: longwords sent by the host, the next one expected on the
+   line */
+static uint64_t usb_sim_tx_sent;
+static int64_t usb_sim_tx_exp = -1;
+static unsigned long usb_sim_tx_ok, usb_sim_tx_bad, usb_sim_tx_sync,
+	usb_sim_tx_unplaced;
+
+static uint64_t
+sim_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+usb_sim_check(int ok, const char *what)
+{
+	if (ok)
+		return;
+	printf("FAIL: %s\n", what);
+	usb_sim_fail++;
+}
+
+static void
+usb_sim_time_add(struct usb_sim_time *t, uint64_t ns)
+{
+	if (!t->n || ns < t->min)
+		t->min = ns;
+	if (ns > t->max)
+		t->max = ns;
+	t->sum += ns;
+	t->n++;
+}
+
+static void
+usb_sim_time_print(const char *name, const struct usb_sim_time *t)
+{
+	printf("UDP_Handler %-8s %7lu calls, min %llu ns, avg %.1f ns, "
+		"max %llu ns\n", name, t->n, (unsigned long long)t->min,
+		t->n ? (double)t->sum / t->n : 0.0,
+		(unsigned long long)t->max);
+}
+
+/* runs UDP_Handler() for as long as the interrupt is pending, like the
+   NVIC would, the time goes to t and moves DWT->CYCCNT on */
+static void
+usb_sim_irq(struct usb_sim_time *t)
+{
+	unsigned int n = 0;
+	uint64_t t0;
+
+	while (sim_udp_irq_pending()) {
+		if (++n > USB_SIM_IRQ_MAX) {
+			usb_sim_irq_stuck++;
+			return;
+		}
+		t0 = sim_now_ns();
+		sim_dwt_run(1);
+		UDP_Handler();
+		sim_dwt_run(0);
+		usb_sim_time_add(t, sim_now_ns() - t0);
+	}
+}
+
+/* ==== E1 side ==== */
+
+/* longword j of the rx stream, FAS/NFAS in timeslot 0 keep e1_align
+   locked */
+static uint32_t
+usb_sim_rx_lw(uint64_t j)
+{
+	uint32_t v = (uint32_t)j * USB_SIM_MUL;
+
+	switch (j % SAM4S_SSC_DBLFRM_LONGWORDS) {
+	case 0:
+		return (v & 0x00ffffff) | (0x9bU << 24);
+	case 8:
+		return (v & 0x00ffffff) | (0xdfU << 24);
+	}
+	return v;
+}
+
+/* longword k sent by the host on iso out */
+static uint32_t
+usb_sim_tx_lw(uint64_t k)
+{
+	return (uint32_t)k * USB_SIM_MUL + 1;
+}
+
+/* what the SSC sends: timeslot 0 is the firmware's, the rest has to be
+   the host's stream without gaps once it has started */
+static void
+usb_sim_tx_check(uint32_t lw)
+{
+	unsigned int pos = usb_sim_tx_pos++ % SAM4S_SSC_DBLFRM_LONGWORDS;
+	uint32_t m = (pos == 0 || pos == 8) ? 0x00ffffff : 0xffffffff;
+	uint32_t k;
+
+	if (usb_sim_tx_exp >= 0) {
+		if (!((lw ^ usb_sim_tx_lw(usb_sim_tx_exp)) & m)) {
+			usb_sim_tx_exp++;
+			usb_sim_tx_ok++;
+			return;
+		}
+		usb_sim_tx_bad++;
+		usb_sim_tx_exp = -1;
+	}
+
+	/* the idle pattern is a longword of the stream as well, but one
+	   that has not been sent yet */
+	k = (lw - 1) * usb_sim_inv;
+	if (m != 0xffffffff || usb_sim_tx_lw(k) != lw || k >= usb_sim_tx_sent) {
+		usb_sim_tx_unplaced++;
+		return;
+	}
+	usb_sim_tx_sync++;
+	usb_sim_tx_exp = (uint64_t)k + 1;
+	usb_sim_tx_ok++;
+}
+
+/* one double-frame through the PDC, the frame sync and the SSC irq, see
+   sim/e1_sim.c */
+static void
+usb_sim_e1_dblfrm(void)
+{
+	TcChannel *tc2 = &TC0->TC_CHANNEL[2];
+	int w;
+
+	for (w=0; w<SAM4S_SSC_DBLFRM_LONGWORDS; w++) {
+		sim_pdc_ssc_rx_word(usb_sim_rx_lw(usb_sim_rx_pos++));
+		sim_tc_set_cv(2, ((w + 1) * SAM4S_SSC_BITS_PER_LONGWORD) %
+			tc2->TC_RC);
+		usb_sim_tx_check(sim_pdc_ssc_tx_word());
+	}
+	if (sim_tc_rc_compare(2))
+		TC2_Handler();
+	sim_tc_sync(2);
+	/* held off, as with e1_sim -x */
+	if (usb_sim_rx_stall) {
+		usb_sim_rx_stall--;
+		sim_ssc_irq_pending();
+		return;
+	}
+	/* from ms 0 on, the cycle counter at the SOF counts the ms: the same
+	   for the ssc irq, the tx recovery after a stall waits for it to
+	   move on to the next longword */
+	if (usb_sim_tx_pos0)
+		sim_dwt_set((usb_sim_tx_pos - usb_sim_tx_pos0) *
+			USB_SIM_CYCLES_PER_LW + USB_SIM_IRQ_CYCLES);
+	if (sim_ssc_irq_pending()) {
+		SSC_Handler();
+		sim_ssc_irq_done();
+	}
+}
+
+/* what the main loop of the firmware does once per ms */
+static void
+usb_sim_main_loop(unsigned long ms)
+{
+	struct trace_util_data d;
+
+	e1_mgmt_poll();
+	/* the console, until the trace goes to usb */
+	while (trace_util_read(&d) == 0)
+		;
+	if (ms % (1000 / SAM4S_CLOCK_HZ) == 0) {
+		sam4s_clock_tick++;
+		stats_util_poll();
+	}
+}
+
+/* ==== the host ==== */
+
+static int
+usb_sim_in(unsigned int ep, void *buf, unsigned int max,
+	struct usb_sim_time *t)
+{
+	int r, tries = USB_SIM_NAK_TRIES;
+
+	do {
+		r = sim_udp_in(usb_sim_addr, ep, buf, max);
+		usb_sim_irq(t);
+	} while (r == SIM_UDP_NAK && --tries);
+	return r;
+}
+
+static int
+usb_sim_out(unsigned int ep, const void *buf, unsigned int len,
+	struct usb_sim_time *t)
+{
+	int r, tries = USB_SIM_NAK_TRIES;
+
+	do {
+		r = sim_udp_out(usb_sim_addr, ep, buf, len);
+		usb_sim_irq(t);
+	} while (r == SIM_UDP_NAK && --tries);
+	return r;
+}
+
+/* one control transfer, returns the length of the data stage, or -1 if
+   the device stalled or did not answer */
+static int
+usb_sim_ctrl(uint8_t type, uint8_t req, uint16_t val, uint16_t idx,
+	uint16_t len, void *data)
+{
+	uint8_t setup[8] = {
+		type, req, val, val >> 8, idx, idx >> 8, len, len >> 8
+	};
+	uint8_t pkt[USB_SIM_EP0_PKT];
+	uint8_t *p = data;
+	unsigned int n = 0, k;
+	int r;
+
+	if (sim_udp_setup(usb_sim_addr, setup) < 0)
+		return -1;
+	usb_sim_irq(&usb_sim_t_ctrl);
+
+	/* without a data stage the status is always in */
+	if ((type & BMREQUESTTYPE_IN) && len) {
+		/* up to a short packet or len bytes, status out */
+		while (n < len) {
+			r = usb_sim_in(0, pkt, sizeof(pkt), &usb_sim_t_ctrl);
+			if (r < 0)
+				return -1;
+			k = r;
+			if (k > len - n) {
+				usb_sim_check(0, "control in: more than wLength");
+				k = len - n;
+			}
+			memcpy(p + n, pkt, k);
+			n += k;
+			if (r < USB_SIM_EP0_PKT)
+				break;
+		}
+		r = usb_sim_out(0, pkt, 0, &usb_sim_t_ctrl);
+		return r < 0 ? -1 : (int)n;
+	}
+
+	/* full packets and a short one, status in */
+	while (n < len) {
+		k = len - n < USB_SIM_EP0_PKT ? len - n : USB_SIM_EP0_PKT;
+		r = usb_sim_out(0, p + n, k, &usb_sim_t_ctrl);
+		if (r < 0)
+			return -1;
+		n += k;
+	}
+	r = usb_sim_in(0, pkt, sizeof(pkt), &usb_sim_t_ctrl);
+	if (r < 0)
+		return -1;
+	usb_sim_check(r == 0, "control out: status stage with data");
+	return n;
+}
+
+static uint32_t
+usb_sim_eptype(uint8_t addr, uint8_t attr)
+{
+	int in = addr & 0x80;
+
+	switch (attr & 3) {
+	case 1:
+		return in ? UDP_CSR_EPTYPE_ISO_IN : UDP_CSR_EPTYPE_ISO_OUT;
+	case 2:
+		return in ? UDP_CSR_EPTYPE_BULK_IN : UDP_CSR_EPTYPE_BULK_OUT;
+	case 3:
+		return in ? UDP_CSR_EPTYPE_INT_IN : UDP_CSR_EPTYPE_INT_OUT;
+	}
+	return UDP_CSR_EPTYPE_CTRL;
+}
+
+/* reset, addressing, descriptors and configuration, the standard
+   requests around it and the ones that have to stall */
+static void
+usb_sim_enumerate(void)
+{
+	uint8_t buf[256];
+	uint8_t setup[8] = { BMREQUESTTYPE_IN, 0x06, 0x00, 0x01, 0, 0, 18, 0 };
+	unsigned int total, k;
+	int r;
+
+	usb_sim_check(sim_udp_attached(), "pull-up not on");
+	usb_sim_addr = 0;
+	sim_udp_bus_reset();
+	usb_sim_irq(&usb_sim_t_ctrl);
+
+	/* the first 8 bytes for bMaxPacketSize0, Linux asks for 64 */
+	r = usb_sim_ctrl(BMREQUESTTYPE_IN, 0x06, 0x0100, 0, 64, buf);
+	usb_sim_check(r == sizeof(sam4s_usb_descr_dev) &&
+		!memcmp(buf, &sam4s_usb_descr_dev, r), "device descriptor");
+	usb_sim_check(buf[7] == USB_SIM_EP0_PKT, "bMaxPacketSize0");
+	sim_udp_bus_reset();
+	usb_sim_irq(&usb_sim_t_ctrl);
+
+	r = usb_sim_ctrl(0x00, 0x05, USB_SIM_ADDR, 0, 0, NULL);
+	usb_sim_check(r == 0, "SET_ADDRESS");
+	usb_sim_check(sim_udp_setup(0, setup) == SIM_UDP_TIMEOUT,
+		"device still answers address 0");
+	usb_sim_addr = USB_SIM_ADDR;
+
+	r = usb_sim_ctrl(BMREQUESTTYPE_IN, 0x06, 0x0100, 0, 18, buf);
+	usb_sim_check(r == sizeof(sam4s_usb_descr_dev) &&
+		!memcmp(buf, &sam4s_usb_descr_dev, r),
+		"device descriptor at the new address");
+
+	/* configuration: the header, then all of it */
+	r = usb_sim_ctrl(BMREQUESTTYPE_IN, 0x06, 0x0200, 0, 9, buf);
+	usb_sim_check(r == 9 && !memcmp(buf, &sam4s_usb_descr_cfg, 9),
+		"configuration descriptor header");
+	total = buf[2] | buf[3] << 8;
+	r = usb_sim_ctrl(BMREQUESTTYPE_IN, 0x06, 0x0200, 0, 255, buf);
+	usb_sim_check(r == (int)total, "configuration descriptor length");
+
+	/* every endpoint in it is enabled with that type */
+	for (k=0; r > 0 && k + 2 <= total && buf[k]; k += buf[k]) {
+		uint32_t csr;
+
+		if (buf[k+1] != LIBUSB_DT_ENDPOINT || k + 7 > total)
+			continue;
+		csr = UDP->UDP_CSR[buf[k+2] & 0x0f];
+		usb_sim_check((csr & UDP_CSR_EPEDS) &&
+			(csr & UDP_CSR_EPTYPE_Msk) ==
+			usb_sim_eptype(buf[k+2], buf[k+3]),
+			"endpoint type differs from the descriptor");
+	}
+
+	/* no string descriptors: stall, and the next request goes through */
+	r = usb_sim_ctrl(BMREQUESTTYPE_IN, 0x06, 0x0300, 0, 255, buf);
+	usb_sim_check(r == -1, "string descriptor not stalled");
+	r = usb_sim_ctrl(BMREQUESTTYPE_IN, 0x00, 0, 0, 2, buf);
+	usb_sim_check(r == 2 && !buf[0] && !buf[1], "GET_STATUS after stall");
+
+	r = usb_sim_ctrl(0x00, 0x09, 1, 0, 0, NULL);
+	usb_sim_check(r == 0, "SET_CONFIGURATION");
+	usb_sim_check(UDP->UDP_GLB_STAT & UDP_GLB_STAT_CONFG, "CONFG not set");
+	r = usb_sim_ctrl(BMREQUESTTYPE_IN, 0x08, 0, 0, 1, buf);
+	usb_sim_check(r == 1 && buf[0] == 1, "GET_CONFIGURATION");
+	r = usb_sim_ctrl(BMREQUESTTYPE_IN | BMREQUESTTYPE_ENDP, 0x00, 0,
+		0x84, 2, buf);
+	usb_sim_check(r == 2 && !buf[0] && !buf[1], "GET_STATUS endpoint");
+
+	/* unknown vendor requests, without and with an out data stage */
+	r = usb_sim_ctrl(BMREQUESTTYPE_IN | BMREQUESTTYPE_VENDOR, 0x7f, 0, 0,
+		16, buf);
+	usb_sim_check(r == -1, "unknown in request not stalled");
+	memset(buf, 0x55, 100);
+	r = usb_sim_ctrl(BMREQUESTTYPE_VENDOR, 0x7f, 0, 0, 100, buf);
+	usb_sim_check(r == -1, "unknown out request not stalled");
+}
+
+/* the statistics block, in one transfer and continued from an offset */
+static void
+usb_sim_get_stats(struct stats_util_block *b)
+{
+	uint8_t buf[sizeof(*b)];
+	int r;
+
+	r = usb_sim_ctrl(BMREQUESTTYPE_IN | BMREQUESTTYPE_VENDOR,
+		SAM4S_USB_VREQ_GET_STATS, 0, 0, sizeof(*b), b);
+	usb_sim_check(r == sizeof(*b), "GET_STATS length");
+	usb_sim_check(b->version == STATS_UTIL_VERSION &&
+		b->len == sizeof(*b), "GET_STATS version");
+
+	r = usb_sim_ctrl(BMREQUESTTYPE_IN | BMREQUESTTYPE_VENDOR,
+		SAM4S_USB_VREQ_GET_STATS, 0, 0, 0, buf);
+	usb_sim_check(r == 0, "GET_STATS wLength 0");
+	r = usb_sim_ctrl(BMREQUESTTYPE_IN | BMREQUESTTYPE_VENDOR,
+		SAM4S_USB_VREQ_GET_STATS, 0, USB_SIM_EP0_PKT + 1, 2048, buf);
+	usb_sim_check(r == sizeof(*b) - USB_SIM_EP0_PKT - 1 &&
+		!memcmp(buf, (uint8_t *)b + USB_SIM_EP0_PKT + 1, r),
+		"GET_STATS continued");
+}
+
+/* the received multiframes from an offset, and a few queued to send:
+   no double-frames are processed in between, so nothing moves */
+static void
+usb_sim_ts0(void)
+{
+	uint8_t buf[sizeof(struct sam4s_usb_ts0_hdr) +
+		E1_TS0_TX_MF * sizeof(struct e1_ts0_mf)];
+	struct sam4s_usb_ts0_hdr h;
+	struct e1_ts0_mf m[E1_TS0_TX_MF];
+	unsigned int room;
+	int r;
+
+	r = usb_sim_ctrl(BMREQUESTTYPE_IN | BMREQUESTTYPE_VENDOR,
+		SAM4S_USB_VREQ_GET_TS0, 0, 0, sizeof(h), &h);
+	usb_sim_check(r == sizeof(h) && h.n == 0 &&
+		h.seq == e1_ts0_rx_seq && h.seq >= 4, "GET_TS0 header");
+	room = h.tx_room;
+
+	r = usb_sim_ctrl(BMREQUESTTYPE_IN | BMREQUESTTYPE_VENDOR,
+		SAM4S_USB_VREQ_GET_TS0, 0, h.seq - 4, sizeof(buf), buf);
+	memcpy(&h, buf, sizeof(h));
+	usb_sim_check(r == sizeof(h) + 4 * sizeof(m[0]) && h.n == 4 &&
+		!memcmp(buf + sizeof(h), &e1_ts0_rx_buf[(h.seq - 4) %
+		E1_TS0_RX_MF], sizeof(m[0])), "GET_TS0 from wIndex");
+
+	memset(m, 0xff, sizeof(m));
+	r = usb_sim_ctrl(BMREQUESTTYPE_VENDOR, SAM4S_USB_VREQ_SET_TS0, 1, 0,
+		sizeof(m[0]) + 4, m);
+	usb_sim_check(r < 0, "SET_TS0 partial multiframe");
+	r = usb_sim_ctrl(BMREQUESTTYPE_VENDOR, SAM4S_USB_VREQ_SET_TS0, 1, 0,
+		2 * sizeof(m[0]), m);
+	usb_sim_check(r == 2 * sizeof(m[0]), "SET_TS0");
+	r = usb_sim_ctrl(BMREQUESTTYPE_VENDOR, SAM4S_USB_VREQ_SET_TS0, 0, 0,
+		(room - 1) * sizeof(m[0]), m);
+	usb_sim_check(r < 0, "SET_TS0 beyond the room");
+	r = usb_sim_ctrl(BMREQUESTTYPE_IN | BMREQUESTTYPE_VENDOR,
+		SAM4S_USB_VREQ_GET_TS0, 0, 0, sizeof(h), &h);
+	usb_sim_check(r == sizeof(h) && h.tx_room == room - 2,
+		"GET_TS0 tx room");
+}
+
+/* the tx jitter buffer settings, the range of the target: it stays at
+   the largest one for the iso out stream */
+static void
+usb_sim_tx_jbuf(void)
+{
+	unsigned int max = SAM4S_SSC_TX_BUF_DBLFRAMES - 3 * SAM4S_SSC_BATCH - 4;
+	int r;
+
+	r = usb_sim_ctrl(BMREQUESTTYPE_VENDOR, SAM4S_USB_VREQ_SET_TX_TARGET,
+		3 + SAM4S_SSC_BATCH, 0, 0, NULL);
+	usb_sim_check(r < 0, "SET_TX_TARGET below 1 ms not stalled");
+	r = usb_sim_ctrl(BMREQUESTTYPE_VENDOR, SAM4S_USB_VREQ_SET_TX_TARGET,
+		max + 1, 0, 0, NULL);
+	usb_sim_check(r < 0, "SET_TX_TARGET beyond the ring not stalled");
+	r = usb_sim_ctrl(BMREQUESTTYPE_VENDOR, SAM4S_USB_VREQ_SET_TX_TARGET,
+		max, 0, 0, NULL);
+	usb_sim_check(r == 0, "SET_TX_TARGET");
+	r = usb_sim_ctrl(BMREQUESTTYPE_VENDOR, SAM4S_USB_VREQ_SET_TX_CONCEAL,
+		0xfffe, 0xffff, 0, NULL);
+	usb_sim_check(r == 0, "SET_TX_CONCEAL");
+}
+
+/* ==== iso in checks ==== */
+
+/* position of lw in the rx stream, -1 if it cannot be placed */
+static int64_t
+usb_sim_rx_find(uint32_t lw)
+{
+	uint32_t j = lw * usb_sim_inv;
+
+	if (j % 8 == 0 || usb_sim_rx_lw(j) != lw)
+		return -1;
+	return j;
+}
+
+/* struct sam4s_usb_iso_in_hdr, and whether it continues the previous
+   packet: if not, *gap and *gaps count what has been skipped */
+static uint32_t
+usb_sim_rx_hdr(const uint8_t *p, int synced, uint32_t next,
+	unsigned long *gap, unsigned long *gaps)
+{
+	uint32_t pos = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+
+	if (synced && pos != next) {
+		usb_sim_check(pos - next < 0x80000000, "iso in: pos went back");
+		*gap += pos - next;
+		(*gaps)++;
+	}
+	return pos;
+}
+
+static void
+usb_sim_rx_raw(const uint8_t *p, unsigned int len)
+{
+	unsigned int k;
+	uint32_t pos;
+	int64_t j;
+
+	usb_sim_check(len >= 4 && len % 4 == 0,
+		"iso in: no header or not whole longwords");
+	if (len < 4)
+		return;
+	pos = usb_sim_rx_hdr(p, usb_sim_rx_synced, usb_sim_rx_next,
+		&usb_sim_rx_gap, &usb_sim_rx_gaps);
+	for (k=4; k+4<=len; k+=4) {
+		uint32_t lw = (uint32_t)p[k] << 24 | p[k+1] << 16 |
+			p[k+2] << 8 | p[k+3];
+		uint32_t at = pos + k/4 - 1;
+
+		if (usb_sim_rx_synced) {
+			if (lw == usb_sim_rx_lw((uint32_t)(at + usb_sim_rx_off))) {
+				usb_sim_rx_ok++;
+				continue;
+			}
+			usb_sim_rx_bad++;
+			usb_sim_rx_synced = 0;
+		}
+		j = usb_sim_rx_find(lw);
+		if (j < 0) {
+			usb_sim_rx_unplaced++;
+			continue;
+		}
+		usb_sim_rx_sync++;
+		usb_sim_rx_synced = 1;
+		usb_sim_rx_off = j - at;
+		usb_sim_rx_ok++;
+	}
+	usb_sim_rx_next = pos + (len - 4) / 4;
+}
+
+/* octets of timeslot ts in frames f..f+3, see e1_demux.h */
+static uint32_t
+usb_sim_rx_grp(uint64_t f, unsigned int ts)
+{
+	uint32_t v = 0;
+	uint64_t j;
+	int i;
+
+	for (i=0; i<4; i++, f++) {
+		j = f / 2 * SAM4S_SSC_DBLFRM_LONGWORDS + f % 2 * 8 + ts / 4;
+		v = v << 8 | ((usb_sim_rx_lw(j) >> (24 - 8 * (ts % 4))) & 0xff);
+	}
+	return v;
+}
+
+/* longword g of the row of the i-th timeslot of the packet */
+static uint32_t
+usb_sim_grp_lw(const uint8_t *p, unsigned int ngrp, unsigned int i,
+	unsigned int g)
+{
+	p += (i * ngrp + g) * 4;
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static int
+usb_sim_grp_match(const uint8_t *p, unsigned int ngrp, uint32_t mask,
+	unsigned int g, uint64_t f)
+{
+	unsigned int ts, i = 0;
+
+	for (ts=0; ts<E1_DEMUX_TS; ts++) {
+		if (!(mask & (1UL << ts)))
+			continue;
+		if (usb_sim_grp_lw(p, ngrp, i++, g) != usb_sim_rx_grp(f, ts))
+			return 0;
+	}
+	return 1;
+}
+
+static void
+usb_sim_rx_demux(const uint8_t *p, unsigned int len, uint32_t mask)
+{
+	unsigned int nts = __builtin_popcount(mask);
+	unsigned int ngrp = (len - 4) / 4 / nts, g;
+	int64_t f, last = usb_sim_rx_pos / 8;
+	uint32_t pos;
+
+	if (len < 4 || (len - 4) % (4 * nts)) {
+		/* a raw packet still queued at SET_TS_MASK */
+		usb_sim_check(!usb_sim_grp_synced,
+			"iso in: no header or not whole groups");
+		usb_sim_grp_unplaced++;
+		return;
+	}
+	pos = usb_sim_rx_hdr(p, usb_sim_grp_synced, usb_sim_grp_next,
+		&usb_sim_grp_gap, &usb_sim_grp_gaps);
+	usb_sim_grp_next = pos + ngrp;
+	p += 4;
+	if (!ngrp)
+		return;
+
+	f = 4 * (int64_t)pos + usb_sim_grp_off;
+	if (!usb_sim_grp_synced || !usb_sim_grp_match(p, ngrp, mask, 0, f)) {
+		if (usb_sim_grp_synced)
+			usb_sim_grp_bad++;
+		/* the group can only be one of the last few */
+		for (f=last; f>=0 && f>last-1024; f--)
+			if (usb_sim_grp_match(p, ngrp, mask, 0, f))
+				break;
+		if (f < 0 || f <= last - 1024) {
+			usb_sim_grp_unplaced += ngrp;
+			usb_sim_grp_synced = 0;
+			return;
+		}
+		usb_sim_grp_sync++;
+		usb_sim_grp_synced = 1;
+		usb_sim_grp_off = f - 4 * (int64_t)pos;
+	}
+
+	for (g=0; g<ngrp; g++, f += 4) {
+		if (usb_sim_grp_match(p, ngrp, mask, g, f))
+			usb_sim_grp_ok++;
+		else
+			usb_sim_grp_bad++;
+	}
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-n ms] [-m mask] [-s skip] [-o stall]\n",
+		argv0);
+	fprintf(stderr, "  -n  number of 1 ms frames to stream\n");
+	fprintf(stderr, "  -m  timeslots for the second half, 0: raw only\n");
+	fprintf(stderr, "  -s  leave out the iso in token every skip-th "
+		"frame\n");
+	fprintf(stderr, "  -o  hold off the ssc irq for stall double-frames "
+		"a quarter into each half,\n      an rx overflow (%u, 0: none)"
+		"\n", USB_SIM_STALL);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned long n_ms = 10000, skip = 0, stall = USB_SIM_STALL, ms;
+	unsigned long n_stall = 0;
+	unsigned long in_pkts = 0, in_empty = 0, out_pkts = 0, fb_pkts = 0;
+	unsigned long trace_bytes = 0;
+	uint32_t mask = 0x00010006, cur_mask = 0;
+	uint32_t fb = USB_SIM_FB_NOMINAL, fb_min = UINT32_MAX, fb_max = 0;
+	uint32_t fb_acc = 0;
+	uint64_t t_start;
+	uint8_t buf[USB_SIM_ISO_PKT];
+	struct stats_util_block st;
+	struct e1_tx_stats tx_stats;
+	int c, r, i;
+
+	while ((c = getopt(argc, argv, "n:m:s:o:h")) != -1) {
+		switch (c) {
+		case 'n':
+			n_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			mask = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			skip = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			stall = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	usb_sim_inv = USB_SIM_MUL;
+	for (i=0; i<5; i++)
+		usb_sim_inv *= 2 - USB_SIM_MUL * usb_sim_inv;
+
+	/* same order as in main() of the firmware */
+	trace_util_init();
+	sam4s_ssc_init();
+	sam4s_timer_init();
+	e1_mgmt_init();
+	sim_tc_sync(0);
+	sim_tc_sync(2);
+	sim_udp_reset();
+	sam4s_usb_init();
+
+	/* the E1 side has to be aligned before it streams */
+	for (i=0; i<256; i++)
+		usb_sim_e1_dblfrm();
+	usb_sim_main_loop(0);
+
+	t_start = sim_now_ns();
+	usb_sim_enumerate();
+	usb_sim_get_stats(&st);
+	usb_sim_ts0();
+	usb_sim_tx_jbuf();
+
+	/* trace to the bulk endpoint, with a data stage of two packets
+	   that the request does not need but has to take */
+	memset(buf, 0xaa, 100);
+	r = usb_sim_ctrl(BMREQUESTTYPE_VENDOR, SAM4S_USB_VREQ_SET_TRACE, 1, 0,
+		100, buf);
+	usb_sim_check(r == 100, "SET_TRACE with data");
+
+	usb_sim_tx_pos0 = usb_sim_tx_pos;
+	for (ms=1; ms<=n_ms; ms++) {
+		unsigned int bytes, k;
+
+		if (ms == n_ms / 2 && mask) {
+			r = usb_sim_ctrl(BMREQUESTTYPE_VENDOR,
+				SAM4S_USB_VREQ_SET_TS_MASK, mask & 0xffff,
+				mask >> 16, 0, NULL);
+			usb_sim_check(r == 0, "SET_TS_MASK");
+			cur_mask = mask;
+		}
+		if (stall && (ms == n_ms / 4 || (mask && ms == 3 * n_ms / 4))) {
+			usb_sim_rx_stall = stall;
+			n_stall++;
+		}
+
+		for (i=0; i<4; i++)
+			usb_sim_e1_dblfrm();
+		usb_sim_main_loop(ms);
+
+		/* the cycle counter at the SOF, for the tx rate in the
+		   feedback, from there it only moves in UDP_Handler() */
+		sim_dwt_set(ms * E1_RATE_NOMINAL * 2 * SAM4S_SSC_CMR_DIV);
+		sim_udp_sof(ms & 0x7ff);
+		usb_sim_irq(&usb_sim_t_sof);
+
+		if (!skip || ms % skip != skip - 1) {
+			r = sim_udp_in(usb_sim_addr, USB_SIM_EP_ISO_IN, buf,
+				sizeof(buf));
+			usb_sim_irq(&usb_sim_t_in);
+			if (r > 0) {
+				in_pkts++;
+				if (cur_mask)
+					usb_sim_rx_demux(buf, r, cur_mask);
+				else
+					usb_sim_rx_raw(buf, r);
+			} else {
+				in_empty++;
+			}
+		}
+
+		r = sim_udp_in(usb_sim_addr, USB_SIM_EP_ISO_FB, buf, 3);
+		usb_sim_irq(&usb_sim_t_fb);
+		if (r == 3) {
+			fb = buf[0] | buf[1] << 8 | buf[2] << 16;
+			if (fb < fb_min)
+				fb_min = fb;
+			if (fb > fb_max)
+				fb_max = fb;
+			fb_pkts++;
+		}
+
+		/* as many bytes as the feedback asks for, whole longwords */
+		fb_acc += fb;
+		bytes = (fb_acc >> 14) & ~3U;
+		if (bytes > USB_SIM_ISO_PKT)
+			bytes = USB_SIM_ISO_PKT;
+		fb_acc -= bytes << 14;
+		for (k=0; k<bytes; k+=4) {
+			uint32_t lw = usb_sim_tx_lw(usb_sim_tx_sent++);
+
+			buf[k] = lw >> 24;
+			buf[k+1] = lw >> 16;
+			buf[k+2] = lw >> 8;
+			buf[k+3] = lw;
+		}
+		r = sim_udp_out(usb_sim_addr, USB_SIM_EP_ISO_OUT, buf, bytes);
+		usb_sim_irq(&usb_sim_t_out);
+		if (r > 0)
+			out_pkts++;
+
+		r = sim_udp_in(usb_sim_addr, USB_SIM_EP_TRACE, buf,
+			USB_SIM_EP0_PKT);
+		usb_sim_irq(&usb_sim_t_trace);
+		if (r >= 0) {
+			usb_sim_check(r % sizeof(struct trace_util_data) == 0,
+				"trace: partial record");
+			trace_bytes += r;
+		}
+	}
+	t_start = sim_now_ns() - t_start;
+
+	usb_sim_main_loop(0);
+	usb_sim_get_stats(&st);
+	r = usb_sim_ctrl(0x00, 0x09, 0, 0, 0, NULL);
+	usb_sim_check(r == 0 && !(UDP->UDP_GLB_STAT & UDP_GLB_STAT_CONFG),
+		"unconfigure");
+	sam4s_usb_off();
+	usb_sim_check(!sim_udp_attached(), "pull-up still on");
+	e1_tx_get_stats(&tx_stats);
+
+	printf("simulated %lu ms of usb in %.3f s, %.0f frames/s\n", n_ms,
+		t_start * 1e-9, n_ms * 1e9 / t_start);
+	usb_sim_time_print("control", &usb_sim_t_ctrl);
+	usb_sim_time_print("sof", &usb_sim_t_sof);
+	usb_sim_time_print("iso in", &usb_sim_t_in);
+	usb_sim_time_print("feedback", &usb_sim_t_fb);
+	usb_sim_time_print("iso out", &usb_sim_t_out);
+	usb_sim_time_print("trace", &usb_sim_t_trace);
+	printf("iso (fw): in %u pkts %u lw (dropped %u, gap %u, busy %u) "
+		"%.0f cycles/pkt, out %u pkts (dropped %u bytes) "
+		"%.0f cycles/pkt, fb %u\n",
+		st.iso.in_pkts, st.iso.in_lw, st.iso.in_dropped,
+		st.iso.in_gap, st.iso.in_busy, st.iso.in_pkts ?
+		(double)st.iso.in_cycles / st.iso.in_pkts : 0.0,
+		st.iso.out_pkts, st.iso.out_dropped, st.iso.out_pkts ?
+		(double)st.iso.out_cycles / st.iso.out_pkts : 0.0,
+		st.iso.fb_pkts);
+	printf("iso in: %lu pkts (%lu empty), raw %lu lw ok, %lu bad, "
+		"sync %lu, unplaced %lu, %lu gaps of %lu lw\n", in_pkts,
+		in_empty, usb_sim_rx_ok, usb_sim_rx_bad, usb_sim_rx_sync,
+		usb_sim_rx_unplaced, usb_sim_rx_gaps, usb_sim_rx_gap);
+	if (mask)
+		printf("iso in: timeslots 0x%08x %lu groups ok, %lu bad, "
+			"sync %lu, unplaced %lu, %lu gaps of %lu groups\n",
+			mask, usb_sim_grp_ok, usb_sim_grp_bad,
+			usb_sim_grp_sync, usb_sim_grp_unplaced,
+			usb_sim_grp_gaps, usb_sim_grp_gap);
+	if (n_stall)
+		printf("rx overflow: %lu stalls of %lu double-frames, %u lost "
+			"(fw: gap %u lw, dropped %u lw)\n", n_stall, stall,
+			st.ssc.rx_lost, st.iso.in_gap, st.iso.in_dropped);
+	printf("iso out: %lu pkts, line %lu lw ok, %lu bad, sync %lu; "
+		"tx underrun %u overrun %u\n", out_pkts, usb_sim_tx_ok,
+		usb_sim_tx_bad, usb_sim_tx_sync, tx_stats.underrun,
+		tx_stats.overrun);
+	printf("feedback: %lu pkts, %.3f..%.3f bytes/frame\n", fb_pkts,
+		fb_min / 16384.0, fb_max / 16384.0);
+	printf("trace: %lu records\n",
+		trace_bytes / sizeof(struct trace_util_data));
+	printf("udp: setup %lu in %lu out %lu nak %lu stall %lu timeout %lu "
+		"iso in empty %lu iso out lost %lu\n", sim_udp_stats.setup,
+		sim_udp_stats.in_pkts, sim_udp_stats.out_pkts,
+		sim_udp_stats.nak, sim_udp_stats.stall, sim_udp_stats.timeout,
+		sim_udp_stats.iso_in_empty, sim_udp_stats.iso_out_lost);
+
+	usb_sim_check(!usb_sim_irq_stuck, "interrupt stuck");
+	usb_sim_check(!sim_udp_stats.fifo_overrun, "fifo overrun");
+	usb_sim_check(!sim_udp_stats.fifo_underrun, "fifo underrun");
+	usb_sim_check(!sim_udp_stats.bank_order, "banks out of order");
+	usb_sim_check(!sim_udp_stats.dir_late, "DIR set after RXSETUP");
+	usb_sim_check(!sim_udp_stats.iso_out_lost, "iso out lost");
+	usb_sim_check(usb_sim_rx_sync == 1 && !usb_sim_rx_bad,
+		"iso in: raw stream not continuous");
+	usb_sim_check(!mask || (usb_sim_grp_sync == 1 && !usb_sim_grp_bad),
+		"iso in: timeslot stream not continuous");
+	usb_sim_check(!n_stall || stall < USB_SIM_STALL || st.ssc.rx_lost,
+		"ssc: no rx overflow from the stall");
+	usb_sim_check(!st.ssc.rx_lost ||
+		(usb_sim_rx_gaps && (!mask || usb_sim_grp_gaps)),
+		"iso in: rx overflow not marked in the stream");
+	usb_sim_check(usb_sim_rx_gap + usb_sim_grp_gap *
+		__builtin_popcount(mask) == st.iso.in_gap + st.iso.in_dropped,
+		"iso in: gaps seen differ from what the firmware left out");
+	/* a stall holds off the tx side as well: the double-frames the
+	   PDC ran out of are skipped, what the host sent meanwhile
+	   overruns the jitter buffer, a long one underruns it, each time
+	   the line continues elsewhere in the stream. The feedback
+	   correction saturates while that drains */
+	usb_sim_check(usb_sim_tx_sync >= 1 && usb_sim_tx_bad < usb_sim_tx_sync &&
+		usb_sim_tx_sync - 1 <= (n_stall ? 2 * n_stall +
+		tx_stats.underrun + tx_stats.overrun : 0),
+		"iso out: stream on the line not continuous");
+	usb_sim_check(st.iso.in_pkts - in_pkts <= 1,
+		"iso in: packets queued but not received");
+	usb_sim_check(st.iso.out_pkts == out_pkts,
+		"iso out: packets received but not handled");
+	usb_sim_check(fb_min + ((4 + !!n_stall) << 14) >= USB_SIM_FB_NOMINAL &&
+		fb_max <= USB_SIM_FB_NOMINAL + (4 << 14), "feedback off");
+	usb_sim_check(trace_bytes > 0 || !SAM4S_USB_TRACE,
+		"no trace on the bulk endpoint");
+
+	printf("%s, %u failed\n", usb_sim_fail ? "FAIL" : "ok", usb_sim_fail);
+	return !!usb_sim_fail;
+}
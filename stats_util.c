@@ -0,0 +1,85 @@
+/*
+ * This file is part of the osmocom sam4s usb interface firmware.
+ * Copyright (c) 2018 Christian Vogel <vogelchr@vogel.cx>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* one versioned block of all statistics for the host, see stats_util.h */
+
+#include "stats_util.h"
+#include "sam4s_clock.h"
+#include "trace_util.h"
+
+#include <string.h>
+
+/* the main loop fills the one not published, the usb irq copies the
+   published one and cannot be interrupted by the main loop while it
+   does so */
+static struct stats_util_block stats_util_block[2];
+static volatile unsigned int stats_util_idx;
+static uint32_t stats_util_seq;
+static unsigned long stats_util_tick;
+
+/* usb irq only, the snapshot a multi-request read is served from */
+static struct stats_util_block stats_util_usb;
+
+void
+stats_util_poll()
+{
+	unsigned int idx = !stats_util_idx;
+	struct stats_util_block *b = &stats_util_block[idx];
+	unsigned long tick = sam4s_clock_tick;
+
+	if (tick == stats_util_tick && stats_util_seq)
+		return;
+	stats_util_tick = tick;
+
+	b->version = STATS_UTIL_VERSION;
+	b->len = sizeof(*b);
+	b->seq = ++stats_util_seq;
+	b->tick = tick;
+	sam4s_ssc_get_irqstats(&b->ssc);
+	e1_mgmt_get_irqstats(&b->e1);
+	b->align_state = e1_align_get_state();
+	e1_align_get_stats(&b->align);
+	b->crc4_locked = e1_crc4_locked();
+	e1_crc4_get_stats(&b->crc4);
+	e1_tx_get_stats(&b->tx);
+	e1_rate_get_stats(&b->rate);
+	e1_hdlc_get_rx_stats(&b->hdlc_rx);
+	e1_hdlc_get_tx_stats(&b->hdlc_tx);
+	e1_ts0_get_stats(&b->ts0);
+	sam4s_usb_get_iso_stats(&b->iso);
+	sam4s_uart0_console_get_stats(&b->console);
+	gps_steer_get_stats(&b->gps);
+	b->trace_lost = trace_util_lost();
+
+	__atomic_store_n(&stats_util_idx, idx, __ATOMIC_RELEASE);
+}
+
+unsigned int
+stats_util_read(unsigned int offs, void *buf, unsigned int len)
+{
+	if (offs == 0)
+		memcpy(&stats_util_usb, &stats_util_block[
+			__atomic_load_n(&stats_util_idx, __ATOMIC_ACQUIRE)],
+			sizeof(stats_util_usb));
+
+	if (offs >= sizeof(stats_util_usb))
+		return 0;
+	if (len > sizeof(stats_util_usb) - offs)
+		len = sizeof(stats_util_usb) - offs;
+	memcpy(buf, (const uint8_t *)&stats_util_usb + offs, len);
+	return len;
+}
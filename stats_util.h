@@ -0,0 +1,61 @@
+#ifndef STATS_UTIL_H
+#define STATS_UTIL_H
+
+#include <stdint.h>
+
+#include "sam4s_ssc.h"
+#include "sam4s_usb.h"
+#include "sam4s_uart0_console.h"
+#include "e1_mgmt.h"
+#include "e1_align.h"
+#include "e1_crc4.h"
+#include "e1_tx.h"
+#include "e1_rate.h"
+#include "e1_hdlc.h"
+#include "e1_ts0.h"
+#include "gps_steer.h"
+
+/* bumped whenever struct stats_util_block or one of the structs in it
+   changes, hosts check it together with len */
+#define STATS_UTIL_VERSION 5
+
+/*
+ * All counters of the firmware in one block, little endian. Apart from
+ * the first two, every field is 32 bits, so the layout has no padding
+ * without having to be declared packed (which would not allow passing
+ * the parts to the getters). The main loop takes a new snapshot every
+ * SysTick (10 ms), each part of it consistent in itself (see
+ * sam4s_irq.h), all of them taken within a few microseconds.
+ */
+struct stats_util_block {
+	uint16_t version;          /* STATS_UTIL_VERSION */
+	uint16_t len;              /* sizeof(struct stats_util_block) */
+	uint32_t seq;              /* snapshots taken so far */
+	uint32_t tick;             /* sam4s_clock_tick of the snapshot */
+	struct sam4s_ssc_irqstats ssc;
+	struct e1_mgmt_irqstats e1;
+	uint32_t align_state;      /* enum e1_align_state */
+	struct e1_align_stats align;
+	uint32_t crc4_locked;
+	struct e1_crc4_stats crc4;
+	struct e1_tx_stats tx;
+	struct e1_rate_stats rate;
+	struct e1_hdlc_rx_stats hdlc_rx;
+	struct e1_hdlc_tx_stats hdlc_tx;
+	struct e1_ts0_stats ts0;
+	struct sam4s_usb_iso_stats iso;
+	struct sam4s_uart0_console_stats console;
+	struct gps_steer_stats gps;
+	uint32_t trace_lost;       /* trace_util_lost() */
+};
+
+/* main loop: takes a new snapshot once per SysTick */
+extern void stats_util_poll();
+
+/* usb irq: copies up to len bytes from offs of the block, offs 0 takes
+   the latest snapshot, higher ones continue in that same one, returns
+   the number of bytes copied */
+extern unsigned int stats_util_read(unsigned int offs, void *buf,
+	unsigned int len);
+
+#endif
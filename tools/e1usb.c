@@ -0,0 +1,565 @@
+/*
+ * This file is part of the osmocom sam4s usb interface firmware.
+ * Copyright (c) 2018 Christian Vogel <vogelchr@vogel.cx>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Asynchronous iso transfers to and from the firmware, or its software
+ * stand-in, see e1usb.h. Built with -DE1USB_LIBUSB=0 only the stand-in
+ * is there and libusb-1.0 is not needed.
+ */
+
+#include "e1usb.h"
+#include "g704.h"
+#include "sam4s_usb.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef E1USB_LIBUSB
+#define E1USB_LIBUSB 1
+#endif
+
+#if E1USB_LIBUSB
+#include <libusb.h>
+#endif
+
+/* iso packets per transfer on the feedback endpoint */
+#define E1USB_FB_PKTS 8
+/* wMaxPacketSize of the feedback endpoint */
+#define E1USB_FB_PKT  3
+/* timeout of control requests, ms */
+#define E1USB_CTRL_TIMEOUT 1000
+
+struct e1usb {
+	struct e1usb_cfg cfg;
+	struct e1usb_stats st;
+	uint32_t tx_frac;         /* bytes per out packet, 10.14 */
+
+	/* stand-in */
+	uint64_t next_ns;         /* end of the next batch of packets */
+	uint64_t sof;             /* frames (1 ms) so far */
+	uint64_t pos;             /* raw mode: octets of the line sent */
+	uint64_t grp;             /* timeslot mode: groups of 4 frames sent */
+	uint32_t ts_mask;
+	uint8_t *pkt;
+
+#if E1USB_LIBUSB
+	libusb_context *ctx;
+	libusb_device_handle *dev;
+	struct libusb_transfer **x;
+	unsigned int nx;
+	unsigned int active;      /* transfers submitted */
+	int gone;
+#endif
+};
+
+/* length of the next out packet: the feedback in steps of longwords, the
+   rest is carried over */
+static unsigned int
+e1usb_tx_len(struct e1usb *u)
+{
+	unsigned int n;
+
+	u->tx_frac += u->st.fb ? u->st.fb : E1USB_FB_NOMINAL;
+	n = (u->tx_frac >> 14) & ~3u;
+	if (n > E1USB_ISO_PKT) {
+		n = E1USB_ISO_PKT;
+		u->tx_frac = 0;
+	} else {
+		u->tx_frac -= n << 14;
+	}
+	return n;
+}
+
+/*
+ * The stand-in: the line carries FAS and NFAS in timeslot 0 and the
+ * frame number plus the timeslot in the others. It sends 8 frames per
+ * ms like the firmware at the nominal rate, behind the same header, the
+ * position goes on over a lost packet. In raw mode the packets are
+ * one longword shorter or longer every now and then, as with a SOF that
+ * is a bit off. Every standin_loss-th packet of each endpoint is lost.
+ */
+
+static uint64_t
+e1usb_now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint8_t
+e1usb_standin_octet(uint64_t frame, unsigned int ts)
+{
+	if (ts == 0)
+		return (frame & 1) ?
+			G704_SI_MSK | G704_NOFAS_BITS | G704_SA_MSK :
+			G704_SI_MSK | G704_FAS_BITS;
+	return frame + ts;
+}
+
+static void
+e1usb_standin_hdr(uint8_t *p, uint32_t pos)
+{
+	p[0] = pos;
+	p[1] = pos >> 8;
+	p[2] = pos >> 16;
+	p[3] = pos >> 24;
+}
+
+static unsigned int
+e1usb_standin_in(struct e1usb *u, uint8_t *p)
+{
+	static const int jitter[4] = { 0, -4, 0, 4 };
+	unsigned int n = E1USB_HDR, ts, g, f;
+
+	if (!u->ts_mask) {
+		/* the line starts with a FAS double-frame, in longwords */
+		e1usb_standin_hdr(p, u->pos / 4);
+		n += 256 + jitter[u->sof % 4];
+		for (f=E1USB_HDR; f<n; f++, u->pos++)
+			p[f] = e1usb_standin_octet(u->pos / E1USB_TS,
+				u->pos % E1USB_TS);
+		return n;
+	}
+
+	e1usb_standin_hdr(p, u->grp);
+	for (ts=0; ts<E1USB_TS; ts++) {
+		if (!(u->ts_mask & (1UL << ts)))
+			continue;
+		for (g=0; g<2; g++)
+			for (f=0; f<4; f++)
+				p[n++] = e1usb_standin_octet(
+					(u->grp + g) * 4 + f, ts);
+	}
+	u->grp += 2;
+	return n;
+}
+
+/* one batch of cfg.pkts frames, like the completion of one transfer on
+   each endpoint */
+static void
+e1usb_standin_xfer(struct e1usb *u)
+{
+	unsigned int i, n;
+
+	u->st.rx_xfers++;
+	if (u->cfg.tx)
+		u->st.tx_xfers++;
+	for (i=0; i<u->cfg.pkts; i++, u->sof++) {
+		int lost = u->cfg.standin_loss &&
+			u->sof % u->cfg.standin_loss == u->cfg.standin_loss - 1;
+
+		n = e1usb_standin_in(u, u->pkt);
+		if (lost) {
+			u->st.rx_lost++;
+			u->cfg.rx(u->cfg.arg, NULL, 0, 1);
+		} else {
+			u->st.rx_pkts++;
+			u->st.rx_bytes += n;
+			u->cfg.rx(u->cfg.arg, u->pkt, n, 0);
+		}
+
+		u->st.fb = E1USB_FB_NOMINAL;
+		u->st.fb_pkts++;
+
+		if (!u->cfg.tx)
+			continue;
+		n = u->cfg.tx(u->cfg.arg, u->pkt, e1usb_tx_len(u));
+		if (lost) {
+			u->st.tx_lost++;
+		} else {
+			u->st.tx_pkts++;
+			u->st.tx_bytes += n;
+		}
+	}
+}
+
+static int
+e1usb_standin_run(struct e1usb *u, int timeout_ms)
+{
+	uint64_t now = e1usb_now_ns();
+	uint64_t end = now + timeout_ms * 1000000ULL;
+	struct timespec ts;
+	uint64_t t;
+
+	for (;;) {
+		if (u->next_ns <= now) {
+			e1usb_standin_xfer(u);
+			u->next_ns += u->cfg.pkts * 1000000ULL;
+			continue;
+		}
+		if (end <= now)
+			return 0;
+		t = u->next_ns < end ? u->next_ns : end;
+		ts.tv_sec = t / 1000000000ULL;
+		ts.tv_nsec = t % 1000000000ULL;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		now = e1usb_now_ns();
+	}
+}
+
+/* as the firmware does it: start over at the last double-frame, or the
+   last group, received */
+static void
+e1usb_standin_set_ts_mask(struct e1usb *u, uint32_t mask)
+{
+	uint64_t frame = u->pos / E1USB_TS;
+
+	if (u->ts_mask)
+		frame = u->grp * 4;
+	u->ts_mask = mask;
+	u->pos = (frame & ~1ULL) * E1USB_TS;
+	u->grp = frame / 4;
+}
+
+#if E1USB_LIBUSB
+
+static void LIBUSB_CALL e1usb_cb(struct libusb_transfer *x);
+
+static int
+e1usb_submit(struct e1usb *u, struct libusb_transfer *x)
+{
+	unsigned int off = 0, n;
+	int i, r;
+
+	/* out: the packets follow each other in the buffer */
+	if (x->endpoint == E1USB_EP_ISO_OUT) {
+		for (i=0; i<x->num_iso_packets; i++) {
+			n = u->cfg.tx(u->cfg.arg, x->buffer + off,
+				e1usb_tx_len(u));
+			x->iso_packet_desc[i].length = n;
+			off += n;
+		}
+	}
+
+	r = libusb_submit_transfer(x);
+	if (r) {
+		if (r == LIBUSB_ERROR_NO_DEVICE)
+			u->gone = 1;
+		u->st.submit_err++;
+		return -1;
+	}
+	u->active++;
+	return 0;
+}
+
+static void
+e1usb_in_done(struct e1usb *u, struct libusb_transfer *x)
+{
+	int i;
+
+	u->st.rx_xfers++;
+	for (i=0; i<x->num_iso_packets; i++) {
+		struct libusb_iso_packet_descriptor *d = &x->iso_packet_desc[i];
+
+		if (x->status != LIBUSB_TRANSFER_COMPLETED ||
+		    d->status != LIBUSB_TRANSFER_COMPLETED) {
+			u->st.rx_lost++;
+			u->cfg.rx(u->cfg.arg, NULL, 0, 1);
+			continue;
+		}
+		u->st.rx_pkts++;
+		u->st.rx_bytes += d->actual_length;
+		u->cfg.rx(u->cfg.arg, libusb_get_iso_packet_buffer_simple(x, i),
+			d->actual_length, 0);
+	}
+}
+
+static void
+e1usb_out_done(struct e1usb *u, struct libusb_transfer *x)
+{
+	int i;
+
+	u->st.tx_xfers++;
+	for (i=0; i<x->num_iso_packets; i++) {
+		struct libusb_iso_packet_descriptor *d = &x->iso_packet_desc[i];
+
+		if (x->status != LIBUSB_TRANSFER_COMPLETED ||
+		    d->status != LIBUSB_TRANSFER_COMPLETED) {
+			u->st.tx_lost++;
+			continue;
+		}
+		u->st.tx_pkts++;
+		u->st.tx_bytes += d->length;
+	}
+}
+
+static void
+e1usb_fb_done(struct e1usb *u, struct libusb_transfer *x)
+{
+	int i;
+
+	if (x->status != LIBUSB_TRANSFER_COMPLETED)
+		return;
+	for (i=0; i<x->num_iso_packets; i++) {
+		struct libusb_iso_packet_descriptor *d = &x->iso_packet_desc[i];
+		const uint8_t *p = libusb_get_iso_packet_buffer_simple(x, i);
+
+		if (d->status != LIBUSB_TRANSFER_COMPLETED ||
+		    d->actual_length != E1USB_FB_PKT)
+			continue;
+		u->st.fb = p[0] | p[1] << 8 | (uint32_t)p[2] << 16;
+		u->st.fb_pkts++;
+	}
+}
+
+static void LIBUSB_CALL
+e1usb_cb(struct libusb_transfer *x)
+{
+	struct e1usb *u = x->user_data;
+
+	u->active--;
+	if (x->status == LIBUSB_TRANSFER_NO_DEVICE)
+		u->gone = 1;
+	if (x->status == LIBUSB_TRANSFER_CANCELLED || u->gone)
+		return;
+
+	if (x->endpoint == E1USB_EP_ISO_IN)
+		e1usb_in_done(u, x);
+	else if (x->endpoint == E1USB_EP_ISO_OUT)
+		e1usb_out_done(u, x);
+	else
+		e1usb_fb_done(u, x);
+
+	e1usb_submit(u, x);
+}
+
+/* the buffers are in usbfs memory where libusb has it, so the kernel
+   does not have to copy them */
+static struct libusb_transfer *
+e1usb_xfer_new(struct e1usb *u, unsigned char ep, unsigned int pkts,
+	unsigned int pktlen)
+{
+	struct libusb_transfer *x = libusb_alloc_transfer(pkts);
+	unsigned int len = pkts * pktlen;
+	unsigned char *buf = NULL;
+	int devmem;
+
+	if (!x)
+		return NULL;
+#if LIBUSB_API_VERSION >= 0x01000105
+	buf = libusb_dev_mem_alloc(u->dev, len);
+#endif
+	devmem = (buf != NULL);
+	if (!buf) {
+		buf = malloc(len);
+		if (!buf) {
+			libusb_free_transfer(x);
+			return NULL;
+		}
+	}
+	libusb_fill_iso_transfer(x, u->dev, ep, buf, len, pkts, e1usb_cb, u, 0);
+	libusb_set_iso_packet_lengths(x, pktlen);
+	if (!devmem)
+		x->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	return x;
+}
+
+static void
+e1usb_xfer_free(struct e1usb *u, struct libusb_transfer *x)
+{
+#if LIBUSB_API_VERSION >= 0x01000105
+	if (!(x->flags & LIBUSB_TRANSFER_FREE_BUFFER))
+		libusb_dev_mem_free(u->dev, x->buffer, x->length);
+#endif
+	libusb_free_transfer(x);
+}
+
+static int
+e1usb_dev_open(struct e1usb *u)
+{
+	unsigned int i, n = 0;
+	int r;
+
+	r = libusb_init(&u->ctx);
+	if (r) {
+		fprintf(stderr, "e1usb: libusb_init: %s\n", libusb_strerror(r));
+		return -1;
+	}
+	u->dev = libusb_open_device_with_vid_pid(u->ctx, E1USB_VID, E1USB_PID);
+	if (!u->dev) {
+		fprintf(stderr, "e1usb: no device %04x:%04x\n", E1USB_VID,
+			E1USB_PID);
+		return -1;
+	}
+	libusb_set_auto_detach_kernel_driver(u->dev, 1);
+	r = libusb_claim_interface(u->dev, 0);
+	if (r) {
+		fprintf(stderr, "e1usb: claim interface: %s\n",
+			libusb_strerror(r));
+		return -1;
+	}
+
+	u->nx = u->cfg.xfers * (u->cfg.tx ? 2 : 1) + 2;
+	u->x = calloc(u->nx, sizeof(*u->x));
+	if (!u->x)
+		return -1;
+	for (i=0; i<u->cfg.xfers; i++) {
+		u->x[n++] = e1usb_xfer_new(u, E1USB_EP_ISO_IN, u->cfg.pkts,
+			E1USB_ISO_PKT);
+		if (u->cfg.tx)
+			u->x[n++] = e1usb_xfer_new(u, E1USB_EP_ISO_OUT,
+				u->cfg.pkts, E1USB_ISO_PKT);
+	}
+	/* the feedback only needs to keep up, not to be gapless */
+	u->x[n++] = e1usb_xfer_new(u, E1USB_EP_ISO_FB, E1USB_FB_PKTS,
+		E1USB_FB_PKT);
+	u->x[n++] = e1usb_xfer_new(u, E1USB_EP_ISO_FB, E1USB_FB_PKTS,
+		E1USB_FB_PKT);
+
+	for (i=0; i<u->nx; i++) {
+		if (!u->x[i]) {
+			fprintf(stderr, "e1usb: out of memory\n");
+			return -1;
+		}
+		if (e1usb_submit(u, u->x[i])) {
+			fprintf(stderr, "e1usb: cannot submit transfers\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+e1usb_dev_close(struct e1usb *u)
+{
+	unsigned int i;
+
+	for (i=0; i<u->nx; i++)
+		if (u->x[i])
+			libusb_cancel_transfer(u->x[i]);
+	while (u->active && !u->gone)
+		if (libusb_handle_events(u->ctx))
+			break;
+	for (i=0; i<u->nx; i++)
+		if (u->x[i])
+			e1usb_xfer_free(u, u->x[i]);
+	free(u->x);
+	if (u->dev) {
+		libusb_release_interface(u->dev, 0);
+		libusb_close(u->dev);
+	}
+	if (u->ctx)
+		libusb_exit(u->ctx);
+}
+
+#endif
+
+struct e1usb *
+e1usb_open(const struct e1usb_cfg *cfg)
+{
+	struct e1usb *u = calloc(1, sizeof(*u));
+
+	if (!u)
+		return NULL;
+	u->cfg = *cfg;
+	if (!u->cfg.xfers)
+		u->cfg.xfers = 1;
+	if (!u->cfg.pkts)
+		u->cfg.pkts = 1;
+
+	if (cfg->standin) {
+		u->pkt = malloc(E1USB_ISO_PKT);
+		if (!u->pkt) {
+			free(u);
+			return NULL;
+		}
+		u->next_ns = e1usb_now_ns() + u->cfg.pkts * 1000000ULL;
+		return u;
+	}
+
+#if E1USB_LIBUSB
+	if (e1usb_dev_open(u) == 0)
+		return u;
+	e1usb_dev_close(u);
+#else
+	fprintf(stderr, "e1usb: built without libusb, only the stand-in\n");
+#endif
+	free(u);
+	return NULL;
+}
+
+void
+e1usb_close(struct e1usb *u)
+{
+#if E1USB_LIBUSB
+	if (!u->cfg.standin)
+		e1usb_dev_close(u);
+#endif
+	free(u->pkt);
+	free(u);
+}
+
+int
+e1usb_run(struct e1usb *u, int timeout_ms)
+{
+#if E1USB_LIBUSB
+	struct timeval tv;
+	int r;
+
+	if (!u->cfg.standin) {
+		tv.tv_sec = timeout_ms / 1000;
+		tv.tv_usec = (timeout_ms % 1000) * 1000;
+		r = libusb_handle_events_timeout_completed(u->ctx, &tv, NULL);
+		if (r && r != LIBUSB_ERROR_INTERRUPTED) {
+			fprintf(stderr, "e1usb: %s\n", libusb_strerror(r));
+			return -1;
+		}
+		return (u->gone || !u->active) ? -1 : 0;
+	}
+#endif
+	return e1usb_standin_run(u, timeout_ms);
+}
+
+int
+e1usb_set_ts_mask(struct e1usb *u, uint32_t mask)
+{
+#if E1USB_LIBUSB
+	if (!u->cfg.standin)
+		return libusb_control_transfer(u->dev, LIBUSB_REQUEST_TYPE_VENDOR |
+			LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT,
+			SAM4S_USB_VREQ_SET_TS_MASK, mask & 0xffff, mask >> 16,
+			NULL, 0, E1USB_CTRL_TIMEOUT) < 0 ? -1 : 0;
+#endif
+	e1usb_standin_set_ts_mask(u, mask);
+	return 0;
+}
+
+int
+e1usb_get_stats_block(struct e1usb *u, void *buf, unsigned int len)
+{
+#if E1USB_LIBUSB
+	if (!u->cfg.standin) {
+		int r = libusb_control_transfer(u->dev,
+			LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE |
+			LIBUSB_ENDPOINT_IN, SAM4S_USB_VREQ_GET_STATS, 0, 0,
+			buf, len, E1USB_CTRL_TIMEOUT);
+
+		return r < 0 ? -1 : r;
+	}
+#endif
+	return -1; /* the stand-in has no firmware counters */
+}
+
+void
+e1usb_get_stats(struct e1usb *u, struct e1usb_stats *p)
+{
+	*p = u->st;
+}
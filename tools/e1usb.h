@@ -0,0 +1,92 @@
+#ifndef E1USB_H
+#define E1USB_H
+
+/*
+ * Host side of the iso endpoints of the firmware: keeps a number of
+ * asynchronous transfers in flight on the iso in (0x84), iso out (0x05)
+ * and feedback (0x86) endpoints and hands each packet to a callback.
+ * With stand-in set in struct e1usb_cfg, no device is opened and the
+ * packets come from a software model of the firmware instead, raw
+ * double-frames or timeslots like sam4s_usb_iso_in_sof() sends them,
+ * so the rest of the host software can be tested without hardware.
+ *
+ * Everything runs in the thread that calls e1usb_run().
+ */
+
+#include <stdint.h>
+
+#define E1USB_VID 0x1d50
+#define E1USB_PID 0x613b
+
+#define E1USB_EP_ISO_IN  0x84
+#define E1USB_EP_ISO_OUT 0x05
+#define E1USB_EP_ISO_FB  0x86
+#define E1USB_ISO_PKT    512  /* wMaxPacketSize of iso in and out */
+#define E1USB_TS         32   /* timeslots, octets per frame */
+
+/* every iso in packet starts with the position of its data in the
+   stream, little endian: longwords in raw mode, groups of 4 frames in
+   timeslot mode, see struct sam4s_usb_iso_in_hdr */
+#define E1USB_HDR        4
+
+/* nominal feedback, 256 bytes per 1 ms frame in 10.14 */
+#define E1USB_FB_NOMINAL (256 << 14)
+
+struct e1usb;
+
+struct e1usb_stats {
+	uint64_t rx_xfers;        /* iso in transfers completed */
+	uint64_t rx_pkts;         /* ... packets received */
+	uint64_t rx_bytes;        /* ... containing that many bytes */
+	uint64_t rx_lost;         /* packets with an error status */
+	uint64_t tx_xfers;        /* iso out transfers completed */
+	uint64_t tx_pkts;
+	uint64_t tx_bytes;
+	uint64_t tx_lost;
+	uint64_t fb_pkts;         /* feedback packets received */
+	uint64_t submit_err;      /* transfers that could not be resubmitted */
+	uint32_t fb;              /* last feedback, bytes per frame in 10.14 */
+};
+
+/* one iso in packet including the header, lost is set (and len 0) for
+   one that did not arrive */
+typedef void (*e1usb_rx_fn)(void *arg, const uint8_t *p, unsigned int len,
+	int lost);
+/* fill the next iso out packet with up to len bytes (a multiple of 4),
+   returns how many have been written */
+typedef unsigned int (*e1usb_tx_fn)(void *arg, uint8_t *p,
+	unsigned int len);
+
+static inline uint32_t
+e1usb_hdr_pos(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+struct e1usb_cfg {
+	unsigned int xfers;       /* transfers in flight per endpoint */
+	unsigned int pkts;        /* iso packets (1 ms each) per transfer */
+	e1usb_rx_fn rx;
+	e1usb_tx_fn tx;           /* NULL: no iso out */
+	void *arg;
+	int standin;              /* software stand-in instead of the device */
+	unsigned int standin_loss;/* stand-in: every n-th packet is lost */
+};
+
+/* NULL on error, which has been printed to stderr */
+extern struct e1usb *e1usb_open(const struct e1usb_cfg *cfg);
+extern void e1usb_close(struct e1usb *u);
+
+/* handles completed transfers for up to timeout_ms, -1 once the device
+   is gone */
+extern int e1usb_run(struct e1usb *u, int timeout_ms);
+
+/* SAM4S_USB_VREQ_SET_TS_MASK, 0 for raw double-frames */
+extern int e1usb_set_ts_mask(struct e1usb *u, uint32_t mask);
+/* SAM4S_USB_VREQ_GET_STATS, returns the length or -1 */
+extern int e1usb_get_stats_block(struct e1usb *u, void *buf,
+	unsigned int len);
+
+extern void e1usb_get_stats(struct e1usb *u, struct e1usb_stats *p);
+
+#endif
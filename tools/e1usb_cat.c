@@ -0,0 +1,152 @@
+/*
+ * This file is part of the osmocom sam4s usb interface firmware.
+ * Copyright (c) 2018 Christian Vogel <vogelchr@vogel.cx>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Client of e1usbd: copies the octets received on a timeslot to stdout,
+ * or with -w those from stdin to the timeslot.
+ *
+ *   e1usb_cat [-n name] [-c frames] [-k] ts
+ *   e1usb_cat [-n name] -w ts
+ *
+ * -c stops after that many frames. -k checks the octets against the
+ * counter the stand-in of e1usbd -s sends instead of writing them out,
+ * frames filled in by the daemon (0xff) do not count as errors.
+ */
+
+#include "e1usb_shm.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* how often to look for new octets, 8 frames per ms */
+#define E1USB_CAT_POLL_US 10000
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-n name] [-c frames] [-k] ts\n"
+		"       %s [-n name] -w ts\n", argv0, argv0);
+	exit(1);
+}
+
+static int
+e1usb_cat_write(struct e1usb_shm *s, unsigned int ts)
+{
+	uint8_t buf[1024];
+	size_t n, done;
+
+	while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0) {
+		for (done=0; done<n; ) {
+			if (!E1USB_SHM_LOAD_ACQ(s->running))
+				return 1;
+			done += e1usb_shm_tx_write(s, ts, buf + done, n - done);
+			if (done < n)
+				usleep(E1USB_CAT_POLL_US);
+		}
+	}
+	return 0;
+}
+
+static int
+e1usb_cat_read(struct e1usb_shm *s, unsigned int ts, uint64_t count,
+	int check)
+{
+	uint64_t pos = E1USB_SHM_LOAD_ACQ(s->rx_frames);
+	uint64_t lost = 0, total = 0, errors = 0;
+	uint8_t buf[4096];
+	int last = -1;
+	unsigned int n, i;
+
+	while (!count || total < count) {
+		n = sizeof(buf);
+		if (count && count - total < n)
+			n = count - total;
+		n = e1usb_shm_rx_read(s, ts, &pos, buf, n, &lost);
+		if (!n) {
+			if (!E1USB_SHM_LOAD_ACQ(s->running))
+				break;
+			usleep(E1USB_CAT_POLL_US);
+			continue;
+		}
+		total += n;
+		if (!check) {
+			if (fwrite(buf, 1, n, stdout) != n)
+				return 1;
+			continue;
+		}
+		for (i=0; i<n; i++) {
+			if (last != -1 && last != 0xff && buf[i] != 0xff &&
+			    buf[i] != ((last + 1) & 0xff))
+				errors++;
+			last = buf[i];
+		}
+	}
+
+	fprintf(stderr, "ts %u: %" PRIu64 " frames, %" PRIu64
+		" overwritten before read", ts, total, lost);
+	if (check)
+		fprintf(stderr, ", %" PRIu64 " discontinuities", errors);
+	fprintf(stderr, "\n");
+	return check && errors;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *name = E1USB_SHM_NAME;
+	struct e1usb_shm *s;
+	uint64_t count = 0;
+	int wr = 0, check = 0;
+	unsigned int ts;
+	int c, ret;
+
+	while ((c = getopt(argc, argv, "n:c:kw")) != -1) {
+		switch (c) {
+		case 'n':
+			name = optarg;
+			break;
+		case 'c':
+			count = strtoull(optarg, NULL, 0);
+			break;
+		case 'k':
+			check = 1;
+			break;
+		case 'w':
+			wr = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+	ts = strtoul(argv[optind], NULL, 0);
+	if (ts >= E1USB_SHM_TS)
+		usage(argv[0]);
+
+	s = e1usb_shm_attach(name);
+	if (!s)
+		return 1;
+	if (wr)
+		ret = e1usb_cat_write(s, ts);
+	else
+		ret = e1usb_cat_read(s, ts, count, check);
+	e1usb_shm_detach(s);
+	return ret;
+}
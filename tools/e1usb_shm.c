@@ -0,0 +1,145 @@
+/*
+ * This file is part of the osmocom sam4s usb interface firmware.
+ * Copyright (c) 2018 Christian Vogel <vogelchr@vogel.cx>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* the shared memory segment of e1usbd, see e1usb_shm.h */
+
+#include "e1usb_shm.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static struct e1usb_shm *
+e1usb_shm_map(const char *name, int flags)
+{
+	struct e1usb_shm *s;
+	int fd;
+
+	fd = shm_open(name, flags, 0644);
+	if (fd == -1) {
+		perror(name);
+		return NULL;
+	}
+	if ((flags & O_CREAT) && ftruncate(fd, sizeof(*s)) == -1) {
+		perror(name);
+		close(fd);
+		return NULL;
+	}
+	s = mmap(NULL, sizeof(*s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED) {
+		perror(name);
+		return NULL;
+	}
+	return s;
+}
+
+struct e1usb_shm *
+e1usb_shm_create(const char *name)
+{
+	struct e1usb_shm *s = e1usb_shm_map(name, O_RDWR | O_CREAT);
+
+	if (!s)
+		return NULL;
+
+	/* a leftover of a daemon that has died is taken over */
+	memset(s, 0, sizeof(*s));
+	memset(s->rx, 0xff, sizeof(s->rx));
+	s->frames = E1USB_SHM_FRAMES;
+	s->pid = getpid();
+	s->running = 1;
+	s->version = E1USB_SHM_VERSION;
+	E1USB_SHM_STORE_REL(s->magic, E1USB_SHM_MAGIC);
+	return s;
+}
+
+void
+e1usb_shm_destroy(const char *name, struct e1usb_shm *s)
+{
+	E1USB_SHM_STORE_REL(s->running, 0);
+	munmap(s, sizeof(*s));
+	shm_unlink(name);
+}
+
+struct e1usb_shm *
+e1usb_shm_attach(const char *name)
+{
+	struct e1usb_shm *s = e1usb_shm_map(name, O_RDWR);
+
+	if (!s)
+		return NULL;
+	if (E1USB_SHM_LOAD_ACQ(s->magic) != E1USB_SHM_MAGIC ||
+	    s->version != E1USB_SHM_VERSION ||
+	    s->frames != E1USB_SHM_FRAMES) {
+		fprintf(stderr, "%s: not a version %d e1usbd segment\n", name,
+			E1USB_SHM_VERSION);
+		munmap(s, sizeof(*s));
+		return NULL;
+	}
+	return s;
+}
+
+void
+e1usb_shm_detach(struct e1usb_shm *s)
+{
+	munmap(s, sizeof(*s));
+}
+
+unsigned int
+e1usb_shm_rx_read(const struct e1usb_shm *s, unsigned int ts, uint64_t *pos,
+	uint8_t *buf, unsigned int n, uint64_t *lost)
+{
+	unsigned int done = 0;
+
+	while (done < n) {
+		unsigned int k = n - done;
+		uint64_t p = *pos;
+		const uint8_t *rp = e1usb_shm_rx_peek(s, ts, &p, &k, lost);
+
+		if (!k)
+			break;
+		memcpy(buf + done, rp, k);
+		if (!e1usb_shm_rx_valid(s, p)) {
+			/* overwritten while copying, try again further on */
+			*pos = p;
+			continue;
+		}
+		*pos = p + k;
+		done += k;
+	}
+	return done;
+}
+
+unsigned int
+e1usb_shm_tx_write(struct e1usb_shm *s, unsigned int ts, const uint8_t *buf,
+	unsigned int n)
+{
+	uint64_t head = s->tx_head[ts];
+	uint64_t room = E1USB_SHM_FRAMES -
+		(head - E1USB_SHM_LOAD_ACQ(s->tx_tail[ts]));
+	unsigned int i;
+
+	if (n > room)
+		n = room;
+	for (i=0; i<n; i++)
+		s->tx[ts][(head + i) % E1USB_SHM_FRAMES] = buf[i];
+	E1USB_SHM_STORE_REL(s->tx_head[ts], head + n);
+	return n;
+}
@@ -0,0 +1,117 @@
+#ifndef E1USB_SHM_H
+#define E1USB_SHM_H
+
+/*
+ * Shared memory between e1usbd and its clients: for each timeslot a ring
+ * of the octets received, one per E1 frame (125 us), and one of the
+ * octets to send. Clients map the segment and read the received octets
+ * in place, nothing is copied on the way from the usb transfer to them
+ * but the demultiplexing itself.
+ *
+ * rx: e1usbd is the only writer. rx_frames counts the frames written so
+ * far, the octet of timeslot ts in frame f is rx[ts][f % frames]. The
+ * daemon may be writing frame rx_frames already, so frame f can be read
+ * while f < rx_frames and is still valid if, after the octets have been
+ * read, rx_frames + 1 - f <= frames. Frames the device did not send or
+ * that were lost on the way (rx_lost_frames) are filled with 0xff, so
+ * the frame count keeps up with the time. In timeslot mode (ts_mask !=
+ * 0) only the timeslots in ts_mask are written.
+ *
+ * tx: one client per timeslot writes its octets and advances tx_head,
+ * the daemon takes them and advances tx_tail. When the ring is empty,
+ * the daemon sends 0xff and counts tx_underrun. Timeslot 0 is replaced
+ * with FAS/NFAS by the firmware.
+ *
+ * The counters are 64 bit and never wrap, they are written with release
+ * and read with acquire semantics.
+ */
+
+#include "e1usb.h"
+
+#include <stdint.h>
+
+#define E1USB_SHM_NAME    "/e1usb"
+#define E1USB_SHM_MAGIC   0x45315553 /* E1US */
+#define E1USB_SHM_VERSION 1
+#define E1USB_SHM_TS      E1USB_TS
+/* frames in each ring, about one second, a power of two */
+#define E1USB_SHM_FRAMES  8192
+
+struct e1usb_shm {
+	uint32_t magic;           /* E1USB_SHM_MAGIC */
+	uint32_t version;         /* E1USB_SHM_VERSION */
+	uint32_t frames;          /* E1USB_SHM_FRAMES */
+	uint32_t ts_mask;         /* 0: raw double-frames, all timeslots */
+	uint32_t pid;             /* of e1usbd */
+	uint32_t running;         /* cleared when e1usbd exits */
+
+	uint64_t rx_frames;       /* frames written */
+	uint64_t rx_lost_frames;  /* ... of those filled in */
+	uint64_t rx_resync;       /* stream started over, not filled in */
+	struct e1usb_stats usb;   /* copy, updated once a second */
+
+	uint64_t tx_head[E1USB_SHM_TS] __attribute__((aligned(64)));
+	uint64_t tx_tail[E1USB_SHM_TS] __attribute__((aligned(64)));
+	uint64_t tx_underrun[E1USB_SHM_TS];
+
+	uint8_t rx[E1USB_SHM_TS][E1USB_SHM_FRAMES] __attribute__((aligned(64)));
+	uint8_t tx[E1USB_SHM_TS][E1USB_SHM_FRAMES] __attribute__((aligned(64)));
+};
+
+#define E1USB_SHM_LOAD_ACQ(x)     __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define E1USB_SHM_STORE_REL(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+/* daemon: creates (or takes over) the segment, NULL on error */
+extern struct e1usb_shm *e1usb_shm_create(const char *name);
+extern void e1usb_shm_destroy(const char *name, struct e1usb_shm *s);
+
+/* client: maps the segment of a running daemon, NULL on error */
+extern struct e1usb_shm *e1usb_shm_attach(const char *name);
+extern void e1usb_shm_detach(struct e1usb_shm *s);
+
+/* the received octets of ts from frame *pos on, in place: returns a
+   pointer to them and sets *n to how many are there without a wrap of
+   the ring (at most the *n passed). If *pos has been overwritten
+   already, it is moved to the oldest frame still there and *lost is
+   increased accordingly. Check e1usb_shm_rx_valid() once done with
+   them. */
+static inline const uint8_t *
+e1usb_shm_rx_peek(const struct e1usb_shm *s, unsigned int ts, uint64_t *pos,
+	unsigned int *n, uint64_t *lost)
+{
+	uint64_t head = E1USB_SHM_LOAD_ACQ(s->rx_frames);
+	unsigned int idx, k;
+
+	if (head + 1 - *pos > E1USB_SHM_FRAMES) {
+		*lost += head + 1 - E1USB_SHM_FRAMES - *pos;
+		*pos = head + 1 - E1USB_SHM_FRAMES;
+	}
+	idx = *pos % E1USB_SHM_FRAMES;
+	k = head - *pos;
+	if (k > E1USB_SHM_FRAMES - idx)
+		k = E1USB_SHM_FRAMES - idx;
+	if (k > *n)
+		k = *n;
+	*n = k;
+	return &s->rx[ts][idx];
+}
+
+/* octets from frame pos on have not been overwritten while they were
+   read */
+static inline int
+e1usb_shm_rx_valid(const struct e1usb_shm *s, uint64_t pos)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return E1USB_SHM_LOAD_ACQ(s->rx_frames) + 1 - pos <= E1USB_SHM_FRAMES;
+}
+
+/* copies what there is, up to n octets, returns how many */
+extern unsigned int e1usb_shm_rx_read(const struct e1usb_shm *s,
+	unsigned int ts, uint64_t *pos, uint8_t *buf, unsigned int n,
+	uint64_t *lost);
+
+/* queues up to n octets for transmission on ts, returns how many */
+extern unsigned int e1usb_shm_tx_write(struct e1usb_shm *s, unsigned int ts,
+	const uint8_t *buf, unsigned int n);
+
+#endif
@@ -0,0 +1,333 @@
+/*
+ * This file is part of the osmocom sam4s usb interface firmware.
+ * Copyright (c) 2018 Christian Vogel <vogelchr@vogel.cx>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Capture daemon for the iso stream: keeps the transfers to the device
+ * going with e1usb.c and (de)multiplexes the E1 frames from/to the
+ * per-timeslot rings in shared memory, see e1usb_shm.h.
+ *
+ *   e1usbd [-s [-l n]] [-m mask] [-x xfers] [-p pkts] [-n name] [-v]
+ *
+ * -s uses the software stand-in instead of the device, -l n makes it
+ * lose every n-th packet. -m selects timeslots on the device (hex, see
+ * SAM4S_USB_VREQ_SET_TS_MASK), the default is raw double-frames. -x and
+ * -p set the transfers in flight and the packets (ms) per transfer, -n
+ * the name of the segment, -v prints the counters every second.
+ *
+ * The header of each packet says where its data is in the stream (see
+ * struct sam4s_usb_iso_in_hdr). What the device did not send, lost on
+ * the bus, or left out for a gap of its own, is filled in with 0xff
+ * frames, so the frame count keeps up with the line. In raw mode it
+ * also gives the frame alignment: longword pos % 8 == 0 starts a frame.
+ * The first packet, one going back in the stream and a gap longer than
+ * the ring start over there.
+ */
+
+#include "e1usb.h"
+#include "e1usb_shm.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* raw mode: longwords per frame */
+#define E1USBD_FRAME_LW (E1USB_TS / 4)
+
+static struct e1usb_shm *e1usbd_shm;
+static uint32_t e1usbd_ts_mask;
+static volatile sig_atomic_t e1usbd_quit;
+
+static uint64_t e1usbd_frame;       /* frame being written */
+static unsigned int e1usbd_phase;   /* raw: timeslot of the next octet */
+static int e1usbd_synced;           /* e1usbd_next is valid */
+static uint32_t e1usbd_next;        /* header pos of the next packet */
+
+static unsigned int e1usbd_tx_phase;
+
+static void
+e1usbd_rx_octets(const uint8_t *p, unsigned int len)
+{
+	uint64_t f = e1usbd_frame;
+	unsigned int ts = e1usbd_phase;
+
+	while (len--) {
+		e1usbd_shm->rx[ts][f % E1USB_SHM_FRAMES] = *p++;
+		if (++ts == E1USB_TS) {
+			ts = 0;
+			f++;
+		}
+	}
+	e1usbd_frame = f;
+	e1usbd_phase = ts;
+}
+
+static const uint8_t e1usbd_idle[E1USB_TS] = {
+	[0 ... E1USB_TS-1] = 0xff
+};
+
+/* raw: n longwords of 0xff */
+static void
+e1usbd_rx_fill_raw(unsigned int n)
+{
+	uint64_t f = e1usbd_frame;
+
+	for (; n >= E1USBD_FRAME_LW; n -= E1USBD_FRAME_LW)
+		e1usbd_rx_octets(e1usbd_idle, E1USB_TS);
+	e1usbd_rx_octets(e1usbd_idle, 4 * n);
+	e1usbd_shm->rx_lost_frames += e1usbd_frame - f;
+}
+
+/* the octets of a packet start at timeslot (pos % 8) * 4, nothing to
+   do with what came before */
+static void
+e1usbd_rx_start_raw(uint32_t pos)
+{
+	unsigned int ts = pos % E1USBD_FRAME_LW * 4;
+
+	if (e1usbd_phase) {
+		e1usbd_rx_octets(e1usbd_idle, E1USB_TS - e1usbd_phase);
+		e1usbd_shm->rx_lost_frames++;
+	}
+	e1usbd_rx_octets(e1usbd_idle, ts);
+}
+
+/* for each selected timeslot in turn the same number of longwords, 4
+   frames each, see sam4s_usb_iso_in_demux() */
+static void
+e1usbd_rx_ts(const uint8_t *p, unsigned int len)
+{
+	/* octets, that is frames, per timeslot */
+	unsigned int n = len / __builtin_popcount(e1usbd_ts_mask) & ~3u;
+	unsigned int ts, i;
+
+	for (ts=0; ts<E1USB_TS; ts++) {
+		if (!(e1usbd_ts_mask & (1UL << ts)))
+			continue;
+		for (i=0; i<n; i++)
+			e1usbd_shm->rx[ts][(e1usbd_frame + i) %
+				E1USB_SHM_FRAMES] = *p++;
+	}
+	e1usbd_frame += n;
+}
+
+/* timeslots: n groups of 4 frames of 0xff */
+static void
+e1usbd_rx_fill_ts(unsigned int n)
+{
+	unsigned int ts, i;
+
+	for (ts=0; ts<E1USB_TS; ts++) {
+		if (!(e1usbd_ts_mask & (1UL << ts)))
+			continue;
+		for (i=0; i<4*n; i++)
+			e1usbd_shm->rx[ts][(e1usbd_frame + i) %
+				E1USB_SHM_FRAMES] = 0xff;
+	}
+	e1usbd_frame += 4 * n;
+	e1usbd_shm->rx_lost_frames += 4 * n;
+}
+
+static void
+e1usbd_rx(void *arg, const uint8_t *p, unsigned int len, int lost)
+{
+	uint32_t pos, gap;
+	uint64_t frames;
+
+	/* what a lost packet had shows as a gap in the next one */
+	if (lost || len < E1USB_HDR)
+		return;
+	pos = e1usb_hdr_pos(p);
+	p += E1USB_HDR;
+	len -= E1USB_HDR;
+
+	/* modulo 2^32, going back is a long way ahead */
+	gap = pos - e1usbd_next;
+	frames = e1usbd_ts_mask ? 4 * (uint64_t)gap : gap / E1USBD_FRAME_LW;
+	if (!e1usbd_synced || frames > E1USB_SHM_FRAMES) {
+		if (e1usbd_synced)
+			e1usbd_shm->rx_resync++;
+		if (!e1usbd_ts_mask)
+			e1usbd_rx_start_raw(pos);
+		e1usbd_synced = 1;
+	} else if (gap) {
+		if (e1usbd_ts_mask)
+			e1usbd_rx_fill_ts(gap);
+		else
+			e1usbd_rx_fill_raw(gap);
+	}
+
+	if (e1usbd_ts_mask) {
+		e1usbd_rx_ts(p, len);
+		e1usbd_next = pos + len / 4 / __builtin_popcount(e1usbd_ts_mask);
+	} else {
+		e1usbd_rx_octets(p, len & ~3u);
+		e1usbd_next = pos + len / 4;
+	}
+	E1USB_SHM_STORE_REL(e1usbd_shm->rx_frames, e1usbd_frame);
+}
+
+/* frames for the device, octet by octet from the tx ring of each
+   timeslot, 0xff where a ring is empty */
+static unsigned int
+e1usbd_tx(void *arg, uint8_t *p, unsigned int len)
+{
+	struct e1usb_shm *s = e1usbd_shm;
+	uint64_t head[E1USB_TS], tail[E1USB_TS];
+	unsigned int ts = e1usbd_tx_phase, i;
+
+	for (i=0; i<E1USB_TS; i++) {
+		head[i] = E1USB_SHM_LOAD_ACQ(s->tx_head[i]);
+		tail[i] = s->tx_tail[i];
+	}
+	for (i=0; i<len; i++) {
+		if (tail[ts] != head[ts]) {
+			p[i] = s->tx[ts][tail[ts]++ % E1USB_SHM_FRAMES];
+		} else {
+			p[i] = 0xff;
+			if (head[ts]) /* only once a client has used it */
+				s->tx_underrun[ts]++;
+		}
+		if (++ts == E1USB_TS)
+			ts = 0;
+	}
+	e1usbd_tx_phase = ts;
+	for (i=0; i<E1USB_TS; i++)
+		E1USB_SHM_STORE_REL(s->tx_tail[i], tail[i]);
+	return len;
+}
+
+static void
+e1usbd_print(const struct e1usb_stats *st)
+{
+	fprintf(stderr, "rx: xfers %llu pkts %llu bytes %llu lost %llu "
+		"frames %llu filled %llu resync %llu\n",
+		(unsigned long long)st->rx_xfers,
+		(unsigned long long)st->rx_pkts,
+		(unsigned long long)st->rx_bytes,
+		(unsigned long long)st->rx_lost,
+		(unsigned long long)e1usbd_shm->rx_frames,
+		(unsigned long long)e1usbd_shm->rx_lost_frames,
+		(unsigned long long)e1usbd_shm->rx_resync);
+	fprintf(stderr, "tx: xfers %llu pkts %llu bytes %llu lost %llu "
+		"fb %llu (%.3f bytes/ms) submit_err %llu\n",
+		(unsigned long long)st->tx_xfers,
+		(unsigned long long)st->tx_pkts,
+		(unsigned long long)st->tx_bytes,
+		(unsigned long long)st->tx_lost,
+		(unsigned long long)st->fb_pkts, st->fb / 16384.0,
+		(unsigned long long)st->submit_err);
+}
+
+static void
+e1usbd_sig(int sig)
+{
+	e1usbd_quit = 1;
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-s [-l n]] [-m mask] [-x xfers] "
+		"[-p pkts] [-n name] [-v]\n", argv0);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct e1usb_cfg cfg = { .xfers = 8, .pkts = 8 };
+	const char *name = E1USB_SHM_NAME;
+	struct e1usb_stats st;
+	struct e1usb *u;
+	unsigned int ticks = 0;
+	int verbose = 0;
+	int c, ret = 0;
+
+	while ((c = getopt(argc, argv, "sl:m:x:p:n:v")) != -1) {
+		switch (c) {
+		case 's':
+			cfg.standin = 1;
+			break;
+		case 'l':
+			cfg.standin_loss = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			e1usbd_ts_mask = strtoul(optarg, NULL, 16);
+			break;
+		case 'x':
+			cfg.xfers = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			cfg.pkts = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			name = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || !cfg.xfers || !cfg.pkts)
+		usage(argv[0]);
+
+	e1usbd_shm = e1usb_shm_create(name);
+	if (!e1usbd_shm)
+		return 1;
+	e1usbd_shm->ts_mask = e1usbd_ts_mask;
+
+	cfg.rx = e1usbd_rx;
+	cfg.tx = e1usbd_tx;
+	u = e1usb_open(&cfg);
+	if (!u) {
+		e1usb_shm_destroy(name, e1usbd_shm);
+		return 1;
+	}
+	if (e1usb_set_ts_mask(u, e1usbd_ts_mask)) {
+		fprintf(stderr, "e1usbd: cannot set the timeslot mask\n");
+		ret = 1;
+		goto out;
+	}
+
+	signal(SIGINT, e1usbd_sig);
+	signal(SIGTERM, e1usbd_sig);
+
+	while (!e1usbd_quit) {
+		if (e1usb_run(u, 100)) {
+			fprintf(stderr, "e1usbd: device gone\n");
+			ret = 1;
+			break;
+		}
+		if (++ticks % 10)
+			continue;
+		e1usb_get_stats(u, &st);
+		e1usbd_shm->usb = st;
+		if (verbose)
+			e1usbd_print(&st);
+	}
+
+out:
+	e1usb_get_stats(u, &st);
+	e1usbd_print(&st);
+	e1usb_close(u);
+	e1usb_shm_destroy(name, e1usbd_shm);
+	return ret;
+}
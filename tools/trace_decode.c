@@ -0,0 +1,198 @@
+/*
+ * This file is part of the osmocom sam4s usb interface firmware.
+ * Copyright (c) 2018 Christian Vogel <vogelchr@vogel.cx>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Decoder for the binary trace the firmware prints on the console, see
+ * trace_util.h: lines "T <ts> <id> <a> <b>" (hex) are replaced by the
+ * time in microseconds since the first event, the time since the event
+ * before, the text looked up at address id of section .trace_str in the
+ * elf file and the arguments. All other lines are passed through.
+ * With -b, the input are the records as they come from the usb bulk
+ * endpoint (SAM4S_USB_VREQ_SET_TRACE), 16 bytes each, little endian.
+ *
+ *   trace_decode [-b] [-f mck_hz] sam4s_fw.elf < console.log
+ *
+ * The timestamps are the 32 bit DWT cycle counter, which wraps every 38.8
+ * seconds at 110.592 MHz, gaps longer than that between two events are
+ * not detected.
+ */
+
+#include "trace_util.h"
+
+#include <elf.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char *trace_str;
+static uint32_t trace_str_addr, trace_str_size;
+
+/* loads section .trace_str of the (32 bit, little endian) elf file */
+static int
+trace_decode_load(const char *fn)
+{
+	FILE *f = fopen(fn, "rb");
+	Elf32_Ehdr eh;
+	Elf32_Shdr *sh = NULL, *p;
+	char *names = NULL;
+	int i, ret = -1;
+
+	if (!f) {
+		perror(fn);
+		return -1;
+	}
+	if (fread(&eh, sizeof(eh), 1, f) != 1 ||
+	    memcmp(eh.e_ident, ELFMAG, SELFMAG) ||
+	    eh.e_ident[EI_CLASS] != ELFCLASS32 ||
+	    eh.e_ident[EI_DATA] != ELFDATA2LSB ||
+	    eh.e_shentsize != sizeof(Elf32_Shdr) ||
+	    eh.e_shstrndx >= eh.e_shnum) {
+		fprintf(stderr, "%s: not a 32 bit little endian elf file\n", fn);
+		goto out;
+	}
+
+	sh = calloc(eh.e_shnum, sizeof(*sh));
+	if (fseek(f, eh.e_shoff, SEEK_SET) ||
+	    fread(sh, sizeof(*sh), eh.e_shnum, f) != eh.e_shnum)
+		goto short_read;
+
+	p = &sh[eh.e_shstrndx];
+	names = calloc(1, p->sh_size + 1);
+	if (fseek(f, p->sh_offset, SEEK_SET) ||
+	    fread(names, 1, p->sh_size, f) != p->sh_size)
+		goto short_read;
+
+	for (i=0; i<eh.e_shnum; i++) {
+		p = &sh[i];
+		if (p->sh_name >= sh[eh.e_shstrndx].sh_size ||
+		    strcmp(names + p->sh_name, ".trace_str"))
+			continue;
+		trace_str_addr = p->sh_addr;
+		trace_str_size = p->sh_size;
+		trace_str = calloc(1, trace_str_size + 1);
+		if (fseek(f, p->sh_offset, SEEK_SET) ||
+		    fread(trace_str, 1, trace_str_size, f) != trace_str_size)
+			goto short_read;
+		ret = 0;
+		goto out;
+	}
+	fprintf(stderr, "%s: no section .trace_str\n", fn);
+	goto out;
+
+short_read:
+	fprintf(stderr, "%s: short read\n", fn);
+out:
+	free(names);
+	free(sh);
+	fclose(f);
+	return ret;
+}
+
+static const char *
+trace_decode_text(uint32_t id)
+{
+	if (id < trace_str_addr || id - trace_str_addr >= trace_str_size)
+		return "(unknown trace id)";
+	return trace_str + (id - trace_str_addr);
+}
+
+static double trace_decode_mck_hz = 110592000.0;
+static uint64_t trace_decode_t;
+static uint32_t trace_decode_last_ts;
+static int trace_decode_first = 1;
+
+static void
+trace_decode_record(uint32_t ts, uint32_t id, uint32_t a, uint32_t b)
+{
+	uint32_t dt;
+
+	dt = trace_decode_first ? 0 : ts - trace_decode_last_ts;
+	trace_decode_t += dt;
+	trace_decode_last_ts = ts;
+	trace_decode_first = 0;
+
+	printf("%14.3f %+12.3f  ", trace_decode_t * 1e6 / trace_decode_mck_hz,
+		dt * 1e6 / trace_decode_mck_hz);
+	if (id == TRACE_UTIL_ID_LOST)
+		printf("trace: %" PRIu32 " entries lost\n", a);
+	else
+		printf("%s 0x%08" PRIx32 " 0x%08" PRIx32 "\n",
+			trace_decode_text(id), a, b);
+}
+
+static uint32_t
+trace_decode_le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-b] [-f mck_hz] firmware.elf < input\n",
+		argv0);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned char rec[16];
+	char line[512];
+	int binary = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "bf:")) != -1) {
+		switch (c) {
+		case 'b':
+			binary = 1;
+			break;
+		case 'f':
+			trace_decode_mck_hz = strtod(optarg, NULL);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || trace_decode_mck_hz <= 0)
+		usage(argv[0]);
+	if (trace_decode_load(argv[optind]))
+		return 1;
+
+	if (binary) {
+		while (fread(rec, sizeof(rec), 1, stdin) == 1)
+			trace_decode_record(trace_decode_le32(rec),
+				trace_decode_le32(rec + 4),
+				trace_decode_le32(rec + 8),
+				trace_decode_le32(rec + 12));
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), stdin)) {
+		uint32_t ts, id, a, b;
+
+		if (sscanf(line, "T %" SCNx32 " %" SCNx32 " %" SCNx32
+			   " %" SCNx32, &ts, &id, &a, &b) != 4) {
+			fputs(line, stdout);
+			continue;
+		}
+		trace_decode_record(ts, id, a, b);
+	}
+	return 0;
+}
@@ -1,4 +1,5 @@
 #include "trace_util.h"
+#include "sam4s_irq.h"
 #include <sam4s8b.h>
 #include <stddef.h>
 
@@ -21,19 +22,110 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
-/* this is a quick and dirty tracing facility using a ring-buffer */
+/* Tracing facility using a ring-buffer of binary records, a timestamp,
+   the address of a string and two arguments, formatted later on the host
+   by tools/trace_decode. They go to the console, or as they are to the
+   host on a usb bulk endpoint, which keeps up with much higher rates.
+   When the reader cannot keep up the oldest entries are dropped, so the
+   last ones before a problem are still there. */
 
+CIRCULAR_BUFFER_DECLARE(trace_ring, struct trace_util_data, 128,
+	CIRCULAR_BUFFER_OVERWRITE)
 
-CIRCULAR_BUFFER_DECLARE(trace_util, struct trace_util_data, 128)
+/* there must only be one reader at a time: the usb irq asks for the ring
+   and only reads once the main loop has seen that, between two reads */
+enum trace_util_sink {
+	TRACE_UTIL_SINK_UART,
+	TRACE_UTIL_SINK_USB_REQ,
+	TRACE_UTIL_SINK_USB
+};
 
-extern int trace_util_read(struct trace_util_data *p);
+static enum trace_util_sink trace_util_sink;
+static unsigned int trace_util_usb_lost; /* lost count sent to the host */
+static struct trace_util_data trace_util_usb_next; /* after the lost record */
+static int trace_util_usb_pending;
+
+void
+trace_util_init() {
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
 
 int
 trace_util_read(struct trace_util_data *p) {
-	return trace_util_get(p);
+	enum trace_util_sink sink = TRACE_UTIL_SINK_USB_REQ;
+
+	/* hand over, unless the usb irq has changed its mind again */
+	__atomic_compare_exchange_n(&trace_util_sink, &sink,
+		TRACE_UTIL_SINK_USB, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	if (sink != TRACE_UTIL_SINK_UART)
+		return -1;
+	return trace_ring_get(p);
 }
 
+/* the ring has a single producer: BASEPRI at the TC2 priority, the most
+   urgent one in use, holds off every other context. Priority 0 cannot be
+   masked that way and must not trace */
 void
-trace_util_write(const struct trace_util_data p) {
-	trace_util_put(p);
-}
\ No newline at end of file
+trace_util_event(const char *text, uint32_t a, uint32_t b) {
+	struct trace_util_data tmp;
+	uint32_t basepri;
+
+	tmp.id = (uint32_t)(uintptr_t)text;
+	tmp.a = a;
+	tmp.b = b;
+	basepri = sam4s_irq_lock(SAM4S_IRQ_PRIO_TC2);
+	tmp.ts = DWT->CYCCNT;
+	trace_ring_put(&tmp);
+	sam4s_irq_unlock(basepri);
+}
+
+/* usb irq context */
+void
+trace_util_usb(int on) {
+	if (!on) {
+		__atomic_store_n(&trace_util_sink, TRACE_UTIL_SINK_UART,
+			__ATOMIC_RELEASE);
+		return;
+	}
+	if (trace_util_sink == TRACE_UTIL_SINK_UART) {
+		trace_util_usb_lost = trace_ring_lost();
+		trace_util_usb_pending = 0;
+		__atomic_store_n(&trace_util_sink, TRACE_UTIL_SINK_USB_REQ,
+			__ATOMIC_RELEASE);
+	}
+}
+
+int
+trace_util_read_usb(struct trace_util_data *p) {
+	unsigned int lost;
+
+	if (__atomic_load_n(&trace_util_sink, __ATOMIC_ACQUIRE) !=
+	    TRACE_UTIL_SINK_USB)
+		return -1;
+
+	if (trace_util_usb_pending) {
+		*p = trace_util_usb_next;
+		trace_util_usb_pending = 0;
+		return 0;
+	}
+	if (trace_ring_get(p))
+		return -1;
+
+	/* the gap comes before the record just read */
+	lost = trace_ring_lost();
+	if (lost != trace_util_usb_lost) {
+		trace_util_usb_lost = lost;
+		trace_util_usb_next = *p;
+		trace_util_usb_pending = 1;
+		p->id = TRACE_UTIL_ID_LOST;
+		p->a = lost;
+		p->b = 0;
+	}
+	return 0;
+}
+
+unsigned int
+trace_util_lost() {
+	return trace_ring_lost();
+}
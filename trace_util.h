@@ -3,12 +3,39 @@
 
 #include <stdint.h>
 
+/* one trace event, 16 bytes, the text is formatted on the host by
+   tools/trace_decode from the string tables in the elf file */
 struct trace_util_data {
-	char text[32];
+	uint32_t ts;   /* DWT cycle counter */
+	uint32_t id;   /* address of the text in section .trace_str */
 	uint32_t a, b;
 };
 
+/* starts the DWT cycle counter used for the timestamps */
+extern void trace_util_init();
+
 extern int trace_util_read(struct trace_util_data *p);
-extern void trace_util_write(const struct trace_util_data p);
+/* may be called from any context, use TRACE_UTIL() */
+extern void trace_util_event(const char *text, uint32_t a, uint32_t b);
+/* entries overwritten before they could be read */
+extern unsigned int trace_util_lost();
+
+/* id of the record put into the usb stream when entries have been lost,
+   a is the number lost so far */
+#define TRACE_UTIL_ID_LOST 0xffffffff
+
+/* the ring is read by the main loop (trace_util_read(), to the console)
+   unless the usb irq has taken it over with trace_util_usb(1), from then
+   on trace_util_read_usb() returns the records */
+extern void trace_util_usb(int on);
+extern int trace_util_read_usb(struct trace_util_data *p);
+
+/* s has to be a string literal, it is put into .trace_str which is kept
+   in the elf file but not loaded into the target (see trace_util.ld) */
+#define TRACE_UTIL(s, a, b) do { \
+		static const char trace_util_text[] \
+			__attribute__((section(".trace_str"))) = s; \
+		trace_util_event(trace_util_text, (a), (b)); \
+	} while (0)
 
-#endif
\ No newline at end of file
+#endif